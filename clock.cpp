@@ -14,6 +14,7 @@
 #else
 #include <GL/glut.h> // Default fallback
 #endif
+#include "glrecord.h" // glBegin/glEnd blocks drawn from cached vertex arrays
 
 #include <cstdio>
 #include <cmath>
@@ -21,6 +21,7 @@
 #else
 #include <GL/glut.h> // Use standard GLUT location on Linux/Windows
 #endif
+#include "glrecord.h" // glBegin/glEnd blocks drawn from cached vertex arrays
 
 // --- Global Variables ---
 // Camera position and orientation
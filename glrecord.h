@@ -0,0 +1,351 @@
+/**
+ * Recording of glBegin/glEnd blocks into cached vertex arrays, for all the demos.
+ *
+ * Include it after the GL headers. From then on glBegin, glVertex*, glColor*, glNormal*, glTexCoord* and glEnd
+ * of the file go through the recorder instead of the driver. The calls between glBegin and glEnd only add
+ * vertices to an array in memory, and glEnd draws the array with one glDrawArrays. Every block is kept apart by
+ * its call site (file and line) and by how many times that site was already run in the frame, so a loop that
+ * draws the 60 ticks of a clock keeps 60 recordings. When the vertices of a block are the same as last frame
+ * the recording is drawn again as it is; only when they changed is it recorded (and uploaded) again. Static
+ * content like the axes, cubes, pyramids and clock ticks then costs one draw call instead of a driver call per
+ * vertex and color.
+ *
+ * A frame starts at every glClear of the color buffer, or at glrecordFrame(). If the file includes GLEW first and
+ * glewInit found the buffer functions, the recordings live in vertex buffer objects; otherwise they are drawn from
+ * client memory with the vertex arrays of OpenGL 1.1, which every opengl32 has without a loader. Attributes set before glBegin are left to the
+ * GL as before, and a block whose first vertices come before its first color (or normal or texture coordinate)
+ * is drawn the old way, because the color of those vertices is not known to the recorder.
+ *
+ * Define GLRECORD_NO_MACROS before including it to keep the GL names untouched and call the recorder by hand
+ * with GLRECORD_BEGIN(mode), glrecordVertex3f(...) and glrecordEnd().
+ */
+
+#ifndef GLRECORD_H
+#define GLRECORD_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+// --- Recordings ---
+
+/// @brief one recorded vertex with everything a block can give it
+typedef struct
+{
+    float position[3];
+    float color[4];
+    float normal[3];
+    float texCoord[2];
+} GlrecordVertex;
+
+/// @brief which attributes a vertex of a block got inside the block
+enum GlrecordAttribute
+{
+    GLRECORD_COLOR = 1,
+    GLRECORD_NORMAL = 2,
+    GLRECORD_TEX_COORD = 4
+};
+
+/// @brief the recording of one run of one call site
+typedef struct
+{
+    GLenum mode;
+    unsigned int attributes;           // the attributes every vertex has
+    std::vector<GlrecordVertex> vertices;
+    GLuint buffer;                     // the vertex buffer object, 0 when drawn from client memory
+} GlrecordEntry;
+
+/// @brief all the recordings of one call site, one per run of it in a frame
+typedef struct
+{
+    std::vector<GlrecordEntry> entries;
+    long long frame; // the frame next counts runs in
+    size_t next;     // the run of the site in this frame
+} GlrecordSite;
+
+/// @brief the recorder of the file, the blocks are only drawn from the thread of the GL context
+typedef struct
+{
+    std::unordered_map<unsigned long long, GlrecordSite> sites;
+    long long frame;
+
+    // the block being recorded
+    bool inBlock;
+    GLenum mode;
+    const char *file;
+    int line;
+    std::vector<GlrecordVertex> vertices;
+    std::vector<unsigned char> vertexAttributes; // the attributes of every vertex
+    GlrecordVertex current;                      // the attributes set inside the block so far
+    unsigned int currentAttributes;
+
+    // what it saved
+    long long replayed;  // blocks drawn from their recording
+    long long recorded;  // blocks recorded again because they changed
+    long long immediate; // blocks drawn the old way
+    long long savedCalls; // glVertex, glColor ... calls that did not reach the driver
+} GlrecordState;
+
+static GlrecordState glrecord;
+
+/// @brief start a new frame: the runs of every call site are counted from the first again
+inline void glrecordFrame()
+{
+    glrecord.frame++;
+}
+
+/// @brief the key of a call site, the file name of a site is always the same string literal
+inline unsigned long long glrecordSiteKey(const char *file, int line)
+{
+    return (unsigned long long)(size_t)file * 31u + (unsigned long long)line;
+}
+
+inline void glrecordBegin(GLenum mode, const char *file, int line)
+{
+    if (glrecord.inBlock)
+        return; // glBegin inside a block is an error the GL would ignore too
+    glrecord.inBlock = true;
+    glrecord.mode = mode;
+    glrecord.file = file;
+    glrecord.line = line;
+    glrecord.vertices.clear();
+    glrecord.vertexAttributes.clear();
+    memset(&glrecord.current, 0, sizeof(glrecord.current));
+    glrecord.currentAttributes = 0;
+}
+
+/// @brief add a vertex with the attributes set so far in the block
+inline void glrecordAddVertex(float x, float y, float z)
+{
+    GlrecordVertex vertex = glrecord.current;
+    vertex.position[0] = x, vertex.position[1] = y, vertex.position[2] = z;
+    glrecord.vertices.push_back(vertex);
+    glrecord.vertexAttributes.push_back((unsigned char)glrecord.currentAttributes);
+}
+
+/// @brief draw the block of the current recording with the old calls
+inline void glrecordDrawImmediate()
+{
+    glBegin(glrecord.mode);
+    for (size_t i = 0; i < glrecord.vertices.size(); i++)
+    {
+        const GlrecordVertex &vertex = glrecord.vertices[i];
+        if (glrecord.vertexAttributes[i] & GLRECORD_COLOR)
+            glColor4fv(vertex.color);
+        if (glrecord.vertexAttributes[i] & GLRECORD_NORMAL)
+            glNormal3fv(vertex.normal);
+        if (glrecord.vertexAttributes[i] & GLRECORD_TEX_COORD)
+            glTexCoord2fv(vertex.texCoord);
+        glVertex3fv(vertex.position);
+    }
+    glEnd();
+}
+
+/// @brief draw a recording with one glDrawArrays, uploading it first if it was just recorded
+inline void glrecordDrawEntry(GlrecordEntry &entry, bool changed)
+{
+    const char *base = (const char *)entry.vertices.data();
+#ifdef __glew_h__
+    bool useBuffer = glGenBuffers != NULL; // NULL if glewInit was not called or the GL has no buffer objects
+    GLint boundBuffer = 0;                  // the program's own array buffer, bound again after the draw
+    if (useBuffer)
+    {
+        glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &boundBuffer);
+        if (entry.buffer == 0)
+            glGenBuffers(1, &entry.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, entry.buffer);
+        if (changed)
+            glBufferData(GL_ARRAY_BUFFER, entry.vertices.size() * sizeof(GlrecordVertex), base, GL_STATIC_DRAW);
+        base = 0; // the offsets are into the buffer
+    }
+#else
+    (void)changed;
+#endif
+    const GLsizei stride = sizeof(GlrecordVertex);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT); // the arrays the program set up stay as they were
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, stride, base + offsetof(GlrecordVertex, position));
+    if (entry.attributes & GLRECORD_COLOR)
+    {
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(4, GL_FLOAT, stride, base + offsetof(GlrecordVertex, color));
+    }
+    else
+        glDisableClientState(GL_COLOR_ARRAY);
+    if (entry.attributes & GLRECORD_NORMAL)
+    {
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_FLOAT, stride, base + offsetof(GlrecordVertex, normal));
+    }
+    else
+        glDisableClientState(GL_NORMAL_ARRAY);
+    if (entry.attributes & GLRECORD_TEX_COORD)
+    {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, stride, base + offsetof(GlrecordVertex, texCoord));
+    }
+    else
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDrawArrays(entry.mode, 0, (GLsizei)entry.vertices.size());
+    glPopClientAttrib();
+#ifdef __glew_h__
+    if (useBuffer)
+        glBindBuffer(GL_ARRAY_BUFFER, boundBuffer);
+#endif
+}
+
+inline void glrecordEnd()
+{
+    if (!glrecord.inBlock)
+        return;
+    glrecord.inBlock = false;
+
+    GlrecordSite &site = glrecord.sites[glrecordSiteKey(glrecord.file, glrecord.line)];
+    if (site.frame != glrecord.frame)
+    {
+        site.frame = glrecord.frame;
+        site.next = 0;
+    }
+    if (site.next == site.entries.size())
+    {
+        GlrecordEntry entry = {0, 0, std::vector<GlrecordVertex>(), 0};
+        site.entries.push_back(entry);
+    }
+    GlrecordEntry &entry = site.entries[site.next++];
+
+    // every vertex must have the same attributes, otherwise some of them take theirs from outside the block
+    unsigned int all = ~0u, any = 0;
+    for (unsigned char attributes : glrecord.vertexAttributes)
+        all &= attributes, any |= attributes;
+    long long calls = (long long)glrecord.vertices.size() * (1 + __builtin_popcount(any));
+    if (glrecord.vertices.empty() || all != any)
+    {
+        glrecordDrawImmediate();
+        glrecord.immediate++;
+    }
+    else
+    {
+        bool changed = entry.mode != glrecord.mode || entry.attributes != any || entry.vertices.size() != glrecord.vertices.size() ||
+                       memcmp(entry.vertices.data(), glrecord.vertices.data(), glrecord.vertices.size() * sizeof(GlrecordVertex)) != 0;
+        if (changed)
+        {
+            entry.mode = glrecord.mode;
+            entry.attributes = any;
+            entry.vertices.swap(glrecord.vertices);
+            glrecord.recorded++;
+        }
+        else
+            glrecord.replayed++;
+        glrecordDrawEntry(entry, changed);
+        glrecord.savedCalls += calls;
+    }
+
+    // the GL leaves the attributes of the last call of a block current, the arrays leave them undefined
+    if (any & GLRECORD_COLOR)
+        glColor4fv(glrecord.current.color);
+    if (any & GLRECORD_NORMAL)
+        glNormal3fv(glrecord.current.normal);
+    if (any & GLRECORD_TEX_COORD)
+        glTexCoord2fv(glrecord.current.texCoord);
+}
+
+// --- Recorded Calls ---
+// Inside a block they only change the recording, outside of one they are passed on to the GL.
+
+inline void glrecordVertex3f(GLfloat x, GLfloat y, GLfloat z)
+{
+    if (glrecord.inBlock)
+        glrecordAddVertex(x, y, z);
+    else
+        glVertex3f(x, y, z);
+}
+inline void glrecordVertex2f(GLfloat x, GLfloat y) { glrecordVertex3f(x, y, 0.0f); }
+inline void glrecordVertex2d(GLdouble x, GLdouble y) { glrecordVertex3f((GLfloat)x, (GLfloat)y, 0.0f); }
+inline void glrecordVertex2i(GLint x, GLint y) { glrecordVertex3f((GLfloat)x, (GLfloat)y, 0.0f); }
+inline void glrecordVertex3d(GLdouble x, GLdouble y, GLdouble z) { glrecordVertex3f((GLfloat)x, (GLfloat)y, (GLfloat)z); }
+inline void glrecordVertex3fv(const GLfloat *v) { glrecordVertex3f(v[0], v[1], v[2]); }
+
+inline void glrecordColor4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+    if (!glrecord.inBlock)
+    {
+        glColor4f(r, g, b, a);
+        return;
+    }
+    GLfloat *color = glrecord.current.color;
+    color[0] = r, color[1] = g, color[2] = b, color[3] = a;
+    glrecord.currentAttributes |= GLRECORD_COLOR;
+}
+inline void glrecordColor3f(GLfloat r, GLfloat g, GLfloat b) { glrecordColor4f(r, g, b, 1.0f); }
+inline void glrecordColor3fv(const GLfloat *c) { glrecordColor4f(c[0], c[1], c[2], 1.0f); }
+inline void glrecordColor4fv(const GLfloat *c) { glrecordColor4f(c[0], c[1], c[2], c[3]); }
+inline void glrecordColor3ub(GLubyte r, GLubyte g, GLubyte b) { glrecordColor4f(r / 255.0f, g / 255.0f, b / 255.0f, 1.0f); }
+
+inline void glrecordNormal3f(GLfloat x, GLfloat y, GLfloat z)
+{
+    if (!glrecord.inBlock)
+    {
+        glNormal3f(x, y, z);
+        return;
+    }
+    GLfloat *normal = glrecord.current.normal;
+    normal[0] = x, normal[1] = y, normal[2] = z;
+    glrecord.currentAttributes |= GLRECORD_NORMAL;
+}
+inline void glrecordNormal3fv(const GLfloat *n) { glrecordNormal3f(n[0], n[1], n[2]); }
+
+inline void glrecordTexCoord2f(GLfloat s, GLfloat t)
+{
+    if (!glrecord.inBlock)
+    {
+        glTexCoord2f(s, t);
+        return;
+    }
+    glrecord.current.texCoord[0] = s, glrecord.current.texCoord[1] = t;
+    glrecord.currentAttributes |= GLRECORD_TEX_COORD;
+}
+
+/// @brief glClear, which also starts a new frame when it clears the color buffer
+inline void glrecordClear(GLbitfield mask)
+{
+    if (mask & GL_COLOR_BUFFER_BIT)
+        glrecordFrame();
+    glClear(mask);
+}
+
+/// @brief print how many blocks were drawn from their recording and how many driver calls that saved
+inline void glrecordPrintStats()
+{
+    size_t entries = 0;
+    for (const auto &site : glrecord.sites)
+        entries += site.second.entries.size();
+    printf("recorded blocks: %zu call sites, %zu recordings, %lld drawn from the recording, %lld recorded again, "
+           "%lld drawn the old way, %lld vertex and attribute calls kept from the driver\n",
+           glrecord.sites.size(), entries, glrecord.replayed, glrecord.recorded, glrecord.immediate, glrecord.savedCalls);
+}
+
+#define GLRECORD_BEGIN(mode) glrecordBegin(mode, __FILE__, __LINE__)
+
+#ifndef GLRECORD_NO_MACROS
+#define glBegin(mode) glrecordBegin(mode, __FILE__, __LINE__)
+#define glEnd() glrecordEnd()
+#define glVertex2f glrecordVertex2f
+#define glVertex2d glrecordVertex2d
+#define glVertex2i glrecordVertex2i
+#define glVertex3f glrecordVertex3f
+#define glVertex3d glrecordVertex3d
+#define glVertex3fv glrecordVertex3fv
+#define glColor3f glrecordColor3f
+#define glColor3fv glrecordColor3fv
+#define glColor3ub glrecordColor3ub
+#define glColor4f glrecordColor4f
+#define glColor4fv glrecordColor4fv
+#define glNormal3f glrecordNormal3f
+#define glNormal3fv glrecordNormal3fv
+#define glTexCoord2f glrecordTexCoord2f
+#define glClear glrecordClear
+#endif
+
+#endif
@@ -0,0 +1,446 @@
+/**
+ * A GL call counter for all the demos, loaded with LD_PRELOAD so none of them has to change.
+ *
+ * It counts every call to the GL entry points the demos use (and the ones glut and glu make for them),
+ * sorted into draw calls, vertices, vertex attributes (colors, normals, texture coordinates), matrix
+ * operations and state changes, per frame. A frame ends at every glXSwapBuffers / eglSwapBuffers, which is
+ * what glutSwapBuffers calls. When the program exits it prints a table with the calls of every function, in
+ * total, per frame and in the busiest frame, and a histogram per kind of how many there were per frame.
+ *
+ * Build on Linux: g++ -O2 -shared -fPIC gltrace.cpp -o libgltrace.so -ldl
+ * Use:            LD_PRELOAD=./libgltrace.so ./balldemo.out --balls 200
+ *
+ * Environment variables (all optional):
+ *   GLTRACE_OUT=FILE       print the report into FILE instead of stderr
+ *   GLTRACE_FRAMES=FILE    also write one CSV line per frame with the counts of every kind
+ *   GLTRACE_TIME=1         also measure the time spent inside every function (this costs some time itself);
+ *                          with a software GL like llvmpipe the vertices of glBegin/glEnd are processed in glEnd
+ *   GLTRACE_CLEAR_FRAMES=1 end a frame at every glClear of the color buffer instead, for runs without a window
+ *                          (--headless, --bench) that never swap
+ *
+ * The functions GLEW loads by name (glBindBuffer, glDrawArraysInstanced ...) are caught by answering
+ * glXGetProcAddress and eglGetProcAddress with the counting version. Draws from display lists count as one
+ * draw call without vertices, the vertices were counted when the list was made.
+ */
+
+// --- Includes ---
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+using namespace std;
+
+// The GL types, declared here instead of including GL/gl.h so the counting functions do not have to match
+// the exact declarations (calling conventions, const, GLAPI) of one particular version of the headers.
+typedef unsigned int GLenum;
+typedef unsigned char GLboolean;
+typedef unsigned int GLbitfield;
+typedef int GLint;
+typedef int GLsizei;
+typedef unsigned int GLuint;
+typedef unsigned char GLubyte;
+typedef float GLfloat;
+typedef double GLdouble;
+typedef long GLintptr;
+typedef long GLsizeiptr;
+
+// --- Counters ---
+// Every function gets a number the first time it is called. The counts of the current frame are kept apart,
+// at the end of the frame they are added to the totals and the kinds are remembered for the histograms.
+
+/// @brief what a GL call does, a call counts for exactly one kind
+enum CallKind
+{
+    KIND_DRAW,      // glBegin, glDrawArrays, glCallList ...
+    KIND_VERTEX,    // glVertex*
+    KIND_ATTRIBUTE, // glColor*, glNormal*, glTexCoord*
+    KIND_MATRIX,    // glRotatef, glTranslatef, glPushMatrix, glLoadIdentity ...
+    KIND_STATE,     // glEnable, glBindTexture, glUseProgram, glBindBuffer ...
+    KIND_OTHER,     // clears, buffer uploads, reads
+    CALL_KINDS
+};
+
+const char *kindNames[CALL_KINDS] = {"draw", "vertex", "attribute", "matrix", "state", "other"};
+
+/// @brief the counts of one function
+typedef struct
+{
+    const char *name;
+    CallKind kind;
+    long long calls;         // in all the finished frames
+    long long frameCalls;    // in the current frame
+    long long maxFrameCalls; // in the busiest frame
+    long long nanoseconds;   // inside the function, with GLTRACE_TIME
+} TracedFunction;
+
+/// @brief what happened in one frame
+typedef struct
+{
+    long long calls[CALL_KINDS];
+    long long vertices; // glVertex calls and the vertices of the array draws
+} FrameCounts;
+
+/// @brief all the counts, the GL is only called from one thread in the demos so nothing is locked
+typedef struct
+{
+    vector<TracedFunction> functions;
+    vector<FrameCounts> frames;
+    FrameCounts current;
+    bool timing;
+    bool clearEndsFrame;
+    FILE *frameFile;
+    bool started;
+} Tracer;
+
+Tracer tracer;
+
+/// @brief read the environment, once before the first call is counted
+void startTracer()
+{
+    tracer.started = true;
+    tracer.timing = getenv("GLTRACE_TIME") != NULL && atoi(getenv("GLTRACE_TIME")) != 0;
+    tracer.clearEndsFrame = getenv("GLTRACE_CLEAR_FRAMES") != NULL && atoi(getenv("GLTRACE_CLEAR_FRAMES")) != 0;
+    const char *framePath = getenv("GLTRACE_FRAMES");
+    if (framePath != NULL)
+    {
+        tracer.frameFile = fopen(framePath, "w");
+        if (tracer.frameFile != NULL)
+            fprintf(tracer.frameFile, "frame,draw,vertex,attribute,matrix,state,other,vertices\n");
+    }
+    memset(&tracer.current, 0, sizeof(tracer.current));
+}
+
+/// @brief give a function its number, called once by every counting function
+int registerFunction(const char *name, CallKind kind)
+{
+    if (!tracer.started)
+        startTracer();
+    TracedFunction function = {name, kind, 0, 0, 0, 0};
+    tracer.functions.push_back(function);
+    return (int)tracer.functions.size() - 1;
+}
+
+/// @brief count a call of a function and the vertices it draws
+inline void countCall(int id, long long vertices)
+{
+    TracedFunction &function = tracer.functions[id];
+    function.frameCalls++;
+    tracer.current.calls[function.kind]++;
+    tracer.current.vertices += vertices;
+}
+
+/// @brief add the current frame to the totals and start a new one
+void endFrame()
+{
+    for (TracedFunction &function : tracer.functions)
+    {
+        function.calls += function.frameCalls;
+        function.maxFrameCalls = max(function.maxFrameCalls, function.frameCalls);
+        function.frameCalls = 0;
+    }
+    if (tracer.frameFile != NULL)
+    {
+        const FrameCounts &c = tracer.current;
+        fprintf(tracer.frameFile, "%zu,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n", tracer.frames.size(), c.calls[KIND_DRAW],
+                c.calls[KIND_VERTEX], c.calls[KIND_ATTRIBUTE], c.calls[KIND_MATRIX], c.calls[KIND_STATE],
+                c.calls[KIND_OTHER], c.vertices);
+    }
+    tracer.frames.push_back(tracer.current);
+    memset(&tracer.current, 0, sizeof(tracer.current));
+}
+
+/// @brief measures the time inside a GL function with GLTRACE_TIME, from its construction to its destruction
+struct CallTimer
+{
+    int id;
+    timespec start;
+    CallTimer(int function) : id(function)
+    {
+        if (tracer.timing)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    ~CallTimer()
+    {
+        if (!tracer.timing)
+            return;
+        timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        tracer.functions[id].nanoseconds += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    }
+};
+
+// --- Finding The Real Functions ---
+
+typedef void *(*GetProcAddress)(const char *name);
+
+/// @brief the real function of a name: the next library that has it, or the GL's own lookup for extensions
+void *realFunction(const char *name)
+{
+    void *function = dlsym(RTLD_NEXT, name);
+    if (function != NULL)
+        return function;
+    static GetProcAddress glxLookup = (GetProcAddress)dlsym(RTLD_NEXT, "glXGetProcAddressARB");
+    static GetProcAddress eglLookup = (GetProcAddress)dlsym(RTLD_NEXT, "eglGetProcAddress");
+    if (glxLookup != NULL && (function = glxLookup(name)) != NULL)
+        return function;
+    if (eglLookup != NULL && (function = eglLookup(name)) != NULL)
+        return function;
+    fprintf(stderr, "gltrace: there is no %s\n", name);
+    abort();
+}
+
+// --- Counted Functions ---
+// One line per function: its kind, how many vertices a call draws, and its declaration. The list makes the
+// counting function and the entry that glXGetProcAddress answers with.
+
+#define TRACED_FUNCTIONS(F)                                                                                                   \
+    F(KIND_DRAW, 0, void, glBegin, (GLenum mode), (mode))                                                                     \
+    F(KIND_OTHER, 0, void, glEnd, (), ())                                                                                     \
+    F(KIND_DRAW, count, void, glDrawArrays, (GLenum mode, GLint first, GLsizei count), (mode, first, count))                  \
+    F(KIND_DRAW, count, void, glDrawElements, (GLenum mode, GLsizei count, GLenum type, const void *indices),                 \
+      (mode, count, type, indices))                                                                                           \
+    F(KIND_DRAW, (long long)count * instances, void, glDrawArraysInstanced,                                                   \
+      (GLenum mode, GLint first, GLsizei count, GLsizei instances), (mode, first, count, instances))                          \
+    F(KIND_DRAW, (long long)count * instances, void, glDrawElementsInstanced,                                                 \
+      (GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei instances), (mode, count, type, indices, instances)) \
+    F(KIND_DRAW, 0, void, glCallList, (GLuint list), (list))                                                                  \
+    F(KIND_VERTEX, 1, void, glVertex2f, (GLfloat x, GLfloat y), (x, y))                                                       \
+    F(KIND_VERTEX, 1, void, glVertex2d, (GLdouble x, GLdouble y), (x, y))                                                     \
+    F(KIND_VERTEX, 1, void, glVertex2i, (GLint x, GLint y), (x, y))                                                           \
+    F(KIND_VERTEX, 1, void, glVertex3f, (GLfloat x, GLfloat y, GLfloat z), (x, y, z))                                         \
+    F(KIND_VERTEX, 1, void, glVertex3d, (GLdouble x, GLdouble y, GLdouble z), (x, y, z))                                      \
+    F(KIND_VERTEX, 1, void, glVertex3fv, (const GLfloat *v), (v))                                                             \
+    F(KIND_VERTEX, 1, void, glVertex3dv, (const GLdouble *v), (v))                                                            \
+    F(KIND_ATTRIBUTE, 0, void, glColor3f, (GLfloat r, GLfloat g, GLfloat b), (r, g, b))                                       \
+    F(KIND_ATTRIBUTE, 0, void, glColor3fv, (const GLfloat *v), (v))                                                           \
+    F(KIND_ATTRIBUTE, 0, void, glColor3ub, (GLubyte r, GLubyte g, GLubyte b), (r, g, b))                                      \
+    F(KIND_ATTRIBUTE, 0, void, glColor4f, (GLfloat r, GLfloat g, GLfloat b, GLfloat a), (r, g, b, a))                         \
+    F(KIND_ATTRIBUTE, 0, void, glColor4fv, (const GLfloat *v), (v))                                                           \
+    F(KIND_ATTRIBUTE, 0, void, glColor4ub, (GLubyte r, GLubyte g, GLubyte b, GLubyte a), (r, g, b, a))                        \
+    F(KIND_ATTRIBUTE, 0, void, glNormal3f, (GLfloat x, GLfloat y, GLfloat z), (x, y, z))                                      \
+    F(KIND_ATTRIBUTE, 0, void, glNormal3fv, (const GLfloat *v), (v))                                                          \
+    F(KIND_ATTRIBUTE, 0, void, glNormal3d, (GLdouble x, GLdouble y, GLdouble z), (x, y, z))                                   \
+    F(KIND_ATTRIBUTE, 0, void, glTexCoord2f, (GLfloat s, GLfloat t), (s, t))                                                  \
+    F(KIND_ATTRIBUTE, 0, void, glTexCoord2d, (GLdouble s, GLdouble t), (s, t))                                                \
+    F(KIND_MATRIX, 0, void, glRotatef, (GLfloat angle, GLfloat x, GLfloat y, GLfloat z), (angle, x, y, z))                    \
+    F(KIND_MATRIX, 0, void, glRotated, (GLdouble angle, GLdouble x, GLdouble y, GLdouble z), (angle, x, y, z))                \
+    F(KIND_MATRIX, 0, void, glTranslatef, (GLfloat x, GLfloat y, GLfloat z), (x, y, z))                                       \
+    F(KIND_MATRIX, 0, void, glTranslated, (GLdouble x, GLdouble y, GLdouble z), (x, y, z))                                    \
+    F(KIND_MATRIX, 0, void, glScalef, (GLfloat x, GLfloat y, GLfloat z), (x, y, z))                                           \
+    F(KIND_MATRIX, 0, void, glScaled, (GLdouble x, GLdouble y, GLdouble z), (x, y, z))                                        \
+    F(KIND_MATRIX, 0, void, glPushMatrix, (), ())                                                                             \
+    F(KIND_MATRIX, 0, void, glPopMatrix, (), ())                                                                              \
+    F(KIND_MATRIX, 0, void, glLoadIdentity, (), ())                                                                           \
+    F(KIND_MATRIX, 0, void, glMatrixMode, (GLenum mode), (mode))                                                              \
+    F(KIND_MATRIX, 0, void, glMultMatrixf, (const GLfloat *m), (m))                                                           \
+    F(KIND_MATRIX, 0, void, glMultMatrixd, (const GLdouble *m), (m))                                                          \
+    F(KIND_MATRIX, 0, void, glLoadMatrixf, (const GLfloat *m), (m))                                                           \
+    F(KIND_MATRIX, 0, void, glLoadMatrixd, (const GLdouble *m), (m))                                                          \
+    F(KIND_MATRIX, 0, void, glOrtho, (GLdouble l, GLdouble r, GLdouble b, GLdouble t, GLdouble n, GLdouble f),                \
+      (l, r, b, t, n, f))                                                                                                     \
+    F(KIND_MATRIX, 0, void, glFrustum, (GLdouble l, GLdouble r, GLdouble b, GLdouble t, GLdouble n, GLdouble f),              \
+      (l, r, b, t, n, f))                                                                                                     \
+    F(KIND_MATRIX, 0, void, glUniformMatrix4fv, (GLint location, GLsizei count, GLboolean transpose, const GLfloat *value),   \
+      (location, count, transpose, value))                                                                                    \
+    F(KIND_STATE, 0, void, glEnable, (GLenum cap), (cap))                                                                     \
+    F(KIND_STATE, 0, void, glDisable, (GLenum cap), (cap))                                                                    \
+    F(KIND_STATE, 0, void, glEnableClientState, (GLenum array), (array))                                                      \
+    F(KIND_STATE, 0, void, glDisableClientState, (GLenum array), (array))                                                     \
+    F(KIND_STATE, 0, void, glBindTexture, (GLenum target, GLuint texture), (target, texture))                                 \
+    F(KIND_STATE, 0, void, glShadeModel, (GLenum mode), (mode))                                                               \
+    F(KIND_STATE, 0, void, glBlendFunc, (GLenum source, GLenum destination), (source, destination))                          \
+    F(KIND_STATE, 0, void, glAlphaFunc, (GLenum function, GLfloat reference), (function, reference))                          \
+    F(KIND_STATE, 0, void, glDepthMask, (GLboolean flag), (flag))                                                             \
+    F(KIND_STATE, 0, void, glLineWidth, (GLfloat width), (width))                                                             \
+    F(KIND_STATE, 0, void, glPointSize, (GLfloat size), (size))                                                               \
+    F(KIND_STATE, 0, void, glPolygonMode, (GLenum face, GLenum mode), (face, mode))                                           \
+    F(KIND_STATE, 0, void, glTexEnvi, (GLenum target, GLenum name, GLint value), (target, name, value))                       \
+    F(KIND_STATE, 0, void, glTexParameteri, (GLenum target, GLenum name, GLint value), (target, name, value))                 \
+    F(KIND_STATE, 0, void, glPointParameterf, (GLenum name, GLfloat value), (name, value))                                    \
+    F(KIND_STATE, 0, void, glPointParameterfv, (GLenum name, const GLfloat *value), (name, value))                            \
+    F(KIND_STATE, 0, void, glVertexPointer, (GLint size, GLenum type, GLsizei stride, const void *pointer),                   \
+      (size, type, stride, pointer))                                                                                          \
+    F(KIND_STATE, 0, void, glColorPointer, (GLint size, GLenum type, GLsizei stride, const void *pointer),                    \
+      (size, type, stride, pointer))                                                                                          \
+    F(KIND_STATE, 0, void, glNormalPointer, (GLenum type, GLsizei stride, const void *pointer), (type, stride, pointer))       \
+    F(KIND_STATE, 0, void, glViewport, (GLint x, GLint y, GLsizei width, GLsizei height), (x, y, width, height))              \
+    F(KIND_STATE, 0, void, glClearColor, (GLfloat r, GLfloat g, GLfloat b, GLfloat a), (r, g, b, a))                          \
+    F(KIND_STATE, 0, void, glUseProgram, (GLuint program), (program))                                                         \
+    F(KIND_STATE, 0, void, glBindBuffer, (GLenum target, GLuint buffer), (target, buffer))                                    \
+    F(KIND_STATE, 0, void, glBindBufferBase, (GLenum target, GLuint index, GLuint buffer), (target, index, buffer))           \
+    F(KIND_STATE, 0, void, glBindVertexArray, (GLuint array), (array))                                                        \
+    F(KIND_STATE, 0, void, glBindFramebuffer, (GLenum target, GLuint framebuffer), (target, framebuffer))                     \
+    F(KIND_STATE, 0, void, glVertexAttribPointer,                                                                             \
+      (GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void *pointer),                     \
+      (index, size, type, normalized, stride, pointer))                                                                       \
+    F(KIND_STATE, 0, void, glEnableVertexAttribArray, (GLuint index), (index))                                                \
+    F(KIND_STATE, 0, void, glDisableVertexAttribArray, (GLuint index), (index))                                               \
+    F(KIND_STATE, 0, void, glVertexAttribDivisor, (GLuint index, GLuint divisor), (index, divisor))                           \
+    F(KIND_STATE, 0, void, glUniform1i, (GLint location, GLint value), (location, value))                                     \
+    F(KIND_STATE, 0, void, glUniform1f, (GLint location, GLfloat value), (location, value))                                   \
+    F(KIND_STATE, 0, void, glUniform4f, (GLint location, GLfloat x, GLfloat y, GLfloat z, GLfloat w), (location, x, y, z, w)) \
+    F(KIND_OTHER, 0, void, glBufferData, (GLenum target, GLsizeiptr size, const void *data, GLenum usage),                    \
+      (target, size, data, usage))                                                                                            \
+    F(KIND_OTHER, 0, void, glBufferSubData, (GLenum target, GLintptr offset, GLsizeiptr size, const void *data),              \
+      (target, offset, size, data))                                                                                           \
+    F(KIND_OTHER, 0, void, glReadPixels,                                                                                      \
+      (GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixels),                            \
+      (x, y, width, height, format, type, pixels))                                                                            \
+    F(KIND_OTHER, 0, void, glFlush, (), ())                                                                                   \
+    F(KIND_OTHER, 0, void, glFinish, (), ())
+
+/// @brief the counting version of a GL function: count the call, then call the real one
+#define COUNTING_FUNCTION(kind, vertices, result, name, parameters, arguments)                         \
+    extern "C" result name parameters                                                                  \
+    {                                                                                                  \
+        static int id = registerFunction(#name, kind);                                                 \
+        static result(*real) parameters = (result(*) parameters)realFunction(#name);                   \
+        countCall(id, vertices);                                                                       \
+        CallTimer timer(id);                                                                           \
+        return real arguments;                                                                         \
+    }
+
+TRACED_FUNCTIONS(COUNTING_FUNCTION)
+
+/// @brief glClear is counted by hand, with GLTRACE_CLEAR_FRAMES a clear of the color buffer starts a new frame
+extern "C" void glClear(GLbitfield mask)
+{
+    static int id = registerFunction("glClear", KIND_OTHER);
+    static void (*real)(GLbitfield) = (void (*)(GLbitfield))realFunction("glClear");
+    const GLbitfield colorBufferBit = 0x00004000;
+    if (tracer.clearEndsFrame && (mask & colorBufferBit) && tracer.current.calls[KIND_DRAW] > 0)
+        endFrame();
+    countCall(id, 0);
+    CallTimer timer(id);
+    real(mask);
+}
+
+// --- Frame Ends And Lookups ---
+
+/// @brief the counting functions by name, for the lookups below
+typedef struct
+{
+    const char *name;
+    void *function;
+} CountingEntry;
+
+#define COUNTING_ENTRY(kind, vertices, result, name, parameters, arguments) {#name, (void *)&name},
+const CountingEntry countingEntries[] = {TRACED_FUNCTIONS(COUNTING_ENTRY){"glClear", (void *)&glClear}};
+
+/// @brief the counting version of a function GLEW looks up by name, or the real one if it is not counted
+void *countingFunction(const char *name, void *real)
+{
+    if (real == NULL)
+        return NULL;
+    for (const CountingEntry &entry : countingEntries)
+        if (strcmp(entry.name, name) == 0)
+            return entry.function;
+    return real;
+}
+
+extern "C" void *glXGetProcAddressARB(const GLubyte *name)
+{
+    static GetProcAddress real = (GetProcAddress)dlsym(RTLD_NEXT, "glXGetProcAddressARB");
+    return countingFunction((const char *)name, real((const char *)name));
+}
+
+extern "C" void *glXGetProcAddress(const GLubyte *name)
+{
+    static GetProcAddress real = (GetProcAddress)dlsym(RTLD_NEXT, "glXGetProcAddress");
+    return countingFunction((const char *)name, real((const char *)name));
+}
+
+extern "C" void *eglGetProcAddress(const char *name)
+{
+    static GetProcAddress real = (GetProcAddress)dlsym(RTLD_NEXT, "eglGetProcAddress");
+    return countingFunction(name, real(name));
+}
+
+extern "C" void glXSwapBuffers(void *display, unsigned long drawable)
+{
+    static void (*real)(void *, unsigned long) = (void (*)(void *, unsigned long))realFunction("glXSwapBuffers");
+    endFrame();
+    real(display, drawable);
+}
+
+extern "C" unsigned int eglSwapBuffers(void *display, void *surface)
+{
+    static unsigned int (*real)(void *, void *) = (unsigned int (*)(void *, void *))realFunction("eglSwapBuffers");
+    endFrame();
+    return real(display, surface);
+}
+
+// --- Report ---
+
+/// @brief which bucket of the histogram a count per frame falls into: 0, 1-9, 10-99, 100-999 ...
+int histogramBucket(long long count)
+{
+    int bucket = 0;
+    while (count > 0 && bucket < 7)
+    {
+        bucket++;
+        count /= 10;
+    }
+    return bucket;
+}
+
+/// @brief print the totals and the histograms when the program ends
+__attribute__((destructor)) void printTraceReport()
+{
+    if (!tracer.started)
+        return;
+    if (tracer.current.calls[KIND_DRAW] > 0 || tracer.frames.empty())
+        endFrame(); // the calls after the last swap
+    FILE *out = stderr;
+    const char *outPath = getenv("GLTRACE_OUT");
+    if (outPath != NULL && (out = fopen(outPath, "w")) == NULL)
+        out = stderr;
+    long long frames = (long long)tracer.frames.size();
+
+    // per function, the most called first
+    vector<TracedFunction> functions = tracer.functions;
+    sort(functions.begin(), functions.end(), [](const TracedFunction &a, const TracedFunction &b)
+         { return a.calls > b.calls; });
+    fprintf(out, "gltrace: %lld frames\n", frames);
+    fprintf(out, "%-28s %-9s %12s %12s %12s%s\n", "function", "kind", "calls", "per frame", "most/frame",
+            tracer.timing ? "      ms total   ns/call" : "");
+    for (const TracedFunction &function : functions)
+    {
+        if (function.calls == 0)
+            continue;
+        fprintf(out, "%-28s %-9s %12lld %12.1f %12lld", function.name, kindNames[function.kind], function.calls,
+                (double)function.calls / frames, function.maxFrameCalls);
+        if (tracer.timing)
+            fprintf(out, " %13.3f %9.1f", function.nanoseconds / 1e6, (double)function.nanoseconds / function.calls);
+        fprintf(out, "\n");
+    }
+
+    // per kind: how many frames had 0, 1-9, 10-99 ... calls of it
+    const char *bucketNames[8] = {"0", "1-9", "10-99", "100-999", "1k-10k", "10k-100k", "100k-1M", ">=1M"};
+    fprintf(out, "\nframes by calls per frame\n%-10s", "kind");
+    for (int bucket = 0; bucket < 8; bucket++)
+        fprintf(out, " %9s", bucketNames[bucket]);
+    fprintf(out, " %12s\n", "mean");
+    for (int kind = 0; kind <= CALL_KINDS; kind++)
+    {
+        long long histogram[8] = {0, 0, 0, 0, 0, 0, 0, 0}, sum = 0;
+        for (const FrameCounts &frame : tracer.frames)
+        {
+            long long count = kind < CALL_KINDS ? frame.calls[kind] : frame.vertices;
+            histogram[histogramBucket(count)]++;
+            sum += count;
+        }
+        fprintf(out, "%-10s", kind < CALL_KINDS ? kindNames[kind] : "vertices");
+        for (int bucket = 0; bucket < 8; bucket++)
+            fprintf(out, " %9lld", histogram[bucket]);
+        fprintf(out, " %12.1f\n", frames ? (double)sum / frames : 0.0);
+    }
+    if (out != stderr)
+        fclose(out);
+    if (tracer.frameFile != NULL)
+        fclose(tracer.frameFile);
+}
@@ -4,6 +4,7 @@
  */
 #include <windows.h> // for MS Windows
 #include <GL/glut.h> // GLUT, include glu.h and gl.h
+#include "glrecord.h" // glBegin/glEnd blocks drawn from cached vertex arrays
 
 /* Initialize OpenGL Graphics */
 void initGL()
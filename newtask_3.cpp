@@ -24,6 +24,7 @@ using namespace std;
 #else
 #include <GL/glut.h> // Use standard GLUT location on Linux/Windows
 #endif
+#include "glrecord.h" // glBegin/glEnd blocks drawn from cached vertex arrays
 
 // --- Global Variables ---
 
@@ -74,10 +75,21 @@ void initGL()
 }
 
 
-const int slices = 40;
-const int stacks = 40;
 const float pi = 3.14159;
-void renderSphere(float radius = 1.0f)
+
+// Levels of detail: the sphere is compiled into a few display lists with fewer and fewer steps, and
+// renderSphere picks one by how many pixels the sphere covers. A level only changes once the size is
+// a bit past the border, so the sphere does not pop back and forth at a border.
+const int sphereLodLevels = 4;
+const int sphereLodSteps[sphereLodLevels] = {40, 24, 14, 8};            // stacks and slices of each level, level 0 is the old sphere
+const float sphereLodMinPixels[sphereLodLevels] = {60.0f, 24.0f, 8.0f, 0.0f}; // smallest radius on the screen for each level
+const float sphereLodHysteresis = 0.15f;
+GLuint sphereLodLists = 0; // the first of the display lists, one per level
+int sphereLod = 0;         // the level used last frame
+long long sphereTriangles = 0; // triangles of the spheres drawn in this frame
+
+/// @brief the old sphere loop, for a unit sphere with the given number of stacks and slices
+void buildSphere(int stacks, int slices)
 {
     for (int i = 0; i < stacks; ++i)
     {
@@ -102,13 +114,129 @@ void renderSphere(float radius = 1.0f)
             else
                 glColor3f(0.0f, 1.0f, 0.0f); // Green
 
-            glVertex3f(radius * x * zr0, radius * y * zr0, radius * z0);
-            glVertex3f(radius * x * zr1, radius * y * zr1, radius * z1);
+            glVertex3f(x * zr0, y * zr0, z0);
+            glVertex3f(x * zr1, y * zr1, z1);
         }
         glEnd();
     }
 }
 
+/// @brief draw a sphere around the current origin, with a level of detail that fits its size on the screen
+void renderSphere(float radius = 1.0f)
+{
+    if (sphereLodLists == 0)
+    {
+        sphereLodLists = glGenLists(sphereLodLevels);
+        for (int level = 0; level < sphereLodLevels; level++)
+        {
+            glNewList(sphereLodLists + level, GL_COMPILE);
+            buildSphere(sphereLodSteps[level], sphereLodSteps[level]);
+            glEndList();
+        }
+    }
+
+    // how big the sphere is on the screen, from the gluLookAt and gluPerspective matrices
+    GLfloat modelview[16], projection[16];
+    GLint viewport[4];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    float depth = -modelview[14]; // the sphere is at the origin of the current matrix
+    if (depth <= radius)
+        sphereLod = 0; // the camera is at or inside the sphere
+    else
+    {
+        float pixels = radius * 0.5f * viewport[3] * projection[5] / depth;
+        while (sphereLod > 0 && pixels > sphereLodMinPixels[sphereLod - 1] * (1.0f + sphereLodHysteresis))
+            sphereLod--;
+        while (sphereLod < sphereLodLevels - 1 && pixels < sphereLodMinPixels[sphereLod] * (1.0f - sphereLodHysteresis))
+            sphereLod++;
+    }
+
+    glPushMatrix();
+    glScalef(radius, radius, radius);
+    glCallList(sphereLodLists + sphereLod);
+    glPopMatrix();
+    sphereTriangles += 2 * sphereLodSteps[sphereLod] * sphereLodSteps[sphereLod]; // each strip has 2 * slices triangles
+}
+
+// Frustum culling: the six planes of the view are taken from the projection and modelview matrices
+// (the method of Gribb and Hartmann), and objects completely behind one of them are not drawn.
+
+/// @brief a plane a*x + b*y + c*z + d = 0 with (a, b, c) of length 1 pointing into the view
+struct Plane
+{
+    float a, b, c, d;
+};
+
+Plane frustum[6];      // left, right, bottom, top, near, far
+int visibleObjects = 0; // objects drawn in this frame
+int culledObjects = 0;  // objects skipped in this frame
+
+/// @brief take the frustum out of the current GL_PROJECTION and GL_MODELVIEW matrices
+void extractFrustum()
+{
+    GLfloat projection[16], modelview[16], clip[16];
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    for (int column = 0; column < 4; column++)
+        for (int row = 0; row < 4; row++)
+        {
+            clip[column * 4 + row] = 0.0f;
+            for (int k = 0; k < 4; k++)
+                clip[column * 4 + row] += projection[k * 4 + row] * modelview[column * 4 + k];
+        }
+
+    // every plane is the last row of clip plus or minus one of the other rows
+    for (int i = 0; i < 6; i++)
+    {
+        int row = i / 2;
+        float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+        float plane[4];
+        for (int column = 0; column < 4; column++)
+            plane[column] = clip[column * 4 + 3] + sign * clip[column * 4 + row];
+        float length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        frustum[i].a = plane[0] / length;
+        frustum[i].b = plane[1] / length;
+        frustum[i].c = plane[2] / length;
+        frustum[i].d = plane[3] / length;
+    }
+}
+
+/// @brief true if the sphere is at least partly in the view, and count it as visible or culled
+bool sphereVisible(float x, float y, float z, float radius)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        if (frustum[i].a * x + frustum[i].b * y + frustum[i].c * z + frustum[i].d < -radius)
+        {
+            culledObjects++;
+            return false;
+        }
+    }
+    visibleObjects++;
+    return true;
+}
+
+/// @brief true if the box is at least partly in the view, and count it as visible or culled
+bool boxVisible(float lowx, float lowy, float lowz, float highx, float highy, float highz)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        // the corner furthest along the plane normal
+        float x = frustum[i].a >= 0.0f ? highx : lowx;
+        float y = frustum[i].b >= 0.0f ? highy : lowy;
+        float z = frustum[i].c >= 0.0f ? highz : lowz;
+        if (frustum[i].a * x + frustum[i].b * y + frustum[i].c * z + frustum[i].d < 0.0f)
+        {
+            culledObjects++;
+            return false;
+        }
+    }
+    visibleObjects++;
+    return true;
+}
+
 /**
  * Main display function
  * Sets up the camera and renders visible objects
@@ -127,16 +255,35 @@ void display()
               centerx, centery, centerz, // Look-at point
               upx, upy, upz);            // Up vector
 
-    // Draw objects based on visibility flags
-    drawCubeWithCheckeredFloor();
-    renderSphere();
-    if (isAxes)
+    // Draw objects based on visibility flags, only the ones in the view
+    sphereTriangles = 0;
+    visibleObjects = culledObjects = 0;
+    extractFrustum();
+    if (boxVisible(-5.0f, -5.0f, -5.0f, 5.0f, 5.0f, 5.0f)) // the room is 10 units big around the origin
+        drawCubeWithCheckeredFloor();
+    if (sphereVisible(0.0f, 0.0f, 0.0f, 1.0f))
+        renderSphere();
+    if (isAxes && boxVisible(0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f))
         drawAxes();
-    if (isCube)
+    if (isCube && boxVisible(-1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f))
         drawCube();
-    if (isPyramid)
+    if (isPyramid && boxVisible(-1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f))
         drawPyramid();
 
+    // show the triangles of the spheres and the culled objects in the title when they change
+    static long long shownTriangles = -1;
+    static int shownVisible = -1, shownCulled = -1;
+    if (sphereTriangles != shownTriangles || visibleObjects != shownVisible || culledObjects != shownCulled)
+    {
+        char title[128];
+        snprintf(title, sizeof(title), "OpenGL 3D Drawing - %lld sphere triangles, %d objects visible, %d culled",
+                 sphereTriangles, visibleObjects, culledObjects);
+        glutSetWindowTitle(title);
+        shownTriangles = sphereTriangles;
+        shownVisible = visibleObjects;
+        shownCulled = culledObjects;
+    }
+
     // Swap buffers (double buffering)
     glutSwapBuffers();
 }
@@ -911,6 +1058,7 @@ int main(int argc, char **argv)
     glutInitWindowSize(640, 640);
     glutInitWindowPosition(50, 50);
     glutCreateWindow("OpenGL 3D Drawing");
+    glewInit(); // the buffer functions glrecord.h draws the blocks with come from GLEW
 
     // Register callback functions
     glutDisplayFunc(display);
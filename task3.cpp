@@ -7,6 +7,36 @@
  * - Keyboard navigation for camera control
  * - Perspective projection
  * - Object toggling
+ *
+ * Command line options (all optional):
+ *   --balls N      put N balls into the room instead of one
+ *   --room SIZE    change the size of the room (cubeSize)
+ *   --domains K    run the simulation without a window, split into K slabs each
+ *                  simulated by its own process, and compare it with a single process run
+ *   --steps S      how many physics steps the --domains run simulates
+ *   --threads N    split the physics of a step over N threads
+ *   --particles N  how many impact sparks can be alive at the same time
+ *   --particle-bench F  keep the spark pool full for F frames without a window and print how long it took
+ *   --core         draw with an OpenGL 3.3 core profile context instead of the fixed function pipeline
+ *   --headless F   draw F frames into an offscreen framebuffer without a window (Linux, EGL) and print how long they took
+ *   --frames PREFIX  write every frame to PREFIX0000.ppm, PREFIX0001.ppm ..., read back without stalling the window
+ *   --software     with --headless, draw on the CPU with the built-in tile rasterizer, without any GL
+ *   --raytrace     with --headless, ray trace on the CPU instead, with shadows from a light under the ceiling
+ *   --record FILE  append every simulated step (spheres, camera, impacts) to FILE, with or without a window
+ *   --render-farm FILE  draw a recorded FILE offline with several processes and write it as a YUV4MPEG2 video
+ *   --video OUT    where --render-farm writes the video (farm.y4m)
+ *   --workers N    how many processes --render-farm uses, one per core by default
+ *   --bench F      draw F frames without a window along a fixed camera path and print the frame time percentiles
+ *   --bench-json PATH  where --bench writes every frame time (benchmark.json)
+ *   --pass-log FILE  write the GPU time of every pass (room, balls, arrows, axes, sparks) of every frame to FILE
+ *   --gpu-physics  move the spheres with a compute shader (OpenGL 4.3) and draw them without copying them back,
+ *                  the spheres then do not bounce off each other
+ *   --gpu-physics-check S  run S steps without contacts with the compute shader, on the CPU and on the CPU with SSE,
+ *                  compare the spheres and print the throughput of each (Linux, EGL)
+ *   --software-check F  draw F frames with GL and with the software rasterizer, compare them pixel by pixel
+ *                  and fail if too many pixels differ (Linux, EGL)
+ *
+ * Build on Linux: g++ task3.cpp -o task3 -lglut -lGLEW -lGL -lGLU -lEGL -pthread
  */
 
 // --- Includes ---
@@ -18,12 +48,32 @@
 #include <GL/glew.h>
 using namespace std;
 
+#if defined(__SSE2__)
+#include <emmintrin.h> // SIMD update of the particles
+#endif
+
+#ifdef __linux__
+#include <pthread.h>  // process shared barrier for the domain run
+#include <sys/mman.h> // shared memory between the domain processes
+#include <sys/wait.h>
+#include <unistd.h>
+#include <semaphore.h> // the frame rings of the render farm workers
+#include <signal.h>
+#include <EGL/egl.h> // the window-less context of the --headless run
+#include <EGL/eglext.h>
+#endif
+
 // OpenGL / GLUT Headers
 #ifdef __APPLE__
 #include <GLUT/glut.h> // Use GLUT framework on macOS
 #else
 #include <GL/glut.h> // Use standard GLUT location on Linux/Windows
+#if defined(FREEGLUT)
+#include <GL/freeglut_ext.h> // glutInitContextVersion for the core profile backend
 #endif
+#endif
+#define GLRECORD_NO_MACROS // only the static blocks are recorded, the immediate sphere mode stays a baseline
+#include "glrecord.h"
 
 /// @brief the force which is applied to the sphere towards land
 float gravity = -9.8f;
@@ -33,6 +83,10 @@ float friction = 0.98f;
 float restitution = 0.8f;
 /// @brief defines the size of the cube with checkered floor
 float cubeSize = 20.0f;
+/// @brief true to draw the floor as one textured quad, false for one quad per tile (key f)
+bool useFloorTexture = true;
+/// @brief how many texels one side of a tile has in the checker texture
+const int floorTexelsPerTile = 32;
 /// @brief the value of pi used in calculations
 float pi = 3.14159f;
 /// @brief increase of ball velocity per plus key press
@@ -41,8 +95,6 @@ float increasePerPlus = 10.0f;
 const float rollMatchFactor = 0.5f;
 /// @brief Limits how fast the sphere is allowed to rotate
 const float maxAngularSpeed = 50.0f;
-/// @brief  quadric to draw the sphere
-GLUquadricObj *quadric;
 
 /// @brief Now below are the original values of the sphere
 
@@ -75,13 +127,20 @@ bool showArrow = true;  // Toggle for showing the arrow
 // --- Function Declarations ---
 void initGL();
 void display();
+void captureFrame();
+void stopFrameCapture(bool withGL);
+void printCaptureStats();
 void reshapeListener(GLsizei width, GLsizei height);
 void keyboardListener(unsigned char key, int x, int y);
 void specialKeyListener(int key, int x, int y);
+void mouseListener(int button, int state, int x, int y);
+void applyKey(unsigned char key);
+void applySpecialKey(int key);
 void drawAxes();
 void drawCube();
 void drawPyramid();
 void drawCubeWithCheckeredFloor();
+void drawRoom();
 
 /**
  * Initialize OpenGL settings
@@ -102,15 +161,37 @@ typedef struct
     float velocity[3];        // Velocity vector of the sphere
     float angularVelocity[3]; // Angular velocity vector of the sphere
     float rotationAngle[3];   // Rotation angle vector of the sphere
+    int id;                   // Identifier of the sphere, it stays the same when the sphere moves to another domain
 
 } Sphere;
 
-/// @brief sphere object we are going to use
-Sphere sphere;
+/// @brief all the spheres in the room, the first one is the sphere with the original values above
+vector<Sphere> spheres;
+/// @brief how many spheres are put into the room, it can be changed with --balls
+int ballCount = 1;
+/// @brief the fastest speed along an axis an extra sphere gets when it is created
+float extraSphereSpeed = 5.0f;
+
+/// @brief a small random number generator, so that the extra spheres are the same in every run and on every platform
+/// @param seed the state of the generator, it is changed by every call
+/// @param low the smallest value returned
+/// @param high the largest value returned
+float randomFloat(unsigned int &seed, float low, float high)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return low + (high - low) * ((seed >> 8) / 16777216.0f);
+}
+
+/// @brief seconds since some fixed moment, to measure how long things take
+double nowSeconds()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-/// @brief set all the values of the sphere to their original values defined above
-void initSphere()
+/// @brief set all the values of the first sphere to their original values defined above
+void initSphere(Sphere &sphere)
 {
+    sphere.id = 0;
     sphere.radius = originalSphereRadius;
     sphere.mass = originalSphereMass;
     sphere.position[0] = originalSpherePosition[0];
@@ -125,9 +206,26 @@ void initSphere()
     sphere.rotationAngle[0] = originalSphereRotationAngle[0];
     sphere.rotationAngle[1] = originalSphereRotationAngle[1];
     sphere.rotationAngle[2] = originalSphereRotationAngle[2];
+}
+
+/// @brief create all the spheres, the first one with the original values and the others at random places with random velocities
+void initSpheres()
+{
+    spheres.assign(ballCount, Sphere());
+    initSphere(spheres[0]);
 
-    quadric = gluNewQuadric();
-    gluQuadricNormals(quadric, GLU_SMOOTH);
+    unsigned int seed = 12345;
+    for (int i = 1; i < ballCount; i++)
+    {
+        Sphere &sphere = spheres[i];
+        sphere = spheres[0]; // same size, mass and rotation as the first sphere
+        sphere.id = i;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            sphere.position[axis] = randomFloat(seed, sphere.radius, cubeSize - sphere.radius);
+            sphere.velocity[axis] = randomFloat(seed, -extraSphereSpeed, extraSphereSpeed);
+        }
+    }
 }
 
 /// @brief  to add the stripes to the sphere
@@ -151,8 +249,45 @@ void stripeColor(GLfloat *color, float angle)
     }
 }
 
-/// @brief draw the sphere with the given color stripes
-void drawSphere()
+// --- Sphere Drawing ---
+
+/// @brief how much work drawing the spheres took in the frames since the last report
+typedef struct
+{
+    long long frames;
+    double sphereSeconds;      // CPU time spent drawing the spheres
+    long long drawCalls;       // glBegin/glEnd blocks and glDrawElements calls
+    long long immediateCalls;  // glVertex and glColor calls
+    long long triangles;       // triangles of all the spheres together
+    long long lodCounts[4];    // how many spheres were drawn with each level of detail
+    double arrowSeconds;       // CPU time spent drawing the velocity arrows
+    long long arrows;          // how many velocity arrows were drawn
+    long long arrowDrawCalls;  // draw calls of the velocity arrows
+} SphereDrawStats;
+
+SphereDrawStats sphereDrawStats;
+
+/// @brief the ways the spheres can be drawn, key m goes through them
+enum SphereRenderMode
+{
+    SPHERES_IMMEDIATE, // the old loop, every vertex calculated again every frame
+    SPHERES_MESH,      // the cached mesh, one draw call per sphere
+    SPHERES_INSTANCED, // the cached mesh, one draw call for all the spheres
+    SPHERES_IMPOSTOR,  // one quad per sphere, the sphere is ray cast in the fragment shader
+    SPHERE_RENDER_MODES
+};
+
+const char *sphereRenderModeNames[SPHERE_RENDER_MODES] = {"immediate mode", "cached mesh", "instanced", "impostors"};
+/// @brief how the spheres are drawn right now
+SphereRenderMode sphereRenderMode = SPHERES_INSTANCED;
+/// @brief true to find the stripe of every pixel in a shader, false for the colors stored at the vertices (key g)
+bool useStripeShader = true;
+
+/// @brief draw the sphere with the given color stripes in immediate mode, every vertex is calculated again.
+/// It is kept to compare it with the cached mesh in drawSphereMesh.
+/// @param sphere the sphere to draw
+/// @param withColors false when the stripe shader colors the sphere, then no color is worked out per vertex
+void drawSphere(const Sphere &sphere, bool withColors = true)
 {
     glPushMatrix(); // save the current GL state
 
@@ -162,13 +297,10 @@ void drawSphere()
     glRotatef(sphere.rotationAngle[2], 0.0f, 0.0f, 1.0f);                     // apply rotation to the z axis
 
     glEnable(GL_COLOR_MATERIAL); // enable color material to track GLcolor
-    gluQuadricCallback(quadric, GLU_ERROR, NULL);
-    gluQuadricDrawStyle(quadric, GLU_FILL); // fills surface style
-    gluQuadricNormals(quadric, GLU_SMOOTH); // configure a quadric object to draw smooth surfaces
-    gluQuadricTexture(quadric, GL_TRUE);
 
     // Set up the color callback
     GLfloat color[3];
+    int vertices = 0;
     glBegin(GL_TRIANGLE_STRIP);
     for (float phi = 0; phi < pi; phi += pi / 20)
     {
@@ -176,36 +308,836 @@ void drawSphere()
         for (float theta = 0; theta <= 2 * pi; theta += pi / 20)
         {
             // it goes around the sphere in 40 steps horizontally
-            stripeColor(color, theta);
-            glColor3fv(color);
+            if (withColors)
+            {
+                stripeColor(color, theta);
+                glColor3fv(color);
+            }
             glVertex3f(
                 sphere.radius * sin(phi) * cos(theta),
                 sphere.radius * cos(phi),
                 sphere.radius * sin(phi) * sin(theta));
 
-            stripeColor(color, theta);
-            glColor3fv(color);
+            if (withColors)
+            {
+                stripeColor(color, theta);
+                glColor3fv(color);
+            }
             glVertex3f(
                 sphere.radius * sin(phi + pi / 20) * cos(theta),
                 sphere.radius * cos(phi + pi / 20),
                 sphere.radius * sin(phi + pi / 20) * sin(theta));
+            vertices += 2;
         }
     }
     glEnd();
 
     glDisable(GL_COLOR_MATERIAL);
     glPopMatrix();
+
+    sphereDrawStats.drawCalls++;
+    sphereDrawStats.immediateCalls += withColors ? 2 * vertices : vertices;
+    sphereDrawStats.triangles += vertices - 2;
+}
+
+/// @brief one vertex of the cached sphere mesh
+typedef struct
+{
+    float position[3];      // on the unit sphere
+    float normal[3];        // the same as the position, it is a unit sphere
+    unsigned char color[4]; // the stripe color
+    float padding;          // makes the vertex 32 bytes
+} SphereVertex;
+
+/// @brief a unit sphere in a vertex and an index buffer
+typedef struct
+{
+    int stacks;         // rings from the top to the bottom
+    int slices;         // steps around the sphere
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    int indexCount;     // three per triangle
+} SphereMesh;
+
+/// @brief the meshes made so far, keyed by stacks and slices, each one is only made once
+map<pair<int, int>, SphereMesh> sphereMeshes;
+
+/// @brief the vertices and triangles of a unit sphere, with the same angles and the same stripes as drawSphere
+/// @param stacks rings from the top to the bottom, drawSphere uses 20
+/// @param slices steps around the sphere, drawSphere uses 40
+void buildSphereMeshData(int stacks, int slices, vector<SphereVertex> &vertices, vector<unsigned int> &indices)
+{
+    // a grid of (stacks + 1) x (slices + 1) vertices, the first and last column are at the same place but the stripes need both
+    vertices.clear();
+    for (int i = 0; i <= stacks; i++)
+    {
+        float phi = pi * i / stacks;
+        for (int j = 0; j <= slices; j++)
+        {
+            float theta = 2 * pi * j / slices;
+            SphereVertex vertex;
+            vertex.position[0] = vertex.normal[0] = sin(phi) * cos(theta);
+            vertex.position[1] = vertex.normal[1] = cos(phi);
+            vertex.position[2] = vertex.normal[2] = sin(phi) * sin(theta);
+            GLfloat color[3];
+            stripeColor(color, min(theta, 2 * pi - 1e-4f)); // the last column gets the color of the stripe before it
+            for (int c = 0; c < 3; c++)
+                vertex.color[c] = (unsigned char)(color[c] * 255.0f);
+            vertex.color[3] = 255;
+            vertex.padding = 0.0f;
+            vertices.push_back(vertex);
+        }
+    }
+
+    // two triangles for every quad of the grid, counter-clockwise seen from outside like GL's front faces, so the
+    // software rasterizer can drop the clockwise ones as facing away
+    indices.clear();
+    for (int i = 0; i < stacks; i++)
+        for (int j = 0; j < slices; j++)
+        {
+            unsigned int topLeft = i * (slices + 1) + j;
+            unsigned int bottomLeft = topLeft + slices + 1;
+            indices.push_back(topLeft);
+            indices.push_back(topLeft + 1);
+            indices.push_back(bottomLeft);
+            indices.push_back(topLeft + 1);
+            indices.push_back(bottomLeft + 1);
+            indices.push_back(bottomLeft);
+        }
+}
+
+/// @brief the mesh of a unit sphere with the given tessellation, made the first time it is asked for.
+/// It uses the same angles and the same stripes as drawSphere, so it looks the same.
+/// @param stacks rings from the top to the bottom, drawSphere uses 20
+/// @param slices steps around the sphere, drawSphere uses 40
+const SphereMesh &getSphereMesh(int stacks, int slices)
+{
+    map<pair<int, int>, SphereMesh>::iterator found = sphereMeshes.find(make_pair(stacks, slices));
+    if (found != sphereMeshes.end())
+        return found->second;
+
+    vector<SphereVertex> vertices;
+    vector<unsigned int> indices;
+    buildSphereMeshData(stacks, slices, vertices, indices);
+
+    SphereMesh mesh;
+    mesh.stacks = stacks;
+    mesh.slices = slices;
+    mesh.indexCount = (int)indices.size();
+    glGenBuffers(1, &mesh.vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(SphereVertex), vertices.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &mesh.indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    return sphereMeshes[make_pair(stacks, slices)] = mesh;
+}
+
+/// @brief bind the buffers of a mesh and point the vertex arrays at them, for the drawSphereMesh calls after it
+void bindSphereMesh(const SphereMesh &mesh)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(SphereVertex), (void *)offsetof(SphereVertex, position));
+    glNormalPointer(GL_FLOAT, sizeof(SphereVertex), (void *)offsetof(SphereVertex, normal));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(SphereVertex), (void *)offsetof(SphereVertex, color));
+}
+
+/// @brief undo bindSphereMesh
+void unbindSphereMesh()
+{
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/// @brief draw one sphere with the mesh bound by bindSphereMesh, with a single draw call
+void drawSphereMesh(const Sphere &sphere, const SphereMesh &mesh)
+{
+    glPushMatrix(); // save the current GL state
+
+    glTranslatef(sphere.position[0], sphere.position[1], sphere.position[2]); // position the sphere using the position vector
+    glRotatef(sphere.rotationAngle[0], 1.0f, 0.0f, 0.0f);                     // apply rotation to the x axis
+    glRotatef(sphere.rotationAngle[1], 0.0f, 1.0f, 0.0f);                     // apply rotation to the y axis
+    glRotatef(sphere.rotationAngle[2], 0.0f, 0.0f, 1.0f);                     // apply rotation to the z axis
+    glScalef(sphere.radius, sphere.radius, sphere.radius);                    // the mesh is a unit sphere
+
+    glDrawElements(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, 0);
+    glPopMatrix();
+
+    sphereDrawStats.drawCalls++;
+    sphereDrawStats.triangles += mesh.indexCount / 3;
+}
+
+// --- Sphere Levels Of Detail ---
+// A ball that covers a few pixels does not need 1600 triangles. Each ball gets one of a few meshes, picked by
+// how many pixels its radius covers on the screen. A ball only changes its level once its size has gone a bit
+// past the border between two levels, so balls that sit near a border do not keep popping between meshes.
+
+const int sphereLodLevels = 4;
+/// @brief the stacks of every level, the slices are twice as many, level 0 is the mesh drawSphere draws
+const int sphereLodStacks[sphereLodLevels] = {20, 12, 8, 5};
+/// @brief the smallest radius on the screen, in pixels, that still gets this level
+const float sphereLodMinPixels[sphereLodLevels] = {40.0f, 16.0f, 6.0f, 0.0f};
+/// @brief how far past a border (as a fraction of it) the radius has to be before the level changes
+const float sphereLodHysteresis = 0.15f;
+/// @brief true to pick a mesh per ball by its size on the screen, false to always use level 0 (key l)
+bool useSphereLod = true;
+/// @brief the level every ball was drawn with last frame, indexed by the id of the ball
+vector<unsigned char> sphereLods;
+
+/// @brief what the current view and projection matrices say about the size of things on the screen
+typedef struct
+{
+    float modelview[16];
+    float pixelsPerUnit; // how many pixels an object 1 unit big, 1 unit in front of the camera, covers
+} SphereLodView;
+
+/// @brief what chooseSphereLod needs from a projection and a modelview matrix and the height of the viewport
+SphereLodView lodViewFromMatrices(const float projection[16], const float modelview[16], int viewportHeight)
+{
+    SphereLodView view;
+    copy(modelview, modelview + 16, view.modelview);
+    view.pixelsPerUnit = 0.5f * viewportHeight * projection[5]; // projection[5] is 1 / tan(fovy / 2)
+    return view;
+}
+
+/// @brief read the matrices of gluPerspective and gluLookAt, and the viewport, for chooseSphereLod
+SphereLodView currentLodView()
+{
+    float projection[16], modelview[16];
+    GLint viewport[4];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    return lodViewFromMatrices(projection, modelview, viewport[3]);
+}
+
+/// @brief pick the level of detail of a ball from its projected radius and the level it had last frame
+/// @return the level, 0 is the finest
+int chooseSphereLod(const Sphere &sphere, const SphereLodView &view)
+{
+    if (!useSphereLod)
+    {
+        sphereDrawStats.lodCounts[0]++;
+        return 0;
+    }
+    if (sphere.id >= (int)sphereLods.size())
+        sphereLods.resize(sphere.id + 1, 0);
+
+    const float *m = view.modelview;
+    float depth = -(m[2] * sphere.position[0] + m[6] * sphere.position[1] + m[10] * sphere.position[2] + m[14]);
+    int level = sphereLods[sphere.id];
+    if (depth <= -sphere.radius)
+        level = sphereLodLevels - 1; // behind the camera, it is clipped away anyway
+    else if (depth <= sphere.radius)
+        level = 0; // the camera is inside or right at the ball
+    else
+    {
+        float pixels = sphere.radius * view.pixelsPerUnit / depth;
+        while (level > 0 && pixels > sphereLodMinPixels[level - 1] * (1.0f + sphereLodHysteresis))
+            level--;
+        while (level < sphereLodLevels - 1 && pixels < sphereLodMinPixels[level] * (1.0f - sphereLodHysteresis))
+            level++;
+    }
+    sphereLods[sphere.id] = level;
+    sphereDrawStats.lodCounts[level]++;
+    return level;
+}
+
+/// @brief the mesh of a level of detail
+const SphereMesh &getSphereLodMesh(int level)
+{
+    return getSphereMesh(sphereLodStacks[level], 2 * sphereLodStacks[level]);
+}
+
+// --- Instanced Spheres ---
+// All the spheres share one mesh, so they can be drawn with a single instanced draw call. What is different
+// for every sphere (where it is, how it is turned, how big it is and its two stripe colors) goes into an
+// instance buffer that is filled once per frame. The shader only needs GLSL 1.20 and instanced arrays,
+// which Mesa's software renderers (llvmpipe, softpipe) have, so it also runs on machines without a GPU.
+
+/// @brief the two stripe colors of the spheres
+GLfloat stripeColors[2][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+
+/// @brief what the instance buffer holds for one sphere
+typedef struct
+{
+    float positionRadius[4];       // the center and the radius
+    float rotation[9];             // the rotation as a 3x3 matrix, column by column
+    unsigned char colors[2][4];    // the two stripe colors
+} SphereInstance;
+
+/// @brief the shader and the buffer of the instanced spheres
+typedef struct
+{
+    GLuint program;
+    GLuint instanceBuffer;
+    int instanceCapacity;             // how many instances fit into the buffer
+    vector<SphereInstance> instances; // filled every frame, it keeps its memory
+    vector<int> levels;               // the level of detail of every sphere this frame
+    GLint analyticLocation;           // the analyticStripes uniform
+    bool failed;                      // set if the shader could not be made, the spheres are then drawn one by one
+} InstancedSpheres;
+
+InstancedSpheres instancedSpheres;
+
+/// @brief compile a vertex and a fragment shader and link them, the attribute names get the locations 1, 2, 3 ...
+/// @param name used in the error messages
+/// @param attributes names of the generic attributes, ended by NULL
+/// @return the program, or 0 if something did not compile
+GLuint compileProgram(const char *name, const char *vertexSource, const char *fragmentSource, const char **attributes)
+{
+    const char *sources[2] = {vertexSource, fragmentSource};
+    GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+    GLuint program = glCreateProgram();
+    for (int i = 0; i < 2; i++)
+    {
+        GLuint shader = glCreateShader(types[i]);
+        glShaderSource(shader, 1, &sources[i], NULL);
+        glCompileShader(shader);
+        GLint compiled = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+        if (!compiled)
+        {
+            char log[2048];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            printf("%s %s shader did not compile:\n%s\n", name, i == 0 ? "vertex" : "fragment", log);
+            glDeleteShader(shader);
+            glDeleteProgram(program);
+            return 0;
+        }
+        glAttachShader(program, shader);
+        glDeleteShader(shader); // it is freed together with the program
+    }
+    for (int i = 0; attributes != NULL && attributes[i] != NULL; i++)
+        glBindAttribLocation(program, i + 1, attributes[i]);
+    glLinkProgram(program);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked)
+    {
+        char log[2048];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("%s program did not link:\n%s\n", name, log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/// @brief the rotation of drawSphere (x, then y, then z axis, in degrees) as a 3x3 matrix, column by column
+void rotationMatrix(const float angles[3], float matrix[9])
+{
+    float rotations[3][9];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float c = cos(angles[axis] * pi / 180.0f);
+        float s = sin(angles[axis] * pi / 180.0f);
+        float *r = rotations[axis];
+        for (int i = 0; i < 9; i++)
+            r[i] = (i % 4 == 0) ? 1.0f : 0.0f;
+        int first = (axis + 1) % 3, second = (axis + 2) % 3; // the two axes that turn
+        r[first * 3 + first] = c;
+        r[second * 3 + second] = c;
+        r[first * 3 + second] = s;  // column first, row second
+        r[second * 3 + first] = -s; // column second, row first
+    }
+    // matrix = Rx * Ry * Rz, the same order as the glRotatef calls
+    float xy[9];
+    for (int column = 0; column < 3; column++)
+        for (int row = 0; row < 3; row++)
+        {
+            xy[column * 3 + row] = 0.0f;
+            for (int k = 0; k < 3; k++)
+                xy[column * 3 + row] += rotations[0][k * 3 + row] * rotations[1][column * 3 + k];
+        }
+    for (int column = 0; column < 3; column++)
+        for (int row = 0; row < 3; row++)
+        {
+            matrix[column * 3 + row] = 0.0f;
+            for (int k = 0; k < 3; k++)
+                matrix[column * 3 + row] += xy[k * 3 + row] * rotations[2][column * 3 + k];
+        }
+}
+
+/// @brief the stripe of a point on the unit sphere in the sphere's own space, the same 18 stripes as stripeColor
+const char *stripeShaderSource =
+    "vec4 stripeColor(vec3 local, vec4 first, vec4 second)\n"
+    "{\n"
+    "    float angle = atan(local.z, local.x); // the longitude, drawSphere calls it theta\n"
+    "    if (angle < 0.0)\n"
+    "        angle += 6.2831853;\n"
+    "    return mod(floor(angle / (6.2831853 / 18.0)), 2.0) < 0.5 ? first : second;\n"
+    "}\n";
+
+/// @brief make the shader of the instanced spheres, it is called the first time they are drawn
+/// @return false if the GL cannot draw instanced spheres
+bool initInstancedSpheres()
+{
+    if (instancedSpheres.program != 0)
+        return true;
+    if (instancedSpheres.failed)
+        return false;
+    if (!GLEW_VERSION_3_3) // the shader compiles on GL 2.1, but glVertexAttribDivisor and glDrawElementsInstanced are NULL
+    {
+        instancedSpheres.failed = true;
+        return false;
+    }
+
+    const char *vertexSource =
+        "#version 120\n"
+        "attribute vec4 instancePositionRadius;\n"
+        "attribute vec3 instanceRotation0;\n"
+        "attribute vec3 instanceRotation1;\n"
+        "attribute vec3 instanceRotation2;\n"
+        "attribute vec4 instanceColor0;\n"
+        "attribute vec4 instanceColor1;\n"
+        "varying vec4 color;\n"
+        "varying vec3 objectPosition; // the point on the unit sphere, for the stripes\n"
+        "varying vec4 color0;\n"
+        "varying vec4 color1;\n"
+        "void main()\n"
+        "{\n"
+        "    vec3 local = gl_Vertex.xyz * instancePositionRadius.w;\n"
+        "    vec3 turned = local.x * instanceRotation0 + local.y * instanceRotation1 + local.z * instanceRotation2;\n"
+        "    gl_Position = gl_ModelViewProjectionMatrix * vec4(turned + instancePositionRadius.xyz, 1.0);\n"
+        "    color = mix(instanceColor0, instanceColor1, gl_Color.g); // the mesh is red and green, green picks the second color\n"
+        "    objectPosition = gl_Vertex.xyz;\n"
+        "    color0 = instanceColor0;\n"
+        "    color1 = instanceColor1;\n"
+        "}\n";
+    string fragmentSource = string(
+        "#version 120\n"
+        "uniform float analyticStripes; // 1 to find the stripe of every pixel, 0 to blend the colors of the vertices\n"
+        "varying vec4 color;\n"
+        "varying vec3 objectPosition;\n"
+        "varying vec4 color0;\n"
+        "varying vec4 color1;\n") + stripeShaderSource +
+        "void main()\n"
+        "{\n"
+        "    gl_FragColor = analyticStripes > 0.5 ? stripeColor(objectPosition, color0, color1) : color;\n"
+        "}\n";
+    const char *attributes[] = {"instancePositionRadius", "instanceRotation0", "instanceRotation1", "instanceRotation2",
+                                "instanceColor0", "instanceColor1", NULL};
+
+    instancedSpheres.program = compileProgram("instanced spheres", vertexSource, fragmentSource.c_str(), attributes);
+    if (instancedSpheres.program == 0)
+    {
+        instancedSpheres.failed = true;
+        return false;
+    }
+    instancedSpheres.analyticLocation = glGetUniformLocation(instancedSpheres.program, "analyticStripes");
+    glGenBuffers(1, &instancedSpheres.instanceBuffer);
+    instancedSpheres.instanceCapacity = 0;
+    return true;
+}
+
+/// @brief point the instance attributes 1 to 6 at the instance buffer, starting with the given instance
+void pointInstanceAttributes(int first)
+{
+    GLsizei stride = sizeof(SphereInstance);
+    size_t base = (size_t)first * stride;
+    const size_t offsets[6] = {offsetof(SphereInstance, positionRadius), offsetof(SphereInstance, rotation),
+                               offsetof(SphereInstance, rotation) + 3 * sizeof(float),
+                               offsetof(SphereInstance, rotation) + 6 * sizeof(float),
+                               offsetof(SphereInstance, colors), offsetof(SphereInstance, colors) + 4};
+    for (int a = 0; a < 6; a++)
+    {
+        GLuint location = a + 1;
+        if (a < 4)
+            glVertexAttribPointer(location, a == 0 ? 4 : 3, GL_FLOAT, GL_FALSE, stride, (void *)(base + offsets[a]));
+        else
+            glVertexAttribPointer(location, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void *)(base + offsets[a]));
+    }
+}
+
+/// @brief what the instance buffer holds for a sphere
+void writeSphereInstance(const Sphere &sphere, SphereInstance &instance)
+{
+    for (int axis = 0; axis < 3; axis++)
+        instance.positionRadius[axis] = sphere.position[axis];
+    instance.positionRadius[3] = sphere.radius;
+    rotationMatrix(sphere.rotationAngle, instance.rotation);
+    for (int c = 0; c < 2; c++)
+    {
+        for (int k = 0; k < 3; k++)
+            instance.colors[c][k] = (unsigned char)(stripeColors[c][k] * 255.0f);
+        instance.colors[c][3] = 255;
+    }
+}
+
+/// @brief copy the first count instances into the instance buffer, it grows when they do not fit, and leave it bound
+void uploadSphereInstances(int count)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, instancedSpheres.instanceBuffer);
+    if (count > instancedSpheres.instanceCapacity)
+    {
+        instancedSpheres.instanceCapacity = count + count / 2;
+        glBufferData(GL_ARRAY_BUFFER, instancedSpheres.instanceCapacity * sizeof(SphereInstance), NULL, GL_STREAM_DRAW);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(SphereInstance), instancedSpheres.instances.data());
+}
+
+/// @brief the attributes 1 to 6 step once per sphere instead of once per vertex
+void enableInstanceAttributes()
+{
+    for (int a = 0; a < 6; a++)
+    {
+        glEnableVertexAttribArray(a + 1);
+        glVertexAttribDivisor(a + 1, 1);
+    }
+}
+
+/// @brief undo enableInstanceAttributes
+void disableInstanceAttributes()
+{
+    for (int a = 0; a < 6; a++)
+    {
+        glVertexAttribDivisor(a + 1, 0);
+        glDisableVertexAttribArray(a + 1);
+    }
+}
+
+/// @brief write the instances of the visible spheres grouped by level of detail, the spheres of level l
+/// go to firsts[l] .. firsts[l + 1] - 1
+void groupSphereInstances(const vector<Sphere> &balls, const vector<int> &visible, const SphereLodView &view,
+                          int firsts[sphereLodLevels + 1])
+{
+    int count = (int)visible.size();
+
+    // pick the levels first, then count them, so every level gets one block of the buffer
+    vector<int> &levels = instancedSpheres.levels;
+    levels.resize(count);
+    fill(firsts, firsts + sphereLodLevels + 1, 0);
+    for (int i = 0; i < count; i++)
+    {
+        levels[i] = chooseSphereLod(balls[visible[i]], view);
+        firsts[levels[i] + 1]++;
+    }
+    for (int level = 0; level < sphereLodLevels; level++)
+        firsts[level + 1] += firsts[level];
+    int next[sphereLodLevels];
+    copy(firsts, firsts + sphereLodLevels, next);
+
+    vector<SphereInstance> &instances = instancedSpheres.instances;
+    instances.resize(count);
+    for (int i = 0; i < count; i++)
+        writeSphereInstance(balls[visible[i]], instances[next[levels[i]]++]);
+}
+
+/// @brief fill the instance buffer with the visible spheres, grouped by level of detail, and draw every group
+/// with one instanced call
+void drawSpheresInstanced(const vector<Sphere> &balls, const vector<int> &visible)
+{
+    int firsts[sphereLodLevels + 1];
+    groupSphereInstances(balls, visible, currentLodView(), firsts);
+    uploadSphereInstances((int)visible.size());
+    enableInstanceAttributes();
+
+    glUseProgram(instancedSpheres.program);
+    glUniform1f(instancedSpheres.analyticLocation, useStripeShader ? 1.0f : 0.0f);
+    for (int level = 0; level < sphereLodLevels; level++)
+    {
+        int instanceCount = firsts[level + 1] - firsts[level];
+        if (instanceCount == 0)
+            continue;
+        const SphereMesh &mesh = getSphereLodMesh(level);
+        glBindBuffer(GL_ARRAY_BUFFER, instancedSpheres.instanceBuffer);
+        pointInstanceAttributes(firsts[level]);
+        bindSphereMesh(mesh);
+        glDrawElementsInstanced(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, 0, instanceCount);
+        sphereDrawStats.drawCalls++;
+        sphereDrawStats.triangles += (long long)instanceCount * (mesh.indexCount / 3);
+    }
+    glUseProgram(0);
+    unbindSphereMesh();
+    disableInstanceAttributes();
+}
+
+// --- Sphere Impostors ---
+// With very many balls even the coarsest mesh is hundreds of vertices per ball. An impostor is a single quad
+// per ball that faces the camera and is just big enough to cover the ball. The fragment shader shoots the ray
+// of its pixel at the ball, throws the pixel away if it misses, and otherwise writes the depth of the hit point,
+// so the balls cut into each other and into the room correctly. The stripe comes from the longitude of the hit
+// point in the ball's own space, so it is sharp at every size.
+
+/// @brief the shader and the quad of the impostors
+typedef struct
+{
+    GLuint program;
+    GLuint quadBuffer; // the four corners of the quad
+    bool failed;       // set if the shader could not be made
+} ImpostorSpheres;
+
+ImpostorSpheres impostorSpheres;
+
+/// @brief make the shader and the quad of the impostors, it is called the first time they are drawn
+/// @return false if the GL cannot draw impostors
+bool initImpostorSpheres()
+{
+    if (impostorSpheres.program != 0)
+        return true;
+    if (impostorSpheres.failed || !initInstancedSpheres())
+        return false;
+
+    const char *vertexSource =
+        "#version 120\n"
+        "attribute vec4 instancePositionRadius;\n"
+        "attribute vec3 instanceRotation0;\n"
+        "attribute vec3 instanceRotation1;\n"
+        "attribute vec3 instanceRotation2;\n"
+        "attribute vec4 instanceColor0;\n"
+        "attribute vec4 instanceColor1;\n"
+        "varying vec3 viewPosition; // the point on the quad, in view space\n"
+        "varying vec3 viewCenter;\n"
+        "varying float radius;\n"
+        "varying mat3 viewToObject; // from view space into the turned sphere's own space\n"
+        "varying vec4 color0;\n"
+        "varying vec4 color1;\n"
+        "void main()\n"
+        "{\n"
+        "    viewCenter = (gl_ModelViewMatrix * vec4(instancePositionRadius.xyz, 1.0)).xyz;\n"
+        "    radius = instancePositionRadius.w;\n"
+        "    float distance = length(viewCenter);\n"
+        "    if (distance <= radius)\n"
+        "    {\n"
+        "        gl_Position = vec4(0.0, 0.0, 2.0, 1.0); // the camera is inside the ball, the quad is clipped away\n"
+        "        return;\n"
+        "    }\n"
+        "    // the quad stands across the ray to the center, the cone of rays touching the ball cuts it in a circle\n"
+        "    vec3 w = viewCenter / distance;\n"
+        "    vec3 helper = abs(w.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);\n"
+        "    vec3 u = normalize(cross(helper, w));\n"
+        "    vec3 v = cross(w, u);\n"
+        "    float size = radius * distance / sqrt(distance * distance - radius * radius);\n"
+        "    viewPosition = viewCenter + size * (gl_Vertex.x * u + gl_Vertex.y * v);\n"
+        "    gl_Position = gl_ProjectionMatrix * vec4(viewPosition, 1.0);\n"
+        "    mat3 rotation = mat3(instanceRotation0, instanceRotation1, instanceRotation2);\n"
+        "    viewToObject = transpose(rotation) * transpose(mat3(gl_ModelViewMatrix));\n"
+        "    color0 = instanceColor0;\n"
+        "    color1 = instanceColor1;\n"
+        "}\n";
+    string fragmentSource = string(
+        "#version 120\n"
+        "varying vec3 viewPosition;\n"
+        "varying vec3 viewCenter;\n"
+        "varying float radius;\n"
+        "varying mat3 viewToObject;\n"
+        "varying vec4 color0;\n"
+        "varying vec4 color1;\n") + stripeShaderSource +
+        "void main()\n"
+        "{\n"
+        "    vec3 direction = normalize(viewPosition); // the camera is at the origin of view space\n"
+        "    float along = dot(direction, viewCenter);\n"
+        "    float discriminant = along * along - (dot(viewCenter, viewCenter) - radius * radius);\n"
+        "    if (discriminant < 0.0)\n"
+        "        discard; // the ray misses the ball\n"
+        "    vec3 hit = direction * (along - sqrt(discriminant));\n"
+        "    vec4 clip = gl_ProjectionMatrix * vec4(hit, 1.0);\n"
+        "    gl_FragDepth = 0.5 * (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far);\n"
+        "    gl_FragColor = stripeColor(viewToObject * ((hit - viewCenter) / radius), color0, color1);\n"
+        "}\n";
+    const char *attributes[] = {"instancePositionRadius", "instanceRotation0", "instanceRotation1", "instanceRotation2",
+                                "instanceColor0", "instanceColor1", NULL};
+
+    impostorSpheres.program = compileProgram("sphere impostors", vertexSource, fragmentSource.c_str(), attributes);
+    if (impostorSpheres.program == 0)
+    {
+        impostorSpheres.failed = true;
+        return false;
+    }
+    const float corners[8] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
+    glGenBuffers(1, &impostorSpheres.quadBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, impostorSpheres.quadBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
+}
+
+/// @brief draw the visible spheres as ray cast impostors, all with one instanced call of four vertices each
+void drawSpheresImpostor(const vector<Sphere> &balls, const vector<int> &visible)
+{
+    int count = (int)visible.size();
+    vector<SphereInstance> &instances = instancedSpheres.instances;
+    instances.resize(count);
+    for (int i = 0; i < count; i++)
+        writeSphereInstance(balls[visible[i]], instances[i]);
+    uploadSphereInstances(count);
+    enableInstanceAttributes();
+    pointInstanceAttributes(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, impostorSpheres.quadBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_FLOAT, 0, 0);
+    glUseProgram(impostorSpheres.program);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    glUseProgram(0);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    disableInstanceAttributes();
+
+    sphereDrawStats.drawCalls++;
+    sphereDrawStats.triangles += 2LL * count;
+}
+
+// --- Analytic Stripes ---
+// The stripes of the meshes come from colors stored at the vertices. They blur across every quad of the
+// mesh and get wide and blurry on coarse levels of detail, and immediate mode works out the color of every
+// vertex on the CPU each frame. With the stripe shader the fragment shader finds the longitude of every pixel
+// on the unit sphere and picks the stripe from it, so the stripes are sharp whatever the mesh is.
+
+/// @brief the shader that gives the fixed function paths (immediate mode and the cached mesh) their stripes
+typedef struct
+{
+    GLuint program;
+    GLint color0Location, color1Location;
+    bool failed; // set if the shader could not be made, the stripes then come from the vertices
+} StripeShader;
+
+StripeShader stripeShader;
+
+/// @brief make the stripe shader, it is called the first time it is used
+/// @return false if the GL cannot run it
+bool initStripeShader()
+{
+    if (stripeShader.program != 0)
+        return true;
+    if (stripeShader.failed)
+        return false;
+
+    const char *vertexSource =
+        "#version 120\n"
+        "varying vec3 objectPosition; // the vertex before the modelview matrix, the stripe only needs its direction\n"
+        "void main()\n"
+        "{\n"
+        "    gl_Position = ftransform();\n"
+        "    objectPosition = gl_Vertex.xyz;\n"
+        "}\n";
+    string fragmentSource = string(
+        "#version 120\n"
+        "uniform vec4 color0;\n"
+        "uniform vec4 color1;\n"
+        "varying vec3 objectPosition;\n") + stripeShaderSource +
+        "void main()\n"
+        "{\n"
+        "    gl_FragColor = stripeColor(objectPosition, color0, color1);\n"
+        "}\n";
+
+    stripeShader.program = compileProgram("stripes", vertexSource, fragmentSource.c_str(), NULL);
+    if (stripeShader.program == 0)
+    {
+        stripeShader.failed = true;
+        return false;
+    }
+    stripeShader.color0Location = glGetUniformLocation(stripeShader.program, "color0");
+    stripeShader.color1Location = glGetUniformLocation(stripeShader.program, "color1");
+    return true;
+}
+
+/// @brief use the stripe shader for the spheres drawn until endStripeShader
+void beginStripeShader()
+{
+    glUseProgram(stripeShader.program);
+    glUniform4f(stripeShader.color0Location, stripeColors[0][0], stripeColors[0][1], stripeColors[0][2], 1.0f);
+    glUniform4f(stripeShader.color1Location, stripeColors[1][0], stripeColors[1][1], stripeColors[1][2], 1.0f);
+}
+
+/// @brief go back to the fixed function pipeline
+void endStripeShader()
+{
+    glUseProgram(0);
+}
+
+/// @brief draw the spheres the way sphereRenderMode says, and measure how long it takes
+/// @param balls all the spheres
+/// @param visible the indices of the spheres to draw, the ones that are in the view
+void drawSpheres(const vector<Sphere> &balls, const vector<int> &visible)
+{
+    double start = nowSeconds();
+    if (sphereRenderMode == SPHERES_IMPOSTOR && !initImpostorSpheres())
+        sphereRenderMode = SPHERES_INSTANCED; // the GL cannot do it, so the spheres are drawn as meshes
+    if (sphereRenderMode == SPHERES_INSTANCED && !initInstancedSpheres())
+        sphereRenderMode = SPHERES_MESH; // the GL cannot do it, so the spheres are drawn one by one
+    if (sphereRenderMode == SPHERES_IMPOSTOR)
+        drawSpheresImpostor(balls, visible);
+    else if (sphereRenderMode == SPHERES_INSTANCED)
+        drawSpheresInstanced(balls, visible);
+    else if (sphereRenderMode == SPHERES_MESH)
+    {
+        bool analytic = useStripeShader && initStripeShader();
+        if (analytic)
+            beginStripeShader();
+        SphereLodView view = currentLodView();
+        glEnable(GL_COLOR_MATERIAL);
+        int bound = -1; // the level whose mesh is bound
+        for (int index : visible)
+        {
+            const Sphere &sphere = balls[index];
+            int level = chooseSphereLod(sphere, view);
+            if (level != bound)
+            {
+                bindSphereMesh(getSphereLodMesh(level));
+                bound = level;
+            }
+            drawSphereMesh(sphere, getSphereLodMesh(level));
+        }
+        unbindSphereMesh();
+        glDisable(GL_COLOR_MATERIAL);
+        if (analytic)
+            endStripeShader();
+    }
+    else
+    {
+        bool analytic = useStripeShader && initStripeShader();
+        if (analytic)
+            beginStripeShader();
+        for (int index : visible)
+            drawSphere(balls[index], !analytic);
+        if (analytic)
+            endStripeShader();
+    }
+    sphereDrawStats.sphereSeconds += nowSeconds() - start;
+}
+
+/// @brief print the average CPU time and calls per frame for drawing the spheres, and start counting again
+void printSphereDrawStats()
+{
+    SphereDrawStats &stats = sphereDrawStats;
+    long long frames = max(1LL, stats.frames);
+    printf("spheres (%s): %.3f ms CPU per frame, %.1f draw calls per frame, %.0f glVertex/glColor calls per frame\n",
+           sphereRenderModeNames[sphereRenderMode], stats.sphereSeconds * 1e3 / frames,
+           (double)stats.drawCalls / frames, (double)stats.immediateCalls / frames);
+    printf("  %.0f triangles per frame, stripes per %s, levels of detail %s:", (double)stats.triangles / frames,
+           useStripeShader ? "pixel" : "vertex", useSphereLod ? "on" : "off");
+    for (int level = 0; level < sphereLodLevels; level++)
+        printf(" %dx%d %.0f", sphereLodStacks[level], 2 * sphereLodStacks[level], (double)stats.lodCounts[level] / frames);
+    printf(" balls per frame\n");
+    if (stats.arrows > 0)
+        printf("  velocity arrows: %.3f ms CPU per frame, %.1f draw calls per frame, %.0f arrows per frame\n",
+               stats.arrowSeconds * 1e3 / frames, (double)stats.arrowDrawCalls / frames, (double)stats.arrows / frames);
+    stats = SphereDrawStats();
 }
 
 /// @brief this function draws the velocity arrow of the sphere using the velocity vector of the sphere
-void drawVelocityArrow()
+/// @param sphere the sphere whose velocity is drawn
+/// @return false if the sphere does not move and no arrow was drawn
+bool drawVelocityArrow(const Sphere &sphere)
 {
     float speed = sqrt(sphere.velocity[0] * sphere.velocity[0] +
                        sphere.velocity[1] * sphere.velocity[1] +
                        sphere.velocity[2] * sphere.velocity[2]); // calculating the speed magnitude
 
     if (speed == 0.0f)
-        return; /// we wont show the vector if there is no speed
+        return false; /// we wont show the vector if there is no speed
 
     glPushMatrix();
     glTranslatef(sphere.position[0], sphere.position[1], sphere.position[2]); // we are finding the position vector of the sphere to start the speed arrow
@@ -248,87 +1180,383 @@ void drawVelocityArrow()
     glPopMatrix();
 
     glPopMatrix();
+    return true;
 }
 
-/// @brief this function checks for collisions for the sphere in all directions. that could be on the roof, on the 4 walls or bouncing off the floor. This method also check for rotation and angular rotational increase when the sphere collides with a surface like in the real world.
-void checkCollisions()
+// --- Velocity Arrows ---
+// drawVelocityArrow works the direction out on the CPU and lets glutSolidCone make the cone again for every
+// ball. Here the arrow is one mesh, made once: a thin four sided shaft and a cone of 8 slices, pointing along
+// +y. Every vertex has a fourth coordinate that says if it moves with the tip, so the shaft stretches with the
+// speed while the cone keeps its size. The instance buffer holds only the position and the velocity of each
+// ball; the shader turns the mesh into the direction of the velocity, so all arrows are one instanced draw.
+
+/// @brief what the instance buffer holds for one arrow, the same two vectors as in Sphere
+typedef struct
 {
+    float position[3];
+    float velocity[3];
+} ArrowInstance;
 
-    // Floor collision (Y-axis)
-    if (sphere.position[1] - sphere.radius <= 0.0f)
+/// @brief the shader, the mesh and the instance buffer of the arrows
+typedef struct
+{
+    GLuint program;
+    GLuint meshBuffer;                // the vertices of the arrow, x y z and the tip flag
+    GLuint indexBuffer;               // the triangles of the arrow
+    int indexCount;
+    GLuint instanceBuffer;
+    int instanceCapacity;
+    vector<ArrowInstance> instances;  // filled every frame, it keeps its memory
+    bool failed;                      // set if the shader could not be made, the arrows are then drawn one by one
+} VelocityArrows;
+
+VelocityArrows velocityArrows;
+
+/// @brief the GLSL function that puts a vertex of the arrow mesh into the world, used by the old and the core shader
+const char *arrowShaderSource =
+    "vec3 arrowVertex(vec4 vertex, vec3 base, vec3 velocity)\n"
+    "{\n"
+    "    float speed = length(velocity);\n"
+    "    vec3 along = velocity / speed;\n"
+    "    vec3 helper = abs(along.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);\n"
+    "    vec3 side = normalize(cross(helper, along));\n"
+    "    vec3 other = cross(along, side);\n"
+    "    float length = vertex.y + vertex.w * speed * 0.5; // the tip moves with the speed like in drawVelocityArrow\n"
+    "    return base + side * vertex.x + along * length + other * vertex.z;\n"
+    "}\n";
+
+/// @brief make the arrow mesh, the same size as drawVelocityArrow draws: a head 0.2 long and 0.1 wide
+void buildArrowMesh()
+{
+    const float shaftRadius = 0.01f, headLength = 0.2f, headWidth = 0.1f;
+    const int headSlices = 8;
+    vector<float> vertices;
+    vector<GLushort> indices;
+    auto add = [&](float x, float y, float z, float tip)
     {
-        sphere.position[1] = sphere.radius;                     // Prevent sinking through the floor by positioning the center of the sphere minimum redius above the floor
-        sphere.velocity[1] = -sphere.velocity[1] * restitution; // as the sphere hits the floor, its velocity changes in the opposite direction with fraction of restitution
-
-        // Apply friction to horizontal velocities
-        sphere.velocity[0] *= friction; // as the sphere hits the floor, its horizontal x velocity remains at the same direction but with a fraction of friction
-        sphere.velocity[2] *= friction; // as the sphere hits the floor, its horizontal z velocity remains at the same direction but with a fraction of friction
-
-        // sphere.angularVelocity[0] += sphere.velocity[2] / sphere.radius;
-        // sphere.angularVelocity[2] += -sphere.velocity[0] / sphere.radius;
+        vertices.insert(vertices.end(), {x, y, z, tip});
+    };
+
+    // the shaft, from the center of the ball (tip 0) to the base of the cone (tip 1), vertices 0 to 7
+    const float corners[4][2] = {{shaftRadius, 0}, {0, shaftRadius}, {-shaftRadius, 0}, {0, -shaftRadius}};
+    for (int tip = 0; tip < 2; tip++)
+        for (int i = 0; i < 4; i++)
+            add(corners[i][0], 0, corners[i][1], (float)tip);
+    for (int i = 0; i < 4; i++)
+    {
+        GLushort a = i, b = (i + 1) % 4;
+        indices.insert(indices.end(), {a, b, (GLushort)(b + 4), a, (GLushort)(b + 4), (GLushort)(a + 4)});
     }
-
-    // Wall collisions (X-axis)
-    if (sphere.position[0] - sphere.radius <= 0.0f)
+    // the cone: the ring of its base, the apex and the center of the base
+    GLushort ring = vertices.size() / 4, apex = ring + headSlices, center = apex + 1;
+    for (int i = 0; i < headSlices; i++)
     {
-        sphere.position[0] = sphere.radius; // set the sphere position to radius away from the wall
-        sphere.velocity[0] = -sphere.velocity[0] * restitution; // the velocity will be in the opposite direction
-
-        // Smoothly adjust Y-axis rotation
-
-        // sphere.angularVelocity[1] += -sphere.velocity[2] / sphere.radius;
+        float angle = 2.0f * pi * i / headSlices;
+        add(headWidth * cos(angle), 0, headWidth * sin(angle), 1);
     }
-    if (sphere.position[0] + sphere.radius >= cubeSize)
+    add(0, headLength, 0, 1);
+    add(0, 0, 0, 1);
+    for (int i = 0; i < headSlices; i++)
     {
-        sphere.position[0] = cubeSize - sphere.radius; // set the sphere position to radius away from the wall
-        sphere.velocity[0] = -sphere.velocity[0] * restitution; // the velocity will be in the opposite direction
-
-        // sphere.angularVelocity[1] += -sphere.velocity[2] / sphere.radius;
+        GLushort a = ring + i, b = ring + (i + 1) % headSlices;
+        indices.insert(indices.end(), {a, b, apex, center, b, a});
     }
 
-    // Wall collisions (Z-axis)
-    if (sphere.position[2] - sphere.radius <= 0.0f)
-    {
-        sphere.position[2] = sphere.radius;
-        sphere.velocity[2] = -sphere.velocity[2] * restitution;
+    glGenBuffers(1, &velocityArrows.meshBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, velocityArrows.meshBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glGenBuffers(1, &velocityArrows.indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, velocityArrows.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    velocityArrows.indexCount = (int)indices.size();
+    glGenBuffers(1, &velocityArrows.instanceBuffer);
+    velocityArrows.instanceCapacity = 0;
+}
 
-        // sphere.angularVelocity[1] += sphere.velocity[0] / sphere.radius;
-    }
-    if (sphere.position[2] + sphere.radius >= cubeSize)
+/// @brief make the mesh and the shader of the arrows the first time they are needed
+/// @return false if instanced arrows are not possible, the arrows are then drawn with drawVelocityArrow
+bool initVelocityArrows()
+{
+    if (velocityArrows.program != 0)
+        return true;
+    if (velocityArrows.failed)
+        return false;
+    if (!GLEW_VERSION_3_3) // glVertexAttribDivisor and glDrawElementsInstanced are NULL before 3.3
     {
-        sphere.position[2] = cubeSize - sphere.radius;
-        sphere.velocity[2] = -sphere.velocity[2] * restitution;
-
-        // sphere.angularVelocity[1] += sphere.velocity[0] / sphere.radius;
+        velocityArrows.failed = true;
+        return false;
     }
 
-    // Ceiling collision (Y-axis top)
-    if (sphere.position[1] + sphere.radius >= cubeSize)
+    string vertexSource = string(
+        "#version 120\n"
+        "attribute vec3 arrowPosition;\n"
+        "attribute vec3 arrowVelocity;\n") + arrowShaderSource +
+        "void main()\n"
+        "{\n"
+        "    gl_Position = gl_ModelViewProjectionMatrix * vec4(arrowVertex(gl_Vertex, arrowPosition, arrowVelocity), 1.0);\n"
+        "}\n";
+    const char *fragmentSource =
+        "#version 120\n"
+        "void main()\n"
+        "{\n"
+        "    gl_FragColor = vec4(1.0, 0.0, 0.0, 1.0);\n"
+        "}\n";
+    const char *attributes[] = {"arrowPosition", "arrowVelocity", NULL};
+
+    velocityArrows.program = compileProgram("velocity arrows", vertexSource.c_str(), fragmentSource, attributes);
+    if (velocityArrows.program == 0)
     {
-        sphere.position[1] = cubeSize - sphere.radius;
-        sphere.velocity[1] = -sphere.velocity[1] * restitution;
+        velocityArrows.failed = true;
+        return false;
     }
+    buildArrowMesh();
+    return true;
 }
 
-/// @brief updatePhysics of the ball
-/// @param deltaTime it is the millisecond time after when the function is called
-void updatePhysics(int deltaTime)
+/// @brief copy the visible balls that move into the arrow instance buffer and leave it bound
+/// @return how many arrows there are
+int uploadArrowInstances(const vector<Sphere> &balls, const vector<int> &visible)
 {
-    float dt = deltaTime / 1000.0f; // Convert to seconds
+    vector<ArrowInstance> &instances = velocityArrows.instances;
+    instances.clear();
+    for (int index : visible)
+    {
+        const Sphere &sphere = balls[index];
+        if (sphere.velocity[0] == 0.0f && sphere.velocity[1] == 0.0f && sphere.velocity[2] == 0.0f)
+            continue; // like drawVelocityArrow, a ball that does not move has no arrow
+        ArrowInstance instance;
+        copy(sphere.position, sphere.position + 3, instance.position);
+        copy(sphere.velocity, sphere.velocity + 3, instance.velocity);
+        instances.push_back(instance);
+    }
 
-    // Apply gravity
-    sphere.velocity[1] += gravity * dt; // in every moment, the sphere will be affected by gravity
+    int count = (int)instances.size();
+    glBindBuffer(GL_ARRAY_BUFFER, velocityArrows.instanceBuffer);
+    if (count > velocityArrows.instanceCapacity)
+        velocityArrows.instanceCapacity = count + count / 2;
+    // new storage every frame, so the driver does not wait for the last frame's draw to finish reading the old one
+    glBufferData(GL_ARRAY_BUFFER, velocityArrows.instanceCapacity * sizeof(ArrowInstance), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(ArrowInstance), instances.data());
+    return count;
+}
 
-    // Update position
+/// @brief point the attributes 1 and 2 at the bound arrow instance buffer, stepping once per arrow
+void pointArrowAttributes()
+{
+    for (int a = 0; a < 2; a++)
+    {
+        glEnableVertexAttribArray(a + 1);
+        glVertexAttribDivisor(a + 1, 1);
+        glVertexAttribPointer(a + 1, 3, GL_FLOAT, GL_FALSE, sizeof(ArrowInstance),
+                              (void *)(a == 0 ? offsetof(ArrowInstance, position) : offsetof(ArrowInstance, velocity)));
+    }
+}
+
+/// @brief draw the velocity arrows of the visible balls, all with one draw call when the shader is there
+void drawVelocityArrows(const vector<Sphere> &balls, const vector<int> &visible)
+{
+    double start = nowSeconds();
+    if (!initVelocityArrows())
+    {
+        long long drawn = 0;
+        for (int index : visible)
+            drawn += drawVelocityArrow(balls[index]);
+        sphereDrawStats.arrows += drawn;
+        sphereDrawStats.arrowDrawCalls += 2 * drawn; // the shaft and the cone
+        sphereDrawStats.arrowSeconds += nowSeconds() - start;
+        return;
+    }
+
+    int count = uploadArrowInstances(balls, visible);
+    if (count > 0)
+    {
+        pointArrowAttributes();
+        glBindBuffer(GL_ARRAY_BUFFER, velocityArrows.meshBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, velocityArrows.indexBuffer);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(4, GL_FLOAT, 0, 0);
+        glUseProgram(velocityArrows.program);
+        glDrawElementsInstanced(GL_TRIANGLES, velocityArrows.indexCount, GL_UNSIGNED_SHORT, 0, count);
+        sphereDrawStats.arrowDrawCalls++;
+        glUseProgram(0);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        for (int a = 0; a < 2; a++)
+        {
+            glVertexAttribDivisor(a + 1, 0);
+            glDisableVertexAttribArray(a + 1);
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    sphereDrawStats.arrows += count;
+    sphereDrawStats.arrowSeconds += nowSeconds() - start;
+}
+
+// --- Impacts ---
+// When a sphere hits the floor, a wall or the ceiling hard enough, the simulation thread sends the impact to
+// the render thread, which turns it into sparks (see Impact Particles). The impacts go through a small ring
+// buffer with one writer and one reader, so they are not lost when display() skips a state.
+
+/// @brief where and how hard a sphere hit the room
+typedef struct
+{
+    float position[3]; // the point on the surface that was hit
+    float normal[3];   // the direction the surface faces, into the room
+    float speed;       // how fast the sphere was moving into the surface, 0 if nothing was hit
+} Impact;
+
+/// @brief impacts slower than this do not make sparks, otherwise a sphere resting on the floor would spark all the time
+float minImpactSpeed = 1.5f;
+
+/// @brief how many impacts fit into the ring, it must be a power of two
+const int impactRingSize = 4096;
+Impact impactRing[impactRingSize];
+/// @brief the next impact the simulation writes and the next one the render thread reads
+atomic<unsigned int> impactWritePosition(0), impactReadPosition(0);
+/// @brief impacts thrown away because the render thread did not keep up
+atomic<long long> droppedImpacts(0);
+
+/// @brief hand an impact to the render thread, only the simulation thread calls it
+void pushImpact(const Impact &impact)
+{
+    unsigned int write = impactWritePosition.load(memory_order_relaxed);
+    if (write - impactReadPosition.load(memory_order_acquire) >= (unsigned int)impactRingSize)
+    {
+        droppedImpacts++;
+        return;
+    }
+    impactRing[write & (impactRingSize - 1)] = impact;
+    impactWritePosition.store(write + 1, memory_order_release);
+}
+
+/// @brief take the next impact, only the render thread calls it
+/// @return false if there is none
+bool popImpact(Impact &impact)
+{
+    unsigned int read = impactReadPosition.load(memory_order_relaxed);
+    if (read == impactWritePosition.load(memory_order_acquire))
+        return false;
+    impact = impactRing[read & (impactRingSize - 1)];
+    impactReadPosition.store(read + 1, memory_order_release);
+    return true;
+}
+
+/// @brief remember the hit if it is the hardest one of the sphere in this step
+/// @param impact where to remember it, nothing is remembered if it is NULL
+/// @param sphere the sphere that hit the surface, before it bounces
+/// @param axis the axis the surface is facing along
+/// @param direction +1 if the surface faces the positive axis (floor, near walls), -1 otherwise
+/// @param surface where the surface is along the axis
+void noteImpact(Impact *impact, const Sphere &sphere, int axis, float direction, float surface)
+{
+    float speed = -sphere.velocity[axis] * direction;
+    if (impact == NULL || speed <= impact->speed)
+        return;
+    for (int i = 0; i < 3; i++)
+    {
+        impact->position[i] = sphere.position[i];
+        impact->normal[i] = 0.0f;
+    }
+    impact->position[axis] = surface;
+    impact->normal[axis] = direction;
+    impact->speed = speed;
+}
+
+/// @brief this function checks for collisions for the sphere in all directions. that could be on the roof, on the 4 walls or bouncing off the floor. This method also check for rotation and angular rotational increase when the sphere collides with a surface like in the real world.
+/// @param sphere the sphere to check against the room
+/// @param impact if it is not NULL, the hardest hit of the sphere is written there
+void checkCollisions(Sphere &sphere, Impact *impact = NULL)
+{
+
+    // Floor collision (Y-axis)
+    if (sphere.position[1] - sphere.radius <= 0.0f)
+    {
+        noteImpact(impact, sphere, 1, 1.0f, 0.0f);
+        sphere.position[1] = sphere.radius;                     // Prevent sinking through the floor by positioning the center of the sphere minimum redius above the floor
+        sphere.velocity[1] = -sphere.velocity[1] * restitution; // as the sphere hits the floor, its velocity changes in the opposite direction with fraction of restitution
+
+        // Apply friction to horizontal velocities
+        sphere.velocity[0] *= friction; // as the sphere hits the floor, its horizontal x velocity remains at the same direction but with a fraction of friction
+        sphere.velocity[2] *= friction; // as the sphere hits the floor, its horizontal z velocity remains at the same direction but with a fraction of friction
+
+        // sphere.angularVelocity[0] += sphere.velocity[2] / sphere.radius;
+        // sphere.angularVelocity[2] += -sphere.velocity[0] / sphere.radius;
+    }
+
+    // Wall collisions (X-axis)
+    if (sphere.position[0] - sphere.radius <= 0.0f)
+    {
+        noteImpact(impact, sphere, 0, 1.0f, 0.0f);
+        sphere.position[0] = sphere.radius; // set the sphere position to radius away from the wall
+        sphere.velocity[0] = -sphere.velocity[0] * restitution; // the velocity will be in the opposite direction
+
+        // Smoothly adjust Y-axis rotation
+
+        // sphere.angularVelocity[1] += -sphere.velocity[2] / sphere.radius;
+    }
+    if (sphere.position[0] + sphere.radius >= cubeSize)
+    {
+        noteImpact(impact, sphere, 0, -1.0f, cubeSize);
+        sphere.position[0] = cubeSize - sphere.radius; // set the sphere position to radius away from the wall
+        sphere.velocity[0] = -sphere.velocity[0] * restitution; // the velocity will be in the opposite direction
+
+        // sphere.angularVelocity[1] += -sphere.velocity[2] / sphere.radius;
+    }
+
+    // Wall collisions (Z-axis)
+    if (sphere.position[2] - sphere.radius <= 0.0f)
+    {
+        noteImpact(impact, sphere, 2, 1.0f, 0.0f);
+        sphere.position[2] = sphere.radius;
+        sphere.velocity[2] = -sphere.velocity[2] * restitution;
+
+        // sphere.angularVelocity[1] += sphere.velocity[0] / sphere.radius;
+    }
+    if (sphere.position[2] + sphere.radius >= cubeSize)
+    {
+        noteImpact(impact, sphere, 2, -1.0f, cubeSize);
+        sphere.position[2] = cubeSize - sphere.radius;
+        sphere.velocity[2] = -sphere.velocity[2] * restitution;
+
+        // sphere.angularVelocity[1] += sphere.velocity[0] / sphere.radius;
+    }
+
+    // Ceiling collision (Y-axis top)
+    if (sphere.position[1] + sphere.radius >= cubeSize)
+    {
+        noteImpact(impact, sphere, 1, -1.0f, cubeSize);
+        sphere.position[1] = cubeSize - sphere.radius;
+        sphere.velocity[1] = -sphere.velocity[1] * restitution;
+    }
+}
+
+/// @brief move the sphere for one step: gravity changes its velocity, the velocity changes its position and then it bounces off the room
+/// @param sphere the sphere to move
+/// @param dt the time of the step in seconds
+/// @param impact if it is not NULL, the hardest hit of the sphere against the room is written there
+void moveSphere(Sphere &sphere, float dt, Impact *impact = NULL)
+{
+    // Apply gravity
+    sphere.velocity[1] += gravity * dt; // in every moment, the sphere will be affected by gravity
+
+    // Update position
     sphere.position[0] += sphere.velocity[0] * dt; // now the sphere is moving according to its velocity
     sphere.position[1] += sphere.velocity[1] * dt;
     sphere.position[2] += sphere.velocity[2] * dt;
 
-    checkCollisions(); // check for collisions
+    checkCollisions(sphere, impact); // check for collisions
+}
 
+/// @brief rotate the sphere according to how fast it is moving, so it looks like it is rolling
+/// @param sphere the sphere to rotate
+/// @param dt the time of the step in seconds
+void spinSphere(Sphere &sphere, float dt)
+{
     // Calculate angular velocity according to velocity and radius
-    sphere.angularVelocity[0] = sphere.velocity[2] / sphere.radius; 
-    sphere.angularVelocity[1] = 0;                     
+    sphere.angularVelocity[0] = sphere.velocity[2] / sphere.radius;
+    sphere.angularVelocity[1] = 0;
     sphere.angularVelocity[2] = -sphere.velocity[0] / sphere.radius;
 
     // Dampen angular velocity
@@ -340,710 +1568,6603 @@ void updatePhysics(int deltaTime)
     sphere.rotationAngle[0] += sphere.angularVelocity[0] * dt * 180.0f / pi;
     sphere.rotationAngle[1] += sphere.angularVelocity[1] * dt * 180.0f / pi;
     sphere.rotationAngle[2] += sphere.angularVelocity[2] * dt * 180.0f / pi;
-
-    // Just to find out the current position for the sphere
-    // cout << "Sphere position: (" << sphere.position[0] << ", " << sphere.position[1] << ", " << sphere.position[2] << ")" << endl;
 }
-/**
- * Main display function
- * Sets up the camera and renders visible objects
- */
-void display()
+
+// --- Trajectory Recording ---
+// With --record FILE every step the simulation hands to the renderer is appended to FILE: the step, the
+// camera, all the spheres and the impacts of the step. The --render-farm run reads it back and draws it
+// offline, sparks and all. The file is a plain dump of the structs, so it is only meant to be read by the same
+// build on the same kind of machine; the header keeps the struct sizes to catch a file of another build.
+
+/// @brief the start of a trajectory file
+typedef struct
 {
-    // Clear color and depth buffers
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    char magic[8];        // "BALLTRJ1"
+    int ballCount;
+    float cubeSize;
+    int stepMilliseconds; // animationSpeed of the recorded run
+    int sphereBytes;      // sizeof(Sphere) of the build that wrote the file
+    int impactBytes;      // sizeof(Impact)
+} TrajectoryHeader;
+
+/// @brief the start of every step in a trajectory file, followed by the spheres and then the impacts
+typedef struct
+{
+    long long step;
+    float camera[9]; // eye, center and up
+    int sphereCount;
+    int impactCount;
+} TrajectoryFrame;
 
-    // Set up the model-view matrix
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+const char trajectoryMagic[8] = {'B', 'A', 'L', 'L', 'T', 'R', 'J', '1'};
 
-    // Position camera using the eye, center and up vectors
-    gluLookAt(eyex, eyey, eyez,          // Camera position
-              centerx, centery, centerz, // Look-at point
-              upx, upy, upz);            // Up vector
+/// @brief the open recording, only used by the simulation thread once it is started
+typedef struct
+{
+    FILE *file;
+    long long lastStep;     // a step is written once, even when a paused simulation publishes it again
+    vector<Impact> impacts; // the impacts of the step that is not written yet, reserved so a step never allocates
+    long long frames;
+    long long bytes;
+    double writeSeconds;
+    bool failed;
+} TrajectoryRecorder;
+
+/// @brief where --record writes the trajectory, empty to record nothing
+string trajectoryRecordPath;
+TrajectoryRecorder trajectoryRecorder;
+
+/// @brief open the trajectory file and write its header, the spheres do not need to exist yet
+/// @return false if the file could not be written
+bool startTrajectoryRecording(const string &path)
+{
+    TrajectoryRecorder &recorder = trajectoryRecorder;
+    recorder.file = fopen(path.c_str(), "wb");
+    if (recorder.file == NULL)
+        return false;
+    TrajectoryHeader header;
+    memcpy(header.magic, trajectoryMagic, sizeof(header.magic));
+    header.ballCount = ballCount;
+    header.cubeSize = cubeSize;
+    header.stepMilliseconds = animationSpeed;
+    header.sphereBytes = sizeof(Sphere);
+    header.impactBytes = sizeof(Impact);
+    recorder.failed = fwrite(&header, sizeof(header), 1, recorder.file) != 1;
+    recorder.bytes = sizeof(header);
+    recorder.lastStep = 0;
+    recorder.impacts.reserve(impactRingSize);
+    return !recorder.failed;
+}
 
-    // Draw objects based on visibility flags
-    drawCubeWithCheckeredFloor();
-    drawSphere();
-    if (showArrow)
-    {
-        drawVelocityArrow();
-    }
-    if (isAxes)
-        drawAxes();
+/// @brief remember an impact of the current step for the recording
+void recordImpact(const Impact &impact)
+{
+    TrajectoryRecorder &recorder = trajectoryRecorder;
+    if (recorder.file != NULL && recorder.impacts.size() < recorder.impacts.capacity())
+        recorder.impacts.push_back(impact);
+}
 
-    // Swap buffers (double buffering)
-    glutSwapBuffers();
+/// @brief append the spheres, the camera and the impacts of a step to the recording, if it is a new step
+void recordStep(long long step)
+{
+    TrajectoryRecorder &recorder = trajectoryRecorder;
+    if (recorder.file == NULL || step <= recorder.lastStep || recorder.failed)
+        return;
+    double start = nowSeconds();
+    TrajectoryFrame frame;
+    frame.step = step;
+    float camera[9] = {eyex, eyey, eyez, centerx, centery, centerz, upx, upy, upz};
+    memcpy(frame.camera, camera, sizeof(camera));
+    frame.sphereCount = (int)spheres.size();
+    frame.impactCount = (int)recorder.impacts.size();
+    bool written = fwrite(&frame, sizeof(frame), 1, recorder.file) == 1;
+    written = written && fwrite(spheres.data(), sizeof(Sphere), spheres.size(), recorder.file) == spheres.size();
+    written = written && fwrite(recorder.impacts.data(), sizeof(Impact), recorder.impacts.size(), recorder.file) == recorder.impacts.size();
+    recorder.failed = !written;
+    recorder.bytes += sizeof(frame) + sizeof(Sphere) * spheres.size() + sizeof(Impact) * recorder.impacts.size();
+    recorder.impacts.clear();
+    recorder.lastStep = step;
+    recorder.frames++;
+    recorder.writeSeconds += nowSeconds() - start;
 }
 
-/**
- * Window reshape callback
- * Handles window resizing and maintains aspect ratio
- */
-void reshapeListener(GLsizei width, GLsizei height)
+/// @brief close the recording and print how big it got, called at exit after the simulation has stopped
+void stopTrajectoryRecording()
 {
-    // Prevent division by zero
-    if (height == 0)
-        height = 1;
+    TrajectoryRecorder &recorder = trajectoryRecorder;
+    if (recorder.file == NULL)
+        return;
+    recorder.failed = fclose(recorder.file) != 0 || recorder.failed;
+    recorder.file = NULL;
+    printf("recorded %lld steps to %s: %.1f MB, %.3f ms per step%s\n", recorder.frames, trajectoryRecordPath.c_str(),
+           recorder.bytes / 1e6, recorder.frames ? recorder.writeSeconds * 1e3 / recorder.frames : 0.0,
+           recorder.failed ? ", THE FILE COULD NOT BE WRITTEN COMPLETELY" : "");
+}
 
-    // Calculate aspect ratio
-    GLfloat aspect = (GLfloat)width / (GLfloat)height;
+/// @brief read the header of a trajectory file and check that this build can read the rest
+/// @return false if it is not a trajectory of this build
+bool readTrajectoryHeader(FILE *file, TrajectoryHeader &header)
+{
+    return fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, trajectoryMagic, sizeof(header.magic)) == 0 &&
+           header.sphereBytes == (int)sizeof(Sphere) && header.impactBytes == (int)sizeof(Impact);
+}
 
-    // Set viewport to cover entire window
-    glViewport(0, 0, width, height);
+/// @brief read the next step of a trajectory file
+/// @return false at the end of the file or if the step is cut off
+bool readTrajectoryFrame(FILE *file, TrajectoryFrame &frame, vector<Sphere> &frameSpheres, vector<Impact> &impacts)
+{
+    if (fread(&frame, sizeof(frame), 1, file) != 1 || frame.sphereCount < 0 || frame.impactCount < 0)
+        return false;
+    frameSpheres.resize(frame.sphereCount);
+    impacts.resize(frame.impactCount);
+    return fread(frameSpheres.data(), sizeof(Sphere), frame.sphereCount, file) == (size_t)frame.sphereCount &&
+           fread(impacts.data(), sizeof(Impact), frame.impactCount, file) == (size_t)frame.impactCount;
+}
 
-    // Set up perspective projection
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+// --- Heap Allocation Counter ---
+// Every allocation with new goes through here. The simulation thread and the physics workers turn counting on,
+// so updatePhysics can check that a step in the steady state does not touch the heap at all.
 
-    // 45-degree field of view, aspect ratio, near and far clipping planes
-    gluPerspective(45.0f, aspect, 0.1f, 100.0f);
+/// @brief true on the threads whose heap allocations are counted
+thread_local bool countAllocations = false;
+/// @brief how many heap allocations the counted threads made
+atomic<long long> countedAllocations(0);
+
+/// @brief take memory from malloc and count it, every replaced operator new below comes here
+void *countedAllocate(size_t size) noexcept
+{
+    if (countAllocations)
+        countedAllocations.fetch_add(1, memory_order_relaxed);
+    return malloc(size ? size : 1);
 }
 
-/**
- * Keyboard input handler for standard keys
- * Manages camera position, object visibility, and program exit
- */
-void keyboardListener(unsigned char key, int x, int y)
+/// @brief give back memory of countedAllocate, every replaced operator delete below comes here; it is not inlined,
+/// otherwise GCC sees free() on memory from operator new and warns about a mismatch that is not one
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void countedFree(void *memory) noexcept
 {
+    free(memory);
+}
 
-    // Calculate view direction vector
-    double lx = centerx - eyex;
-    double lz = centerz - eyez;
-    double s;
+// all forms are replaced together, so memory from any of them goes back through the matching delete
+void *operator new(size_t size)
+{
+    void *memory = countedAllocate(size);
+    if (memory == NULL)
+        throw bad_alloc();
+    return memory;
+}
 
-    switch (key)
-    {
-    case '1':
-    {
-        // we are getting the vector which originates from the camera position to the reference point
-        double caX = centerx - eyex;
-        double caY = centery - eyey;
-        double caZ = centerz - eyez;
+void *operator new[](size_t size)
+{
+    void *memory = countedAllocate(size);
+    if (memory == NULL)
+        throw bad_alloc();
+    return memory;
+}
 
-        // we are calculating the cross product of the new vector and the head vector
-        double crossX = upy * caZ - upz * caY;
-        double crossY = upz * caX - upx * caZ;
-        double crossZ = upx * caY - upy * caX;
-        // as a result the new cross vector will be the perpendicular of the head and the camera to refernce point vector
-        // so it might be on the left or on the right side of the current camera position
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    return countedAllocate(size);
+}
 
-        // getting the magnitude value of the cross product vector
-        double crossMag = sqrt(crossX * crossX + crossY * crossY + crossZ * crossZ);
-        // Now, we are making the the new t vector as the unit vector for the direction of cross vector
-        double tX = crossX / crossMag;
-        double tY = crossY / crossMag;
-        double tZ = crossZ / crossMag;
-        // Now, we are incrementing the camera position in the direction of the t vector
-        double daX = tX * rotationSpeed;
-        double daY = tY * rotationSpeed;
-        double daZ = tZ * rotationSpeed;
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return countedAllocate(size);
+}
 
-        centerx = centerx + daX;
-        centery = centery + daY;
-        centerz = centerz + daZ;
-        break;
-    }
-    case '2':
-    {
-        // we are getting the vector which originates from the camera position to the reference point
-        double caX = centerx - eyex;
-        double caY = centery - eyey;
-        double caZ = centerz - eyez;
+void operator delete(void *memory) noexcept
+{
+    countedFree(memory);
+}
 
-        // we are calculating the cross product of the new vector and the head vector
-        double crossX = upy * caZ - upz * caY;
-        double crossY = upz * caX - upx * caZ;
-        double crossZ = upx * caY - upy * caX;
+void operator delete[](void *memory) noexcept
+{
+    countedFree(memory);
+}
 
-        // getting the magnitude value of the cross product vector
-        double crossMag = sqrt(crossX * crossX + crossY * crossY + crossZ * crossZ);
-        double tX = crossX / crossMag;
-        double tY = crossY / crossMag;
-        double tZ = crossZ / crossMag;
+void operator delete(void *memory, size_t) noexcept
+{
+    countedFree(memory);
+}
 
-        // Now, we are calculating the value to change 
-        double daX = tX * rotationSpeed;
-        double daY = tY * rotationSpeed;
-        double daZ = tZ * rotationSpeed;
-        // Now, we are decrementing the camera position in the direction of the t vector
-        centerx = centerx - daX;
-        centery = centery - daY;
-        centerz = centerz - daZ;
-        break;
-    }
-    case '3': // Rotate camera upwards
-    {
-        float ROTATION_ANGLE = rotationSpeed;
-        //  the new vector vireDir is the vector from the camera to the reference point
-        float viewDirx = centerx - eyex;
-        float viewDiry = centery - eyey;
-        float viewDirz = centerz - eyez;
+void operator delete[](void *memory, size_t) noexcept
+{
+    countedFree(memory);
+}
 
-        // Normalize the view direction
-        // getting the magnitude of the viewDir vector
-        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
-        // now we are normalizing the viewDir vector as a unit vector
-        viewDirx /= viewLength;
-        viewDiry /= viewLength;
-        viewDirz /= viewLength;
+void operator delete(void *memory, const nothrow_t &) noexcept
+{
+    countedFree(memory);
+}
 
-        // Normalize the up vector to get  the direction unit vector
-        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
-        upx /= upLength;
-        upy /= upLength;
-        upz /= upLength;
+void operator delete[](void *memory, const nothrow_t &) noexcept
+{
+    countedFree(memory);
+}
 
+// --- Step Arenas ---
+// The grid, the contact changes and the lists of touching spheres only live for one step. Instead of
+// allocating them with vectors every step, they are taken from an arena: a block of memory that is handed
+// out from front to back and emptied all at once at the start of the next step. If a step needs more than
+// the block has, the extra memory comes from the heap for that step and the block grows at the next reset,
+// so after the first steps no step allocates anything.
 
-        // we will create a rotation matrix around the up vector
-        float cosAngle = cos(ROTATION_ANGLE);
-        float sinAngle = sin(ROTATION_ANGLE);
+/// @brief a block of memory handed out from front to back and emptied all at once
+typedef struct
+{
+    char *memory;    // the block
+    size_t capacity; // bytes in the block
+    size_t used;     // bytes handed out of the block
+    size_t spilled;  // bytes that did not fit and came from the heap since the last reset
+    char *overflow;  // the heap blocks of this step, each one starts with a pointer to the next
+} Arena;
+
+/// @brief the arena of the simulation thread, emptied at the start of every updatePhysics
+Arena stepArena;
+/// @brief the most physics workers there can be
+const int maxPhysicsThreads = 64;
+/// @brief one arena for every physics worker, for what a worker needs during a parallel phase
+Arena workerArenas[maxPhysicsThreads];
+
+/// @brief take some bytes from the arena, they stay valid until the next resetArena
+void *arenaAllocateBytes(Arena &arena, size_t bytes)
+{
+    bytes = (bytes + 15) & ~(size_t)15; // keep everything 16 byte aligned
+    if (arena.used + bytes <= arena.capacity)
+    {
+        void *memory = arena.memory + arena.used;
+        arena.used += bytes;
+        return memory;
+    }
 
-        // Rotate the view direction, this is the new view direction from the camera to the reference point, here there is ROTATION ANGLE difference from now viewDir vector, and 90 - ROTATION ANGLE reference from the up vector, so we just add cos angle with viewDir anmd sin angle with up vector
-        float newViewDirx = viewDirx * cosAngle + upx * sinAngle;
-        float newViewDiry = viewDiry * cosAngle + upy * sinAngle;
-        float newViewDirz = viewDirz * cosAngle + upz * sinAngle;
+    // the block is full, this memory comes from the heap and is given back at the next reset
+    char *block = new char[bytes + 16];
+    *(char **)block = arena.overflow;
+    arena.overflow = block;
+    arena.spilled += bytes;
+    return block + 16;
+}
 
-        // Rotate the up vector, this is the new up vector here there is ROTATION ANGLE difference from now up vector, and 90 + ROTATION ANGLE difference from the viewDir vector, so we just subtract cos angle with up vector and sin angle with viewDir vector
-        float newUpx = upx * cosAngle - viewDirx * sinAngle;
-        float newUpy = upy * cosAngle - viewDiry * sinAngle;
-        float newUpz = upz * cosAngle - viewDirz * sinAngle;
+/// @brief take room for count values of type T from the arena
+template <typename T>
+T *arenaAllocate(Arena &arena, size_t count)
+{
+    return (T *)arenaAllocateBytes(arena, count * sizeof(T));
+}
 
-        // Update the center position by adding the new view direction with the camera position to get the new center
-        centerx = eyex + newViewDirx * viewLength;
-        centery = eyey + newViewDiry * viewLength;
-        centerz = eyez + newViewDirz * viewLength;
- 
-        // Update the up vector 
-        upx = newUpx;
-        upy = newUpy;
-        upz = newUpz;
-        break;
-    }
-    case '4': // Rotate camera downwards
+/// @brief empty the arena, if the last step did not fit into the block the block grows so the next step will
+void resetArena(Arena &arena)
+{
+    if (arena.overflow != NULL)
     {
-        // the new vector vireDir is the vector from the camera to the reference point
-        float ROTATION_ANGLE = -rotationSpeed;
-        float viewDirx = centerx - eyex;
-        float viewDiry = centery - eyey;
-        float viewDirz = centerz - eyez;
+        size_t needed = arena.used + arena.spilled;
+        while (arena.overflow != NULL)
+        {
+            char *next = *(char **)arena.overflow;
+            delete[] arena.overflow;
+            arena.overflow = next;
+        }
+        delete[] arena.memory;
+        arena.capacity = max((size_t)65536, needed + needed / 2);
+        arena.memory = new char[arena.capacity];
+    }
+    arena.used = 0;
+    arena.spilled = 0;
+}
 
-        // Normalize the view direction vector as a unit vector
-        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
-        viewDirx /= viewLength;
-        viewDiry /= viewLength;
-        viewDirz /= viewLength;
+// --- Physics Workers ---
+// The phases of a step where every sphere is handled on its own (moving, finding its contacts, spinning)
+// are split over physicsThreadCount threads. The simulation thread is worker 0 and the others wait
+// for work. A task is a plain function with a context pointer, so handing out work does not allocate.
 
-        // Normalize the up vector as a unit vector 
-        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
-        upx /= upLength;
-        upy /= upLength;
-        upz /= upLength;
+/// @brief how many threads work on a step, it can be changed with --threads
+int physicsThreadCount = 1;
 
+/// @brief the work of a parallel phase: handle the items begin to end-1, worker says whose arena to use
+typedef void (*ParallelTask)(void *context, int begin, int end, int worker);
 
-        // Create rotation matrix around the right vector 
-        float cosAngle = cos(ROTATION_ANGLE);
-        float sinAngle = sin(ROTATION_ANGLE);
-        // here the rotation angle is the angle between the right vector and the view direction vector, so we just add cos angle with viewDir anmd sin angle with right vector
-        // so as it is minus, it will rotate at the different direction
-        // Rotate the view direction vector this is the new view direction from the camera to the reference point here there is ROTATION ANGLE difference from now viewDir vector, and 90 - ROTATION ANGLE reference from the up vector, so we just add cos angle with viewDir anmd sin angle with up vector
-        float newViewDirx = viewDirx * cosAngle + upx * sinAngle;
-        float newViewDiry = viewDiry * cosAngle + upy * sinAngle;
-        float newViewDirz = viewDirz * cosAngle + upz * sinAngle;
+/// @brief the state shared by the physics workers
+typedef struct
+{
+    vector<thread> threads;
+    mutex lock;
+    condition_variable workReady;
+    condition_variable workDone;
+    ParallelTask task;
+    void *context;
+    int count;            // how many items the phase has
+    int chunk;            // how many items a worker takes at once
+    atomic<int> next;     // the first item nobody took yet
+    long long generation; // increased for every phase, so the workers see that there is new work
+    int busy;             // workers still working on the phase
+    bool stop;
+} PhysicsWorkers;
+
+PhysicsWorkers physicsWorkers;
+
+/// @brief take chunks of the current phase until there are none left
+void runParallelChunks(int worker)
+{
+    while (true)
+    {
+        int begin = physicsWorkers.next.fetch_add(physicsWorkers.chunk);
+        if (begin >= physicsWorkers.count)
+            return;
+        int end = min(physicsWorkers.count, begin + physicsWorkers.chunk);
+        physicsWorkers.task(physicsWorkers.context, begin, end, worker);
+    }
+}
 
-        // Rotate the up vector this is the new up vector, here there is ROTATION ANGLE difference from now up vector, and 90 + ROTATION ANGLE difference from the viewDir vector, so we just subtract cos angle with up vector and sin angle with viewDir vector
-        float newUpx = upx * cosAngle - viewDirx * sinAngle;
-        float newUpy = upy * cosAngle - viewDiry * sinAngle;
-        float newUpz = upz * cosAngle - viewDirz * sinAngle;
+/// @brief the loop of a physics worker thread
+void physicsWorkerLoop(int worker)
+{
+    countAllocations = true;
+    long long seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(physicsWorkers.lock);
+            physicsWorkers.workReady.wait(lock, [&]
+                                          { return physicsWorkers.stop || physicsWorkers.generation != seen; });
+            if (physicsWorkers.stop)
+                return;
+            seen = physicsWorkers.generation;
+        }
+        runParallelChunks(worker);
+        {
+            lock_guard<mutex> lock(physicsWorkers.lock);
+            if (--physicsWorkers.busy == 0)
+                physicsWorkers.workDone.notify_one();
+        }
+    }
+}
 
-        // Update the center position by adding the new view direction with the camera position to get the new center
-        centerx = eyex + newViewDirx * viewLength;
-        centery = eyey + newViewDiry * viewLength;
-        centerz = eyez + newViewDirz * viewLength;
+/// @brief start the physics worker threads, the calling thread becomes worker 0
+void startPhysicsWorkers()
+{
+    physicsThreadCount = min(max(1, physicsThreadCount), maxPhysicsThreads);
+    for (int worker = 1; worker < physicsThreadCount; worker++)
+        physicsWorkers.threads.push_back(thread(physicsWorkerLoop, worker));
+}
 
-        // Update the up vector 
-        upx = newUpx;
-        upy = newUpy;
-        upz = newUpz;
-        break;
+/// @brief stop the physics worker threads, called when the program ends
+void stopPhysicsWorkers()
+{
+    {
+        lock_guard<mutex> lock(physicsWorkers.lock);
+        physicsWorkers.stop = true;
     }
-    case '5':
+    physicsWorkers.workReady.notify_all();
+    for (thread &worker : physicsWorkers.threads)
+        worker.join();
+    physicsWorkers.threads.clear();
+}
+
+/// @brief run task over the items 0 to count-1 on all physics workers and wait until all of them are done
+/// @param chunk how many items a worker takes at once, 0 to pick it from the count; with 0 small phases run on
+/// the calling thread alone
+void parallelFor(int count, ParallelTask task, void *context, int chunk = 0)
+{
+    int threads = min(physicsThreadCount, 1 + (int)physicsWorkers.threads.size());
+    if (threads == 1 || (chunk == 0 && count < 256))
     {
+        task(context, 0, count, 0);
+        return;
+    }
+    {
+        lock_guard<mutex> lock(physicsWorkers.lock);
+        physicsWorkers.task = task;
+        physicsWorkers.context = context;
+        physicsWorkers.count = count;
+        physicsWorkers.chunk = chunk > 0 ? chunk : max(64, count / (threads * 4));
+        physicsWorkers.next = 0;
+        physicsWorkers.busy = threads - 1;
+        physicsWorkers.generation++;
+    }
+    physicsWorkers.workReady.notify_all();
+    runParallelChunks(0);
+    unique_lock<mutex> lock(physicsWorkers.lock);
+    physicsWorkers.workDone.wait(lock, []
+                                 { return physicsWorkers.busy == 0; });
+}
 
-        float TILT_ANGLE = rotationSpeed; // Positive for clockwise, negative for counter-clockwise
+// --- Sphere Contacts ---
 
-        // Calculate the view direction vector from the camera to the reference point
-        float viewDirx = centerx - eyex;
-        float viewDiry = centery - eyey;
-        float viewDirz = centerz - eyez;
+/// @brief which bucket of the sphere grid a cell belongs to, different cells can share a bucket
+/// @param cellX the cell index along x
+/// @param cellY the cell index along y
+/// @param cellZ the cell index along z
+/// @param bucketCount how many buckets the grid has, it must be a power of two
+int gridBucket(int cellX, int cellY, int cellZ, int bucketCount)
+{
+    unsigned int hash = (unsigned int)cellX * 73856093u ^ (unsigned int)cellY * 19349663u ^ (unsigned int)cellZ * 83492791u;
+    return (int)(hash & (unsigned int)(bucketCount - 1));
+}
 
-        // Normalize the view direction vector as a unit vector
-        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
-        viewDirx /= viewLength;
-        viewDiry /= viewLength;
-        viewDirz /= viewLength;
+/// @brief everything the contact phase needs, it lives in the step arena
+typedef struct
+{
+    const Sphere *balls;
+    float cellSize;
+    int bucketCount;
+    const int *bucketStart;   // the spheres of bucket b are bucketEntries[bucketStart[b]] to bucketEntries[bucketStart[b + 1] - 1]
+    const int *bucketEntries;
+    float *velocityChange;    // 3 values per updated sphere
+    float *positionChange;    // 3 values per updated sphere
+    int contacts[maxPhysicsThreads];
+} ContactPhase;
+
+/// @brief find the spheres touching the spheres begin to end-1 and add up how they push them
+void findSphereContacts(void *context, int begin, int end, int worker)
+{
+    ContactPhase &phase = *(ContactPhase *)context;
+    const Sphere *balls = phase.balls;
+    float cellSize = phase.cellSize;
+    Arena &arena = workerArenas[worker];
 
-        // Normalize the up vector as a unit vector
-        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
-        upx /= upLength;
-        upy /= upLength;
-        upz /= upLength;
+    for (int i = begin; i < end; i++)
+    {
+        const Sphere &a = balls[i];
+        int cellX = (int)floor(a.position[0] / cellSize);
+        int cellY = (int)floor(a.position[1] / cellSize);
+        int cellZ = (int)floor(a.position[2] / cellSize);
+
+        // look at the 27 cells around the sphere, two cells can land in the same bucket so we skip the buckets we have already seen
+        int visited[27];
+        int visitedCount = 0;
+        int candidates = 0;
+        for (int dx = -1; dx <= 1; dx++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dz = -1; dz <= 1; dz++)
+                {
+                    int bucket = gridBucket(cellX + dx, cellY + dy, cellZ + dz, phase.bucketCount);
+                    if (find(visited, visited + visitedCount, bucket) != visited + visitedCount)
+                        continue;
+                    visited[visitedCount++] = bucket;
+                    candidates += phase.bucketStart[bucket + 1] - phase.bucketStart[bucket];
+                }
+
+        // the list of touching spheres is only needed for this sphere, so it is given back to the arena right after
+        size_t mark = arena.used;
+        int *touching = arenaAllocate<int>(arena, candidates);
+        int touchingCount = 0;
+        for (int v = 0; v < visitedCount; v++)
+        {
+            int bucket = visited[v];
+            for (int e = phase.bucketStart[bucket]; e < phase.bucketStart[bucket + 1]; e++)
+            {
+                int j = phase.bucketEntries[e];
+                if (j == i)
+                    continue;
+                const Sphere &b = balls[j];
+                float ddx = a.position[0] - b.position[0];
+                float ddy = a.position[1] - b.position[1];
+                float ddz = a.position[2] - b.position[2];
+                float reach = a.radius + b.radius;
+                if (ddx * ddx + ddy * ddy + ddz * ddz < reach * reach)
+                    touching[touchingCount++] = j;
+            }
+        }
 
-        // Calculate the right vector 
-        // cross product of view direction and up vector
-        float rightx = viewDiry * upz - viewDirz * upy;
-        float righty = viewDirz * upx - viewDirx * upz;
-        float rightz = viewDirx * upy - viewDiry * upx;
+        // add the touching spheres up in the order of their id
+        sort(touching, touching + touchingCount, [balls](int first, int second)
+             { return balls[first].id < balls[second].id; });
 
-        // Create rotation matrix using Rodrigues' rotation formula
-        float cosAngle = cos(TILT_ANGLE);
-        float sinAngle = sin(TILT_ANGLE);
+        for (int t = 0; t < touchingCount; t++)
+        {
+            const Sphere &b = balls[touching[t]];
+            float normal[3] = {a.position[0] - b.position[0], a.position[1] - b.position[1], a.position[2] - b.position[2]};
+            float distance = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            if (distance < 1e-6f)
+            {
+                // the centers are on top of each other, so we push them apart along x, in the direction of their ids
+                normal[0] = a.id < b.id ? -1.0f : 1.0f;
+                normal[1] = normal[2] = 0.0f;
+                distance = 0.0f;
+            }
+            else
+            {
+                normal[0] /= distance;
+                normal[1] /= distance;
+                normal[2] /= distance;
+            }
 
-        // Rotate the up vector around the view direction axis, as the TILT_ANGLE differencec from the current up vector, and 90 - TILT_ANGLE difference from the right vector, so we just add cos angle with up vector and sin angle with right vector
-        float newUpx = upx * cosAngle + rightx * sinAngle;
-        float newUpy = upy * cosAngle + righty * sinAngle;
-        float newUpz = upz * cosAngle + rightz * sinAngle;
+            // each sphere moves away from the other one by its share of the overlap, the lighter one moves more
+            float overlap = a.radius + b.radius - distance;
+            float share = b.mass / (a.mass + b.mass);
 
-        // Update the up vector
-        upx = newUpx;
-        upy = newUpy;
-        upz = newUpz;
+            // the spheres only bounce if they are moving towards each other
+            float approach = (a.velocity[0] - b.velocity[0]) * normal[0] +
+                             (a.velocity[1] - b.velocity[1]) * normal[1] +
+                             (a.velocity[2] - b.velocity[2]) * normal[2];
+            float impulse = 0.0f;
+            if (approach < 0.0f)
+                impulse = -(1.0f + restitution) * approach / (1.0f / a.mass + 1.0f / b.mass);
 
-        // We make the up vector again the unit vector for the next rotation
-        upLength = sqrt(upx * upx + upy * upy + upz * upz);
-        upx /= upLength;
-        upy /= upLength;
-        upz /= upLength;
-        break;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                phase.positionChange[3 * i + axis] += normal[axis] * overlap * share;
+                phase.velocityChange[3 * i + axis] += normal[axis] * impulse / a.mass;
+            }
+        }
+        phase.contacts[worker] += touchingCount;
+        arena.used = mark;
     }
-    case '6':
+}
+
+/// @brief finds the spheres that touch each other and makes them bounce off each other.
+/// Every sphere only looks at the state before this function was called (the changes are applied at the end),
+/// and the spheres touching one sphere are always added up in the order of their id,
+/// so the result does not depend on the order of the spheres in the array or on how many workers there are.
+/// That is what lets a domain process find exactly the same result as a single process run.
+/// The scratch memory comes from stepArena and the worker arenas, so the caller must reset them every step.
+/// @param balls the spheres, the first ownedCount of them are changed, the rest are only looked at (the halo of a domain)
+/// @param count how many spheres there are in total
+/// @param ownedCount how many spheres at the start of the array are updated
+/// @return how many touching pairs were found for the updated spheres
+int resolveSphereContacts(Sphere *balls, int count, int ownedCount)
+{
+    if (count < 2)
+        return 0;
+
+    // the grid cells are as big as the largest possible distance between two touching centers
+    float maxRadius = 0.0f;
+    for (int i = 0; i < count; i++)
+        maxRadius = max(maxRadius, balls[i].radius);
+
+    ContactPhase &phase = *arenaAllocate<ContactPhase>(stepArena, 1);
+    phase.balls = balls;
+    phase.cellSize = 2.0f * maxRadius;
+    phase.bucketCount = 1;
+    while (phase.bucketCount < 2 * count)
+        phase.bucketCount *= 2;
+
+    // Put every sphere into a bucket of the grid with a counting sort
+    int *cellOf = arenaAllocate<int>(stepArena, count);
+    int *bucketStart = arenaAllocate<int>(stepArena, phase.bucketCount + 1);
+    int *bucketFill = arenaAllocate<int>(stepArena, phase.bucketCount);
+    int *bucketEntries = arenaAllocate<int>(stepArena, count);
+    fill(bucketStart, bucketStart + phase.bucketCount + 1, 0);
+    for (int i = 0; i < count; i++)
     {
+        cellOf[i] = gridBucket((int)floor(balls[i].position[0] / phase.cellSize),
+                               (int)floor(balls[i].position[1] / phase.cellSize),
+                               (int)floor(balls[i].position[2] / phase.cellSize), phase.bucketCount);
+        bucketStart[cellOf[i] + 1]++;
+    }
+    for (int b = 0; b < phase.bucketCount; b++)
+        bucketStart[b + 1] += bucketStart[b];
+    copy(bucketStart, bucketStart + phase.bucketCount, bucketFill);
+    for (int i = 0; i < count; i++)
+        bucketEntries[bucketFill[cellOf[i]]++] = i;
+    phase.bucketStart = bucketStart;
+    phase.bucketEntries = bucketEntries;
+
+    // the change of every updated sphere, applied after all of them are calculated
+    phase.velocityChange = arenaAllocate<float>(stepArena, 3 * ownedCount);
+    phase.positionChange = arenaAllocate<float>(stepArena, 3 * ownedCount);
+    fill(phase.velocityChange, phase.velocityChange + 3 * ownedCount, 0.0f);
+    fill(phase.positionChange, phase.positionChange + 3 * ownedCount, 0.0f);
+    fill(phase.contacts, phase.contacts + maxPhysicsThreads, 0);
+
+    parallelFor(ownedCount, findSphereContacts, &phase);
+
+    int contacts = 0;
+    for (int worker = 0; worker < maxPhysicsThreads; worker++)
+        contacts += phase.contacts[worker];
+    for (int i = 0; i < ownedCount; i++)
+        for (int axis = 0; axis < 3; axis++)
+        {
+            balls[i].position[axis] += phase.positionChange[3 * i + axis];
+            balls[i].velocity[axis] += phase.velocityChange[3 * i + axis];
+        }
 
-        float TILT_ANGLE = -rotationSpeed; // Positive for clockwise, negative for counter-clockwise
+    return contacts;
+}
 
-        // Calculate the view direction vector from the camera to the reference point
-        float viewDirx = centerx - eyex;
-        float viewDiry = centery - eyey;
-        float viewDirz = centerz - eyez;
+/// @brief how many steps allocated on the heap, and when the last one did
+typedef struct
+{
+    long long steps;           // steps checked
+    long long allocatingSteps; // steps that allocated on the heap
+    long long lastAllocatingStep;
+    long long allocations;     // heap allocations made inside steps
+} StepAllocations;
 
-        // Normalize the view direction vector as a unit vector
-        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
-        viewDirx /= viewLength;
-        viewDiry /= viewLength;
-        viewDirz /= viewLength;
+StepAllocations stepAllocations;
 
-        // Normalize the up vector as a unit vector
-        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
-        upx /= upLength;
-        upy /= upLength;
-        upz /= upLength;
+/// @brief what the move phase needs: the time of the step and one impact per sphere
+typedef struct
+{
+    float dt;
+    Impact *impacts;
+} MovePhase;
 
-        // Calculate the right vector 
-        // cross product of view direction and up vector
-        float rightx = viewDiry * upz - viewDirz * upy;
-        float righty = viewDirz * upx - viewDirx * upz;
-        float rightz = viewDirx * upy - viewDiry * upx;
+/// @brief move the spheres begin to end-1 and remember how hard each one hit the room
+void moveSpheresTask(void *context, int begin, int end, int worker)
+{
+    MovePhase &phase = *(MovePhase *)context;
+    for (int i = begin; i < end; i++)
+    {
+        phase.impacts[i].speed = 0.0f;
+        moveSphere(spheres[i], phase.dt, &phase.impacts[i]);
+    }
+}
 
-        // Create rotation matrix using Rodrigues' rotation formula
-        float cosAngle = cos(TILT_ANGLE);
-        float sinAngle = sin(TILT_ANGLE);
+/// @brief spin the spheres begin to end-1, the context is the time of the step
+void spinSpheresTask(void *context, int begin, int end, int worker)
+{
+    float dt = *(float *)context;
+    for (int i = begin; i < end; i++)
+        spinSphere(spheres[i], dt);
+}
 
-        // Rotate the up vector around the view direction axis , as the TILT_ANGLE differencec from the current up vector, and 90 - TILT_ANGLE difference from the right vector, so we just add cos angle with up vector and sin angle with right vector
-        float newUpx = upx * cosAngle + rightx * sinAngle;
-        float newUpy = upy * cosAngle + righty * sinAngle;
-        float newUpz = upz * cosAngle + rightz * sinAngle;
+/// @brief updatePhysics of the balls
+/// @param deltaTime it is the millisecond time after when the function is called
+void updatePhysics(int deltaTime)
+{
+    float dt = deltaTime / 1000.0f; // Convert to seconds
 
-        // Update the up vector
-        upx = newUpx;
-        upy = newUpy;
-        upz = newUpz;
+    // everything of the last step is thrown away at once, the arenas grow here if the last step did not fit
+    resetArena(stepArena);
+    for (int worker = 0; worker < physicsThreadCount; worker++)
+        resetArena(workerArenas[worker]);
+    bool counting = countAllocations;
+    countAllocations = true;
+    long long allocationsBefore = countedAllocations;
+
+    MovePhase move;
+    move.dt = dt;
+    move.impacts = arenaAllocate<Impact>(stepArena, spheres.size());
+    parallelFor((int)spheres.size(), moveSpheresTask, &move);
+
+    // the hard hits become sparks on the render thread
+    for (size_t i = 0; i < spheres.size(); i++)
+        if (move.impacts[i].speed >= minImpactSpeed)
+        {
+            pushImpact(move.impacts[i]);
+            recordImpact(move.impacts[i]);
+        }
 
-        // We make the up vector again the unit vector for the next rotation
-        upLength = sqrt(upx * upx + upy * upy + upz * upz);
-        upx /= upLength;
-        upy /= upLength;
-        upz /= upLength;
-        break;
+    resolveSphereContacts(spheres.data(), (int)spheres.size(), (int)spheres.size()); // the balls bounce off each other
+
+    parallelFor((int)spheres.size(), spinSpheresTask, &dt);
+
+    // a step that allocated is fine while the arenas are still growing, but not once they are big enough
+    long long allocations = countedAllocations - allocationsBefore;
+    stepAllocations.steps++;
+    if (allocations > 0)
+    {
+        stepAllocations.allocatingSteps++;
+        stepAllocations.lastAllocatingStep = stepAllocations.steps;
+        stepAllocations.allocations += allocations;
     }
+    countAllocations = counting;
 
-   
+    // Just to find out the current position for the sphere
+    // cout << "Sphere position: (" << spheres[0].position[0] << ", " << spheres[0].position[1] << ", " << spheres[0].position[2] << ")" << endl;
+}
+
+/// @brief print how many steps touched the heap, after the first few steps it should stay at zero
+void printStepAllocations()
+{
+    printf("heap allocations: %lld in %lld of %lld steps, the last one in step %lld, %lld steps without any since\n",
+           stepAllocations.allocations, stepAllocations.allocatingSteps, stepAllocations.steps,
+           stepAllocations.lastAllocatingStep, stepAllocations.steps - stepAllocations.lastAllocatingStep);
+}
+
+// --- Domain Decomposition ---
+// The room is cut into slabs along the x axis and every slab is simulated by its own process.
+// The processes share one block of memory: every domain has its own spheres, the spheres near its two
+// borders (the halo, copied to the neighbours each step) and the spheres that left it (the migrants).
+
+/// @brief how many processes (slabs) the --domains run uses, 0 means the normal window
+int domainCount = 0;
+/// @brief how many physics steps the --domains run simulates
+int domainSteps = 1000;
+/// @brief the largest difference from the single process run that is still counted as the same result
+float domainTolerance = 1e-4f;
+
+/// @brief what one domain shares with the others, followed in memory by its sphere buffers
+typedef struct
+{
+    int ownedCount;        // how many spheres the domain owns right now
+    int haloCount[2];      // spheres near the left [0] and right [1] border, copied for the neighbour
+    int migrantCount[2];   // spheres that left through the left [0] and right [1] border
+    int minOwned;          // the fewest spheres the domain owned in a step
+    int maxOwned;          // the most spheres the domain owned in a step
+    long long sphereSteps; // sum of the owned spheres over all steps
+    long long contacts;    // touching pairs the domain resolved
+    long long migrations;  // spheres the domain handed to a neighbour
+    double workSeconds;    // time spent simulating
+    double waitSeconds;    // time spent waiting for the other domains
+    int overflow;          // set if a buffer was too small
+} DomainHeader;
+
+#ifdef __linux__
+
+/// @brief the shared memory of the --domains run and where every buffer of it is
+typedef struct
+{
+    char *memory;
+    size_t bytes;
+    size_t headerBytes;   // bytes before the first domain and before the buffers of a domain
+    size_t domainBytes;   // bytes of one domain: header and buffers
+    int capacity;         // how many spheres fit into every buffer
+    pthread_barrier_t *barrier;
+} DomainMemory;
+
+/// @brief the header of a domain inside the shared memory
+DomainHeader *domainHeader(DomainMemory &shared, int domain)
+{
+    return (DomainHeader *)(shared.memory + shared.headerBytes + domain * shared.domainBytes);
+}
+
+/// @brief one of the five sphere buffers of a domain: 0 owned, 1 left halo, 2 right halo, 3 left migrants, 4 right migrants
+Sphere *domainBuffer(DomainMemory &shared, int domain, int buffer)
+{
+    char *start = (char *)domainHeader(shared, domain) + shared.headerBytes;
+    return (Sphere *)(start + (size_t)buffer * shared.capacity * sizeof(Sphere));
+}
+
+/// @brief wait until every domain reached the same point, and count the waiting time for this domain
+void waitForDomains(DomainMemory &shared, DomainHeader *header)
+{
+    double start = nowSeconds();
+    pthread_barrier_wait(shared.barrier);
+    header->waitSeconds += nowSeconds() - start;
+}
+
+/// @brief add a sphere to one of the buffers of a domain if there is still space
+void pushToBuffer(DomainMemory &shared, DomainHeader *header, Sphere *buffer, int &count, const Sphere &sphere)
+{
+    if (count >= shared.capacity)
+    {
+        header->overflow = 1;
+        return;
+    }
+    buffer[count++] = sphere;
+}
+
+/// @brief the loop of one domain process, it simulates the spheres of its slab for all the steps
+/// @param shared the memory shared by all domains
+/// @param domain which slab this process simulates
+/// @param dt the time of a step in seconds
+/// @param haloWidth how close to a border a sphere must be to be copied to the neighbour, the diameter of the largest sphere
+void runDomain(DomainMemory &shared, int domain, float dt, float haloWidth)
+{
+    float slabWidth = cubeSize / domainCount;
+    float low = domain * slabWidth;
+    float high = (domain + 1) * slabWidth;
+    bool hasLeft = domain > 0;
+    bool hasRight = domain < domainCount - 1;
+
+    DomainHeader *header = domainHeader(shared, domain);
+    Sphere *owned = domainBuffer(shared, domain, 0);
+    Sphere *halo[2] = {domainBuffer(shared, domain, 1), domainBuffer(shared, domain, 2)};
+    Sphere *migrants[2] = {domainBuffer(shared, domain, 3), domainBuffer(shared, domain, 4)};
+
+    // the physics workers were not copied into this process, so the domain works alone
+    physicsThreadCount = 1;
+
+    // the spheres the contacts are solved on: our own spheres first, then the halos of the neighbours
+    vector<Sphere> local(3 * shared.capacity);
+
+    for (int step = 0; step < domainSteps; step++)
+    {
+        double start = nowSeconds();
+        resetArena(stepArena);
+        resetArena(workerArenas[0]);
+
+        // move our spheres, the ones that left the slab go to the migrant buffer of their side
+        int kept = 0;
+        header->migrantCount[0] = header->migrantCount[1] = 0;
+        for (int i = 0; i < header->ownedCount; i++)
+        {
+            Sphere &sphere = owned[i];
+            moveSphere(sphere, dt);
+            if (hasLeft && sphere.position[0] < low)
+                pushToBuffer(shared, header, migrants[0], header->migrantCount[0], sphere);
+            else if (hasRight && sphere.position[0] >= high)
+                pushToBuffer(shared, header, migrants[1], header->migrantCount[1], sphere);
+            else
+                owned[kept++] = sphere;
+        }
+        header->migrations += header->migrantCount[0] + header->migrantCount[1];
+        header->ownedCount = kept;
+        header->workSeconds += nowSeconds() - start;
+
+        waitForDomains(shared, header); // every migrant is written
+        start = nowSeconds();
+
+        // take the spheres that came in from the neighbours
+        if (hasLeft)
+        {
+            DomainHeader *left = domainHeader(shared, domain - 1);
+            Sphere *incoming = domainBuffer(shared, domain - 1, 4);
+            for (int i = 0; i < left->migrantCount[1]; i++)
+                pushToBuffer(shared, header, owned, header->ownedCount, incoming[i]);
+        }
+        if (hasRight)
+        {
+            DomainHeader *right = domainHeader(shared, domain + 1);
+            Sphere *incoming = domainBuffer(shared, domain + 1, 3);
+            for (int i = 0; i < right->migrantCount[0]; i++)
+                pushToBuffer(shared, header, owned, header->ownedCount, incoming[i]);
+        }
+        header->minOwned = min(header->minOwned, header->ownedCount);
+        header->maxOwned = max(header->maxOwned, header->ownedCount);
+        header->sphereSteps += header->ownedCount;
+
+        // now every sphere we own is inside the slab, so a sphere of a neighbour can only touch
+        // one of ours if it is less than haloWidth away from the border
+        header->haloCount[0] = header->haloCount[1] = 0;
+        for (int i = 0; i < header->ownedCount; i++)
+        {
+            if (hasLeft && owned[i].position[0] < low + haloWidth)
+                pushToBuffer(shared, header, halo[0], header->haloCount[0], owned[i]);
+            if (hasRight && owned[i].position[0] >= high - haloWidth)
+                pushToBuffer(shared, header, halo[1], header->haloCount[1], owned[i]);
+        }
+        header->workSeconds += nowSeconds() - start;
+
+        waitForDomains(shared, header); // every halo is written
+        start = nowSeconds();
+
+        int count = 0;
+        for (int i = 0; i < header->ownedCount; i++)
+            local[count++] = owned[i];
+        if (hasLeft)
+        {
+            DomainHeader *left = domainHeader(shared, domain - 1);
+            Sphere *leftHalo = domainBuffer(shared, domain - 1, 2);
+            for (int i = 0; i < left->haloCount[1]; i++)
+                local[count++] = leftHalo[i];
+        }
+        if (hasRight)
+        {
+            DomainHeader *right = domainHeader(shared, domain + 1);
+            Sphere *rightHalo = domainBuffer(shared, domain + 1, 1);
+            for (int i = 0; i < right->haloCount[0]; i++)
+                local[count++] = rightHalo[i];
+        }
+        header->contacts += resolveSphereContacts(local.data(), count, header->ownedCount);
+
+        for (int i = 0; i < header->ownedCount; i++)
+        {
+            owned[i] = local[i];
+            spinSphere(owned[i], dt);
+        }
+        header->workSeconds += nowSeconds() - start;
+    }
+}
+
+/// @brief simulate the room split into domainCount slabs, each in its own process, and compare the result with a single process run.
+/// It prints how many spheres and how much time every domain had, so an imbalance between the slabs can be seen.
+/// @return 0 if the two runs give the same result within domainTolerance
+int runDomainDecomposition()
+{
+    const int stepMilliseconds = animationSpeed;
+    const float dt = stepMilliseconds / 1000.0f;
+
+    if (spheres.empty())
+        return 0;
+    float slabWidth = cubeSize / domainCount;
+    float haloWidth = 0.0f;
+    for (const Sphere &sphere : spheres)
+        haloWidth = max(haloWidth, 2.0f * sphere.radius);
+    if (slabWidth < haloWidth)
+    {
+        printf("The slabs are %.3f wide, but they must be at least one sphere (%.3f) wide. Use fewer domains or a larger room.\n",
+               slabWidth, haloWidth);
+        return 1;
+    }
+
+    // the single process run we compare with
+    vector<Sphere> initial = spheres;
+    double start = nowSeconds();
+    for (int step = 0; step < domainSteps; step++)
+        updatePhysics(stepMilliseconds);
+    double singleSeconds = nowSeconds() - start;
+    printStepAllocations();
+    vector<Sphere> reference = spheres;
+    spheres = initial;
+
+    // the shared memory: a barrier and then every domain with its header and five sphere buffers.
+    // The buffers can hold all the spheres, but only the pages that are really written take memory.
+    DomainMemory shared;
+    shared.capacity = (int)spheres.size();
+    shared.headerBytes = (max(sizeof(DomainHeader), sizeof(pthread_barrier_t)) + 63) / 64 * 64;
+    shared.domainBytes = shared.headerBytes + 5 * (size_t)shared.capacity * sizeof(Sphere);
+    shared.domainBytes = (shared.domainBytes + 63) / 64 * 64;
+    shared.bytes = shared.headerBytes + domainCount * shared.domainBytes;
+    shared.memory = (char *)mmap(NULL, shared.bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared.memory == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    shared.barrier = (pthread_barrier_t *)shared.memory;
+    pthread_barrierattr_t attributes;
+    pthread_barrierattr_init(&attributes);
+    pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(shared.barrier, &attributes, domainCount);
+    pthread_barrierattr_destroy(&attributes);
+
+    for (int d = 0; d < domainCount; d++)
+    {
+        DomainHeader *header = domainHeader(shared, d);
+        memset(header, 0, sizeof(DomainHeader));
+        header->minOwned = INT_MAX;
+    }
+    for (const Sphere &sphere : spheres)
+    {
+        int d = min(domainCount - 1, max(0, (int)(sphere.position[0] / slabWidth)));
+        DomainHeader *header = domainHeader(shared, d);
+        domainBuffer(shared, d, 0)[header->ownedCount++] = sphere;
+    }
+
+    start = nowSeconds();
+    vector<pid_t> children;
+    for (int d = 0; d < domainCount; d++)
+    {
+        pid_t child = fork();
+        if (child < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0)
+        {
+            runDomain(shared, d, dt, haloWidth);
+            _exit(0);
+        }
+        children.push_back(child);
+    }
+    int failed = 0;
+    for (pid_t child : children)
+    {
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    double domainSeconds = nowSeconds() - start;
+
+    // Per domain load
+    printf("%d spheres, %d steps, %d domains along x (slabs %.3f wide)\n", (int)spheres.size(), domainSteps, domainCount, slabWidth);
+    printf("domain  avg spheres  min  max  contacts  migrations  work(s)  wait(s)\n");
+    double meanLoad = 0.0, maxLoad = 0.0;
+    for (int d = 0; d < domainCount; d++)
+    {
+        DomainHeader *header = domainHeader(shared, d);
+        double average = (double)header->sphereSteps / domainSteps;
+        meanLoad += average / domainCount;
+        maxLoad = max(maxLoad, average);
+        printf("%6d  %11.1f  %3d  %3d  %8lld  %10lld  %7.3f  %7.3f\n", d, average, header->minOwned, header->maxOwned,
+               header->contacts, header->migrations, header->workSeconds, header->waitSeconds);
+        if (header->overflow)
+            failed = 1;
+    }
+    printf("load imbalance (busiest / average): %.2f\n", meanLoad > 0.0 ? maxLoad / meanLoad : 1.0);
+    printf("single process: %.3f s, %d processes: %.3f s\n", singleSeconds, domainCount, domainSeconds);
+
+    // Compare with the single process run, sphere by sphere
+    vector<Sphere> result(spheres.size());
+    vector<bool> found(spheres.size(), false);
+    for (int d = 0; d < domainCount; d++)
+    {
+        DomainHeader *header = domainHeader(shared, d);
+        Sphere *owned = domainBuffer(shared, d, 0);
+        for (int i = 0; i < header->ownedCount; i++)
+        {
+            result[owned[i].id] = owned[i];
+            found[owned[i].id] = true;
+        }
+    }
+    float positionError = 0.0f, velocityError = 0.0f;
+    int missing = 0;
+    for (size_t i = 0; i < reference.size(); i++)
+    {
+        if (!found[i])
+        {
+            missing++;
+            continue;
+        }
+        for (int axis = 0; axis < 3; axis++)
+        {
+            positionError = max(positionError, fabs(result[i].position[axis] - reference[i].position[axis]));
+            velocityError = max(velocityError, fabs(result[i].velocity[axis] - reference[i].velocity[axis]));
+        }
+    }
+    spheres = result;
+
+    pthread_barrier_destroy(shared.barrier);
+    munmap(shared.memory, shared.bytes);
+
+    bool same = !failed && missing == 0 && positionError <= domainTolerance && velocityError <= domainTolerance;
+    printf("largest difference to the single process run: position %g, velocity %g, missing spheres %d -> %s\n",
+           positionError, velocityError, missing, same ? "same result" : "DIFFERENT");
+    return same ? 0 : 1;
+}
+
+#else
+
+int runDomainDecomposition()
+{
+    printf("--domains needs fork and shared memory, it is only available on Linux\n");
+    return 1;
+}
+
+#endif
+
+// --- Impact Particles ---
+// The sparks of the impacts live in a pool of fixed size that is allocated once. Every value of a particle has
+// its own array (structure of arrays), so the update handles four particles at once with SSE. Free slots are
+// kept on a stack and reused, and the update writes the position and color of every slot into one array
+// that is drawn as point sprites with a single draw call. Dead slots are drawn fully transparent.
+// The particles are only for the eye, so they live on the render thread and are moved once per frame.
+
+/// @brief how many particles the pool holds, it can be changed with --particles
+int particleCapacity = 1 << 16;
+/// @brief how many sparks an impact makes for every unit of impact speed
+float particlesPerSpeed = 12.0f;
+/// @brief the most sparks one impact makes
+int maxParticlesPerImpact = 200;
+/// @brief how much of its speed a spark keeps when it bounces off the floor
+float particleBounce = 0.4f;
+/// @brief how much of its speed a spark keeps every second because of the air
+float particleDrag = 0.6f;
+/// @brief the last seconds of its life, when a spark fades out
+float particleFadeTime = 0.5f;
+/// @brief the size of a spark on the screen in pixels, when it is 10 units away from the camera
+float particlePointSize = 6.0f;
+
+/// @brief what is drawn for one particle
+typedef struct
+{
+    float position[3];
+    unsigned char color[4];
+} ParticleVertex;
+
+/// @brief all the particles
+typedef struct
+{
+    int capacity;             // how many slots there are, a multiple of 4
+    float *positionX, *positionY, *positionZ;
+    float *velocityX, *velocityY, *velocityZ;
+    float *life;              // seconds the particle still lives, 0 or less means the slot is free
+    ParticleVertex *vertices; // what is drawn for every slot
+    int *freeSlots;           // stack of the free slots, the lowest slot is on top
+    int freeCount;
+    int used;                 // only the slots below this were ever used, so only they are moved and drawn
+    int alive;                // particles alive right now
+    long long spawned;        // particles made so far
+    long long dropped;        // particles not made because the pool was full
+    double updateSeconds;     // time spent moving the particles
+    long long updates;
+    unsigned int seed;        // for randomFloat
+    GLuint vertexBuffer;      // the vertices on the GPU
+    GLuint spriteTexture;     // the round spot drawn for each particle
+} ParticlePool;
+
+ParticlePool particles;
+
+/// @brief allocate all the slots of the pool, this is the only time the pool allocates memory
+void initParticlePool(ParticlePool &pool, int capacity)
+{
+    pool.capacity = (max(4, capacity) + 3) / 4 * 4;
+    float **arrays[7] = {&pool.positionX, &pool.positionY, &pool.positionZ, &pool.velocityX, &pool.velocityY, &pool.velocityZ, &pool.life};
+    for (float **array : arrays)
+    {
+        *array = new float[pool.capacity];
+        fill(*array, *array + pool.capacity, 0.0f);
+    }
+    pool.vertices = new ParticleVertex[pool.capacity];
+    memset(pool.vertices, 0, pool.capacity * sizeof(ParticleVertex));
+    pool.freeSlots = new int[pool.capacity];
+    for (int i = 0; i < pool.capacity; i++)
+        pool.freeSlots[i] = pool.capacity - 1 - i;
+    pool.freeCount = pool.capacity;
+    pool.used = 0;
+    pool.alive = 0;
+    pool.spawned = pool.dropped = 0;
+    pool.updateSeconds = 0.0;
+    pool.updates = 0;
+    pool.seed = 777;
+    pool.vertexBuffer = 0;
+    pool.spriteTexture = 0;
+}
+
+/// @brief make the vertex buffer and the sprite texture, it needs the GL context
+void initParticleGraphics(ParticlePool &pool)
+{
+    glGenBuffers(1, &pool.vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, pool.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, pool.capacity * sizeof(ParticleVertex), NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // a white spot that fades out towards its border
+    const int size = 16;
+    unsigned char spot[size * size * 4];
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            float dx = (x + 0.5f) / size * 2.0f - 1.0f;
+            float dy = (y + 0.5f) / size * 2.0f - 1.0f;
+            float falloff = max(0.0f, 1.0f - sqrt(dx * dx + dy * dy));
+            unsigned char *texel = spot + 4 * (y * size + x);
+            texel[0] = texel[1] = texel[2] = 255;
+            texel[3] = (unsigned char)(255.0f * falloff * falloff);
+        }
+    glGenTextures(1, &pool.spriteTexture);
+    glBindTexture(GL_TEXTURE_2D, pool.spriteTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, spot);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/// @brief make the sparks of one impact, they fly away from the surface in a cone
+void spawnParticles(ParticlePool &pool, const Impact &impact)
+{
+    int count = min(maxParticlesPerImpact, (int)(impact.speed * particlesPerSpeed));
+    for (int k = 0; k < count; k++)
+    {
+        if (pool.freeCount == 0)
+        {
+            pool.dropped += count - k; // the pool is full, these sparks are not made
+            return;
+        }
+        int slot = pool.freeSlots[--pool.freeCount];
+        pool.used = max(pool.used, slot + 1);
+
+        // a random direction: mostly along the normal of the surface, spread sideways
+        float direction[3];
+        for (int axis = 0; axis < 3; axis++)
+            direction[axis] = impact.normal[axis] * randomFloat(pool.seed, 0.3f, 1.0f) + randomFloat(pool.seed, -0.7f, 0.7f) * (1.0f - fabs(impact.normal[axis]));
+        float speed = impact.speed * randomFloat(pool.seed, 0.2f, 0.8f);
+
+        pool.positionX[slot] = impact.position[0] + impact.normal[0] * 0.02f;
+        pool.positionY[slot] = impact.position[1] + impact.normal[1] * 0.02f;
+        pool.positionZ[slot] = impact.position[2] + impact.normal[2] * 0.02f;
+        pool.velocityX[slot] = direction[0] * speed;
+        pool.velocityY[slot] = direction[1] * speed;
+        pool.velocityZ[slot] = direction[2] * speed;
+        pool.life[slot] = randomFloat(pool.seed, 0.4f, 1.2f);
+        pool.alive++;
+        pool.spawned++;
+    }
+}
+
+/// @brief give a slot back to the pool
+void freeParticle(ParticlePool &pool, int slot)
+{
+    pool.freeSlots[pool.freeCount++] = slot;
+    pool.alive--;
+}
+
+/// @brief the color of a spark: white-yellow when new, red and transparent when it fades out
+/// @return the color packed as the bytes r, g, b, a
+unsigned int particleColor(float life)
+{
+    float fade = min(max(life / particleFadeTime, 0.0f), 1.0f);
+    unsigned int red = 255;
+    unsigned int green = (unsigned int)(60.0f + 195.0f * fade);
+    unsigned int blue = (unsigned int)(40.0f + 120.0f * fade * fade);
+    unsigned int alpha = (unsigned int)(255.0f * fade);
+    return red | green << 8 | blue << 16 | alpha << 24;
+}
+
+/// @brief move all the particles for dt seconds and write what is drawn for them
+void updateParticles(ParticlePool &pool, float dt)
+{
+    double start = nowSeconds();
+    float fall = gravity * dt;
+    float drag = pow(particleDrag, dt);
+    int used = (pool.used + 3) / 4 * 4;
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 fall4 = _mm_set1_ps(fall);
+    const __m128 drag4 = _mm_set1_ps(drag);
+    const __m128 dt4 = _mm_set1_ps(dt);
+    const __m128 bounce4 = _mm_set1_ps(-particleBounce);
+    const __m128 floorDrag4 = _mm_set1_ps(particleBounce);
+    const __m128 fade4 = _mm_set1_ps(1.0f / particleFadeTime);
+    for (; i < used; i += 4)
+    {
+        __m128 life = _mm_loadu_ps(pool.life + i);
+        __m128 alive = _mm_cmpgt_ps(life, zero);
+
+        // gravity and air
+        __m128 vx = _mm_mul_ps(_mm_loadu_ps(pool.velocityX + i), drag4);
+        __m128 vy = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(pool.velocityY + i), fall4), drag4);
+        __m128 vz = _mm_mul_ps(_mm_loadu_ps(pool.velocityZ + i), drag4);
+        __m128 x = _mm_add_ps(_mm_loadu_ps(pool.positionX + i), _mm_mul_ps(vx, dt4));
+        __m128 y = _mm_add_ps(_mm_loadu_ps(pool.positionY + i), _mm_mul_ps(vy, dt4));
+        __m128 z = _mm_add_ps(_mm_loadu_ps(pool.positionZ + i), _mm_mul_ps(vz, dt4));
+
+        // the ones below the floor bounce back up and lose some speed
+        __m128 below = _mm_cmplt_ps(y, zero);
+        y = _mm_max_ps(y, zero);
+        vy = _mm_or_ps(_mm_and_ps(below, _mm_mul_ps(vy, bounce4)), _mm_andnot_ps(below, vy));
+        __m128 slide = _mm_or_ps(_mm_and_ps(below, floorDrag4), _mm_andnot_ps(below, one));
+        vx = _mm_mul_ps(vx, slide);
+        vz = _mm_mul_ps(vz, slide);
+
+        __m128 newLife = _mm_sub_ps(life, dt4);
+        _mm_storeu_ps(pool.positionX + i, x);
+        _mm_storeu_ps(pool.positionY + i, y);
+        _mm_storeu_ps(pool.positionZ + i, z);
+        _mm_storeu_ps(pool.velocityX + i, vx);
+        _mm_storeu_ps(pool.velocityY + i, vy);
+        _mm_storeu_ps(pool.velocityZ + i, vz);
+        _mm_storeu_ps(pool.life + i, newLife);
+
+        // the slots whose particle died in this update go back on the free stack
+        int died = _mm_movemask_ps(_mm_and_ps(alive, _mm_cmple_ps(newLife, zero)));
+        while (died)
+        {
+            int lane = __builtin_ctz(died);
+            freeParticle(pool, i + lane);
+            died &= died - 1;
+        }
+
+        // the color, same as particleColor but for four particles
+        __m128 fade = _mm_min_ps(_mm_max_ps(_mm_mul_ps(newLife, fade4), zero), one);
+        __m128i red = _mm_set1_epi32(255);
+        __m128i green = _mm_cvttps_epi32(_mm_add_ps(_mm_set1_ps(60.0f), _mm_mul_ps(_mm_set1_ps(195.0f), fade)));
+        __m128i blue = _mm_cvttps_epi32(_mm_add_ps(_mm_set1_ps(40.0f), _mm_mul_ps(_mm_set1_ps(120.0f), _mm_mul_ps(fade, fade))));
+        __m128i alpha = _mm_cvttps_epi32(_mm_mul_ps(_mm_set1_ps(255.0f), fade));
+        __m128i color = _mm_or_si128(_mm_or_si128(red, _mm_slli_epi32(green, 8)),
+                                     _mm_or_si128(_mm_slli_epi32(blue, 16), _mm_slli_epi32(alpha, 24)));
+
+        // turn the four x, y, z and color values into four vertices
+        __m128 c = _mm_castsi128_ps(color);
+        _MM_TRANSPOSE4_PS(x, y, z, c);
+        _mm_storeu_ps((float *)(pool.vertices + i), x);
+        _mm_storeu_ps((float *)(pool.vertices + i + 1), y);
+        _mm_storeu_ps((float *)(pool.vertices + i + 2), z);
+        _mm_storeu_ps((float *)(pool.vertices + i + 3), c);
+    }
+#endif
+
+    // the same without SIMD, for the processors without SSE2
+    for (; i < used; i++)
+    {
+        bool alive = pool.life[i] > 0.0f;
+        pool.velocityX[i] *= drag;
+        pool.velocityY[i] = (pool.velocityY[i] + fall) * drag;
+        pool.velocityZ[i] *= drag;
+        pool.positionX[i] += pool.velocityX[i] * dt;
+        pool.positionY[i] += pool.velocityY[i] * dt;
+        pool.positionZ[i] += pool.velocityZ[i] * dt;
+        if (pool.positionY[i] < 0.0f)
+        {
+            pool.positionY[i] = 0.0f;
+            pool.velocityY[i] *= -particleBounce;
+            pool.velocityX[i] *= particleBounce;
+            pool.velocityZ[i] *= particleBounce;
+        }
+        pool.life[i] -= dt;
+        if (alive && pool.life[i] <= 0.0f)
+            freeParticle(pool, i);
+
+        ParticleVertex &vertex = pool.vertices[i];
+        vertex.position[0] = pool.positionX[i];
+        vertex.position[1] = pool.positionY[i];
+        vertex.position[2] = pool.positionZ[i];
+        unsigned int color = particleColor(pool.life[i]);
+        memcpy(vertex.color, &color, 4);
+    }
+
+    pool.updateSeconds += nowSeconds() - start;
+    pool.updates++;
+}
+
+/// @brief draw all the used slots as point sprites with one draw call, the dead ones are transparent
+void drawParticles(ParticlePool &pool)
+{
+    if (pool.used == 0 || pool.vertexBuffer == 0)
+        return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, pool.vertexBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, pool.used * sizeof(ParticleVertex), pool.vertices);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(ParticleVertex), (void *)offsetof(ParticleVertex, position));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(ParticleVertex), (void *)offsetof(ParticleVertex, color));
+
+    // the sparks glow: they are added to what is behind them and do not hide each other
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    glDepthMask(GL_FALSE);
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.0f);
+
+    // every point is drawn as a small textured square, smaller when it is further away (size / (0.1 * distance))
+    GLfloat attenuation[] = {0.0f, 0.0f, 0.01f};
+    glPointParameterfv(GL_POINT_DISTANCE_ATTENUATION, attenuation);
+    glPointParameterf(GL_POINT_SIZE_MAX, 3.0f * particlePointSize);
+    glPointSize(particlePointSize);
+    glEnable(GL_POINT_SPRITE);
+    glTexEnvi(GL_POINT_SPRITE, GL_COORD_REPLACE, GL_TRUE);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, pool.spriteTexture);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+    glDrawArrays(GL_POINTS, 0, pool.used);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+    glDisable(GL_POINT_SPRITE);
+    GLfloat noAttenuation[] = {1.0f, 0.0f, 0.0f};
+    glPointParameterfv(GL_POINT_DISTANCE_ATTENUATION, noAttenuation);
+    glPointSize(1.0f);
+    glDisable(GL_ALPHA_TEST);
+    glDepthMask(GL_TRUE);
+    glDisable(GL_BLEND);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/// @brief when set, the sparks move this many seconds every frame instead of the time since the last frame,
+/// so the frames of a --headless run come out the same every time
+float particleTimeStep = 0.0f;
+
+/// @brief turn the new impacts into sparks and move the sparks, called once per frame by display()
+void animateParticles()
+{
+    static double lastFrame = nowSeconds();
+    double now = nowSeconds();
+    float dt = (float)min(now - lastFrame, 0.05); // after a long pause the sparks do not jump
+    lastFrame = now;
+    if (particleTimeStep > 0.0f)
+        dt = particleTimeStep;
+
+    Impact impact;
+    while (popImpact(impact))
+        spawnParticles(particles, impact);
+    updateParticles(particles, dt);
+}
+
+/// @brief print how many sparks there are and how long moving them takes
+void printParticleStats()
+{
+    printf("particles: %d alive of %d, %lld made, %lld not made because the pool was full, %lld impacts lost, %.3f ms per update\n",
+           particles.alive, particles.capacity, particles.spawned, particles.dropped, droppedImpacts.load(),
+           particles.updates ? particles.updateSeconds * 1e3 / particles.updates : 0.0);
+}
+
+/// @brief keep the pool full of sparks for a number of frames without a window, and check that no frame allocates
+/// @param frames how many frames of 1/60 second to simulate
+/// @return 0 if no frame allocated memory
+int runParticleBenchmark(int frames)
+{
+    initParticlePool(particles, particleCapacity);
+    unsigned int seed = 99;
+    float dt = 1.0f / 60.0f;
+    int minAlive = INT_MAX;
+    long long aliveSum = 0;
+
+    countAllocations = true;
+    long long allocationsBefore = countedAllocations;
+    double start = nowSeconds();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        // impacts at random places on the floor until the pool is full again
+        while (particles.freeCount >= maxParticlesPerImpact)
+        {
+            Impact impact = {{randomFloat(seed, 0.0f, cubeSize), 0.0f, randomFloat(seed, 0.0f, cubeSize)}, {0.0f, 1.0f, 0.0f}, 1000.0f};
+            spawnParticles(particles, impact);
+        }
+        updateParticles(particles, dt);
+        minAlive = min(minAlive, particles.alive);
+        aliveSum += particles.alive;
+    }
+    double seconds = nowSeconds() - start;
+    long long allocations = countedAllocations - allocationsBefore;
+    countAllocations = false;
+
+    printf("%d frames with a pool of %d particles: %d alive at least, %.0f on average\n", frames, particles.capacity, minAlive, (double)aliveSum / frames);
+    printf("%.3f ms per frame in total, %.3f ms of it moving the particles, %lld heap allocations\n",
+           seconds * 1e3 / frames, particles.updateSeconds * 1e3 / particles.updates, allocations);
+    return allocations == 0 ? 0 : 1;
+}
+
+// --- Simulation Thread ---
+// The physics runs on its own thread, so a slow frame does not slow down the physics and a slow step does not
+// slow down the drawing. After every step the simulation hands a copy of the scene to display() through a
+// triple buffer: one slot is written by the simulation, one is read by display() and the one in the middle
+// holds the newest finished state. Both sides only swap their slot with the middle one, so nobody ever waits.
+
+/// @brief what the simulation thread hands to display() after every step
+typedef struct
+{
+    vector<Sphere> spheres; // the spheres after the step
+    // the centers and radii again, one array each in the order of spheres, for cullSpheres
+    vector<float> boundsX, boundsY, boundsZ, boundsRadius;
+    vector<int> blockStart;   // the balls of block b are blockStart[b] .. blockStart[b + 1] - 1
+    vector<float> blockBoxes; // the smallest box around the balls of every block, low x, y, z then high x, y, z
+    long long step;         // how many steps were simulated so far
+    long long sphereResets; // how many times the spheres were put back with key r, the spheres are copied when it changes
+    float velocityChange;   // the speed keys + and - added to every axis of every sphere so far
+    double publishTime;     // when the state was handed over, in nowSeconds()
+    GLfloat eye[3];         // Camera position when the state was handed over
+    GLfloat center[3];      // Look-at point
+    GLfloat up[3];          // Up vector
+} SceneState;
+
+/// @brief the three slots of the triple buffer
+SceneState sceneStates[3];
+
+/// @brief set by --gpu-physics: the spheres are moved by a compute shader on the render thread (see GPU Physics),
+/// the simulation thread then only counts the steps and hands over the camera and the keys that change the spheres
+bool useGpuPhysics = false;
+/// @brief how many times key r put the spheres back, only the simulation thread writes it
+long long sphereResets = 0;
+/// @brief the speed keys + and - added to every axis of every sphere, only the simulation thread writes it
+float velocityChange = 0.0f;
+
+/// @brief cells of the sorting grid along every axis of the room, a power of two
+const int cullSortGridSize = 16;
+/// @brief the spheres are sorted again once the boxes of the blocks are this many times as big as after the last sort
+const float cullResortGrowth = 1.5f;
+
+/// @brief the order of the spheres for culling, only used by the simulation thread
+typedef struct
+{
+    vector<Sphere> sorted;  // where the spheres are sorted into, it keeps its memory
+    vector<int> codes;      // the cell of every sphere along the curve
+    vector<int> codeNext;   // the next place of every cell in sorted while sorting
+    vector<int> blockStart; // where the balls of every cell started after the last sort, they are the blocks of cullSpheres
+    float sortedExtent;     // the mean size of a block right after the last sort
+    float extent;           // the mean size of a block at the last pack
+    long long sorts;        // how many times the spheres were sorted
+} CullOrder;
+
+CullOrder cullOrder;
+
+/// @brief the place of a cell along a Z-order curve, the bits of x, y and z take turns
+int mortonCode(int x, int y, int z)
+{
+    int code = 0;
+    for (int bit = 0; (1 << bit) < cullSortGridSize; bit++)
+        code |= (((x >> bit) & 1) << (3 * bit)) | (((y >> bit) & 1) << (3 * bit + 1)) | (((z >> bit) & 1) << (3 * bit + 2));
+    return code;
+}
+
+/// @brief sort the spheres of the simulation along a Z-order curve through the cells of a grid with a counting
+/// sort, so balls next to each other in the array are also close in the room. The physics does not depend on
+/// the order of the spheres (see resolveSphereContacts), and the balls keep their ids.
+void sortSpheresForCulling()
+{
+    CullOrder &order = cullOrder;
+    int count = (int)spheres.size();
+    const int codes = cullSortGridSize * cullSortGridSize * cullSortGridSize;
+    order.codes.resize(count);
+    order.blockStart.assign(codes + 1, 0);
+    float cellsPerUnit = cullSortGridSize / cubeSize;
+    for (int i = 0; i < count; i++)
+    {
+        int cell[3];
+        for (int axis = 0; axis < 3; axis++)
+            cell[axis] = min(max((int)(spheres[i].position[axis] * cellsPerUnit), 0), cullSortGridSize - 1);
+        order.codes[i] = mortonCode(cell[0], cell[1], cell[2]);
+        order.blockStart[order.codes[i] + 1]++;
+    }
+    for (int code = 0; code < codes; code++)
+        order.blockStart[code + 1] += order.blockStart[code];
+    order.codeNext.assign(order.blockStart.begin(), order.blockStart.end() - 1);
+    order.sorted.resize(count);
+    for (int i = 0; i < count; i++)
+        order.sorted[order.codeNext[order.codes[i]]++] = spheres[i];
+    spheres.swap(order.sorted);
+    order.sortedExtent = 0.0f; // the next pack measures it
+    order.sorts++;
+}
+
+/// @brief sort the spheres again if the ball count changed or the balls moved so far that the boxes of the blocks
+/// grew too much since the last sort, between sorts the order of the last one is good enough
+void keepSpheresSortedForCulling()
+{
+    CullOrder &order = cullOrder;
+    if (order.sorted.size() != spheres.size() || order.extent > cullResortGrowth * order.sortedExtent)
+        sortSpheresForCulling();
+}
+
+/// @brief copy the centers and radii of the spheres into one array each and find the box around the balls of every
+/// block, so cullSpheres can throw away or keep whole blocks at once. A block is the run of balls that were in one
+/// cell at the last sort; they drift apart until the next one. It is one pass in the order of the spheres.
+void packSphereBounds(SceneState &state)
+{
+    int count = (int)spheres.size();
+    int blocks = (int)cullOrder.blockStart.size() - 1;
+    state.blockStart.assign(cullOrder.blockStart.begin(), cullOrder.blockStart.end());
+    state.boundsX.resize(count);
+    state.boundsY.resize(count);
+    state.boundsZ.resize(count);
+    state.boundsRadius.resize(count);
+    state.blockBoxes.resize(6 * blocks);
+
+    float extent = 0.0f;
+    int filled = 0;
+    for (int block = 0; block < blocks; block++)
+    {
+        float *box = &state.blockBoxes[6 * block];
+        box[0] = box[1] = box[2] = FLT_MAX;
+        box[3] = box[4] = box[5] = -FLT_MAX;
+        int first = state.blockStart[block], last = state.blockStart[block + 1];
+        if (first == last)
+            continue;
+        filled++;
+        for (int i = first; i < last; i++)
+        {
+            const Sphere &sphere = spheres[i];
+            state.boundsX[i] = sphere.position[0];
+            state.boundsY[i] = sphere.position[1];
+            state.boundsZ[i] = sphere.position[2];
+            state.boundsRadius[i] = sphere.radius;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                box[axis] = min(box[axis], sphere.position[axis] - sphere.radius);
+                box[axis + 3] = max(box[axis + 3], sphere.position[axis] + sphere.radius);
+            }
+        }
+        extent += max(box[3] - box[0], max(box[4] - box[1], box[5] - box[2]));
+    }
+    cullOrder.extent = extent / max(filled, 1);
+    if (cullOrder.sortedExtent == 0.0f)
+        cullOrder.sortedExtent = cullOrder.extent;
+}
+
+/// @brief the slot only the simulation thread writes
+int writeSlot = 0;
+/// @brief the slot only display() reads
+int readSlot = 1;
+/// @brief the slot in the middle: the lowest two bits are its index, newStateFlag is set while display() has not taken it yet
+atomic<int> middleSlot(2);
+const int newStateFlag = 4;
+
+/// @brief the thread that runs updatePhysics
+thread simulationThread;
+/// @brief set to false to make the simulation thread end
+atomic<bool> simulationRunning(false);
+
+/// @brief how long each side spent on its own work and on the other side, written by one thread and read for the report
+typedef struct
+{
+    atomic<long long> steps;              // steps simulated
+    atomic<long long> statesPublished;    // states handed to display()
+    atomic<long long> statesDropped;      // states replaced by a newer one before display() took them
+    atomic<long long> stepNanoseconds;    // time spent in updatePhysics
+    atomic<long long> publishNanoseconds; // time the simulation spent handing states over
+    long long frames;                     // frames drawn
+    long long staleFrames;                // frames drawn with no new state, display() had to wait for the simulation
+    double acquireSeconds;                // time display() spent taking the newest state
+    double drawSeconds;                   // time display() spent drawing
+    double stateAgeSeconds;               // sum of how old the drawn states were
+    double maxStateAgeSeconds;            // the oldest state that was drawn
+} ThreadTimings;
+
+ThreadTimings threadTimings;
+
+/// @brief copy the spheres into the simulation's slot and swap it with the middle slot
+/// @param step how many steps were simulated so far
+void publishSceneState(long long step)
+{
+    double start = nowSeconds();
+    SceneState &state = sceneStates[writeSlot];
+    if (!useGpuPhysics)
+    {
+        keepSpheresSortedForCulling();
+        state.spheres.assign(spheres.begin(), spheres.end()); // the slot keeps its memory, so this only copies
+        packSphereBounds(state);
+    }
+    else if (state.sphereResets != sphereResets)
+        state.spheres.assign(spheres.begin(), spheres.end()); // the spheres only change on the CPU when they are put back
+    state.step = step;
+    state.sphereResets = sphereResets;
+    state.velocityChange = velocityChange;
+    state.eye[0] = eyex, state.eye[1] = eyey, state.eye[2] = eyez;
+    state.center[0] = centerx, state.center[1] = centery, state.center[2] = centerz;
+    state.up[0] = upx, state.up[1] = upy, state.up[2] = upz;
+    state.publishTime = nowSeconds();
+    recordStep(step);
+
+    int previous = middleSlot.exchange(writeSlot | newStateFlag, memory_order_acq_rel);
+    if (previous & newStateFlag)
+        threadTimings.statesDropped++; // display() never saw the state we just replaced
+    writeSlot = previous & 3;
+
+    threadTimings.statesPublished++;
+    threadTimings.publishNanoseconds += (long long)((nowSeconds() - start) * 1e9);
+}
+
+/// @brief take the newest finished state if there is one, never waits for the simulation
+/// @return the state display() should draw
+const SceneState &acquireSceneState()
+{
+    double start = nowSeconds();
+    if (middleSlot.load(memory_order_acquire) & newStateFlag)
+        readSlot = middleSlot.exchange(readSlot, memory_order_acq_rel) & 3;
+    else
+        threadTimings.staleFrames++;
+    threadTimings.acquireSeconds += nowSeconds() - start;
+    return sceneStates[readSlot];
+}
+
+// --- Input Commands ---
+// The GLUT callbacks run on the render thread, but the spheres, the pause flag and the camera belong to the
+// simulation thread. So key presses and mouse clicks are put into a bounded queue as commands, and the
+// simulation applies them at the start of its next step. The queue is the bounded queue by Dmitry Vyukov:
+// every cell has a sequence number telling whether it is free for a writer or holds a command for the reader,
+// so any number of threads can add commands without a lock while the simulation takes them out.
+
+/// @brief what kind of input a command carries
+enum CommandType
+{
+    KEY_COMMAND,         // a normal key, handled by applyKey
+    SPECIAL_KEY_COMMAND, // an arrow or page key, handled by applySpecialKey
+    MOUSE_COMMAND        // a mouse button or the mouse wheel
+};
+
+/// @brief one input event waiting for the simulation thread
+typedef struct
+{
+    CommandType type;
+    int key;            // the key, or the mouse button
+    int state;          // GLUT_DOWN or GLUT_UP for mouse buttons
+    double enqueueTime; // when the command was put into the queue, in nowSeconds()
+} Command;
+
+/// @brief how many commands fit into the queue, it must be a power of two
+const int commandQueueSize = 256;
+
+/// @brief one cell of the command queue
+typedef struct
+{
+    atomic<unsigned int> sequence;
+    Command command;
+} CommandCell;
+
+CommandCell commandQueue[commandQueueSize];
+/// @brief the next position a writer takes
+atomic<unsigned int> commandWritePosition(0);
+/// @brief the next position the simulation reads, only the simulation thread uses it
+unsigned int commandReadPosition = 0;
+
+/// @brief how long the commands waited in the queue, only changed by the simulation thread
+typedef struct
+{
+    atomic<long long> applied;   // commands applied
+    atomic<long long> dropped;   // commands thrown away because the queue was full
+    atomic<long long> totalNanoseconds;
+    atomic<long long> maxNanoseconds;
+    atomic<long long> histogram[8]; // waiting time below 0.1, 0.5, 1, 2, 5, 10, 20 ms and above
+} CommandLatency;
+
+CommandLatency commandLatency;
+const double commandLatencyLimits[7] = {0.1e-3, 0.5e-3, 1e-3, 2e-3, 5e-3, 10e-3, 20e-3};
+
+/// @brief give every cell its starting sequence number, must be called before the first command
+void initCommandQueue()
+{
+    for (int i = 0; i < commandQueueSize; i++)
+        commandQueue[i].sequence.store(i, memory_order_relaxed);
+}
+
+/// @brief put a command into the queue, it can be called from any thread
+/// @return false if the queue was full and the command was thrown away
+bool pushCommand(CommandType type, int key, int state = 0)
+{
+    unsigned int position = commandWritePosition.load(memory_order_relaxed);
+    while (true)
+    {
+        CommandCell &cell = commandQueue[position & (commandQueueSize - 1)];
+        unsigned int sequence = cell.sequence.load(memory_order_acquire);
+        int difference = (int)(sequence - position);
+        if (difference == 0)
+        {
+            // the cell is free, try to claim it before another writer does
+            if (commandWritePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+            {
+                cell.command.type = type;
+                cell.command.key = key;
+                cell.command.state = state;
+                cell.command.enqueueTime = nowSeconds();
+                cell.sequence.store(position + 1, memory_order_release); // now the reader can take it
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            commandLatency.dropped++; // the simulation has not taken the command a full queue ago
+            return false;
+        }
+        else
+            position = commandWritePosition.load(memory_order_relaxed); // another writer was faster
+    }
+}
+
+/// @brief take the next command out of the queue, only the simulation thread calls it
+/// @return false if the queue is empty
+bool popCommand(Command &command)
+{
+    CommandCell &cell = commandQueue[commandReadPosition & (commandQueueSize - 1)];
+    if (cell.sequence.load(memory_order_acquire) != commandReadPosition + 1)
+        return false;
+    command = cell.command;
+    cell.sequence.store(commandReadPosition + commandQueueSize, memory_order_release); // free the cell for the writers
+    commandReadPosition++;
+    return true;
+}
+
+/// @brief apply every command that is waiting, called by the simulation thread at the start of a step
+void applyCommands()
+{
+    Command command;
+    while (popCommand(command))
+    {
+        switch (command.type)
+        {
+        case KEY_COMMAND:
+            applyKey((unsigned char)command.key);
+            break;
+        case SPECIAL_KEY_COMMAND:
+            applySpecialKey(command.key);
+            break;
+        case MOUSE_COMMAND:
+            // the wheel turns into button 3 (up) and 4 (down) in freeglut, it moves the camera forward and back
+            if (command.state == GLUT_DOWN && command.key == 3)
+                applySpecialKey(GLUT_KEY_UP);
+            else if (command.state == GLUT_DOWN && command.key == 4)
+                applySpecialKey(GLUT_KEY_DOWN);
+            break;
+        }
+
+        double waited = nowSeconds() - command.enqueueTime;
+        long long nanoseconds = (long long)(waited * 1e9);
+        commandLatency.applied++;
+        commandLatency.totalNanoseconds += nanoseconds;
+        if (nanoseconds > commandLatency.maxNanoseconds)
+            commandLatency.maxNanoseconds = nanoseconds;
+        int bucket = 0;
+        while (bucket < 7 && waited >= commandLatencyLimits[bucket])
+            bucket++;
+        commandLatency.histogram[bucket]++;
+    }
+}
+
+/// @brief print how long the commands waited between the GLUT callback and the simulation step that applied them
+void printCommandLatency()
+{
+    long long applied = commandLatency.applied;
+    printf("commands: %lld applied, %lld dropped, %.3f ms average wait, %.3f ms longest wait\n", applied,
+           commandLatency.dropped.load(), applied ? commandLatency.totalNanoseconds / 1e6 / applied : 0.0,
+           commandLatency.maxNanoseconds / 1e6);
+    printf("  <0.1ms %lld  <0.5ms %lld  <1ms %lld  <2ms %lld  <5ms %lld  <10ms %lld  <20ms %lld  more %lld\n",
+           commandLatency.histogram[0].load(), commandLatency.histogram[1].load(), commandLatency.histogram[2].load(),
+           commandLatency.histogram[3].load(), commandLatency.histogram[4].load(), commandLatency.histogram[5].load(),
+           commandLatency.histogram[6].load(), commandLatency.histogram[7].load());
+}
+
+/// @brief the loop of the simulation thread, one step every animationSpeed milliseconds
+void simulationLoop()
+{
+    long long step = 0;
+    auto nextStep = chrono::steady_clock::now();
+    while (simulationRunning)
+    {
+        double start = nowSeconds();
+        applyCommands(); // the keys and mouse clicks since the last step
+        if (paused == false)
+        {
+            // we wont apply physics if the scene is paused, with --gpu-physics display() runs the steps
+            if (!useGpuPhysics)
+                updatePhysics(animationSpeed);
+            step++;
+            threadTimings.steps++;
+        }
+        threadTimings.stepNanoseconds += (long long)((nowSeconds() - start) * 1e9);
+        publishSceneState(step);
+
+        // if the step took longer than animationSpeed we start the next one right away instead of catching up
+        nextStep += chrono::milliseconds(animationSpeed);
+        auto now = chrono::steady_clock::now();
+        if (nextStep < now)
+            nextStep = now;
+        this_thread::sleep_until(nextStep);
+    }
+}
+
+/// @brief fill all three slots with the current spheres
+void resetSceneStates()
+{
+    for (int i = 0; i < 3; i++)
+    {
+        writeSlot = i;
+        sceneStates[i].sphereResets = -1; // every slot takes a copy of the spheres
+        publishSceneState(0);
+    }
+    writeSlot = 0;
+    readSlot = 1;
+    middleSlot = 2;
+    threadTimings.statesPublished = 0;
+    threadTimings.statesDropped = 0;
+    threadTimings.publishNanoseconds = 0;
+}
+
+/// @brief fill all three slots with the current spheres and start the simulation thread
+void startSimulationThread()
+{
+    initCommandQueue();
+    resetSceneStates();
+    simulationRunning = true;
+    simulationThread = thread(simulationLoop);
+}
+
+/// @brief stop the simulation thread, called when the program ends
+void stopSimulationThread()
+{
+    simulationRunning = false;
+    if (simulationThread.joinable())
+        simulationThread.join();
+}
+
+/// @brief print how long the render and the simulation thread worked and how long each one waited for the other
+void printThreadTimings()
+{
+    ThreadTimings &t = threadTimings;
+    long long frames = max(1LL, t.frames);
+    long long steps = max(1LL, t.steps.load());
+    long long published = max(1LL, t.statesPublished.load());
+    printf("simulation: %lld steps, %.3f ms per step, %.4f ms per hand over, %lld of %lld states never drawn\n",
+           t.steps.load(), t.stepNanoseconds / 1e6 / steps, t.publishNanoseconds / 1e6 / published,
+           t.statesDropped.load(), t.statesPublished.load());
+    printf("render: %lld frames, %.3f ms drawing per frame, %.4f ms taking the state per frame\n",
+           t.frames, t.drawSeconds * 1e3 / frames, t.acquireSeconds * 1e3 / frames);
+    printf("render waited for the simulation: %lld frames had no new state, drawn states were %.2f ms old on average (%.2f ms at most)\n",
+           t.staleFrames, t.stateAgeSeconds * 1e3 / frames, t.maxStateAgeSeconds * 1e3);
+}
+
+// --- Frustum Culling ---
+// Before drawing, the six planes of the view are taken from the projection and modelview matrices (the method of
+// Gribb and Hartmann). A ball is drawn only if it is not completely behind one of the planes. With every state
+// the simulation hands over the centers and radii in arrays, with a box around every block of balls in a row.
+// The simulation sorts the spheres along a curve through the cells of a coarse grid now and then, and a block is
+// the balls of one cell at the last sort, so its box stays small while the balls drift until the next sort.
+// Whole blocks are kept or thrown away by their box, and only the balls of blocks on the border of the view are
+// tested, four at a time with SSE2.
+
+/// @brief a plane a*x + b*y + c*z + d = 0 with (a, b, c) of length 1 pointing into the view
+typedef struct
+{
+    float a, b, c, d;
+} Plane;
+
+/// @brief the six planes of the view: left, right, bottom, top, near, far
+typedef struct
+{
+    Plane planes[6];
+} Frustum;
+
+/// @brief how much culling did in the frames since the last report
+typedef struct
+{
+    long long frames;
+    double seconds;      // CPU time spent testing the balls
+    long long visible;   // balls drawn
+    long long culled;    // balls skipped
+    long long lastVisible, lastCulled; // the numbers of the last frame, for the title
+} CullStats;
+
+CullStats cullStats;
+/// @brief true to skip everything outside of the view, false to draw everything (key o)
+bool useFrustumCulling = true;
+/// @brief the indices of the balls in the view this frame, it keeps its memory
+vector<int> visibleSpheres;
+/// @brief where cullSpheres writes the indices, it only grows: a vector that shrank would fill the whole
+/// length with zeros again every time it grows back
+vector<int> cullIndices;
+
+/// @brief take the frustum out of a projection and a modelview matrix, both column by column
+Frustum frustumFromMatrices(const float projection[16], const float modelview[16])
+{
+    float clip[16];
+    for (int column = 0; column < 4; column++)
+        for (int row = 0; row < 4; row++)
+        {
+            clip[column * 4 + row] = 0.0f;
+            for (int k = 0; k < 4; k++)
+                clip[column * 4 + row] += projection[k * 4 + row] * modelview[column * 4 + k];
+        }
+
+    // every plane is the last row of clip plus or minus one of the other rows
+    Frustum frustum;
+    for (int i = 0; i < 6; i++)
+    {
+        int row = i / 2;
+        float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+        float plane[4];
+        for (int column = 0; column < 4; column++)
+            plane[column] = clip[column * 4 + 3] + sign * clip[column * 4 + row];
+        float length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        frustum.planes[i].a = plane[0] / length;
+        frustum.planes[i].b = plane[1] / length;
+        frustum.planes[i].c = plane[2] / length;
+        frustum.planes[i].d = plane[3] / length;
+    }
+    return frustum;
+}
+
+/// @brief take the frustum out of the current GL_PROJECTION and GL_MODELVIEW matrices
+Frustum currentFrustum()
+{
+    float projection[16], modelview[16];
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    return frustumFromMatrices(projection, modelview);
+}
+
+/// @brief true if a sphere is at least partly inside the frustum
+bool sphereInFrustum(const Frustum &frustum, float x, float y, float z, float radius)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        const Plane &p = frustum.planes[i];
+        if (p.a * x + p.b * y + p.c * z + p.d < -radius)
+            return false;
+    }
+    return true;
+}
+
+/// @brief where a box is compared with the frustum
+enum BoxPlacement
+{
+    BOX_OUTSIDE, // completely behind one of the planes
+    BOX_PARTLY,  // might cross a plane
+    BOX_INSIDE   // completely in front of every plane
+};
+
+/// @brief compare a box with the frustum, using the corner furthest along and the one furthest against every normal
+BoxPlacement placeBox(const Frustum &frustum, const float low[3], const float high[3])
+{
+    BoxPlacement placement = BOX_INSIDE;
+    for (int i = 0; i < 6; i++)
+    {
+        const Plane &p = frustum.planes[i];
+        float furthest = p.a * (p.a >= 0.0f ? high[0] : low[0]) + p.b * (p.b >= 0.0f ? high[1] : low[1]) +
+                         p.c * (p.c >= 0.0f ? high[2] : low[2]) + p.d;
+        if (furthest < 0.0f)
+            return BOX_OUTSIDE;
+        float nearest = p.a * (p.a >= 0.0f ? low[0] : high[0]) + p.b * (p.b >= 0.0f ? low[1] : high[1]) +
+                        p.c * (p.c >= 0.0f ? low[2] : high[2]) + p.d;
+        if (nearest < 0.0f)
+            placement = BOX_PARTLY;
+    }
+    return placement;
+}
+
+/// @brief true if a box is at least partly inside the frustum
+bool boxInFrustum(const Frustum &frustum, const float low[3], const float high[3])
+{
+    return placeBox(frustum, low, high) != BOX_OUTSIDE;
+}
+
+/// @brief test the balls first .. last - 1 against the frustum and add the visible ones to out
+/// @return the new number of indices in out
+int cullPackedSpheres(const SceneState &state, const Frustum &frustum, int first, int last, int *out, int found)
+{
+    const float *xs = state.boundsX.data(), *ys = state.boundsY.data(), *zs = state.boundsZ.data(), *rs = state.boundsRadius.data();
+    int i = first;
+#if defined(__SSE2__)
+    __m128 a[6], b[6], c[6], d[6];
+    for (int k = 0; k < 6; k++)
+    {
+        a[k] = _mm_set1_ps(frustum.planes[k].a);
+        b[k] = _mm_set1_ps(frustum.planes[k].b);
+        c[k] = _mm_set1_ps(frustum.planes[k].c);
+        d[k] = _mm_set1_ps(frustum.planes[k].d);
+    }
+    for (; i + 4 <= last; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(xs + i), y = _mm_loadu_ps(ys + i), z = _mm_loadu_ps(zs + i);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(rs + i));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int k = 0; k < 6; k++)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[k], x), _mm_mul_ps(b[k], y)),
+                                         _mm_add_ps(_mm_mul_ps(c[k], z), d[k]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+        int mask = _mm_movemask_ps(inside);
+        // write all four indices and only move past the ones that are in the view, that needs no branches
+        out[found] = i;
+        found += mask & 1;
+        out[found] = i + 1;
+        found += (mask >> 1) & 1;
+        out[found] = i + 2;
+        found += (mask >> 2) & 1;
+        out[found] = i + 3;
+        found += (mask >> 3) & 1;
+    }
+#endif
+    for (; i < last; i++)
+    {
+        if (sphereInFrustum(frustum, xs[i], ys[i], zs[i], rs[i]))
+            out[found++] = i;
+    }
+    return found;
+}
+
+/// @brief find the balls of a state that are in the frustum. Blocks that are completely outside are skipped
+/// and blocks completely inside are kept without looking at their balls, only the balls of the blocks on the
+/// border of the view are tested one by one.
+/// @param visible gets the indices of the balls in the view
+void cullSpheres(const SceneState &state, const Frustum &frustum, vector<int> &visible)
+{
+    double start = nowSeconds();
+    int count = (int)state.boundsX.size();
+    if ((int)cullIndices.size() < count)
+        cullIndices.resize(count);
+    int *out = cullIndices.data();
+    int found = 0;
+    if (!useFrustumCulling)
+    {
+        for (int i = 0; i < count; i++)
+            out[i] = i;
+        found = count;
+    }
+    else
+    {
+        int blocks = (int)state.blockStart.size() - 1;
+        for (int block = 0; block < blocks; block++)
+        {
+            int first = state.blockStart[block], last = state.blockStart[block + 1];
+            if (first == last)
+                continue;
+            const float *box = &state.blockBoxes[6 * block];
+            BoxPlacement placement = placeBox(frustum, box, box + 3);
+            if (placement == BOX_INSIDE)
+            {
+                for (int i = first; i < last; i++)
+                    out[found++] = i;
+            }
+            else if (placement == BOX_PARTLY)
+                found = cullPackedSpheres(state, frustum, first, last, out, found);
+        }
+    }
+    visible.assign(out, out + found);
+
+    cullStats.seconds += nowSeconds() - start;
+    cullStats.visible += found;
+    cullStats.culled += count - found;
+    cullStats.lastVisible = found;
+    cullStats.lastCulled = count - found;
+}
+
+/// @brief print how many balls were culled per frame and how long it took, and start counting again
+void printCullStats()
+{
+    CullStats &stats = cullStats;
+    long long frames = max(1LL, stats.frames);
+    printf("frustum culling %s: %.0f balls visible and %.0f culled per frame, %.3f ms CPU per frame\n",
+           useFrustumCulling ? "on" : "off", (double)stats.visible / frames, (double)stats.culled / frames,
+           stats.seconds * 1e3 / frames);
+    long long lastVisible = stats.lastVisible, lastCulled = stats.lastCulled;
+    stats = CullStats();
+    stats.lastVisible = lastVisible;
+    stats.lastCulled = lastCulled;
+}
+
+// --- GPU Pass Timers ---
+// Every pass of a frame (the room, the balls, the arrows, the axes and the sparks) is put between the two ends
+// of a GL_TIME_ELAPSED query. Asking for the result right away would make the CPU wait for the GPU, so every
+// frame uses the next of passTimerFrames sets of queries and the results are collected when the GPU says they
+// are there, normally a frame or two later. A set whose results are still not there when it is needed again is
+// counted as lost. The last passTimerWindow frames are kept for the averages in the title, on key 'i', and at
+// the end of a --headless run; --pass-log FILE writes the times of every frame. Key 'q' turns the timers off
+// and on. The --bench run measures whole frames with its own query, so it turns them off (queries of the same
+// kind must not overlap).
+
+/// @brief the passes of a frame that are timed on the GPU
+enum RenderPass
+{
+    PASS_ROOM,
+    PASS_BALLS,
+    PASS_ARROWS,
+    PASS_AXES,
+    PASS_SPARKS,
+    RENDER_PASSES
+};
+
+const char *renderPassNames[RENDER_PASSES] = {"room", "balls", "arrows", "axes", "sparks"};
+/// @brief how many frames of queries can wait for their results
+const int passTimerFrames = 4;
+/// @brief how many frames the averages are over
+const int passTimerWindow = 120;
+
+/// @brief true to time the passes, key q
+bool usePassTimers = true;
+/// @brief where every frame's pass times are written, empty for nowhere
+string passLogPath;
+
+typedef struct
+{
+    bool ready;                                          // the queries exist, there are timer queries
+    GLuint queries[passTimerFrames][RENDER_PASSES];
+    bool issued[passTimerFrames][RENDER_PASSES];         // the pass was drawn in the frame of the set
+    long long setFrames[passTimerFrames];                // the frame of every set, -1 if it has no results to collect
+    long long frame;                                     // the frame being drawn
+    int slot;                                            // its set, -1 if this frame is not timed
+    float window[passTimerWindow][RENDER_PASSES];        // milliseconds of the last frames, a ring
+    int windowCount, windowNext;
+    long long collected, lost;
+    FILE *log;
+} PassTimers;
+
+PassTimers passTimers;
+
+/// @brief make the queries once the GL context is current
+void initPassTimers()
+{
+    PassTimers &timers = passTimers;
+    timers.ready = usePassTimers && GLEW_ARB_timer_query;
+    timers.slot = -1;
+    if (!timers.ready)
+        return;
+    glGenQueries(passTimerFrames * RENDER_PASSES, &timers.queries[0][0]);
+    for (int set = 0; set < passTimerFrames; set++)
+        timers.setFrames[set] = -1;
+    if (!passLogPath.empty() && (timers.log = fopen(passLogPath.c_str(), "w")) != NULL)
+    {
+        fprintf(timers.log, "frame");
+        for (int pass = 0; pass < RENDER_PASSES; pass++)
+            fprintf(timers.log, ",%s_ms", renderPassNames[pass]);
+        fprintf(timers.log, "\n");
+    }
+}
+
+/// @brief read the results of a set if the GPU has them, without waiting
+/// @return false if they are not there yet
+bool collectPassTimes(int set)
+{
+    PassTimers &timers = passTimers;
+    int last = -1;
+    for (int pass = 0; pass < RENDER_PASSES; pass++)
+        if (timers.issued[set][pass])
+            last = pass;
+    if (last >= 0)
+    {
+        GLint available = 0; // the queries finish in order, when the last one is there all of them are
+        glGetQueryObjectiv(timers.queries[set][last], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return false;
+    }
+    float *times = timers.window[timers.windowNext];
+    for (int pass = 0; pass < RENDER_PASSES; pass++)
+    {
+        GLuint64 nanoseconds = 0;
+        if (timers.issued[set][pass])
+            glGetQueryObjectui64v(timers.queries[set][pass], GL_QUERY_RESULT, &nanoseconds);
+        times[pass] = nanoseconds / 1e6f;
+    }
+    if (timers.log != NULL)
+    {
+        fprintf(timers.log, "%lld", timers.setFrames[set]);
+        for (int pass = 0; pass < RENDER_PASSES; pass++)
+            fprintf(timers.log, ",%.4f", times[pass]);
+        fprintf(timers.log, "\n");
+    }
+    timers.windowNext = (timers.windowNext + 1) % passTimerWindow;
+    timers.windowCount = min(timers.windowCount + 1, passTimerWindow);
+    timers.setFrames[set] = -1;
+    timers.collected++;
+    return true;
+}
+
+/// @brief collect what has arrived and take a set of queries for the new frame, called before a frame is drawn
+void beginPassTimerFrame()
+{
+    PassTimers &timers = passTimers;
+    timers.slot = -1;
+    if (!timers.ready || !usePassTimers)
+        return;
+    // the oldest sets first, so the log stays in frame order
+    for (int age = passTimerFrames - 1; age >= 1; age--)
+    {
+        int set = (int)((timers.frame + passTimerFrames - age) % passTimerFrames);
+        if (timers.setFrames[set] >= 0 && !collectPassTimes(set))
+            break;
+    }
+    timers.slot = (int)(timers.frame % passTimerFrames);
+    if (timers.setFrames[timers.slot] >= 0 && !collectPassTimes(timers.slot))
+        timers.lost++; // still not there after passTimerFrames frames, the queries are used again anyway
+    timers.setFrames[timers.slot] = timers.frame++;
+    for (int pass = 0; pass < RENDER_PASSES; pass++)
+        timers.issued[timers.slot][pass] = false;
+}
+
+/// @brief start the query of a pass, the passes must not overlap
+void beginPass(RenderPass pass)
+{
+    PassTimers &timers = passTimers;
+    if (timers.slot < 0)
+        return;
+    glBeginQuery(GL_TIME_ELAPSED, timers.queries[timers.slot][pass]);
+    timers.issued[timers.slot][pass] = true;
+}
+
+void endPass()
+{
+    if (passTimers.slot >= 0)
+        glEndQuery(GL_TIME_ELAPSED);
+}
+
+/// @brief the average time of every pass over the window, in milliseconds
+void averagePassTimes(float *average, float *longest)
+{
+    const PassTimers &timers = passTimers;
+    for (int pass = 0; pass < RENDER_PASSES; pass++)
+    {
+        average[pass] = longest[pass] = 0.0f;
+        for (int i = 0; i < timers.windowCount; i++)
+        {
+            average[pass] += timers.window[i][pass] / timers.windowCount;
+            longest[pass] = max(longest[pass], timers.window[i][pass]);
+        }
+    }
+}
+
+/// @brief the average pass times in a few words, for the window title
+void formatPassTimes(char *text, size_t size)
+{
+    text[0] = '\0';
+    if (!passTimers.ready || !usePassTimers || passTimers.windowCount == 0)
+        return;
+    float average[RENDER_PASSES], longest[RENDER_PASSES];
+    averagePassTimes(average, longest);
+    size_t length = snprintf(text, size, ", GPU ms:");
+    for (int pass = 0; pass < RENDER_PASSES && length < size; pass++)
+        length += snprintf(text + length, size - length, " %s %.2f", renderPassNames[pass], average[pass]);
+}
+
+/// @brief print the average and the longest time of every pass over the window
+void printPassTimes()
+{
+    const PassTimers &timers = passTimers;
+    if (!timers.ready)
+    {
+        printf("GPU pass times: %s\n", usePassTimers ? "there are no timer queries" : "off");
+        return;
+    }
+    float average[RENDER_PASSES], longest[RENDER_PASSES], total = 0.0f;
+    averagePassTimes(average, longest);
+    printf("GPU pass times over the last %d frames (%lld collected, %lld lost), average / longest ms:", timers.windowCount,
+           timers.collected, timers.lost);
+    for (int pass = 0; pass < RENDER_PASSES; pass++)
+    {
+        printf(" %s %.3f / %.3f", renderPassNames[pass], average[pass], longest[pass]);
+        total += average[pass];
+    }
+    printf(", all %.3f\n", total);
+}
+
+/// @brief collect the last results and close the log, the GL context must still be current
+void stopPassTimers()
+{
+    PassTimers &timers = passTimers;
+    if (!timers.ready)
+        return;
+    glFinish();
+    for (int age = passTimerFrames; age >= 1; age--)
+    {
+        int set = (int)((timers.frame + passTimerFrames - age) % passTimerFrames);
+        if (timers.setFrames[set] >= 0)
+            collectPassTimes(set);
+    }
+    if (timers.log != NULL)
+        fclose(timers.log);
+    timers.log = NULL;
+}
+
+// --- GPU Physics ---
+// With --gpu-physics the spheres are moved by a compute shader instead of updatePhysics. They live in a shader
+// storage buffer with the same layout as Sphere, and the shader does for one sphere what moveSphere,
+// checkCollisions and spinSphere do. Without contacts the spheres do not depend on each other, so one dispatch
+// runs all the steps display() is behind. At the end the shader writes the SphereInstance of its sphere into a
+// second buffer, which the instanced sphere shader reads as its instance buffer, so the spheres never come back
+// to the CPU. On this path the spheres do not bounce off each other, make no sparks and have no arrows, all of
+// that needs them on the CPU. Compute shaders need GL 4.3, which Mesa's llvmpipe has in its compatibility profile.
+
+/// @brief the buffers and the shader of the spheres on the GPU, only used by the render thread
+typedef struct
+{
+    GLuint program;
+    GLuint sphereBuffer;   // the spheres, laid out like Sphere
+    GLuint instanceBuffer; // their SphereInstance, written by the shader
+    int count;             // how many spheres the buffers hold
+    long long step;        // the step the spheres on the GPU are at
+    long long sphereResets;
+    float velocityChange;  // the part of SceneState::velocityChange the spheres already got
+    bool instancesWritten; // false until the shader wrote the instances of the uploaded spheres
+    bool ready;
+    GLint countLocation, stepsLocation, dtLocation, velocityChangeLocation, colorsLocation;
+} GpuPhysics;
+
+GpuPhysics gpuPhysics;
+
+/// @brief the spheres do not have to be a multiple of this, the last group leaves out the ones past the end
+const int gpuPhysicsGroupSize = 64;
+
+/// @brief what moveSphere, checkCollisions and spinSphere do, in the same order, for steps steps of one sphere
+const char *gpuPhysicsSource =
+    "#version 430\n"
+    "layout(local_size_x = 64) in;\n"
+    "struct Sphere\n"
+    "{\n"
+    "    float radius;\n"
+    "    float mass;\n"
+    "    float position[3];\n"
+    "    float velocity[3];\n"
+    "    float angularVelocity[3];\n"
+    "    float rotationAngle[3];\n"
+    "    int id;\n"
+    "};\n"
+    "struct SphereInstance\n"
+    "{\n"
+    "    float positionRadius[4];\n"
+    "    float rotation[9];\n"
+    "    uint colors[2];\n"
+    "};\n"
+    "layout(std430, binding = 0) buffer Spheres { Sphere spheres[]; };\n"
+    "layout(std430, binding = 1) writeonly buffer Instances { SphereInstance instances[]; };\n"
+    "uniform int count;\n"
+    "uniform int steps;\n"
+    "uniform float dt;\n"
+    "uniform float velocityChange; // added to every axis before the first step, keys + and -\n"
+    "uniform uint colors[2];\n"
+    "uniform float gravity;\n"
+    "uniform float friction;\n"
+    "uniform float restitution;\n"
+    "uniform float cubeSize;\n"
+    "uniform float pi;\n"
+    "// the rotation of one axis as rotationMatrix makes it\n"
+    "mat3 axisRotation(int axis, float degrees)\n"
+    "{\n"
+    "    float c = cos(degrees * pi / 180.0);\n"
+    "    float s = sin(degrees * pi / 180.0);\n"
+    "    int first = (axis + 1) % 3, second = (axis + 2) % 3;\n"
+    "    mat3 r = mat3(1.0);\n"
+    "    r[first][first] = c;\n"
+    "    r[second][second] = c;\n"
+    "    r[first][second] = s;\n"
+    "    r[second][first] = -s;\n"
+    "    return r;\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    int i = int(gl_GlobalInvocationID.x);\n"
+    "    if (i >= count)\n"
+    "        return;\n"
+    "    float radius = spheres[i].radius;\n"
+    "    vec3 p = vec3(spheres[i].position[0], spheres[i].position[1], spheres[i].position[2]);\n"
+    "    vec3 v = vec3(spheres[i].velocity[0], spheres[i].velocity[1], spheres[i].velocity[2]) + vec3(velocityChange);\n"
+    "    vec3 spin = vec3(spheres[i].angularVelocity[0], spheres[i].angularVelocity[1], spheres[i].angularVelocity[2]);\n"
+    "    vec3 angle = vec3(spheres[i].rotationAngle[0], spheres[i].rotationAngle[1], spheres[i].rotationAngle[2]);\n"
+    "    for (int step = 0; step < steps; step++)\n"
+    "    {\n"
+    "        v.y += gravity * dt;\n"
+    "        p += v * dt;\n"
+    "        if (p.y - radius <= 0.0)\n"
+    "        {\n"
+    "            p.y = radius;\n"
+    "            v.y = -v.y * restitution;\n"
+    "            v.x *= friction;\n"
+    "            v.z *= friction;\n"
+    "        }\n"
+    "        if (p.x - radius <= 0.0)\n"
+    "        {\n"
+    "            p.x = radius;\n"
+    "            v.x = -v.x * restitution;\n"
+    "        }\n"
+    "        if (p.x + radius >= cubeSize)\n"
+    "        {\n"
+    "            p.x = cubeSize - radius;\n"
+    "            v.x = -v.x * restitution;\n"
+    "        }\n"
+    "        if (p.z - radius <= 0.0)\n"
+    "        {\n"
+    "            p.z = radius;\n"
+    "            v.z = -v.z * restitution;\n"
+    "        }\n"
+    "        if (p.z + radius >= cubeSize)\n"
+    "        {\n"
+    "            p.z = cubeSize - radius;\n"
+    "            v.z = -v.z * restitution;\n"
+    "        }\n"
+    "        if (p.y + radius >= cubeSize)\n"
+    "        {\n"
+    "            p.y = cubeSize - radius;\n"
+    "            v.y = -v.y * restitution;\n"
+    "        }\n"
+    "        spin = vec3(v.z / radius, 0.0, -v.x / radius);\n"
+    "        angle += spin * dt * 180.0 / pi;\n"
+    "    }\n"
+    "    for (int k = 0; k < 3; k++)\n"
+    "    {\n"
+    "        spheres[i].position[k] = p[k];\n"
+    "        spheres[i].velocity[k] = v[k];\n"
+    "        spheres[i].angularVelocity[k] = spin[k];\n"
+    "        spheres[i].rotationAngle[k] = angle[k];\n"
+    "        instances[i].positionRadius[k] = p[k];\n"
+    "    }\n"
+    "    instances[i].positionRadius[3] = radius;\n"
+    "    mat3 rotation = axisRotation(0, angle.x) * axisRotation(1, angle.y) * axisRotation(2, angle.z);\n"
+    "    for (int column = 0; column < 3; column++)\n"
+    "        for (int row = 0; row < 3; row++)\n"
+    "            instances[i].rotation[column * 3 + row] = rotation[column][row];\n"
+    "    instances[i].colors[0] = colors[0];\n"
+    "    instances[i].colors[1] = colors[1];\n"
+    "}\n";
+
+/// @brief compile and link a compute shader
+/// @param name used in the error messages
+/// @return the program, or 0 if it did not compile
+GLuint compileComputeProgram(const char *name, const char *source)
+{
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled)
+    {
+        char log[2048];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("%s compute shader did not compile:\n%s\n", name, log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glDeleteShader(shader); // it is freed together with the program
+    glLinkProgram(program);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked)
+    {
+        char log[2048];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("%s program did not link:\n%s\n", name, log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/// @brief make the shader and the buffers, the spheres are uploaded by the first syncGpuPhysics
+/// @return false if the GL has no compute shaders, after printing why
+bool initGpuPhysics()
+{
+    if (gpuPhysics.ready)
+        return true;
+    if (!GLEW_VERSION_4_3)
+    {
+        printf("--gpu-physics needs OpenGL 4.3 for compute shaders, this GL is %s\n", glGetString(GL_VERSION));
+        return false;
+    }
+    GpuPhysics &gpu = gpuPhysics;
+    gpu.program = compileComputeProgram("GPU physics", gpuPhysicsSource);
+    if (gpu.program == 0)
+        return false;
+    gpu.countLocation = glGetUniformLocation(gpu.program, "count");
+    gpu.stepsLocation = glGetUniformLocation(gpu.program, "steps");
+    gpu.dtLocation = glGetUniformLocation(gpu.program, "dt");
+    gpu.velocityChangeLocation = glGetUniformLocation(gpu.program, "velocityChange");
+    gpu.colorsLocation = glGetUniformLocation(gpu.program, "colors");
+
+    // the constants of the room are set once, keys do not change them
+    glUseProgram(gpu.program);
+    glUniform1f(glGetUniformLocation(gpu.program, "gravity"), gravity);
+    glUniform1f(glGetUniformLocation(gpu.program, "friction"), friction);
+    glUniform1f(glGetUniformLocation(gpu.program, "restitution"), restitution);
+    glUniform1f(glGetUniformLocation(gpu.program, "cubeSize"), cubeSize);
+    glUniform1f(glGetUniformLocation(gpu.program, "pi"), pi);
+    glUseProgram(0);
+
+    glGenBuffers(1, &gpu.sphereBuffer);
+    glGenBuffers(1, &gpu.instanceBuffer);
+    gpu.count = 0;
+    gpu.sphereResets = -1; // the first state brings the spheres
+    gpu.ready = true;
+    return true;
+}
+
+/// @brief put spheres into the sphere buffer and make the instance buffer as big
+void uploadGpuSpheres(const vector<Sphere> &balls)
+{
+    GpuPhysics &gpu = gpuPhysics;
+    gpu.count = (int)balls.size();
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu.sphereBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gpu.count * sizeof(Sphere), balls.data(), GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu.instanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gpu.count * sizeof(SphereInstance), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    gpu.instancesWritten = false;
+}
+
+/// @brief move the spheres on the GPU by steps steps with one dispatch, and write their instances
+/// @param extraVelocity added to every axis of every velocity before the first step
+void dispatchGpuPhysics(int steps, float extraVelocity)
+{
+    GpuPhysics &gpu = gpuPhysics;
+    GLuint colors[2];
+    for (int c = 0; c < 2; c++)
+    {
+        colors[c] = 255u << 24;
+        for (int k = 0; k < 3; k++)
+            colors[c] |= (GLuint)(unsigned char)(stripeColors[c][k] * 255.0f) << (8 * k); // as writeSphereInstance packs them
+    }
+    glUseProgram(gpu.program);
+    glUniform1i(gpu.countLocation, gpu.count);
+    glUniform1i(gpu.stepsLocation, steps);
+    glUniform1f(gpu.dtLocation, animationSpeed / 1000.0f);
+    glUniform1f(gpu.velocityChangeLocation, extraVelocity);
+    glUniform1uiv(gpu.colorsLocation, 2, colors);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpu.sphereBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpu.instanceBuffer);
+    glDispatchCompute((gpu.count + gpuPhysicsGroupSize - 1) / gpuPhysicsGroupSize, 1, 1);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+    glUseProgram(0);
+    // the next dispatch reads the spheres, and the sphere shader reads the instances as vertex attributes
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    gpu.instancesWritten = true;
+}
+
+/// @brief bring the spheres on the GPU to the step of a state: upload them again if they were put back, then run
+/// the steps they are behind and the speed keys pressed since the last frame, all in one dispatch
+void syncGpuPhysics(const SceneState &state)
+{
+    GpuPhysics &gpu = gpuPhysics;
+    if (state.sphereResets != gpu.sphereResets)
+    {
+        uploadGpuSpheres(state.spheres);
+        gpu.sphereResets = state.sphereResets;
+        gpu.step = state.step;
+        gpu.velocityChange = state.velocityChange;
+    }
+    long long steps = max(0LL, state.step - gpu.step);
+    float extraVelocity = state.velocityChange - gpu.velocityChange;
+    if (steps > 0 || extraVelocity != 0.0f || !gpu.instancesWritten)
+        dispatchGpuPhysics((int)steps, extraVelocity);
+    gpu.step = max(gpu.step, state.step);
+    gpu.velocityChange = state.velocityChange;
+}
+
+/// @brief draw all the spheres straight from the instance buffer the shader wrote, with one instanced call;
+/// their sizes on the screen are not known on the CPU, so all of them get the same level of detail and none is culled
+void drawGpuSpheres()
+{
+    double start = nowSeconds();
+    GpuPhysics &gpu = gpuPhysics;
+    if (gpu.count == 0 || !initInstancedSpheres())
+        return;
+    int level = useSphereLod ? 2 : 0;
+    const SphereMesh &mesh = getSphereLodMesh(level);
+    enableInstanceAttributes();
+    glUseProgram(instancedSpheres.program);
+    glUniform1f(instancedSpheres.analyticLocation, useStripeShader ? 1.0f : 0.0f);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu.instanceBuffer);
+    pointInstanceAttributes(0);
+    bindSphereMesh(mesh);
+    glDrawElementsInstanced(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, 0, gpu.count);
+    glUseProgram(0);
+    unbindSphereMesh();
+    disableInstanceAttributes();
+
+    sphereDrawStats.drawCalls++;
+    sphereDrawStats.triangles += (long long)gpu.count * (mesh.indexCount / 3);
+    sphereDrawStats.lodCounts[level] += gpu.count;
+    sphereDrawStats.sphereSeconds += nowSeconds() - start;
+}
+
+// --- Core Profile Backend ---
+// With --core the window gets an OpenGL 3.3 core profile context and nothing of the fixed function pipeline
+// is used: the view and projection matrices are worked out here instead of by gluLookAt and gluPerspective,
+// the values that are the same for the whole frame reach the shaders through one uniform buffer, and every
+// draw goes through a vertex array object. The old path stays the default, so the fps of both can be
+// compared on the same machine to see what the legacy calls cost in the driver.
+// The core backend draws the room, the axes, the balls (as instanced meshes with the stripe shader) and the
+// velocity arrows; the sparks are only drawn by the old path.
+
+/// @brief true when the window was opened with a core profile context (--core)
+bool useCoreProfile = false;
+/// @brief the projection of the window, the same for both backends
+const float fieldOfView = 45.0f, nearPlane = 0.1f, farPlane = 100.0f;
+/// @brief width / height of the window, set by reshapeListener
+float viewAspect = 1.0f;
+
+/// @brief out = a * b, all matrices column by column like OpenGL's
+void multiplyMatrices(const float a[16], const float b[16], float out[16])
+{
+    float result[16];
+    for (int column = 0; column < 4; column++)
+        for (int row = 0; row < 4; row++)
+        {
+            result[column * 4 + row] = 0.0f;
+            for (int k = 0; k < 4; k++)
+                result[column * 4 + row] += a[k * 4 + row] * b[column * 4 + k];
+        }
+    copy(result, result + 16, out);
+}
+
+/// @brief the matrix gluPerspective makes
+/// @param fovy the field of view from the bottom to the top, in degrees
+void perspectiveMatrix(float fovy, float aspect, float zNear, float zFar, float m[16])
+{
+    float f = 1.0f / tan(fovy * pi / 360.0f);
+    fill(m, m + 16, 0.0f);
+    m[0] = f / aspect;
+    m[5] = f;
+    m[10] = (zFar + zNear) / (zNear - zFar);
+    m[11] = -1.0f;
+    m[14] = 2.0f * zFar * zNear / (zNear - zFar);
+}
+
+/// @brief the matrix gluLookAt makes
+void lookAtMatrix(const GLfloat eye[3], const GLfloat center[3], const GLfloat up[3], float m[16])
+{
+    float f[3] = {center[0] - eye[0], center[1] - eye[1], center[2] - eye[2]};
+    float length = sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (int i = 0; i < 3; i++)
+        f[i] /= length;
+    // side = f x up, then the true up = side x f
+    float side[3] = {f[1] * up[2] - f[2] * up[1], f[2] * up[0] - f[0] * up[2], f[0] * up[1] - f[1] * up[0]};
+    length = sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+    for (int i = 0; i < 3; i++)
+        side[i] /= length;
+    float u[3] = {side[1] * f[2] - side[2] * f[1], side[2] * f[0] - side[0] * f[2], side[0] * f[1] - side[1] * f[0]};
+
+    fill(m, m + 16, 0.0f);
+    for (int i = 0; i < 3; i++)
+    {
+        m[i * 4 + 0] = side[i];
+        m[i * 4 + 1] = u[i];
+        m[i * 4 + 2] = -f[i];
+    }
+    m[12] = -(side[0] * eye[0] + side[1] * eye[1] + side[2] * eye[2]);
+    m[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+    m[14] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+    m[15] = 1.0f;
+}
+
+/// @brief the uniform block Frame of the core shaders, in the std140 layout
+typedef struct
+{
+    float view[16];
+    float projection[16];
+    float stripeColors[2][4];
+} FrameUniforms;
+
+/// @brief one vertex of the room and the axes in the core backend
+typedef struct
+{
+    float position[3];
+    float color[3];
+    float texCoord[2];
+} SceneVertex;
+
+/// @brief everything the core backend keeps on the GL side
+typedef struct
+{
+    GLuint sphereProgram;                // instanced sphere meshes
+    GLuint sceneProgram;                 // the room and the axes
+    GLint useTextureLocation;            // the useTexture uniform of sceneProgram
+    GLuint frameUniformBuffer;           // FrameUniforms, bound to binding point 0
+    GLuint sceneArray, sceneBuffer;      // the vertex array and buffer of the room and the axes
+    float sceneSize;                     // the cubeSize the room buffer was made with
+    GLuint floorTexture;                 // the checker, like the one of the old path
+    GLuint sphereArrays[sphereLodLevels]; // one vertex array per level of detail
+    GLuint arrowProgram, arrowArray;     // the velocity arrows, see Velocity Arrows
+} CoreRenderer;
+
+CoreRenderer coreRenderer;
+
+/// @brief the uniform block every core shader starts with
+const char *frameBlockSource =
+    "#version 330 core\n"
+    "layout(std140) uniform Frame\n"
+    "{\n"
+    "    mat4 view;\n"
+    "    mat4 projection;\n"
+    "    vec4 stripeColor0;\n"
+    "    vec4 stripeColor1;\n"
+    "};\n";
+
+/// @brief the room of the core backend: the floor as one textured quad (6 vertices), the walls and the ceiling
+/// (30 vertices), then the three axes as lines (6 vertices)
+const int coreFloorVertices = 6, coreWallVertices = 30, coreAxesVertices = 6;
+
+/// @brief add the two triangles of a quad to the scene vertices
+void addSceneQuad(vector<SceneVertex> &vertices, const float corners[4][3], const float color[3], float repeats)
+{
+    const float texCoords[4][2] = {{0.0f, 0.0f}, {repeats, 0.0f}, {repeats, repeats}, {0.0f, repeats}};
+    const int order[6] = {0, 1, 2, 0, 2, 3};
+    for (int i = 0; i < 6; i++)
+    {
+        SceneVertex vertex;
+        copy(corners[order[i]], corners[order[i]] + 3, vertex.position);
+        copy(color, color + 3, vertex.color);
+        copy(texCoords[order[i]], texCoords[order[i]] + 2, vertex.texCoord);
+        vertices.push_back(vertex);
+    }
+}
+
+/// @brief fill the room buffer for the current cubeSize
+void buildCoreScene()
+{
+    float c = cubeSize;
+    const float white[3] = {1.0f, 1.0f, 1.0f};
+    const float wallColor[3] = {0.5f, 1.0f, 0.5f};    // the same colors as drawCubeWithCheckeredFloor
+    const float ceilingColor[3] = {0.5f, 0.5f, 0.5f};
+    vector<SceneVertex> vertices;
+
+    const float floorCorners[4][3] = {{0, 0, 0}, {c, 0, 0}, {c, 0, c}, {0, 0, c}};
+    addSceneQuad(vertices, floorCorners, white, (int)cubeSize / 2.0f); // the texture holds 2x2 tiles
+    const float walls[5][4][3] = {{{0, 0, 0}, {c, 0, 0}, {c, c, 0}, {0, c, 0}},  // front
+                                  {{0, 0, c}, {c, 0, c}, {c, c, c}, {0, c, c}},  // back
+                                  {{0, 0, 0}, {0, 0, c}, {0, c, c}, {0, c, 0}},  // left
+                                  {{c, 0, 0}, {c, 0, c}, {c, c, c}, {c, c, 0}},  // right
+                                  {{0, c, 0}, {c, c, 0}, {c, c, c}, {0, c, c}}}; // ceiling
+    for (int wall = 0; wall < 5; wall++)
+        addSceneQuad(vertices, walls[wall], wall < 4 ? wallColor : ceilingColor, 0.0f);
+
+    // the axes, red x, green y and blue z, like drawAxes
+    for (int axis = 0; axis < 3; axis++)
+        for (int end = 0; end < 2; end++)
+        {
+            SceneVertex vertex = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f}};
+            vertex.position[axis] = (float)end;
+            vertex.color[axis] = 1.0f;
+            vertices.push_back(vertex);
+        }
+
+    glBindBuffer(GL_ARRAY_BUFFER, coreRenderer.sceneBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(SceneVertex), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    coreRenderer.sceneSize = cubeSize;
+}
+
+/// @brief compile the core shaders and make the buffers, vertex arrays and the floor texture
+/// @return false if something could not be made
+bool initCoreRenderer()
+{
+    string sphereVertex = string(frameBlockSource) +
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec4 instancePositionRadius;\n"
+        "layout(location = 2) in vec3 instanceRotation0;\n"
+        "layout(location = 3) in vec3 instanceRotation1;\n"
+        "layout(location = 4) in vec3 instanceRotation2;\n"
+        "layout(location = 5) in vec4 instanceColor0;\n"
+        "layout(location = 6) in vec4 instanceColor1;\n"
+        "out vec3 objectPosition;\n"
+        "out vec4 color0;\n"
+        "out vec4 color1;\n"
+        "void main()\n"
+        "{\n"
+        "    mat3 rotation = mat3(instanceRotation0, instanceRotation1, instanceRotation2);\n"
+        "    vec3 world = rotation * (position * instancePositionRadius.w) + instancePositionRadius.xyz;\n"
+        "    gl_Position = projection * view * vec4(world, 1.0);\n"
+        "    objectPosition = position;\n"
+        "    color0 = instanceColor0;\n"
+        "    color1 = instanceColor1;\n"
+        "}\n";
+    string sphereFragment = string(frameBlockSource) +
+        "in vec3 objectPosition;\n"
+        "in vec4 color0;\n"
+        "in vec4 color1;\n"
+        "out vec4 fragmentColor;\n" + stripeShaderSource +
+        "void main()\n"
+        "{\n"
+        "    fragmentColor = stripeColor(objectPosition, color0, color1);\n"
+        "}\n";
+    string sceneVertex = string(frameBlockSource) +
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec3 color;\n"
+        "layout(location = 2) in vec2 texCoord;\n"
+        "out vec3 vertexColor;\n"
+        "out vec2 vertexTexCoord;\n"
+        "void main()\n"
+        "{\n"
+        "    gl_Position = projection * view * vec4(position, 1.0);\n"
+        "    vertexColor = color;\n"
+        "    vertexTexCoord = texCoord;\n"
+        "}\n";
+    string sceneFragment = string(frameBlockSource) +
+        "uniform sampler2D checker;\n"
+        "uniform int useTexture;\n"
+        "in vec3 vertexColor;\n"
+        "in vec2 vertexTexCoord;\n"
+        "out vec4 fragmentColor;\n"
+        "void main()\n"
+        "{\n"
+        "    float shade = useTexture != 0 ? texture(checker, vertexTexCoord).r : 1.0;\n"
+        "    fragmentColor = vec4(vertexColor * shade, 1.0);\n"
+        "}\n";
+
+    string arrowVertex = string(frameBlockSource) +
+        "layout(location = 0) in vec4 vertex;\n"
+        "layout(location = 1) in vec3 arrowPosition;\n"
+        "layout(location = 2) in vec3 arrowVelocity;\n" + arrowShaderSource +
+        "void main()\n"
+        "{\n"
+        "    gl_Position = projection * view * vec4(arrowVertex(vertex, arrowPosition, arrowVelocity), 1.0);\n"
+        "}\n";
+    string arrowFragment = string(frameBlockSource) +
+        "out vec4 fragmentColor;\n"
+        "void main()\n"
+        "{\n"
+        "    fragmentColor = vec4(1.0, 0.0, 0.0, 1.0);\n"
+        "}\n";
+
+    coreRenderer.sphereProgram = compileProgram("core spheres", sphereVertex.c_str(), sphereFragment.c_str(), NULL);
+    coreRenderer.sceneProgram = compileProgram("core scene", sceneVertex.c_str(), sceneFragment.c_str(), NULL);
+    coreRenderer.arrowProgram = compileProgram("core arrows", arrowVertex.c_str(), arrowFragment.c_str(), NULL);
+    if (coreRenderer.sphereProgram == 0 || coreRenderer.sceneProgram == 0 || coreRenderer.arrowProgram == 0)
+        return false;
+    GLuint programs[3] = {coreRenderer.sphereProgram, coreRenderer.sceneProgram, coreRenderer.arrowProgram};
+    for (int i = 0; i < 3; i++)
+        glUniformBlockBinding(programs[i], glGetUniformBlockIndex(programs[i], "Frame"), 0);
+    coreRenderer.useTextureLocation = glGetUniformLocation(coreRenderer.sceneProgram, "useTexture");
+    glUseProgram(coreRenderer.sceneProgram);
+    glUniform1i(glGetUniformLocation(coreRenderer.sceneProgram, "checker"), 0);
+    glUseProgram(0);
+
+    glGenBuffers(1, &coreRenderer.frameUniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, coreRenderer.frameUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, coreRenderer.frameUniformBuffer);
+
+    // the room: position, color and texture coordinate of every vertex
+    glGenVertexArrays(1, &coreRenderer.sceneArray);
+    glGenBuffers(1, &coreRenderer.sceneBuffer);
+    buildCoreScene();
+    glBindVertexArray(coreRenderer.sceneArray);
+    glBindBuffer(GL_ARRAY_BUFFER, coreRenderer.sceneBuffer);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SceneVertex), (void *)offsetof(SceneVertex, position));
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(SceneVertex), (void *)offsetof(SceneVertex, color));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(SceneVertex), (void *)offsetof(SceneVertex, texCoord));
+    glBindVertexArray(0);
+
+    // the checker texture, one channel because GL_LUMINANCE is gone from the core profile
+    const int size = 2 * floorTexelsPerTile;
+    vector<unsigned char> texels(size * size);
+    for (int t = 0; t < size; t++)
+        for (int s = 0; s < size; s++)
+            texels[t * size + s] = ((s / floorTexelsPerTile + t / floorTexelsPerTile) % 2 == 0) ? 255 : 0;
+    glGenTextures(1, &coreRenderer.floorTexture);
+    glBindTexture(GL_TEXTURE_2D, coreRenderer.floorTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, size, size, 0, GL_RED, GL_UNSIGNED_BYTE, texels.data());
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    if (GLEW_EXT_texture_filter_anisotropic)
+    {
+        GLfloat maxAnisotropy = 1.0f;
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, min(maxAnisotropy, 8.0f));
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // one vertex array per level of detail: the mesh, its indices, and the instance attributes that step per ball
+    if (instancedSpheres.instanceBuffer == 0)
+        glGenBuffers(1, &instancedSpheres.instanceBuffer);
+    glGenVertexArrays(sphereLodLevels, coreRenderer.sphereArrays);
+    for (int level = 0; level < sphereLodLevels; level++)
+    {
+        const SphereMesh &mesh = getSphereLodMesh(level);
+        glBindVertexArray(coreRenderer.sphereArrays[level]);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SphereVertex), (void *)offsetof(SphereVertex, position));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+        enableInstanceAttributes();
+        glBindVertexArray(0);
+    }
+
+    // the arrows: the buffers keep their names when they grow, so the pointers are set once
+    buildArrowMesh();
+    glGenVertexArrays(1, &coreRenderer.arrowArray);
+    glBindVertexArray(coreRenderer.arrowArray);
+    glBindBuffer(GL_ARRAY_BUFFER, velocityArrows.meshBuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, velocityArrows.indexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, velocityArrows.instanceBuffer);
+    pointArrowAttributes();
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
+}
+
+/// @brief draw a state with the core backend
+void drawSceneCore(const SceneState &state)
+{
+    if (coreRenderer.sceneSize != cubeSize)
+        buildCoreScene();
+
+    FrameUniforms frame;
+    lookAtMatrix(state.eye, state.center, state.up, frame.view);
+    perspectiveMatrix(fieldOfView, viewAspect, nearPlane, farPlane, frame.projection);
+    for (int c = 0; c < 2; c++)
+    {
+        copy(stripeColors[c], stripeColors[c] + 3, frame.stripeColors[c]);
+        frame.stripeColors[c][3] = 1.0f;
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, coreRenderer.frameUniformBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    // only what is in the view is drawn
+    Frustum frustum = frustumFromMatrices(frame.projection, frame.view);
+    cullSpheres(state, frustum, visibleSpheres);
+    cullStats.frames++;
+    float roomLow[3] = {0.0f, 0.0f, 0.0f}, roomHigh[3] = {cubeSize, cubeSize, cubeSize};
+    float axesLow[3] = {0.0f, 0.0f, 0.0f}, axesHigh[3] = {1.0f, 1.0f, 1.0f};
+
+    glUseProgram(coreRenderer.sceneProgram);
+    glBindVertexArray(coreRenderer.sceneArray);
+    if (!useFrustumCulling || boxInFrustum(frustum, roomLow, roomHigh))
+    {
+        beginPass(PASS_ROOM);
+        glBindTexture(GL_TEXTURE_2D, coreRenderer.floorTexture);
+        glUniform1i(coreRenderer.useTextureLocation, 1);
+        glDrawArrays(GL_TRIANGLES, 0, coreFloorVertices);
+        glUniform1i(coreRenderer.useTextureLocation, 0);
+        glDrawArrays(GL_TRIANGLES, coreFloorVertices, coreWallVertices);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        endPass();
+    }
+    if (isAxes && (!useFrustumCulling || boxInFrustum(frustum, axesLow, axesHigh)))
+    {
+        beginPass(PASS_AXES);
+        glDrawArrays(GL_LINES, coreFloorVertices + coreWallVertices, coreAxesVertices);
+        endPass();
+    }
+
+    // the balls, one instanced draw per level of detail
+    double start = nowSeconds();
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    int firsts[sphereLodLevels + 1];
+    groupSphereInstances(state.spheres, visibleSpheres, lodViewFromMatrices(frame.projection, frame.view, viewport[3]), firsts);
+    uploadSphereInstances((int)visibleSpheres.size());
+    beginPass(PASS_BALLS);
+    glUseProgram(coreRenderer.sphereProgram);
+    for (int level = 0; level < sphereLodLevels; level++)
+    {
+        int instanceCount = firsts[level + 1] - firsts[level];
+        if (instanceCount == 0)
+            continue;
+        const SphereMesh &mesh = getSphereLodMesh(level);
+        glBindVertexArray(coreRenderer.sphereArrays[level]);
+        pointInstanceAttributes(firsts[level]); // the instance buffer is still bound from the upload
+        glDrawElementsInstanced(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, 0, instanceCount);
+        sphereDrawStats.drawCalls++;
+        sphereDrawStats.triangles += (long long)instanceCount * (mesh.indexCount / 3);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+    endPass();
+    sphereDrawStats.sphereSeconds += nowSeconds() - start;
+    sphereDrawStats.frames++;
+
+    if (showArrow)
+    {
+        start = nowSeconds();
+        int count = uploadArrowInstances(state.spheres, visibleSpheres);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        if (count > 0)
+        {
+            beginPass(PASS_ARROWS);
+            glUseProgram(coreRenderer.arrowProgram);
+            glBindVertexArray(coreRenderer.arrowArray);
+            glDrawElementsInstanced(GL_TRIANGLES, velocityArrows.indexCount, GL_UNSIGNED_SHORT, 0, count);
+            sphereDrawStats.arrowDrawCalls++;
+            glBindVertexArray(0);
+            glUseProgram(0);
+            endPass();
+        }
+        sphereDrawStats.arrows += count;
+        sphereDrawStats.arrowSeconds += nowSeconds() - start;
+    }
+
+    animateParticles(); // the sparks still fly, they are only drawn by the old path
+}
+
+/// @brief draw a state with the fixed function pipeline
+void drawSceneLegacy(const SceneState &state)
+{
+    // Set up the model-view matrix
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    // Position camera using the eye, center and up vectors the simulation handed over
+    gluLookAt(state.eye[0], state.eye[1], state.eye[2],          // Camera position
+              state.center[0], state.center[1], state.center[2], // Look-at point
+              state.up[0], state.up[1], state.up[2]);            // Up vector
+
+    // only what is in the view is drawn, the spheres on the GPU are all drawn
+    bool gpuSpheres = useGpuPhysics && gpuPhysics.ready;
+    Frustum frustum = currentFrustum();
+    if (!gpuSpheres)
+    {
+        cullSpheres(state, frustum, visibleSpheres);
+        cullStats.frames++;
+    }
+    float roomLow[3] = {0.0f, 0.0f, 0.0f}, roomHigh[3] = {cubeSize, cubeSize, cubeSize};
+    float axesLow[3] = {0.0f, 0.0f, 0.0f}, axesHigh[3] = {1.0f, 1.0f, 1.0f};
+
+    // Draw objects based on visibility flags, every pass timed on the GPU
+    if (!useFrustumCulling || boxInFrustum(frustum, roomLow, roomHigh))
+    {
+        beginPass(PASS_ROOM);
+        drawRoom();
+        endPass();
+    }
+    beginPass(PASS_BALLS);
+    if (gpuSpheres)
+        drawGpuSpheres();
+    else
+        drawSpheres(state.spheres, visibleSpheres);
+    endPass();
+    sphereDrawStats.frames++;
+    if (showArrow && !gpuSpheres)
+    {
+        beginPass(PASS_ARROWS);
+        drawVelocityArrows(state.spheres, visibleSpheres);
+        endPass();
+    }
+    if (isAxes && (!useFrustumCulling || boxInFrustum(frustum, axesLow, axesHigh)))
+    {
+        beginPass(PASS_AXES);
+        drawAxes();
+        endPass();
+    }
+
+    // the sparks of the impacts are drawn last, they are see-through
+    animateParticles();
+    beginPass(PASS_SPARKS);
+    drawParticles(particles);
+    endPass();
+}
+
+/// @brief draw the newest state into the bound framebuffer, without showing it
+void renderFrame()
+{
+    double frameStart = nowSeconds();
+    const SceneState &state = acquireSceneState(); // the newest state the simulation finished
+    if (useGpuPhysics && gpuPhysics.ready)
+        syncGpuPhysics(state); // the steps the simulation counted since the last frame
+    beginPassTimerFrame();
+
+    // Clear color and depth buffers
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glrecordFrame();
+
+    if (useCoreProfile)
+        drawSceneCore(state);
+    else
+        drawSceneLegacy(state);
+
+    double frameEnd = nowSeconds();
+    double stateAge = frameEnd - state.publishTime;
+    threadTimings.frames++;
+    threadTimings.drawSeconds += frameEnd - frameStart;
+    threadTimings.stateAgeSeconds += stateAge;
+    threadTimings.maxStateAgeSeconds = max(threadTimings.maxStateAgeSeconds, stateAge);
+}
+
+/**
+ * Main display function
+ * Sets up the camera and renders visible objects
+ */
+void display()
+{
+    renderFrame();
+    captureFrame(); // before the swap, the back buffer is undefined after it
+
+    // Swap buffers (double buffering)
+    glutSwapBuffers();
+}
+
+/**
+ * Window reshape callback
+ * Handles window resizing and maintains aspect ratio
+ */
+void reshapeListener(GLsizei width, GLsizei height)
+{
+    // Prevent division by zero
+    if (height == 0)
+        height = 1;
+
+    // Calculate aspect ratio
+    GLfloat aspect = (GLfloat)width / (GLfloat)height;
+
+    // Set viewport to cover entire window
+    glViewport(0, 0, width, height);
+    viewAspect = aspect;
+    if (useCoreProfile)
+        return; // the core backend makes its projection matrix itself every frame
+
+    // Set up perspective projection
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+
+    // 45-degree field of view, aspect ratio, near and far clipping planes
+    gluPerspective(fieldOfView, aspect, nearPlane, farPlane);
+}
+
+/**
+ * Applies a standard key on the simulation thread
+ * Manages camera position, sphere speed, pausing and resetting
+ */
+void applyKey(unsigned char key)
+{
+    // Calculate view direction vector
+    double lx = centerx - eyex;
+    double lz = centerz - eyez;
+    double s;
+
+    switch (key)
+    {
+    case '1':
+    {
+        // we are getting the vector which originates from the camera position to the reference point
+        double caX = centerx - eyex;
+        double caY = centery - eyey;
+        double caZ = centerz - eyez;
+
+        // we are calculating the cross product of the new vector and the head vector
+        double crossX = upy * caZ - upz * caY;
+        double crossY = upz * caX - upx * caZ;
+        double crossZ = upx * caY - upy * caX;
+        // as a result the new cross vector will be the perpendicular of the head and the camera to refernce point vector
+        // so it might be on the left or on the right side of the current camera position
+
+        // getting the magnitude value of the cross product vector
+        double crossMag = sqrt(crossX * crossX + crossY * crossY + crossZ * crossZ);
+        // Now, we are making the the new t vector as the unit vector for the direction of cross vector
+        double tX = crossX / crossMag;
+        double tY = crossY / crossMag;
+        double tZ = crossZ / crossMag;
+        // Now, we are incrementing the camera position in the direction of the t vector
+        double daX = tX * rotationSpeed;
+        double daY = tY * rotationSpeed;
+        double daZ = tZ * rotationSpeed;
+
+        centerx = centerx + daX;
+        centery = centery + daY;
+        centerz = centerz + daZ;
+        break;
+    }
+    case '2':
+    {
+        // we are getting the vector which originates from the camera position to the reference point
+        double caX = centerx - eyex;
+        double caY = centery - eyey;
+        double caZ = centerz - eyez;
+
+        // we are calculating the cross product of the new vector and the head vector
+        double crossX = upy * caZ - upz * caY;
+        double crossY = upz * caX - upx * caZ;
+        double crossZ = upx * caY - upy * caX;
+
+        // getting the magnitude value of the cross product vector
+        double crossMag = sqrt(crossX * crossX + crossY * crossY + crossZ * crossZ);
+        double tX = crossX / crossMag;
+        double tY = crossY / crossMag;
+        double tZ = crossZ / crossMag;
+
+        // Now, we are calculating the value to change 
+        double daX = tX * rotationSpeed;
+        double daY = tY * rotationSpeed;
+        double daZ = tZ * rotationSpeed;
+        // Now, we are decrementing the camera position in the direction of the t vector
+        centerx = centerx - daX;
+        centery = centery - daY;
+        centerz = centerz - daZ;
+        break;
+    }
+    case '3': // Rotate camera upwards
+    {
+        float ROTATION_ANGLE = rotationSpeed;
+        //  the new vector vireDir is the vector from the camera to the reference point
+        float viewDirx = centerx - eyex;
+        float viewDiry = centery - eyey;
+        float viewDirz = centerz - eyez;
+
+        // Normalize the view direction
+        // getting the magnitude of the viewDir vector
+        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
+        // now we are normalizing the viewDir vector as a unit vector
+        viewDirx /= viewLength;
+        viewDiry /= viewLength;
+        viewDirz /= viewLength;
+
+        // Normalize the up vector to get  the direction unit vector
+        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
+        upx /= upLength;
+        upy /= upLength;
+        upz /= upLength;
+
+
+        // we will create a rotation matrix around the up vector
+        float cosAngle = cos(ROTATION_ANGLE);
+        float sinAngle = sin(ROTATION_ANGLE);
+
+        // Rotate the view direction, this is the new view direction from the camera to the reference point, here there is ROTATION ANGLE difference from now viewDir vector, and 90 - ROTATION ANGLE reference from the up vector, so we just add cos angle with viewDir anmd sin angle with up vector
+        float newViewDirx = viewDirx * cosAngle + upx * sinAngle;
+        float newViewDiry = viewDiry * cosAngle + upy * sinAngle;
+        float newViewDirz = viewDirz * cosAngle + upz * sinAngle;
+
+        // Rotate the up vector, this is the new up vector here there is ROTATION ANGLE difference from now up vector, and 90 + ROTATION ANGLE difference from the viewDir vector, so we just subtract cos angle with up vector and sin angle with viewDir vector
+        float newUpx = upx * cosAngle - viewDirx * sinAngle;
+        float newUpy = upy * cosAngle - viewDiry * sinAngle;
+        float newUpz = upz * cosAngle - viewDirz * sinAngle;
+
+        // Update the center position by adding the new view direction with the camera position to get the new center
+        centerx = eyex + newViewDirx * viewLength;
+        centery = eyey + newViewDiry * viewLength;
+        centerz = eyez + newViewDirz * viewLength;
+ 
+        // Update the up vector 
+        upx = newUpx;
+        upy = newUpy;
+        upz = newUpz;
+        break;
+    }
+    case '4': // Rotate camera downwards
+    {
+        // the new vector vireDir is the vector from the camera to the reference point
+        float ROTATION_ANGLE = -rotationSpeed;
+        float viewDirx = centerx - eyex;
+        float viewDiry = centery - eyey;
+        float viewDirz = centerz - eyez;
+
+        // Normalize the view direction vector as a unit vector
+        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
+        viewDirx /= viewLength;
+        viewDiry /= viewLength;
+        viewDirz /= viewLength;
+
+        // Normalize the up vector as a unit vector 
+        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
+        upx /= upLength;
+        upy /= upLength;
+        upz /= upLength;
+
+
+        // Create rotation matrix around the right vector 
+        float cosAngle = cos(ROTATION_ANGLE);
+        float sinAngle = sin(ROTATION_ANGLE);
+        // here the rotation angle is the angle between the right vector and the view direction vector, so we just add cos angle with viewDir anmd sin angle with right vector
+        // so as it is minus, it will rotate at the different direction
+        // Rotate the view direction vector this is the new view direction from the camera to the reference point here there is ROTATION ANGLE difference from now viewDir vector, and 90 - ROTATION ANGLE reference from the up vector, so we just add cos angle with viewDir anmd sin angle with up vector
+        float newViewDirx = viewDirx * cosAngle + upx * sinAngle;
+        float newViewDiry = viewDiry * cosAngle + upy * sinAngle;
+        float newViewDirz = viewDirz * cosAngle + upz * sinAngle;
+
+        // Rotate the up vector this is the new up vector, here there is ROTATION ANGLE difference from now up vector, and 90 + ROTATION ANGLE difference from the viewDir vector, so we just subtract cos angle with up vector and sin angle with viewDir vector
+        float newUpx = upx * cosAngle - viewDirx * sinAngle;
+        float newUpy = upy * cosAngle - viewDiry * sinAngle;
+        float newUpz = upz * cosAngle - viewDirz * sinAngle;
+
+        // Update the center position by adding the new view direction with the camera position to get the new center
+        centerx = eyex + newViewDirx * viewLength;
+        centery = eyey + newViewDiry * viewLength;
+        centerz = eyez + newViewDirz * viewLength;
+
+        // Update the up vector 
+        upx = newUpx;
+        upy = newUpy;
+        upz = newUpz;
+        break;
+    }
+    case '5':
+    {
+
+        float TILT_ANGLE = rotationSpeed; // Positive for clockwise, negative for counter-clockwise
+
+        // Calculate the view direction vector from the camera to the reference point
+        float viewDirx = centerx - eyex;
+        float viewDiry = centery - eyey;
+        float viewDirz = centerz - eyez;
+
+        // Normalize the view direction vector as a unit vector
+        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
+        viewDirx /= viewLength;
+        viewDiry /= viewLength;
+        viewDirz /= viewLength;
+
+        // Normalize the up vector as a unit vector
+        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
+        upx /= upLength;
+        upy /= upLength;
+        upz /= upLength;
+
+        // Calculate the right vector 
+        // cross product of view direction and up vector
+        float rightx = viewDiry * upz - viewDirz * upy;
+        float righty = viewDirz * upx - viewDirx * upz;
+        float rightz = viewDirx * upy - viewDiry * upx;
+
+        // Create rotation matrix using Rodrigues' rotation formula
+        float cosAngle = cos(TILT_ANGLE);
+        float sinAngle = sin(TILT_ANGLE);
+
+        // Rotate the up vector around the view direction axis, as the TILT_ANGLE differencec from the current up vector, and 90 - TILT_ANGLE difference from the right vector, so we just add cos angle with up vector and sin angle with right vector
+        float newUpx = upx * cosAngle + rightx * sinAngle;
+        float newUpy = upy * cosAngle + righty * sinAngle;
+        float newUpz = upz * cosAngle + rightz * sinAngle;
+
+        // Update the up vector
+        upx = newUpx;
+        upy = newUpy;
+        upz = newUpz;
+
+        // We make the up vector again the unit vector for the next rotation
+        upLength = sqrt(upx * upx + upy * upy + upz * upz);
+        upx /= upLength;
+        upy /= upLength;
+        upz /= upLength;
+        break;
+    }
+    case '6':
+    {
+
+        float TILT_ANGLE = -rotationSpeed; // Positive for clockwise, negative for counter-clockwise
+
+        // Calculate the view direction vector from the camera to the reference point
+        float viewDirx = centerx - eyex;
+        float viewDiry = centery - eyey;
+        float viewDirz = centerz - eyez;
+
+        // Normalize the view direction vector as a unit vector
+        float viewLength = sqrt(viewDirx * viewDirx + viewDiry * viewDiry + viewDirz * viewDirz);
+        viewDirx /= viewLength;
+        viewDiry /= viewLength;
+        viewDirz /= viewLength;
+
+        // Normalize the up vector as a unit vector
+        float upLength = sqrt(upx * upx + upy * upy + upz * upz);
+        upx /= upLength;
+        upy /= upLength;
+        upz /= upLength;
+
+        // Calculate the right vector 
+        // cross product of view direction and up vector
+        float rightx = viewDiry * upz - viewDirz * upy;
+        float righty = viewDirz * upx - viewDirx * upz;
+        float rightz = viewDirx * upy - viewDiry * upx;
+
+        // Create rotation matrix using Rodrigues' rotation formula
+        float cosAngle = cos(TILT_ANGLE);
+        float sinAngle = sin(TILT_ANGLE);
+
+        // Rotate the up vector around the view direction axis , as the TILT_ANGLE differencec from the current up vector, and 90 - TILT_ANGLE difference from the right vector, so we just add cos angle with up vector and sin angle with right vector
+        float newUpx = upx * cosAngle + rightx * sinAngle;
+        float newUpy = upy * cosAngle + righty * sinAngle;
+        float newUpz = upz * cosAngle + rightz * sinAngle;
+
+        // Update the up vector
+        upx = newUpx;
+        upy = newUpy;
+        upz = newUpz;
+
+        // We make the up vector again the unit vector for the next rotation
+        upLength = sqrt(upx * upx + upy * upy + upz * upz);
+        upx /= upLength;
+        upy /= upLength;
+        upz /= upLength;
+        break;
+    }
+
+   
+
+    case 'w':
+    {
+        // Move camera up without changing the reference point
+        eyey += movementSpeed;
+        break;
+    }
+    case 's':
+        eyey -= movementSpeed;
+        break; // Move camera down withiout changing the refernce point
+
+    case 't':
+        centerz += movementSpeed;
+        break; // Move look-at point forward
+    case 'y':
+        centerz -= movementSpeed;
+        break; // Move look-at point backward
+    case '*':
+        movementSpeed += 0.1f;
+        rotationSpeed += 0.1f;
+        break;
+    case '/':
+        movementSpeed -= 0.1f;
+        rotationSpeed -= 0.1f;
+        break;
+    case '+':
+        velocityChange += increasePerPlus; // with --gpu-physics the spheres on the GPU get it from the next state
+        if (!useGpuPhysics)
+            for (Sphere &sphere : spheres)
+            {
+                sphere.velocity[0] += increasePerPlus;
+                sphere.velocity[1] += increasePerPlus;
+                sphere.velocity[2] += increasePerPlus;
+            }
+        break;
+    case '-':
+        velocityChange -= increasePerPlus;
+        if (!useGpuPhysics)
+            for (Sphere &sphere : spheres)
+            {
+                sphere.velocity[0] -= increasePerPlus;
+                sphere.velocity[1] -= increasePerPlus;
+                sphere.velocity[2] -= increasePerPlus;
+            }
+        break;
+    case ' ':
+        paused = !paused;
+        break;
+    case 'r':
+        if (paused)
+        {
+            initSpheres(); // only reset key is appliable if paused currently
+            sphereResets++;
+        }
+        break;
+    }
+}
+
+/**
+ * Applies a special key (arrow keys, function keys) on the simulation thread
+ * Provides camera orbit functionality
+ */
+void applySpecialKey(int key)
+{
+
+    // Calculate view direction vector
+    double lx = centerx - eyex;
+    double lz = centerz - eyez;
+    double s;
+
+    switch (key)
+    {
+
+    case GLUT_KEY_LEFT:
+    {
+        // Calculate the vector from the camera to the reference point
+        double cx = centerx - eyex;
+        double cy = centery - eyey;
+        double cz = centerz - eyez;
+
+        // Calculate the cross product of the head vector and the camera-reference point vector
+        double leftx = upy * cz - upz * cy;
+        double lefty = upz * cx - upx * cz;
+        double leftz = upx * cy - upy * cx;
+        // Now the cross product of the head vector and the camera-reference point vector is the left vector
+        // as cross vector is at the perpendicular of two vectors
+
+        // Normalize the left vector as we only need the unit vector (direction)
+        double length = sqrt(leftx * leftx + lefty * lefty + leftz * leftz); // calculating the length
+        leftx /= length;
+        lefty /= length;
+        leftz /= length;
+
+        // Move the camera position in the left direction by the movement speed
+        eyex += leftx * movementSpeed;
+        eyey += lefty * movementSpeed;
+        eyez += leftz * movementSpeed;
+
+        // Move the look-at point in the left direction by the movement speed
+        centerx += leftx * movementSpeed;
+        centery += lefty * movementSpeed;
+        centerz += leftz * movementSpeed;
+
+        break;
+    }
+
+    case GLUT_KEY_RIGHT:
+    {
+        // Calculate the vector from the camera to the reference point
+        double cx = centerx - eyex;
+        double cy = centery - eyey;
+        double cz = centerz - eyez;
+
+        // Calculate the cross product of the head vector and the camera-reference point vector
+        double rightx = upy * cz - upz * cy;
+        double righty = upz * cx - upx * cz;
+        double rightz = upx * cy - upy * cx;
+        // Now the cross product of the head vector and the camera-reference point vector is the right vector
+        // as cross vector is at the perpendicular of two vectors
+        // Normalize the right vector as we only need the unit vector (direction)
+        double length = sqrt(rightx * rightx + righty * righty + rightz * rightz); // calculating the length
+        rightx /= length;
+        righty /= length;
+        rightz /= length;
+
+        // Move the camera position in the right direction by the movement speed
+        eyex -= rightx * movementSpeed;
+        eyey -= righty * movementSpeed;
+        eyez -= rightz * movementSpeed;
+
+        // Move the look-at point in the right direction by the movement speed
+        centerx -= rightx * movementSpeed;
+        centery -= righty * movementSpeed;
+        centerz -= rightz * movementSpeed;
+
+        break;
+    }
+
+    case GLUT_KEY_UP:
+    {
+        // Calculate the vector from the camera to the reference point
+        double cx = centerx - eyex;
+        double cy = centery - eyey;
+        double cz = centerz - eyez;
+
+        // Normalize the vector as we only need the unit vector (direction)
+        double length = sqrt(cx * cx + cy * cy + cz * cz);
+        cx /= length;
+        cy /= length;
+        cz /= length;
+
+        // Move the camera position towards the c vector by a single movementSpeed unit
+        eyex += cx * movementSpeed;
+        eyey += cy * movementSpeed;
+        eyez += cz * movementSpeed;
+
+        // Move the look-at point towards the c vector by a single movementSpeed unit
+        centerx += cx * movementSpeed;
+        centery += cy * movementSpeed;
+        centerz += cz * movementSpeed;
+
+        break;
+    }
+
+    case GLUT_KEY_DOWN:
+    {
+        // Calculate the vector from the camera to the reference point
+        double cx = centerx - eyex;
+        double cy = centery - eyey;
+        double cz = centerz - eyez;
+
+        // Normalize the vector as we only need the unit vector (direction)
+        double length = sqrt(cx * cx + cy * cy + cz * cz);
+        cx /= length;
+        cy /= length;
+        cz /= length;
+
+        // Move the camera position away from the c vector by a single movementSpeed unit
+        eyex -= cx * movementSpeed;
+        eyey -= cy * movementSpeed;
+        eyez -= cz * movementSpeed;
+
+        // Move the look-at point away from the c vector by a single movementSpeed unit
+        centerx -= cx * movementSpeed;
+        centery -= cy * movementSpeed;
+        centerz -= cz * movementSpeed;
+
+        break;
+    }
+    case GLUT_KEY_PAGE_UP:
+    {
+        // here we know the up side is the side of the head vector, which in this case is the up vector
+        // Move the camera position along the head vector by a single unit
+        eyex += upx * movementSpeed;
+        eyey += upy * movementSpeed;
+        eyez += upz * movementSpeed;
+
+        // Move the reference point towards the up vector by a single unit of movement speed
+        centerx += upx * movementSpeed;
+        centery += upy * movementSpeed;
+        centerz += upz * movementSpeed;
+
+        break;
+    }
+
+    case GLUT_KEY_PAGE_DOWN:
+    {
+        // here we know the down side is the other side of the head vector, which in this case is the up vector
+        // Move the camera position along the opposite direction of the head vector by a single unit
+        eyex -= upx * movementSpeed;
+        eyey -= upy * movementSpeed;
+        eyez -= upz * movementSpeed;
+
+        // Move the reference point towards the opposite direction of the up vector by a single unit of movement speed
+        centerx -= upx * movementSpeed;
+        centery -= upy * movementSpeed;
+        centerz -= upz * movementSpeed;
+
+        break;
+    }
+    }
+}
+
+/**
+ * Keyboard input handler for standard keys
+ * Object visibility and program exit are handled right here, everything else goes to the simulation thread
+ */
+void keyboardListener(unsigned char key, int x, int y)
+{
+    switch (key)
+    {
+    // --- Object Visibility Toggles ---
+    case 'a':
+        isAxes = !isAxes;
+        break; // Toggle axes
+    case 'c':
+        isCube = !isCube;
+        break; // Toggle cube
+    case 'p':
+        isPyramid = !isPyramid;
+        break; // Toggle pyramid
+    case 'v':
+        showArrow = !showArrow; // toggle the arrow of the sphere velocity
+        break;
+    case 'i':
+        printThreadTimings(); // how long the render and the simulation waited for each other
+        printCommandLatency();
+        printStepAllocations();
+        printParticleStats();
+        printSphereDrawStats();
+        printCullStats();
+        printCaptureStats();
+        printPassTimes();
+        glrecordPrintStats();
+        break;
+    case 'q':
+        usePassTimers = !usePassTimers; // time the passes on the GPU, or not
+        break;
+    case 'm':
+        printSphereDrawStats(); // the numbers of the old way, before switching
+        sphereRenderMode = (SphereRenderMode)((sphereRenderMode + 1) % SPHERE_RENDER_MODES); // immediate mode, cached mesh, instanced or impostors
+        break;
+    case 'l':
+        printSphereDrawStats(); // the numbers before switching
+        useSphereLod = !useSphereLod; // a mesh per ball by its size on the screen, or always the finest one
+        break;
+    case 'g':
+        printSphereDrawStats(); // the numbers before switching
+        useStripeShader = !useStripeShader; // stripes per pixel in a shader, or the colors of the vertices
+        break;
+    case 'o':
+        printCullStats(); // the numbers before switching
+        useFrustumCulling = !useFrustumCulling; // skip the balls outside of the view, or draw everything
+        break;
+    case 'f':
+        useFloorTexture = !useFloorTexture; // one textured quad or one quad per tile, the room list is made again
+        break;
+
+    // --- Program Control ---
+    case 27:
+        stopPassTimers();
+        stopFrameCapture(true); // the frames still in the ring need the GL context
+        exit(0);
+        break; // ESC key: exit program
+
+    default:
+        pushCommand(KEY_COMMAND, key); // camera, speed, pause and reset belong to the simulation
+        break;
+    }
+
+    glutPostRedisplay(); // Request a screen refresh
+}
+
+/**
+ * Special key input handler (arrow keys, function keys)
+ * The camera belongs to the simulation thread, so the key is sent to it
+ */
+void specialKeyListener(int key, int x, int y)
+{
+    pushCommand(SPECIAL_KEY_COMMAND, key);
+}
+
+/**
+ * Mouse input handler, the wheel moves the camera forward and back on the simulation thread
+ */
+void mouseListener(int button, int state, int x, int y)
+{
+    pushCommand(MOUSE_COMMAND, button, state);
+}
+
+// Simulate physics
+
+/**
+ * Draw coordinate axes
+ * X axis: red, Y axis: green, Z axis: blue
+ */
+void drawAxes()
+{
+    glLineWidth(3); // Set line thickness
+
+    GLRECORD_BEGIN(GL_LINES); // the same six vertices every frame, drawn from their recording
+
+    // X axis (red)
+    glrecordColor3f(1, 0, 0);
+    glrecordVertex3f(0, 0, 0);
+    glrecordVertex3f(1, 0, 0);
+
+    // Y axis (green)
+    glrecordColor3f(0, 1, 0);
+    glrecordVertex3f(0, 0, 0);
+    glrecordVertex3f(0, 1, 0);
+
+    // Z axis (blue)
+    glrecordColor3f(0, 0, 1);
+    glrecordVertex3f(0, 0, 0);
+    glrecordVertex3f(0, 0, 1);
+
+    glrecordEnd();
+}
+
+
+/// @brief draws a checkered floor made of alternating black and white square tiles
+/// @param size what will be the size of the floor
+/// @param tiles how many tiles in each direction
+void drawCheckeredFloor(float size, int tiles)
+{
+    // Set up the colors
+    GLfloat white[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    GLfloat black[] = {0.0f, 0.0f, 0.0f, 1.0f};
+
+    float tileSize = size / tiles;
+
+    // Draw the floor on XZ plane starting from (0,0,0)
+    glBegin(GL_QUADS);
+    for (int x = 0; x < tiles; x++)
+    {
+        for (int z = 0; z < tiles; z++)
+        {
+            if ((x + z) % 2 == 0)
+            {
+                glColor4fv(white); // checking the color of the tile
+            }
+            else
+            {
+                glColor4fv(black);
+            }
+
+            // draws a tile of the floor which will be tilesize length long, and xz plane
+            glVertex3f(x * tileSize, 0.0f, z * tileSize);
+            glVertex3f((x + 1) * tileSize, 0.0f, z * tileSize);
+            glVertex3f((x + 1) * tileSize, 0.0f, (z + 1) * tileSize);
+            glVertex3f(x * tileSize, 0.0f, (z + 1) * tileSize);
+        }
+    }
+    glEnd();
+}
+
+// --- Textured Floor ---
+// The floor can also be one big quad with a repeating checker texture. Its cost does not depend on how many
+// tiles the room has. One texture repeat is 2x2 tiles. Up close the texture is sampled with GL_NEAREST, which
+// keeps the tile edges sharp because they lie on texel edges. Far away it is sampled from mipmaps, which fade
+// to grey, so the distant tiles do not shimmer.
+
+/// @brief the checker texture, made the first time the room is built
+GLuint floorTexture = 0;
+
+/// @brief make the mipmapped checker texture, it must not be called while a display list is being compiled
+void initFloorTexture()
+{
+    if (floorTexture != 0)
+        return;
+    const int size = 2 * floorTexelsPerTile;
+    vector<unsigned char> texels(size * size);
+    for (int t = 0; t < size; t++)
+        for (int s = 0; s < size; s++)
+            texels[t * size + s] = ((s / floorTexelsPerTile + t / floorTexelsPerTile) % 2 == 0) ? 255 : 0; // tile (0,0) is white
+
+    glGenTextures(1, &floorTexture);
+    glBindTexture(GL_TEXTURE_2D, floorTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_LUMINANCE, size, size, GL_LUMINANCE, GL_UNSIGNED_BYTE, texels.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    if (GLEW_EXT_texture_filter_anisotropic)
+    {
+        // the floor is seen at a flat angle, so it is blurred much less with anisotropic filtering
+        GLfloat maxAnisotropy = 1.0f;
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, min(maxAnisotropy, 8.0f));
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/// @brief draws the same floor as drawCheckeredFloor with a single textured quad
+/// @param size what will be the size of the floor
+/// @param tiles how many tiles in each direction
+void drawTexturedFloor(float size, int tiles)
+{
+    float repeats = tiles / 2.0f; // the texture holds 2x2 tiles
+
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, floorTexture);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f);
+    glVertex3f(0.0f, 0.0f, 0.0f);
+    glTexCoord2f(repeats, 0.0f);
+    glVertex3f(size, 0.0f, 0.0f);
+    glTexCoord2f(repeats, repeats);
+    glVertex3f(size, 0.0f, size);
+    glTexCoord2f(0.0f, repeats);
+    glVertex3f(0.0f, 0.0f, size);
+    glEnd();
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+}
+
+void drawCubeWithCheckeredFloor()
+{
+    // Set up the cube's dimensions
+
+    int tiles = cubeSize;
+    // Number of tiles in each direction
+
+    // Set up the colors
+    GLfloat wallColor[] = {0.5f, 1.0f, 0.5f, 1.0f}; // the color of the walls
+    GLfloat ceilingColor[] = {0.5f, 0.5f, 0.5f, 1.0f}; // the color of the ceiling
+
+    // Draw the checkered floor starting from origin
+    if (useFloorTexture)
+        drawTexturedFloor(cubeSize, tiles);
+    else
+        drawCheckeredFloor(cubeSize, tiles);
+
+    // Draw the walls
+    glBegin(GL_QUADS);
+    glColor4fv(wallColor);
+    // Front wall with the wall color
+    glVertex3f(0.0f, 0.0f, 0.0f);
+    glVertex3f(cubeSize, 0.0f, 0.0f);
+    glVertex3f(cubeSize, cubeSize, 0.0f);
+    glVertex3f(0.0f, cubeSize, 0.0f);
+
+    // drawing the back wall with the wall color
+    glVertex3f(0.0f, 0.0f, cubeSize);
+    glVertex3f(cubeSize, 0.0f, cubeSize);
+    glVertex3f(cubeSize, cubeSize, cubeSize);
+    glVertex3f(0.0f, cubeSize, cubeSize);
+
+    // drawing the left wall with the wall color
+    glVertex3f(0.0f, 0.0f, 0.0f);
+    glVertex3f(0.0f, 0.0f, cubeSize);
+    glVertex3f(0.0f, cubeSize, cubeSize);
+    glVertex3f(0.0f, cubeSize, 0.0f);
+
+    // drawing the right wall with the wall color
+    glVertex3f(cubeSize, 0.0f, 0.0f);
+    glVertex3f(cubeSize, 0.0f, cubeSize);
+    glVertex3f(cubeSize, cubeSize, cubeSize);
+    glVertex3f(cubeSize, cubeSize, 0.0f);
+    glEnd();
+
+    // Drawing the ceiling with the color of the ceiling
+    glBegin(GL_QUADS);
+    glColor4fv(ceilingColor); // cahnge the color as the color of the ceiling is different from the wall color
+    glVertex3f(0.0f, cubeSize, 0.0f);
+    glVertex3f(cubeSize, cubeSize, 0.0f);
+    glVertex3f(cubeSize, cubeSize, cubeSize);
+    glVertex3f(0.0f, cubeSize, cubeSize);
+    glEnd();
+}
+
+/// @brief the room never moves, so its quads are compiled into a display list once and not sent again every frame
+GLuint roomList = 0;
+/// @brief the cubeSize the display list was made with, it is made again when cubeSize changes
+float roomListSize = -1.0f;
+/// @brief the floor the display list was made with, it is made again when key f switches the floor
+bool roomListFloorTexture = false;
+
+/// @brief draw the floor, the walls and the ceiling with a single glCallList
+void drawRoom()
+{
+    if (roomList == 0)
+        roomList = glGenLists(1);
+    if (roomListSize != cubeSize || roomListFloorTexture != useFloorTexture)
+    {
+        if (useFloorTexture)
+            initFloorTexture();
+        glNewList(roomList, GL_COMPILE);
+        drawCubeWithCheckeredFloor();
+        glEndList();
+        roomListSize = cubeSize;
+        roomListFloorTexture = useFloorTexture;
+    }
+    glCallList(roomList);
+}
+
+/**
+ * Timer function for animation.
+ * This demonstrates the use of a timer instead of idle function.
+ * Timer functions provide better control over animation speed.
+ * The physics itself runs on the simulation thread, the timer only asks for a new frame.
+ *
+ * @param value Value passed to the timer function (not used here)
+ */
+void timerFunction(int value)
+{
+    // show the waiting times in the title once per second
+    static double lastTitle = nowSeconds();
+    static long long lastFrames = 0, lastSteps = 0;
+    double now = nowSeconds();
+    if (now - lastTitle >= 1.0)
+    {
+        long long frames = threadTimings.frames - lastFrames;
+        long long steps = threadTimings.steps - lastSteps;
+        char title[320], passes[160];
+        formatPassTimes(passes, sizeof(passes));
+        snprintf(title, sizeof(title), "OpenGL 3D Drawing - %.0f fps, %.0f steps/s, %lld stale frames, %lld balls visible, %lld culled%s",
+                 frames / (now - lastTitle), steps / (now - lastTitle), threadTimings.staleFrames,
+                 cullStats.lastVisible, cullStats.lastCulled, passes);
+        glutSetWindowTitle(title);
+        lastTitle = now;
+        lastFrames = threadTimings.frames;
+        lastSteps = threadTimings.steps;
+    }
+
+    // Request a redisplay
+    glutPostRedisplay();
+
+    // Register the timer again
+    glutTimerFunc(animationSpeed, timerFunction, 0);
+}
+
+/// @brief how many frames the --particle-bench run simulates, 0 means the normal window
+int particleBenchmarkFrames = 0;
+
+// --- Frame Capture ---
+// With --frames PREFIX every frame the window shows is also written to PREFIX0000.ppm, PREFIX0001.ppm ...
+// Reading the pixels straight into memory would make the CPU wait until the GL has finished the frame. So
+// glReadPixels goes into one of a ring of three pixel buffer objects, and a fence marks when the copy is done.
+// The buffer of frame N - 2 is mapped while frame N is drawn, by then its fence has normally been passed and
+// mapping does not wait. The pixels are copied into one of a few buffers that a background thread writes to
+// disk. When the disk is too slow and all buffers are waiting, the frame is dropped instead of slowing down
+// the window. The --headless run waits for a buffer instead, so that it writes every frame. Without fences
+// (ARB_sync) the pixels are read directly and every frame waits.
+
+/// @brief how many pixel buffer objects the ring has
+const int captureRingSize = 3;
+/// @brief how many frames can wait for the encoder thread, more are dropped
+const int captureBufferCount = 8;
+
+/// @brief a frame waiting for the encoder thread
+typedef struct
+{
+    long long frame;
+    int buffer; // which of the capture buffers holds the pixels
+    int width, height;
+} CapturedFrame;
+
+/// @brief the ring of pixel buffers, the encoder thread and the numbers of the report
+typedef struct
+{
+    bool active;
+    string prefix;
+    bool asynchronous;                      // pixel buffers and fences, false if there is no ARB_sync
+    bool waitForEncoder;                    // wait for a free buffer instead of dropping the frame
+    int width, height;                      // the size of the frames in the ring
+    GLuint pixelBuffers[captureRingSize];
+    GLsync fences[captureRingSize];
+    long long slotFrames[captureRingSize];  // the frame in each pixel buffer, -1 if it is empty
+    long long nextFrame;
+
+    thread encoder;
+    mutex lock;
+    condition_variable ready;               // a frame was queued or stop was set
+    condition_variable bufferFreed;
+    vector<vector<unsigned char>> buffers;  // captureBufferCount frames of pixels
+    vector<int> freeBuffers;
+    deque<CapturedFrame> queue;             // frames for the encoder, oldest first
+    bool stop;
+
+    long long captured, dropped, lost, written, failed;
+    size_t longestQueue;
+    double issueSeconds;                    // glReadPixels into the pixel buffer and the fence
+    double waitSeconds;                     // waiting for fences, the direct glReadPixels or a free buffer
+    double copySeconds;                     // mapping the pixel buffer and copying the pixels out
+    double encodeSeconds;                   // the encoder thread writing the files
+} FrameCapture;
+
+FrameCapture frameCapture;
+
+/// @brief write the RGB pixels read from the framebuffer as a binary PPM, turned so the top row comes first
+/// @return false if the file could not be written
+bool writePPM(const string &path, const vector<unsigned char> &pixels, int width, int height)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL)
+        return false;
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    bool written = true;
+    for (int y = height - 1; y >= 0 && written; y--)
+        written = fwrite(&pixels[(size_t)y * width * 3], 1, width * 3, file) == (size_t)width * 3;
+    return fclose(file) == 0 && written;
+}
+
+/// @brief the loop of the encoder thread: write the frames in the queue until stop is set and the queue is empty
+void captureEncoderLoop()
+{
+    FrameCapture &capture = frameCapture;
+    unique_lock<mutex> lock(capture.lock);
+    while (true)
+    {
+        capture.ready.wait(lock, [&]
+                           { return capture.stop || !capture.queue.empty(); });
+        if (capture.queue.empty())
+            return; // stop was set and everything is written
+        CapturedFrame frame = capture.queue.front();
+        capture.queue.pop_front();
+        lock.unlock();
+
+        double start = nowSeconds();
+        char number[16];
+        snprintf(number, sizeof(number), "%04lld.ppm", frame.frame);
+        bool written = writePPM(capture.prefix + number, capture.buffers[frame.buffer], frame.width, frame.height);
+
+        lock.lock();
+        capture.encodeSeconds += nowSeconds() - start;
+        (written ? capture.written : capture.failed)++;
+        capture.freeBuffers.push_back(frame.buffer);
+        capture.bufferFreed.notify_one();
+    }
+}
+
+/// @brief take a free capture buffer for a frame of the given size
+/// @return the buffer, or -1 if the encoder is behind and all of them are waiting
+int takeCaptureBuffer(int width, int height)
+{
+    FrameCapture &capture = frameCapture;
+    unique_lock<mutex> lock(capture.lock);
+    if (capture.waitForEncoder)
+        capture.bufferFreed.wait(lock, [&]
+                                 { return !capture.freeBuffers.empty(); });
+    if (capture.freeBuffers.empty())
+        return -1;
+    int buffer = capture.freeBuffers.back();
+    capture.freeBuffers.pop_back();
+    capture.buffers[buffer].resize((size_t)width * height * 3); // only allocates the first time and after a resize
+    return buffer;
+}
+
+/// @brief hand a filled capture buffer to the encoder thread
+void queueCapturedFrame(long long frame, int buffer, int width, int height)
+{
+    FrameCapture &capture = frameCapture;
+    {
+        lock_guard<mutex> lock(capture.lock);
+        CapturedFrame captured = {frame, buffer, width, height};
+        capture.queue.push_back(captured);
+        capture.longestQueue = max(capture.longestQueue, capture.queue.size());
+    }
+    capture.ready.notify_one();
+    capture.captured++;
+}
+
+/// @brief map the pixel buffer of a ring slot, copy the frame out for the encoder and free the slot
+/// @param wait wait for the fence; without it the slot stays full if the GL is not done with it yet
+void collectCaptureSlot(int slot, bool wait)
+{
+    FrameCapture &capture = frameCapture;
+    if (capture.slotFrames[slot] < 0)
+        return;
+    double start = nowSeconds();
+    GLenum status = glClientWaitSync(capture.fences[slot], 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+    {
+        if (!wait)
+            return;
+        status = glClientWaitSync(capture.fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+    }
+    double waited = nowSeconds();
+    capture.waitSeconds += waited - start;
+    glDeleteSync(capture.fences[slot]);
+    capture.fences[slot] = 0;
+
+    int buffer = status == GL_WAIT_FAILED ? -1 : takeCaptureBuffer(capture.width, capture.height);
+    if (buffer < 0)
+        capture.dropped++;
+    else
+    {
+        size_t bytes = (size_t)capture.width * capture.height * 3;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pixelBuffers[slot]);
+        const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+        if (pixels != NULL)
+        {
+            memcpy(capture.buffers[buffer].data(), pixels, bytes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            queueCapturedFrame(capture.slotFrames[slot], buffer, capture.width, capture.height);
+        }
+        else
+        {
+            lock_guard<mutex> lock(capture.lock);
+            capture.freeBuffers.push_back(buffer);
+            capture.dropped++;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    capture.slotFrames[slot] = -1;
+    capture.copySeconds += nowSeconds() - waited;
+}
+
+/// @brief make the pixel buffers for frames of a size, after collecting what is still in the ring
+void resizeCaptureRing(int width, int height)
+{
+    FrameCapture &capture = frameCapture;
+    for (int slot = 0; slot < captureRingSize; slot++)
+        collectCaptureSlot(slot, true);
+    capture.width = width;
+    capture.height = height;
+    if (!capture.asynchronous)
+        return;
+    for (int slot = 0; slot < captureRingSize; slot++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pixelBuffers[slot]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)width * height * 3, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/// @brief start writing every frame to prefix0000.ppm, prefix0001.ppm ..., the GL context must be current
+/// @param waitForEncoder wait when the encoder is behind instead of dropping frames
+void startFrameCapture(const string &prefix, bool waitForEncoder)
+{
+    FrameCapture &capture = frameCapture;
+    capture.prefix = prefix;
+    capture.asynchronous = GLEW_ARB_sync;
+    capture.waitForEncoder = waitForEncoder;
+    capture.width = capture.height = 0;
+    capture.nextFrame = 0;
+    for (int slot = 0; slot < captureRingSize; slot++)
+        capture.slotFrames[slot] = -1, capture.fences[slot] = 0;
+    if (capture.asynchronous)
+        glGenBuffers(captureRingSize, capture.pixelBuffers);
+    capture.buffers.assign(captureBufferCount, vector<unsigned char>());
+    capture.freeBuffers.clear();
+    for (int buffer = 0; buffer < captureBufferCount; buffer++)
+        capture.freeBuffers.push_back(buffer);
+    capture.stop = false;
+    capture.encoder = thread(captureEncoderLoop);
+    capture.active = true;
+}
+
+/// @brief capture the frame that was just drawn, before the buffers are swapped
+void captureFrame()
+{
+    FrameCapture &capture = frameCapture;
+    if (!capture.active)
+        return;
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (viewport[2] != capture.width || viewport[3] != capture.height)
+        resizeCaptureRing(viewport[2], viewport[3]);
+    long long frame = capture.nextFrame++;
+    double start = nowSeconds();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    if (!capture.asynchronous)
+    {
+        // no fences: read straight into a capture buffer, the CPU waits for the GL to finish the frame
+        int buffer = takeCaptureBuffer(capture.width, capture.height);
+        if (buffer < 0)
+        {
+            capture.dropped++;
+            return;
+        }
+        glReadPixels(0, 0, capture.width, capture.height, GL_RGB, GL_UNSIGNED_BYTE, capture.buffers[buffer].data());
+        capture.waitSeconds += nowSeconds() - start;
+        queueCapturedFrame(frame, buffer, capture.width, capture.height);
+        return;
+    }
+
+    // the slot of this frame was collected one frame ago; if that had to give up, wait for it now
+    int slot = (int)(frame % captureRingSize);
+    collectCaptureSlot(slot, true);
+    double issued = nowSeconds();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pixelBuffers[slot]);
+    glReadPixels(0, 0, capture.width, capture.height, GL_RGB, GL_UNSIGNED_BYTE, 0); // returns before the copy is done
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capture.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    capture.slotFrames[slot] = frame;
+    capture.issueSeconds += nowSeconds() - issued;
+
+    // frame N - 2 has had a whole frame to arrive
+    collectCaptureSlot((int)((frame + 1) % captureRingSize), false);
+}
+
+/// @brief stop the capture: collect the frames still in the ring, let the encoder write everything and end it
+/// @param withGL false when the GL context may be gone (at exit), the frames still in the ring are then lost
+void stopFrameCapture(bool withGL)
+{
+    FrameCapture &capture = frameCapture;
+    if (!capture.active)
+        return;
+    for (int slot = 0; slot < captureRingSize; slot++)
+    {
+        long long frame = (capture.nextFrame + slot) % captureRingSize; // the oldest frames first
+        if (withGL)
+            collectCaptureSlot((int)frame, true);
+        else if (capture.slotFrames[frame] >= 0)
+            capture.lost++;
+    }
+    {
+        lock_guard<mutex> lock(capture.lock);
+        capture.stop = true;
+    }
+    capture.ready.notify_one();
+    capture.encoder.join();
+    if (withGL && capture.asynchronous)
+        glDeleteBuffers(captureRingSize, capture.pixelBuffers);
+    capture.active = false;
+}
+
+/// @brief print how much the capture cost the render thread and how many frames did not make it to disk, if any were captured
+void printCaptureStats()
+{
+    FrameCapture &capture = frameCapture;
+    if (capture.nextFrame == 0)
+        return; // nothing was captured
+    lock_guard<mutex> lock(capture.lock);
+    long long frames = capture.nextFrame;
+    printf("capture (%s): %lld frames, %lld written, %lld dropped because the encoder was behind, %lld lost at exit, %lld failed to write\n",
+           capture.asynchronous ? "pixel buffer ring" : "direct glReadPixels", capture.nextFrame, capture.written,
+           capture.dropped, capture.lost, capture.failed);
+    printf("  render thread per frame: %.3f ms reading into the ring, %.3f ms waiting, %.3f ms mapping and copying; "
+           "encoder: %.3f ms per frame, %zu frames queued at most\n",
+           capture.issueSeconds * 1e3 / frames, capture.waitSeconds * 1e3 / frames, capture.copySeconds * 1e3 / frames,
+           capture.encodeSeconds * 1e3 / max(1LL, capture.written + capture.failed), capture.longestQueue);
+}
+
+// --- Headless Rendering ---
+// With --headless F the program opens no window. It makes an EGL context without any surface (Mesa's
+// surfaceless platform where it exists, so no X server or Wayland is needed) and draws into a framebuffer
+// object of the size the window would have. The physics is stepped on the main thread once before every
+// frame and the sparks move a fixed time per frame, so the same options give the same frames every time.
+// The time per frame is printed at the end, with and without the readback, and with --frames every frame is
+// written as a binary PPM, which most image tools read.
+
+/// @brief how many frames the --headless run draws, 0 to open a window as usual
+int headlessFrames = 0;
+/// @brief where the --headless run writes its frames, empty to write none
+string headlessFramePrefix;
+/// @brief the size of the window, and of the offscreen framebuffer of the --headless run
+const int windowWidth = 640, windowHeight = 640;
+
+#ifdef __linux__
+/// @brief make an EGL context without a surface and make it current
+/// @return false if there is no EGL display or the context could not be made
+bool createHeadlessContext()
+{
+    EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+    const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (clientExtensions != NULL && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") != NULL)
+    {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay != NULL)
+            eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (eglDisplay == EGL_NO_DISPLAY)
+        eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API))
+        return false;
+
+    // without a surface type eglChooseConfig only looks at window configs, which the surfaceless platform has none of
+    const EGLint configAttributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(eglDisplay, configAttributes, &config, 1, &configCount) || configCount == 0)
+        return false;
+    const EGLint coreAttributes[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+    EGLContext context = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, useCoreProfile ? coreAttributes : NULL);
+    return context != EGL_NO_CONTEXT && eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+/// @brief make the EGL context and the offscreen framebuffer, and set up the GL the way main does for the window
+/// @return false if something is missing, after printing what
+bool initHeadlessRenderer()
+{
+    if (!createHeadlessContext())
+    {
+        printf("no EGL context for the headless run\n");
+        return false;
+    }
+    glewExperimental = GL_TRUE;
+    glewInit(); // GLEW may complain that there is no GLX display, the GL functions are loaded anyway
+
+    // the framebuffer the window would have: color and depth
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, windowWidth, windowHeight);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, windowWidth, windowHeight);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        printf("the offscreen framebuffer is not complete\n");
+        return false;
+    }
+
+    // the same set up as the window gets in main
+    glEnable(GL_DEPTH_TEST);
+    if (useCoreProfile && !initCoreRenderer())
+    {
+        printf("the core profile backend could not be set up\n");
+        return false;
+    }
+    if (!useCoreProfile)
+        glShadeModel(GL_SMOOTH);
+    initGL();
+    initParticlePool(particles, particleCapacity);
+    if (!useCoreProfile)
+        initParticleGraphics(particles);
+    if (showArrow && !useCoreProfile && !initVelocityArrows())
+        showArrow = false; // the one by one arrows need glutSolidCone, and there is no GLUT here
+    reshapeListener(windowWidth, windowHeight);
+    initPassTimers();
+    paused = false;
+    particleTimeStep = animationSpeed / 1000.0f;
+    return true;
+}
+#endif
+
+/// @brief draw headlessFrames frames into an offscreen framebuffer without a window, and print how long it took
+/// @return 0 if all frames were drawn and written
+int runHeadless()
+{
+#ifdef __linux__
+    if (!initHeadlessRenderer())
+        return 1;
+    printf("headless: %s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+    if (useGpuPhysics && !initGpuPhysics())
+        return 1;
+    initSpheres();
+    resetSceneStates();
+
+    if (!headlessFramePrefix.empty())
+        startFrameCapture(headlessFramePrefix, true);
+    double renderSeconds = 0.0, readSeconds = 0.0;
+    for (int frame = 0; frame < headlessFrames; frame++)
+    {
+        if (!useGpuPhysics)
+            updatePhysics(animationSpeed);
+        threadTimings.steps++;
+        publishSceneState(frame + 1);
+
+        double start = nowSeconds();
+        renderFrame();
+        glFinish(); // count the time the GL needs to finish the frame, not only the time to hand it the calls
+        double rendered = nowSeconds();
+        renderSeconds += rendered - start;
+
+        captureFrame();
+        readSeconds += nowSeconds() - rendered;
+    }
+    stopFrameCapture(true);
+    stopPassTimers();
+
+    int frames = max(1, headlessFrames);
+    printf("%d frames of %dx%d with %d balls: %.3f ms per frame drawn (%.1f fps)", headlessFrames, windowWidth,
+           windowHeight, ballCount, renderSeconds * 1e3 / frames, frames / max(renderSeconds, 1e-9));
+    if (!headlessFramePrefix.empty())
+        printf(", %.3f ms per frame to capture", readSeconds * 1e3 / frames);
+    printf("\n");
+    printSphereDrawStats();
+    printCullStats();
+    printPassTimes();
+    glrecordPrintStats();
+    if (!headlessFramePrefix.empty())
+    {
+        printCaptureStats();
+        if (frameCapture.failed > 0)
+        {
+            printf("could not write %lld frames to %s\n", frameCapture.failed, headlessFramePrefix.c_str());
+            return 1;
+        }
+    }
+    return 0;
+#else
+    printf("--headless needs EGL, which this build does not have\n");
+    return 1;
+#endif
+}
+
+// --- Benchmark ---
+// --bench F draws F frames without a window along a fixed camera path: one circle around the room, going up
+// and down and in and out, so the frames see the whole room, the balls from near and from far, and the room
+// from behind the walls. The balls move as in the --headless run, so the same options give the same frames.
+// For every frame it measures the physics step, the CPU time to hand the frame to the GL, the GPU time of the
+// frame (a timer query) and the time from one frame to the next. Like a swap chain it lets the CPU run at
+// most benchmarkQueryCount - 1 frames ahead of the GPU. The table shows min, median, p95, p99 and max, and
+// --bench-json writes the same with every single frame, to compare two builds.
+
+/// @brief how many frames the --bench run measures, 0 to not run it
+int benchmarkFrames = 0;
+/// @brief where the --bench run writes its results
+string benchmarkJsonPath = "benchmark.json";
+/// @brief frames drawn before the measured ones, so the caches, buffers and shaders are ready
+const int benchmarkWarmupFrames = 10;
+/// @brief how many timer queries are in flight, the CPU waits for the oldest one
+const int benchmarkQueryCount = 3;
+
+/// @brief the times of every measured frame, in milliseconds
+typedef struct
+{
+    vector<double> physics; // updatePhysics
+    vector<double> cpu;     // renderFrame, handing the frame to the GL
+    vector<double> gpu;     // the timer query around renderFrame, empty without ARB_timer_query
+    vector<double> frame;   // from the start of this frame to the start of the next
+} BenchmarkTimes;
+
+/// @brief min, percentiles and max of one kind of time
+typedef struct
+{
+    double min, median, p95, p99, max, mean;
+} BenchmarkSummary;
+
+/// @brief put the camera where the path is at a part of the way, 0 at the start and 1 at the end
+void setBenchmarkCamera(float along)
+{
+    float angle = 2.0f * pi * along;
+    float middle = cubeSize * 0.5f;
+    float distance = cubeSize * (0.35f + 0.3f * sin(2.0f * angle)); // out through the walls and back
+    eyex = middle + distance * cos(angle);
+    eyey = cubeSize * (0.5f + 0.3f * sin(3.0f * angle));
+    eyez = middle + distance * sin(angle);
+    centerx = middle, centery = cubeSize * 0.25f, centerz = middle;
+    upx = 0.0f, upy = 1.0f, upz = 0.0f;
+}
+
+/// @brief the nearest rank percentile of sorted times
+double percentile(const vector<double> &sorted, double fraction)
+{
+    size_t rank = (size_t)ceil(fraction * sorted.size());
+    return sorted[min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+BenchmarkSummary summarizeTimes(vector<double> times)
+{
+    BenchmarkSummary summary = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    if (times.empty())
+        return summary;
+    sort(times.begin(), times.end());
+    summary.min = times.front();
+    summary.median = percentile(times, 0.5);
+    summary.p95 = percentile(times, 0.95);
+    summary.p99 = percentile(times, 0.99);
+    summary.max = times.back();
+    for (double time : times)
+        summary.mean += time / times.size();
+    return summary;
+}
+
+/// @brief write a string as a JSON string, with quotes
+void writeJsonString(FILE *file, const char *text)
+{
+    fputc('"', file);
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            fprintf(file, "\\u%04x", *c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+/// @brief write the results of the --bench run as JSON
+/// @return false if the file could not be written
+bool writeBenchmarkJson(const string &path, const BenchmarkTimes &times, const char *renderer, const char *version)
+{
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == NULL)
+        return false;
+    fprintf(file, "{\n  \"build\": {\"compiler\": ");
+    writeJsonString(file, __VERSION__);
+    fprintf(file, ", \"date\": ");
+    writeJsonString(file, __DATE__ " " __TIME__);
+#if defined(__SSE2__)
+    fprintf(file, ", \"sse2\": true},\n");
+#else
+    fprintf(file, ", \"sse2\": false},\n");
+#endif
+    fprintf(file, "  \"renderer\": ");
+    writeJsonString(file, renderer);
+    fprintf(file, ",\n  \"version\": ");
+    writeJsonString(file, version);
+    fprintf(file, ",\n  \"settings\": {\"frames\": %d, \"warmup\": %d, \"balls\": %d, \"room\": %g, \"width\": %d, "
+                  "\"height\": %d, \"core\": %s, \"threads\": %d, \"culling\": %s, \"lod\": %s},\n",
+            benchmarkFrames, benchmarkWarmupFrames, ballCount, cubeSize, windowWidth, windowHeight,
+            useCoreProfile ? "true" : "false", physicsThreadCount, useFrustumCulling ? "true" : "false",
+            useSphereLod ? "true" : "false");
+
+    const char *names[4] = {"physics_ms", "cpu_ms", "gpu_ms", "frame_ms"};
+    const vector<double> *series[4] = {&times.physics, &times.cpu, &times.gpu, &times.frame};
+    fprintf(file, "  \"summary\": {");
+    for (int s = 0; s < 4; s++)
+    {
+        if (series[s]->empty())
+            continue;
+        BenchmarkSummary summary = summarizeTimes(*series[s]);
+        fprintf(file, "%s\n    \"%s\": {\"min\": %.4f, \"median\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"mean\": %.4f}",
+                s > 0 ? "," : "", names[s], summary.min, summary.median, summary.p95, summary.p99, summary.max, summary.mean);
+    }
+    fprintf(file, "\n  },\n  \"frames\": {");
+    for (int s = 0; s < 4; s++)
+    {
+        if (series[s]->empty())
+            continue;
+        fprintf(file, "%s\n    \"%s\": [", s > 0 ? "," : "", names[s]);
+        for (size_t i = 0; i < series[s]->size(); i++)
+            fprintf(file, "%s%.4f", i > 0 ? ", " : "", (*series[s])[i]);
+        fprintf(file, "]");
+    }
+    fprintf(file, "\n  }\n}\n");
+    return fclose(file) == 0;
+}
+
+/// @brief draw benchmarkFrames frames along the camera path, print the times and write them as JSON
+/// @return 0 if the run worked and the JSON was written
+int runBenchmark()
+{
+#ifdef __linux__
+    usePassTimers = false; // the frame queries below would overlap with the ones of the passes
+    if (!initHeadlessRenderer())
+        return 1;
+    string renderer = (const char *)glGetString(GL_RENDERER), version = (const char *)glGetString(GL_VERSION);
+    initSpheres();
+    setBenchmarkCamera(0.0f);
+    resetSceneStates();
+
+    bool timerQueries = GLEW_ARB_timer_query;
+    GLuint queries[benchmarkQueryCount];
+    if (timerQueries)
+        glGenQueries(benchmarkQueryCount, queries);
+
+    BenchmarkTimes times;
+    int total = benchmarkWarmupFrames + benchmarkFrames;
+    vector<double> frameStarts(total + 1);
+    vector<double> gpu(total, 0.0);
+    for (int frame = 0; frame < total; frame++)
+    {
+        int query = frame % benchmarkQueryCount;
+        if (timerQueries && frame >= benchmarkQueryCount)
+        {
+            // the oldest frame in flight has to be done before its query is used again, this waits for the GPU
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(queries[query], GL_QUERY_RESULT, &nanoseconds);
+            gpu[frame - benchmarkQueryCount] = nanoseconds / 1e6;
+        }
+        frameStarts[frame] = nowSeconds();
+
+        double start = nowSeconds();
+        updatePhysics(animationSpeed);
+        threadTimings.steps++;
+        double stepped = nowSeconds();
+        setBenchmarkCamera(max(0, frame - benchmarkWarmupFrames) / (float)max(1, benchmarkFrames));
+        publishSceneState(frame + 1);
+
+        double drawStart = nowSeconds();
+        if (timerQueries)
+            glBeginQuery(GL_TIME_ELAPSED, queries[query]);
+        renderFrame();
+        if (timerQueries)
+            glEndQuery(GL_TIME_ELAPSED);
+        glFlush(); // what a swap would do: the GL starts on the frame now
+        double drawn = nowSeconds();
+
+        if (frame >= benchmarkWarmupFrames)
+        {
+            times.physics.push_back((stepped - start) * 1e3);
+            times.cpu.push_back((drawn - drawStart) * 1e3);
+        }
+    }
+    for (int frame = max(0, total - benchmarkQueryCount); frame < total && timerQueries; frame++)
+    {
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(queries[frame % benchmarkQueryCount], GL_QUERY_RESULT, &nanoseconds);
+        gpu[frame] = nanoseconds / 1e6;
+    }
+    glFinish();
+    frameStarts[total] = nowSeconds();
+    for (int frame = benchmarkWarmupFrames; frame < total; frame++)
+    {
+        times.frame.push_back((frameStarts[frame + 1] - frameStarts[frame]) * 1e3);
+        if (timerQueries)
+            times.gpu.push_back(gpu[frame]);
+    }
+    if (timerQueries)
+        glDeleteQueries(benchmarkQueryCount, queries);
+
+    printf("benchmark: %d frames of %dx%d with %d balls, %s, %s\n", benchmarkFrames, windowWidth, windowHeight,
+           ballCount, useCoreProfile ? "core profile" : "fixed function", renderer.c_str());
+    printf("             min   median      p95      p99      max     mean  (ms)\n");
+    const char *names[4] = {"physics", "cpu", "gpu", "frame"};
+    const vector<double> *series[4] = {&times.physics, &times.cpu, &times.gpu, &times.frame};
+    for (int s = 0; s < 4; s++)
+    {
+        if (series[s]->empty())
+        {
+            printf("%-8s  not measured, there are no timer queries\n", names[s]);
+            continue;
+        }
+        BenchmarkSummary summary = summarizeTimes(*series[s]);
+        printf("%-8s %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", names[s], summary.min, summary.median, summary.p95,
+               summary.p99, summary.max, summary.mean);
+    }
+    if (!writeBenchmarkJson(benchmarkJsonPath, times, renderer.c_str(), version.c_str()))
+    {
+        printf("could not write %s\n", benchmarkJsonPath.c_str());
+        return 1;
+    }
+    printf("written to %s\n", benchmarkJsonPath.c_str());
+    return 0;
+#else
+    printf("--bench needs EGL, which this build does not have\n");
+    return 1;
+#endif
+}
+
+// --- GPU Physics Check ---
+// --gpu-physics-check S moves the spheres of --balls S steps without contacts in three ways and compares them:
+// one sphere after the other with moveSphere and spinSphere, four spheres at a time with SSE on a structure of
+// arrays copy (the way the sparks are moved), and with the compute shader of GPU Physics, once with a dispatch per
+// step and once with all the steps in one dispatch. Both CPU paths are split over --threads. The SSE path does the
+// same float operations in the same order, so it must give exactly the same spheres. The GPU may round
+// differently (fused multiply adds, its own division), and a sphere that is a hair closer to a wall bounces a step
+// earlier, so the GPU is compared with a tolerance and the spheres past it are counted. Every path prints its
+// throughput in sphere steps per second.
+
+/// @brief how many steps --gpu-physics-check runs, 0 to run none
+int gpuPhysicsCheckSteps = 0;
+/// @brief how far a position or velocity of the GPU may be from the CPU before the sphere counts as different
+float gpuPhysicsTolerance = 1e-3f;
+
+/// @brief what the steps without contacts need of the spheres, every value in its own array
+typedef struct
+{
+    vector<float> positionX, positionY, positionZ;
+    vector<float> velocityX, velocityY, velocityZ;
+    vector<float> rotationX, rotationZ; // the rotation around y does not change, spinSphere keeps it at 0 speed
+    vector<float> radius;
+} SphereArrays;
+
+/// @brief copy the spheres into arrays
+void spheresToArrays(const vector<Sphere> &balls, SphereArrays &arrays)
+{
+    size_t count = balls.size();
+    vector<float> *all[9] = {&arrays.positionX, &arrays.positionY, &arrays.positionZ, &arrays.velocityX, &arrays.velocityY,
+                             &arrays.velocityZ, &arrays.rotationX, &arrays.rotationZ, &arrays.radius};
+    for (vector<float> *values : all)
+        values->resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const Sphere &sphere = balls[i];
+        arrays.positionX[i] = sphere.position[0], arrays.positionY[i] = sphere.position[1], arrays.positionZ[i] = sphere.position[2];
+        arrays.velocityX[i] = sphere.velocity[0], arrays.velocityY[i] = sphere.velocity[1], arrays.velocityZ[i] = sphere.velocity[2];
+        arrays.rotationX[i] = sphere.rotationAngle[0], arrays.rotationZ[i] = sphere.rotationAngle[2];
+        arrays.radius[i] = sphere.radius;
+    }
+}
+
+/// @brief copy the arrays back into the spheres, with the angular velocity spinSphere would have left
+void arraysToSpheres(const SphereArrays &arrays, vector<Sphere> &balls)
+{
+    for (size_t i = 0; i < balls.size(); i++)
+    {
+        Sphere &sphere = balls[i];
+        sphere.position[0] = arrays.positionX[i], sphere.position[1] = arrays.positionY[i], sphere.position[2] = arrays.positionZ[i];
+        sphere.velocity[0] = arrays.velocityX[i], sphere.velocity[1] = arrays.velocityY[i], sphere.velocity[2] = arrays.velocityZ[i];
+        sphere.rotationAngle[0] = arrays.rotationX[i], sphere.rotationAngle[2] = arrays.rotationZ[i];
+        sphere.angularVelocity[0] = sphere.velocity[2] / sphere.radius;
+        sphere.angularVelocity[1] = 0;
+        sphere.angularVelocity[2] = -sphere.velocity[0] / sphere.radius;
+    }
+}
+
+/// @brief what one step without contacts needs: the spheres (one of the two is used) and the time of the step
+typedef struct
+{
+    Sphere *balls;
+    SphereArrays *arrays;
+    float dt;
+} ContactFreeStep;
+
+/// @brief move and spin the spheres begin to end-1 one after the other, like updatePhysics without contacts
+void stepSpheresTask(void *context, int begin, int end, int worker)
+{
+    const ContactFreeStep &step = *(const ContactFreeStep *)context;
+    for (int i = begin; i < end; i++)
+    {
+        moveSphere(step.balls[i], step.dt);
+        spinSphere(step.balls[i], step.dt);
+    }
+}
+
+/// @brief the same for the arrays, four spheres at a time with SSE, every bounce is a mask instead of a branch
+void stepSphereArraysTask(void *context, int begin, int end, int worker)
+{
+    const ContactFreeStep &step = *(const ContactFreeStep *)context;
+    SphereArrays &a = *step.arrays;
+    float dt = step.dt, fall = gravity * dt;
+    int i = begin;
+
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 dt4 = _mm_set1_ps(dt);
+    const __m128 fall4 = _mm_set1_ps(fall);
+    const __m128 restitution4 = _mm_set1_ps(restitution);
+    const __m128 friction4 = _mm_set1_ps(friction);
+    const __m128 size4 = _mm_set1_ps(cubeSize);
+    const __m128 degrees4 = _mm_set1_ps(180.0f);
+    const __m128 pi4 = _mm_set1_ps(pi);
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128 r = _mm_loadu_ps(&a.radius[i]);
+        __m128 x = _mm_loadu_ps(&a.positionX[i]), y = _mm_loadu_ps(&a.positionY[i]), z = _mm_loadu_ps(&a.positionZ[i]);
+        __m128 vx = _mm_loadu_ps(&a.velocityX[i]), vz = _mm_loadu_ps(&a.velocityZ[i]);
+        __m128 vy = _mm_add_ps(_mm_loadu_ps(&a.velocityY[i]), fall4);
+        x = _mm_add_ps(x, _mm_mul_ps(vx, dt4));
+        y = _mm_add_ps(y, _mm_mul_ps(vy, dt4));
+        z = _mm_add_ps(z, _mm_mul_ps(vz, dt4));
+
+        // the same tests in the same order as checkCollisions, a lane only changes where its test is true
+        __m128 high = _mm_sub_ps(size4, r);
+        __m128 hit = _mm_cmple_ps(_mm_sub_ps(y, r), zero); // floor, with friction along it
+        y = _mm_or_ps(_mm_and_ps(hit, r), _mm_andnot_ps(hit, y));
+        vy = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(_mm_xor_ps(vy, sign), restitution4)), _mm_andnot_ps(hit, vy));
+        vx = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(vx, friction4)), _mm_andnot_ps(hit, vx));
+        vz = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(vz, friction4)), _mm_andnot_ps(hit, vz));
+        hit = _mm_cmple_ps(_mm_sub_ps(x, r), zero);
+        x = _mm_or_ps(_mm_and_ps(hit, r), _mm_andnot_ps(hit, x));
+        vx = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(_mm_xor_ps(vx, sign), restitution4)), _mm_andnot_ps(hit, vx));
+        hit = _mm_cmpge_ps(_mm_add_ps(x, r), size4);
+        x = _mm_or_ps(_mm_and_ps(hit, high), _mm_andnot_ps(hit, x));
+        vx = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(_mm_xor_ps(vx, sign), restitution4)), _mm_andnot_ps(hit, vx));
+        hit = _mm_cmple_ps(_mm_sub_ps(z, r), zero);
+        z = _mm_or_ps(_mm_and_ps(hit, r), _mm_andnot_ps(hit, z));
+        vz = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(_mm_xor_ps(vz, sign), restitution4)), _mm_andnot_ps(hit, vz));
+        hit = _mm_cmpge_ps(_mm_add_ps(z, r), size4);
+        z = _mm_or_ps(_mm_and_ps(hit, high), _mm_andnot_ps(hit, z));
+        vz = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(_mm_xor_ps(vz, sign), restitution4)), _mm_andnot_ps(hit, vz));
+        hit = _mm_cmpge_ps(_mm_add_ps(y, r), size4); // ceiling
+        y = _mm_or_ps(_mm_and_ps(hit, high), _mm_andnot_ps(hit, y));
+        vy = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(_mm_xor_ps(vy, sign), restitution4)), _mm_andnot_ps(hit, vy));
+
+        // spinSphere: the angle grows by speed / radius * dt * 180 / pi
+        __m128 spinX = _mm_div_ps(vz, r), spinZ = _mm_div_ps(_mm_xor_ps(vx, sign), r);
+        __m128 rotationX = _mm_add_ps(_mm_loadu_ps(&a.rotationX[i]), _mm_div_ps(_mm_mul_ps(_mm_mul_ps(spinX, dt4), degrees4), pi4));
+        __m128 rotationZ = _mm_add_ps(_mm_loadu_ps(&a.rotationZ[i]), _mm_div_ps(_mm_mul_ps(_mm_mul_ps(spinZ, dt4), degrees4), pi4));
+
+        _mm_storeu_ps(&a.positionX[i], x);
+        _mm_storeu_ps(&a.positionY[i], y);
+        _mm_storeu_ps(&a.positionZ[i], z);
+        _mm_storeu_ps(&a.velocityX[i], vx);
+        _mm_storeu_ps(&a.velocityY[i], vy);
+        _mm_storeu_ps(&a.velocityZ[i], vz);
+        _mm_storeu_ps(&a.rotationX[i], rotationX);
+        _mm_storeu_ps(&a.rotationZ[i], rotationZ);
+    }
+#endif
+
+    // the rest, and all of them on processors without SSE2, one at a time through a sphere
+    for (; i < end; i++)
+    {
+        Sphere sphere;
+        sphere.radius = a.radius[i];
+        sphere.position[0] = a.positionX[i], sphere.position[1] = a.positionY[i], sphere.position[2] = a.positionZ[i];
+        sphere.velocity[0] = a.velocityX[i], sphere.velocity[1] = a.velocityY[i], sphere.velocity[2] = a.velocityZ[i];
+        sphere.rotationAngle[0] = a.rotationX[i], sphere.rotationAngle[1] = 0.0f, sphere.rotationAngle[2] = a.rotationZ[i];
+        moveSphere(sphere, dt);
+        spinSphere(sphere, dt);
+        a.positionX[i] = sphere.position[0], a.positionY[i] = sphere.position[1], a.positionZ[i] = sphere.position[2];
+        a.velocityX[i] = sphere.velocity[0], a.velocityY[i] = sphere.velocity[1], a.velocityZ[i] = sphere.velocity[2];
+        a.rotationX[i] = sphere.rotationAngle[0], a.rotationZ[i] = sphere.rotationAngle[2];
+    }
+}
+
+/// @brief how far two runs of the same spheres ended up from each other
+typedef struct
+{
+    float position; // the largest difference of a position along an axis
+    float velocity; // the same for the velocities
+    float rotation; // the same for the rotation angles, relative to the angle, they grow without end
+    int different;  // spheres with a position or velocity more than gpuPhysicsTolerance away
+} SphereDifference;
+
+SphereDifference compareSpheres(const vector<Sphere> &a, const vector<Sphere> &b)
+{
+    SphereDifference difference = {0.0f, 0.0f, 0.0f, 0};
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        float position = 0.0f, velocity = 0.0f;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            position = max(position, fabsf(a[i].position[axis] - b[i].position[axis]));
+            velocity = max(velocity, fabsf(a[i].velocity[axis] - b[i].velocity[axis]));
+            float angle = fabsf(a[i].rotationAngle[axis] - b[i].rotationAngle[axis]);
+            difference.rotation = max(difference.rotation, angle / max(1.0f, fabsf(a[i].rotationAngle[axis])));
+        }
+        difference.position = max(difference.position, position);
+        difference.velocity = max(difference.velocity, velocity);
+        if (position > gpuPhysicsTolerance || velocity > gpuPhysicsTolerance)
+            difference.different++;
+    }
+    return difference;
+}
+
+/// @brief print the time and throughput of one path
+void printPhysicsThroughput(const char *name, double seconds, int count, int steps)
+{
+    printf("%-22s %9.3f ms  %8.2f million sphere steps per second\n", name, seconds * 1e3,
+           (double)count * steps / max(seconds, 1e-9) / 1e6);
+}
+
+/// @brief run the steps on the CPU, with SSE and on the GPU, compare the spheres and print the throughput
+/// @return 0 if the SSE path matched exactly and no sphere of the GPU was past the tolerance
+int runGpuPhysicsCheck()
+{
+#ifdef __linux__
+    if (!createHeadlessContext())
+    {
+        printf("no EGL context for the GPU physics check\n");
+        return 1;
+    }
+    glewExperimental = GL_TRUE;
+    glewInit();
+    if (!initGpuPhysics())
+        return 1;
+    initSpheres();
+    const vector<Sphere> initial = spheres;
+    int count = (int)initial.size(), steps = gpuPhysicsCheckSteps;
+    float dt = animationSpeed / 1000.0f;
+    printf("GPU physics check: %d balls, %d steps of %d ms without contacts, %d CPU threads, %s\n", count, steps,
+           animationSpeed, physicsThreadCount, glGetString(GL_RENDERER));
+
+    // one sphere after the other
+    vector<Sphere> cpu = initial;
+    ContactFreeStep step = {cpu.data(), NULL, dt};
+    double start = nowSeconds();
+    for (int s = 0; s < steps; s++)
+        parallelFor(count, stepSpheresTask, &step);
+    printPhysicsThroughput("cpu", nowSeconds() - start, count, steps);
+
+    // four at a time, the copies into and out of the arrays are not timed, a simulation would keep them
+    SphereArrays arrays;
+    spheresToArrays(initial, arrays);
+    step.arrays = &arrays;
+    start = nowSeconds();
+    for (int s = 0; s < steps; s++)
+        parallelFor(count, stepSphereArraysTask, &step);
+#if defined(__SSE2__)
+    printPhysicsThroughput("cpu arrays (SSE2)", nowSeconds() - start, count, steps);
+#else
+    printPhysicsThroughput("cpu arrays (no SSE2)", nowSeconds() - start, count, steps);
+#endif
+    vector<Sphere> simd = initial;
+    arraysToSpheres(arrays, simd);
+    SphereDifference simdDifference = compareSpheres(cpu, simd);
+    bool simdSame = simdDifference.position == 0.0f && simdDifference.velocity == 0.0f && simdDifference.rotation == 0.0f;
+    printf("  %s the cpu\n", simdSame ? "exactly the same as" : "NOT the same as");
+
+    // on the GPU, the upload and the read back are not timed, the spheres stay on the GPU while it draws them
+    int different = 0;
+    const char *names[2] = {"gpu, dispatch per step", "gpu, one dispatch"};
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uploadGpuSpheres(initial);
+        glFinish();
+        start = nowSeconds();
+        if (pass == 0)
+            for (int s = 0; s < steps; s++)
+                dispatchGpuPhysics(1, 0.0f);
+        else
+            dispatchGpuPhysics(steps, 0.0f);
+        glFinish();
+        printPhysicsThroughput(names[pass], nowSeconds() - start, count, steps);
+
+        vector<Sphere> gpu(count);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuPhysics.sphereBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(Sphere), gpu.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        SphereDifference difference = compareSpheres(cpu, gpu);
+        printf("  positions %g and velocities %g off at most, rotations %g, %d balls more than %g off\n",
+               difference.position, difference.velocity, difference.rotation, difference.different, gpuPhysicsTolerance);
+        different += difference.different;
+    }
+    return simdSame && different == 0 ? 0 : 1;
+#else
+    printf("--gpu-physics-check needs EGL, which this build does not have\n");
+    return 1;
+#endif
+}
+
+// --- Render Farm ---
+// --render-farm FILE draws a trajectory recorded with --record offline and writes it as one raw video stream
+// (YUV4MPEG2, --video OUT.y4m), which ffmpeg and most players read. The frames are dealt out in turn to
+// --workers processes, frame f to worker f % workers, and every worker has its own headless context. They are
+// processes and not threads because the renderer keeps its state in globals. A worker converts its frames to
+// YUV 4:2:0 itself and puts them into its own small ring in shared memory; the main process takes them out in
+// frame order and writes them, so the video is written while it is drawn. The sparks of a frame depend on all
+// the impacts before it, so every worker moves the sparks through every frame and only draws its own frames.
+
+/// @brief the trajectory the --render-farm run draws, empty to not run it
+string renderFarmPath;
+/// @brief the video file of the --render-farm run
+string renderFarmVideoPath = "farm.y4m";
+/// @brief how many worker processes the --render-farm run starts, 0 for one per core
+int renderFarmWorkers = 0;
+/// @brief how many finished frames every worker can have waiting for the main process
+const int renderFarmRingDepth = 3;
+
+/// @brief the color conversion of BT.601 in limited range, in 8 bit fixed point
+inline unsigned char lumaOf(int r, int g, int b)
+{
+    return (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+inline unsigned char blueDifferenceOf(int r, int g, int b)
+{
+    return (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+inline unsigned char redDifferenceOf(int r, int g, int b)
+{
+    return (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+#if defined(__SSE2__)
+/// @brief split eight RGBA pixels into their red, green and blue values as 16 bit numbers
+inline void splitPixels(__m128i first, __m128i second, __m128i &red, __m128i &green, __m128i &blue)
+{
+    const __m128i byte = _mm_set1_epi32(0xFF);
+    red = _mm_packs_epi32(_mm_and_si128(first, byte), _mm_and_si128(second, byte));
+    green = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(first, 8), byte), _mm_and_si128(_mm_srli_epi32(second, 8), byte));
+    blue = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(first, 16), byte), _mm_and_si128(_mm_srli_epi32(second, 16), byte));
+}
+
+/// @brief the luma of eight pixels; the sum is at most 56228, which fits into an unsigned 16 bit lane
+inline __m128i luma8(__m128i red, __m128i green, __m128i blue)
+{
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(red, _mm_set1_epi16(66)), _mm_mullo_epi16(green, _mm_set1_epi16(129)));
+    sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_mullo_epi16(blue, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+}
+
+/// @brief a color difference of eight pixels, the weighted sum stays within a signed 16 bit lane
+inline __m128i chroma8(__m128i red, __m128i green, __m128i blue, short redWeight, short greenWeight, short blueWeight)
+{
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(red, _mm_set1_epi16(redWeight)), _mm_mullo_epi16(green, _mm_set1_epi16(greenWeight)));
+    sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_mullo_epi16(blue, _mm_set1_epi16(blueWeight)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+
+/// @brief the rounded average of every 2x2 block of sixteen pixels in two rows, as eight 16 bit numbers
+inline __m128i average2x2(__m128i topLeft, __m128i topRight, __m128i bottomLeft, __m128i bottomRight)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i left = _mm_madd_epi16(_mm_add_epi16(topLeft, bottomLeft), ones); // neighbouring pairs added up
+    __m128i right = _mm_madd_epi16(_mm_add_epi16(topRight, bottomRight), ones);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(left, right), _mm_set1_epi16(2)), 2);
+}
+#endif
+
+/// @brief convert a frame read from the GL (RGBA, bottom row first) into the three planes of YUV 4:2:0 (top row
+/// first), in BT.601 limited range with the color of every 2x2 block averaged; width and height must be even
+void convertToYuv420(const uint32_t *pixels, int width, int height, unsigned char *lumaPlane, unsigned char *bluePlane, unsigned char *redPlane)
+{
+    for (int row = 0; row < height; row += 2)
+    {
+        const uint32_t *top = pixels + (size_t)(height - 1 - row) * width;
+        const uint32_t *bottom = top - width;
+        unsigned char *lumaTop = lumaPlane + (size_t)row * width;
+        unsigned char *lumaBottom = lumaTop + width;
+        unsigned char *blue = bluePlane + (size_t)row / 2 * (width / 2);
+        unsigned char *red = redPlane + (size_t)row / 2 * (width / 2);
+        int x = 0;
+
+#if defined(__SSE2__)
+        // sixteen pixels of both rows at a time: sixteen luma values per row and eight of each color difference
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i r[2][2], g[2][2], b[2][2]; // [row][left or right eight pixels]
+            for (int half = 0; half < 2; half++)
+            {
+                const __m128i *t = (const __m128i *)(top + x + 8 * half);
+                const __m128i *d = (const __m128i *)(bottom + x + 8 * half);
+                splitPixels(_mm_loadu_si128(t), _mm_loadu_si128(t + 1), r[0][half], g[0][half], b[0][half]);
+                splitPixels(_mm_loadu_si128(d), _mm_loadu_si128(d + 1), r[1][half], g[1][half], b[1][half]);
+            }
+            _mm_storeu_si128((__m128i *)(lumaTop + x), _mm_packus_epi16(luma8(r[0][0], g[0][0], b[0][0]), luma8(r[0][1], g[0][1], b[0][1])));
+            _mm_storeu_si128((__m128i *)(lumaBottom + x), _mm_packus_epi16(luma8(r[1][0], g[1][0], b[1][0]), luma8(r[1][1], g[1][1], b[1][1])));
+
+            __m128i averageRed = average2x2(r[0][0], r[0][1], r[1][0], r[1][1]);
+            __m128i averageGreen = average2x2(g[0][0], g[0][1], g[1][0], g[1][1]);
+            __m128i averageBlue = average2x2(b[0][0], b[0][1], b[1][0], b[1][1]);
+            __m128i u = chroma8(averageRed, averageGreen, averageBlue, -38, -74, 112);
+            __m128i v = chroma8(averageRed, averageGreen, averageBlue, 112, -94, -18);
+            _mm_storel_epi64((__m128i *)(blue + x / 2), _mm_packus_epi16(u, u));
+            _mm_storel_epi64((__m128i *)(red + x / 2), _mm_packus_epi16(v, v));
+        }
+#endif
+
+        for (; x < width; x += 2)
+        {
+            uint32_t block[4] = {top[x], top[x + 1], bottom[x], bottom[x + 1]};
+            int sum[3] = {0, 0, 0};
+            for (int k = 0; k < 4; k++)
+            {
+                int r = block[k] & 0xFF, g = (block[k] >> 8) & 0xFF, b = (block[k] >> 16) & 0xFF;
+                (k < 2 ? lumaTop : lumaBottom)[x + (k & 1)] = lumaOf(r, g, b);
+                sum[0] += r, sum[1] += g, sum[2] += b;
+            }
+            int r = (sum[0] + 2) >> 2, g = (sum[1] + 2) >> 2, b = (sum[2] + 2) >> 2;
+            blue[x / 2] = blueDifferenceOf(r, g, b);
+            red[x / 2] = redDifferenceOf(r, g, b);
+        }
+    }
+}
+
+#ifdef __linux__
+
+/// @brief what one worker shares with the main process, followed in memory by its ring of frames
+typedef struct
+{
+    sem_t filled;          // frames in the ring the main process has not written yet
+    sem_t free;            // places in the ring the worker can draw into
+    int failed;            // set if the worker could not set up its context or read the trajectory
+    long long frames;      // frames the worker drew
+    double renderSeconds;  // drawing, until the GL finished
+    double readSeconds;    // glReadPixels
+    double convertSeconds; // RGB to YUV
+    double sparkSeconds;   // moving the sparks through the frames of the other workers
+    double waitSeconds;    // waiting for a free place in the ring
+} FarmWorker;
+
+/// @brief the shared memory of the --render-farm run and where everything is in it
+typedef struct
+{
+    char *memory;
+    size_t bytes;
+    size_t workerBytes; // one worker: its header and its ring
+    size_t headerBytes; // bytes before the ring of a worker
+    size_t frameBytes;  // one YUV 4:2:0 frame
+    int workers;
+} FarmMemory;
+
+FarmWorker *farmWorker(FarmMemory &shared, int worker)
+{
+    return (FarmWorker *)(shared.memory + worker * shared.workerBytes);
+}
+
+/// @brief the place in the ring of a worker that its k-th frame goes to
+unsigned char *farmFrame(FarmMemory &shared, int worker, long long k)
+{
+    return (unsigned char *)farmWorker(shared, worker) + shared.headerBytes + (k % renderFarmRingDepth) * shared.frameBytes;
+}
 
-    case 'w':
+/// @brief the loop of one worker process: replay the trajectory, draw every workers-th frame and hand it over
+/// @return the exit status of the process
+int runFarmWorker(FarmMemory &shared, int worker, long long frameCount)
+{
+    FarmWorker *header = farmWorker(shared, worker);
+    FILE *file = fopen(renderFarmPath.c_str(), "rb");
+    TrajectoryHeader trajectory;
+    if (file == NULL || !readTrajectoryHeader(file, trajectory) || !initHeadlessRenderer())
     {
-        // Move camera up without changing the reference point
-        eyey += movementSpeed;
-        break;
+        header->failed = 1;
+        sem_post(&header->filled); // wakes the main process, which sees the failure
+        return 1;
     }
-    case 's':
-        eyey -= movementSpeed;
-        break; // Move camera down withiout changing the refernce point
+    initSpheres();
+    resetSceneStates();
 
-    case 't':
-        centerz += movementSpeed;
-        break; // Move look-at point forward
-    case 'y':
-        centerz -= movementSpeed;
-        break; // Move look-at point backward
-    case '*':
-        movementSpeed += 0.1f;
-        rotationSpeed += 0.1f;
-        break;
-    case '/':
-        movementSpeed -= 0.1f;
-        rotationSpeed -= 0.1f;
-        break;
-    case '+':
-        sphere.velocity[0] += increasePerPlus;
-        sphere.velocity[1] += increasePerPlus;
-        sphere.velocity[2] += increasePerPlus;
-        break;
-    case '-':
-        sphere.velocity[0] -= increasePerPlus;
-        sphere.velocity[1] -= increasePerPlus;
-        sphere.velocity[2] -= increasePerPlus;
-        break;
-    case ' ':
-        paused = !paused;
-        break;
-    case 'r':
-        if (paused)
+    vector<uint32_t> pixels((size_t)windowWidth * windowHeight);
+    TrajectoryFrame frame;
+    vector<Impact> impacts;
+    for (long long f = 0; f < frameCount; f++)
+    {
+        if (!readTrajectoryFrame(file, frame, spheres, impacts))
         {
-            initSphere(); // only reset key is appliable if paused currently
+            header->failed = 1;
+            sem_post(&header->filled);
+            return 1;
+        }
+        for (const Impact &impact : impacts)
+            pushImpact(impact);
+        if (f % shared.workers != worker)
+        {
+            double start = nowSeconds();
+            animateParticles(); // the sparks of this frame, drawn by another worker
+            header->sparkSeconds += nowSeconds() - start;
+            continue;
         }
-        break;
-
-    // --- Object Visibility Toggles ---
-    case 'a':
-        isAxes = !isAxes;
-        break; // Toggle axes
-    case 'c':
-        isCube = !isCube;
-        break; // Toggle cube
-    case 'p':
-        isPyramid = !isPyramid;
-        break; // Toggle pyramid
-    case 'v':
-        showArrow = !showArrow; // toggle the arrow of the sphere velocity
-        break;
 
-    // --- Program Control ---
-    case 27:
-        exit(0);
-        break; // ESC key: exit program
+        eyex = frame.camera[0], eyey = frame.camera[1], eyez = frame.camera[2];
+        centerx = frame.camera[3], centery = frame.camera[4], centerz = frame.camera[5];
+        upx = frame.camera[6], upy = frame.camera[7], upz = frame.camera[8];
+        publishSceneState(frame.step);
+        double start = nowSeconds();
+        renderFrame();
+        glFinish();
+        double rendered = nowSeconds();
+        glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        double read = nowSeconds();
+        sem_wait(&header->free);
+        double freed = nowSeconds();
+        long long k = f / shared.workers;
+        unsigned char *luma = farmFrame(shared, worker, k);
+        unsigned char *blue = luma + (size_t)windowWidth * windowHeight;
+        unsigned char *red = blue + (size_t)windowWidth * windowHeight / 4;
+        convertToYuv420(pixels.data(), windowWidth, windowHeight, luma, blue, red);
+        sem_post(&header->filled);
+
+        header->renderSeconds += rendered - start;
+        header->readSeconds += read - rendered;
+        header->waitSeconds += freed - read;
+        header->convertSeconds += nowSeconds() - freed;
+        header->frames++;
     }
+    fclose(file);
+    return 0;
+}
 
-    glutPostRedisplay(); // Request a screen refresh
+/// @brief wait until a worker has finished its next frame, or has failed or died
+/// @return false if the frame will never come
+bool waitForFarmFrame(FarmWorker *header, pid_t child)
+{
+    while (true)
+    {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000; // look every 0.1 s whether the worker is still there
+        if (deadline.tv_nsec >= 1000000000)
+            deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+        if (sem_timedwait(&header->filled, &deadline) == 0)
+            return !header->failed;
+        if (errno != ETIMEDOUT && errno != EINTR)
+            return false;
+        if (waitpid(child, NULL, WNOHANG) != 0)
+            return false; // the worker ended without handing over the frame
+    }
 }
 
-/**
- * Special key input handler (arrow keys, function keys)
- * Provides camera orbit functionality
- */
-void specialKeyListener(int key, int x, int y)
+/// @brief draw the trajectory in renderFarmPath with renderFarmWorkers processes and write it to renderFarmVideoPath
+/// @return 0 if every frame was written
+int runRenderFarm()
 {
+    // count the frames, and take the room and the time step from the recording
+    FILE *file = fopen(renderFarmPath.c_str(), "rb");
+    TrajectoryHeader trajectory;
+    if (file == NULL || !readTrajectoryHeader(file, trajectory))
+    {
+        printf("%s is not a trajectory recorded with --record by this build\n", renderFarmPath.c_str());
+        return 1;
+    }
+    TrajectoryFrame frame;
+    long long frameCount = 0;
+    while (fread(&frame, sizeof(frame), 1, file) == 1 &&
+           fseek(file, (long)(sizeof(Sphere) * frame.sphereCount + sizeof(Impact) * frame.impactCount), SEEK_CUR) == 0)
+        frameCount++;
+    fclose(file);
+    ballCount = trajectory.ballCount;
+    cubeSize = trajectory.cubeSize;
+    animationSpeed = trajectory.stepMilliseconds;
+    int workers = renderFarmWorkers > 0 ? renderFarmWorkers : max(1, (int)thread::hardware_concurrency());
+    workers = (int)max(1LL, min((long long)workers, frameCount));
+
+    FarmMemory shared;
+    shared.workers = workers;
+    shared.frameBytes = (size_t)windowWidth * windowHeight * 3 / 2;
+    shared.headerBytes = (sizeof(FarmWorker) + 63) / 64 * 64;
+    shared.workerBytes = (shared.headerBytes + renderFarmRingDepth * shared.frameBytes + 4095) / 4096 * 4096;
+    shared.bytes = workers * shared.workerBytes;
+    shared.memory = (char *)mmap(NULL, shared.bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared.memory == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    for (int w = 0; w < workers; w++)
+    {
+        FarmWorker *header = farmWorker(shared, w);
+        memset(header, 0, sizeof(FarmWorker));
+        sem_init(&header->filled, 1, 0);
+        sem_init(&header->free, 1, renderFarmRingDepth);
+    }
 
-    // Calculate view direction vector
-    double lx = centerx - eyex;
-    double lz = centerz - eyez;
-    double s;
+    FILE *video = fopen(renderFarmVideoPath.c_str(), "wb");
+    if (video == NULL)
+    {
+        printf("could not write %s\n", renderFarmVideoPath.c_str());
+        return 1;
+    }
+    fflush(stdout); // the workers inherit what is not printed yet
+    double start = nowSeconds();
+    vector<pid_t> children;
+    for (int w = 0; w < workers; w++)
+    {
+        pid_t child = fork();
+        if (child < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0)
+            _exit(runFarmWorker(shared, w, frameCount));
+        children.push_back(child);
+    }
 
-    switch (key)
+    // the frames in order, each from the ring of the worker that drew it
+    fprintf(video, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", windowWidth, windowHeight, 1000,
+            max(1, animationSpeed));
+    double waitSeconds = 0.0, writeSeconds = 0.0;
+    long long written = 0;
+    bool failed = false;
+    for (long long f = 0; f < frameCount && !failed; f++)
+    {
+        int w = (int)(f % workers);
+        FarmWorker *header = farmWorker(shared, w);
+        double waitStart = nowSeconds();
+        if (!waitForFarmFrame(header, children[w]))
+        {
+            printf("worker %d could not draw frame %lld\n", w, f);
+            failed = true;
+            break;
+        }
+        double writeStart = nowSeconds();
+        failed = fputs("FRAME\n", video) == EOF || fwrite(farmFrame(shared, w, f / workers), 1, shared.frameBytes, video) != shared.frameBytes;
+        sem_post(&header->free);
+        waitSeconds += writeStart - waitStart;
+        writeSeconds += nowSeconds() - writeStart;
+        written += !failed;
+    }
+    failed = fclose(video) != 0 || failed;
+    for (pid_t child : children)
     {
+        if (failed)
+            kill(child, SIGTERM); // the others may wait for a place in their ring forever
+        int status = 0;
+        waitpid(child, &status, 0);
+    }
+    double seconds = nowSeconds() - start;
 
-    case GLUT_KEY_LEFT:
+    printf("%lld of %lld frames of %dx%d with %d balls written to %s by %d workers: %.3f s, %.1f frames per second\n",
+           written, frameCount, windowWidth, windowHeight, ballCount, renderFarmVideoPath.c_str(), workers, seconds,
+           written / max(seconds, 1e-9));
+    printf("worker  frames  draw(ms)  read(ms)  yuv(ms)  sparks(s)  waited(s)\n");
+    for (int w = 0; w < workers; w++)
     {
-        // Calculate the vector from the camera to the reference point
-        double cx = centerx - eyex;
-        double cy = centery - eyey;
-        double cz = centerz - eyez;
+        FarmWorker *header = farmWorker(shared, w);
+        double frames = (double)max(1LL, header->frames);
+        printf("%6d  %6lld  %8.3f  %8.3f  %7.3f  %9.3f  %9.3f\n", w, header->frames, header->renderSeconds * 1e3 / frames,
+               header->readSeconds * 1e3 / frames, header->convertSeconds * 1e3 / frames, header->sparkSeconds, header->waitSeconds);
+        sem_destroy(&header->filled);
+        sem_destroy(&header->free);
+    }
+    printf("main process: %.3f s waiting for the workers, %.3f ms per frame writing\n", waitSeconds,
+           writeSeconds * 1e3 / max(1LL, written));
+    munmap(shared.memory, shared.bytes);
+    return failed ? 1 : 0;
+}
 
-        // Calculate the cross product of the head vector and the camera-reference point vector
-        double leftx = upy * cz - upz * cy;
-        double lefty = upz * cx - upx * cz;
-        double leftz = upx * cy - upy * cx;
-        // Now the cross product of the head vector and the camera-reference point vector is the left vector
-        // as cross vector is at the perpendicular of two vectors
+#else
 
-        // Normalize the left vector as we only need the unit vector (direction)
-        double length = sqrt(leftx * leftx + lefty * lefty + leftz * leftz); // calculating the length
-        leftx /= length;
-        lefty /= length;
-        leftz /= length;
+int runRenderFarm()
+{
+    printf("--render-farm needs fork, shared memory and EGL, it is only available on Linux\n");
+    return 1;
+}
 
-        // Move the camera position in the left direction by the movement speed
-        eyex += leftx * movementSpeed;
-        eyey += lefty * movementSpeed;
-        eyez += leftz * movementSpeed;
+#endif
 
-        // Move the look-at point in the left direction by the movement speed
-        centerx += leftx * movementSpeed;
-        centery += lefty * movementSpeed;
-        centerz += leftz * movementSpeed;
+// --- Software Rasterizer ---
+// With --headless F --software the frames are drawn without any GL at all, on the CPU. The scene is turned
+// into coloured triangles (the room, the balls from the level of detail meshes) and lines (the axes, drawn as
+// thin quads). Each triangle is clipped against the near plane, projected, and written into the bins of the
+// 64x64 pixel tiles its bounding box touches. The tiles are then filled in parallel on the physics workers,
+// each worker owning whole tiles, so no two threads ever write the same pixel. Inside a tile the three edge
+// functions, the depth and the colour are planes over the screen, evaluated for four pixels at once with SSE2.
+// The time of every tile is kept, so the report shows where in the picture the time goes.
+// The arrows and the sparks are not drawn by this renderer.
+
+/// @brief true to draw the --headless frames on the CPU instead of with GL (--software)
+bool useSoftwareRenderer = false;
+/// @brief the side of a screen tile in pixels, a multiple of 4 so the SIMD loop never runs into the next tile
+const int rasterTileSize = 64;
+/// @brief the width of the axes in pixels, like glLineWidth in drawAxes
+const float rasterLineWidth = 3.0f;
+
+/// @brief a vertex after the view and the projection, before the division by w
+typedef struct
+{
+    float clip[4];
+    float color[3]; // 0 to 255
+} RasterVertex;
 
-        break;
-    }
+/// @brief a triangle ready for the tiles, everything is a plane a * x + b * y + c over the pixel centers
+typedef struct
+{
+    float edges[3][3];          // one plane per edge, positive inside
+    float depth[3];             // z / w
+    float colors[3][3];         // red, green and blue
+    int minX, minY, maxX, maxY; // the bounding box in pixels, inside the screen
+} RasterTriangle;
 
-    case GLUT_KEY_RIGHT:
+/// @brief the framebuffer, the triangles of the frame and the times of the tiles
+typedef struct
+{
+    int width, height, stride;        // stride is the pixels per row, a multiple of 4
+    int tilesX, tilesY;
+    vector<uint32_t> colors;          // 0xAABBGGRR, the bottom row first like glReadPixels
+    vector<float> depths;
+    vector<RasterTriangle> triangles; // all triangles of the frame, they keep their memory
+    vector<vector<int>> bins;         // the triangles touching each tile, in the order they were sent
+    vector<RasterVertex> transformed; // the vertices of the sphere being sent
+    float viewProjection[16];
+    vector<SphereVertex> lodVertices[sphereLodLevels];
+    vector<unsigned int> lodIndices[sphereLodLevels];
+
+    long long frames;
+    double geometrySeconds;           // clipping, projecting and binning
+    double rasterSeconds;             // filling all tiles, on all workers
+    vector<double> tileSeconds;       // the time of every tile
+    vector<long long> tileTriangles;  // triangles in the bin of every tile
+    vector<long long> tilePixels;     // pixels that passed the depth test in every tile
+} SoftwareRenderer;
+
+SoftwareRenderer softwareRenderer;
+
+/// @brief make the framebuffer and keep the meshes of the levels of detail on the CPU
+void initSoftwareRenderer(int width, int height)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    r.width = width;
+    r.height = height;
+    r.stride = (width + 3) & ~3;
+    r.tilesX = (width + rasterTileSize - 1) / rasterTileSize;
+    r.tilesY = (height + rasterTileSize - 1) / rasterTileSize;
+    r.colors.assign((size_t)r.stride * height, 0);
+    r.depths.assign((size_t)r.stride * height, FLT_MAX);
+    int tiles = r.tilesX * r.tilesY;
+    r.bins.assign(tiles, vector<int>());
+    r.tileSeconds.assign(tiles, 0.0);
+    r.tileTriangles.assign(tiles, 0);
+    r.tilePixels.assign(tiles, 0);
+    for (int level = 0; level < sphereLodLevels; level++)
+        buildSphereMeshData(sphereLodStacks[level], 2 * sphereLodStacks[level], r.lodVertices[level], r.lodIndices[level]);
+}
+
+/// @brief set up a triangle whose corners are already in pixels (x, y) and depth (z), and put it into the bins
+/// @param cullBack drop the triangle if it is turned clockwise on the screen, which means it faces away
+void binScreenTriangle(const float corners[3][3], const float colors[3][3], bool cullBack)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    float area = (corners[1][0] - corners[0][0]) * (corners[2][1] - corners[0][1]) -
+                 (corners[2][0] - corners[0][0]) * (corners[1][1] - corners[0][1]);
+    if (area == 0.0f || (cullBack && area < 0.0f))
+        return;
+
+    RasterTriangle t;
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (int i = 0; i < 3; i++)
     {
-        // Calculate the vector from the camera to the reference point
-        double cx = centerx - eyex;
-        double cy = centery - eyey;
-        double cz = centerz - eyez;
+        minX = min(minX, corners[i][0]), maxX = max(maxX, corners[i][0]);
+        minY = min(minY, corners[i][1]), maxY = max(maxY, corners[i][1]);
+    }
+    t.minX = max(0, (int)floor(minX));
+    t.minY = max(0, (int)floor(minY));
+    t.maxX = min(r.width - 1, (int)ceil(maxX));
+    t.maxY = min(r.height - 1, (int)ceil(maxY));
+    if (t.minX > t.maxX || t.minY > t.maxY)
+        return;
+
+    // edge i goes from corner i + 1 to corner i + 2 and is 0 at corner i + 1 and i + 2; divided by the area it
+    // is the weight of corner i, so the depth and the colors are the sums of the edges times the corner values
+    float sign = area > 0.0f ? 1.0f : -1.0f;
+    for (int i = 0; i < 3; i++)
+    {
+        const float *from = corners[(i + 1) % 3], *to = corners[(i + 2) % 3];
+        float a = -(to[1] - from[1]), b = to[0] - from[0];
+        float edge[3] = {a, b, -(a * from[0] + b * from[1])};
+        for (int k = 0; k < 3; k++)
+            t.edges[i][k] = sign * edge[k];
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        t.depth[k] = 0.0f;
+        for (int c = 0; c < 3; c++)
+            t.colors[c][k] = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            float weight = sign * t.edges[i][k] / area;
+            t.depth[k] += weight * corners[i][2];
+            for (int c = 0; c < 3; c++)
+                t.colors[c][k] += weight * colors[i][c];
+        }
+    }
 
-        // Calculate the cross product of the head vector and the camera-reference point vector
-        double rightx = upy * cz - upz * cy;
-        double righty = upz * cx - upx * cz;
-        double rightz = upx * cy - upy * cx;
-        // Now the cross product of the head vector and the camera-reference point vector is the right vector
-        // as cross vector is at the perpendicular of two vectors
-        // Normalize the right vector as we only need the unit vector (direction)
-        double length = sqrt(rightx * rightx + righty * righty + rightz * rightz); // calculating the length
-        rightx /= length;
-        righty /= length;
-        rightz /= length;
+    int index = (int)r.triangles.size();
+    r.triangles.push_back(t);
+    for (int ty = t.minY / rasterTileSize; ty <= t.maxY / rasterTileSize; ty++)
+        for (int tx = t.minX / rasterTileSize; tx <= t.maxX / rasterTileSize; tx++)
+            r.bins[ty * r.tilesX + tx].push_back(index);
+}
 
-        // Move the camera position in the right direction by the movement speed
-        eyex -= rightx * movementSpeed;
-        eyey -= righty * movementSpeed;
-        eyez -= rightz * movementSpeed;
+/// @brief divide by w and go from -1..1 to pixels
+void projectRasterVertex(const RasterVertex &vertex, float corner[3], float color[3])
+{
+    SoftwareRenderer &r = softwareRenderer;
+    float w = vertex.clip[3];
+    corner[0] = (vertex.clip[0] / w * 0.5f + 0.5f) * r.width;
+    corner[1] = (vertex.clip[1] / w * 0.5f + 0.5f) * r.height;
+    corner[2] = vertex.clip[2] / w;
+    copy(vertex.color, vertex.color + 3, color);
+}
 
-        // Move the look-at point in the right direction by the movement speed
-        centerx -= rightx * movementSpeed;
-        centery -= righty * movementSpeed;
-        centerz -= rightz * movementSpeed;
+/// @brief the point where the edge from a to b crosses the near plane (z = -w)
+RasterVertex clipAtNearPlane(const RasterVertex &a, const RasterVertex &b)
+{
+    float da = a.clip[2] + a.clip[3], db = b.clip[2] + b.clip[3];
+    float t = da / (da - db);
+    RasterVertex v;
+    for (int k = 0; k < 4; k++)
+        v.clip[k] = a.clip[k] + t * (b.clip[k] - a.clip[k]);
+    for (int k = 0; k < 3; k++)
+        v.color[k] = a.color[k] + t * (b.color[k] - a.color[k]);
+    return v;
+}
 
-        break;
+/// @brief clip a triangle against the near plane, project it and bin what is left (one or two triangles)
+void submitRasterTriangle(const RasterVertex &a, const RasterVertex &b, const RasterVertex &c, bool cullBack)
+{
+    const RasterVertex *in[3] = {&a, &b, &c};
+    RasterVertex polygon[4];
+    int count = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        const RasterVertex &current = *in[i], &next = *in[(i + 1) % 3];
+        bool currentInside = current.clip[2] >= -current.clip[3], nextInside = next.clip[2] >= -next.clip[3];
+        if (currentInside)
+            polygon[count++] = current;
+        if (currentInside != nextInside)
+            polygon[count++] = clipAtNearPlane(current, next);
     }
 
-    case GLUT_KEY_UP:
+    float corners[3][3], colors[3][3];
+    projectRasterVertex(polygon[0], corners[0], colors[0]);
+    for (int i = 1; i + 1 < count; i++)
     {
-        // Calculate the vector from the camera to the reference point
-        double cx = centerx - eyex;
-        double cy = centery - eyey;
-        double cz = centerz - eyez;
+        projectRasterVertex(polygon[i], corners[1], colors[1]);
+        projectRasterVertex(polygon[i + 1], corners[2], colors[2]);
+        binScreenTriangle(corners, colors, cullBack);
+    }
+}
 
-        // Normalize the vector as we only need the unit vector (direction)
-        double length = sqrt(cx * cx + cy * cy + cz * cz);
-        cx /= length;
-        cy /= length;
-        cz /= length;
+/// @brief put a world position through the view and the projection
+RasterVertex makeRasterVertex(const float m[16], const float position[3], const float color[3])
+{
+    RasterVertex v;
+    for (int row = 0; row < 4; row++)
+        v.clip[row] = m[row] * position[0] + m[4 + row] * position[1] + m[8 + row] * position[2] + m[12 + row];
+    copy(color, color + 3, v.color);
+    return v;
+}
 
-        // Move the camera position towards the c vector by a single movementSpeed unit
-        eyex += cx * movementSpeed;
-        eyey += cy * movementSpeed;
-        eyez += cz * movementSpeed;
+/// @brief a quad of one color, as two triangles, seen from both sides
+void submitRasterQuad(const float corners[4][3], const float color[3])
+{
+    const float *m = softwareRenderer.viewProjection;
+    RasterVertex v[4];
+    for (int i = 0; i < 4; i++)
+        v[i] = makeRasterVertex(m, corners[i], color);
+    submitRasterTriangle(v[0], v[1], v[2], false);
+    submitRasterTriangle(v[0], v[2], v[3], false);
+}
 
-        // Move the look-at point towards the c vector by a single movementSpeed unit
-        centerx += cx * movementSpeed;
-        centery += cy * movementSpeed;
-        centerz += cz * movementSpeed;
+/// @brief a line rasterLineWidth pixels wide, drawn as a quad that faces the screen
+void submitRasterLine(const float from[3], const float to[3], const float color[3])
+{
+    const float *m = softwareRenderer.viewProjection;
+    RasterVertex a = makeRasterVertex(m, from, color), b = makeRasterVertex(m, to, color);
+    bool aInside = a.clip[2] >= -a.clip[3], bInside = b.clip[2] >= -b.clip[3];
+    if (!aInside && !bInside)
+        return;
+    if (!aInside)
+        a = clipAtNearPlane(a, b);
+    else if (!bInside)
+        b = clipAtNearPlane(b, a);
+
+    float ends[2][3], colors[2][3];
+    projectRasterVertex(a, ends[0], colors[0]);
+    projectRasterVertex(b, ends[1], colors[1]);
+    float dx = ends[1][0] - ends[0][0], dy = ends[1][1] - ends[0][1];
+    float length = sqrt(dx * dx + dy * dy);
+    if (length == 0.0f)
+        return;
+    float nx = -dy / length * rasterLineWidth * 0.5f, ny = dx / length * rasterLineWidth * 0.5f;
+    float corners[4][3] = {{ends[0][0] + nx, ends[0][1] + ny, ends[0][2]}, {ends[0][0] - nx, ends[0][1] - ny, ends[0][2]},
+                           {ends[1][0] - nx, ends[1][1] - ny, ends[1][2]}, {ends[1][0] + nx, ends[1][1] + ny, ends[1][2]}};
+    float first[3][3], second[3][3], quadColors[3][3];
+    for (int k = 0; k < 3; k++)
+    {
+        first[0][k] = corners[0][k], first[1][k] = corners[1][k], first[2][k] = corners[2][k];
+        second[0][k] = corners[0][k], second[1][k] = corners[2][k], second[2][k] = corners[3][k];
+        quadColors[0][k] = quadColors[1][k] = quadColors[2][k] = colors[0][k];
+    }
+    binScreenTriangle(first, quadColors, false);
+    binScreenTriangle(second, quadColors, false);
+}
 
-        break;
+/// @brief send the triangles of a ball with the mesh of a level of detail. The ones facing away are dropped,
+/// unless the near plane cuts into the ball, then its inside shows like it does with GL
+/// @return how many triangles the mesh has
+int submitRasterSphere(const Sphere &sphere, int level, const float eye[3])
+{
+    SoftwareRenderer &r = softwareRenderer;
+    float distance = 0.0f;
+    for (int axis = 0; axis < 3; axis++)
+        distance += (sphere.position[axis] - eye[axis]) * (sphere.position[axis] - eye[axis]);
+    float reach = sphere.radius + 2.0f * nearPlane; // the corners of the near plane are a bit further than nearPlane
+    bool cullBack = distance > reach * reach;
+
+    float rotation[9], model[16], m[16];
+    rotationMatrix(sphere.rotationAngle, rotation);
+    for (int column = 0; column < 3; column++)
+    {
+        for (int row = 0; row < 3; row++)
+            model[column * 4 + row] = rotation[column * 3 + row] * sphere.radius;
+        model[column * 4 + 3] = 0.0f;
+        model[12 + column] = sphere.position[column];
     }
+    model[15] = 1.0f;
+    multiplyMatrices(r.viewProjection, model, m);
 
-    case GLUT_KEY_DOWN:
+    const vector<SphereVertex> &vertices = r.lodVertices[level];
+    r.transformed.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++)
     {
-        // Calculate the vector from the camera to the reference point
-        double cx = centerx - eyex;
-        double cy = centery - eyey;
-        double cz = centerz - eyez;
+        const float color[3] = {(float)vertices[i].color[0], (float)vertices[i].color[1], (float)vertices[i].color[2]};
+        r.transformed[i] = makeRasterVertex(m, vertices[i].position, color);
+    }
+    const vector<unsigned int> &indices = r.lodIndices[level];
+    for (size_t i = 0; i < indices.size(); i += 3)
+        submitRasterTriangle(r.transformed[indices[i]], r.transformed[indices[i + 1]], r.transformed[indices[i + 2]], cullBack);
+    return (int)indices.size() / 3;
+}
 
-        // Normalize the vector as we only need the unit vector (direction)
-        double length = sqrt(cx * cx + cy * cy + cz * cz);
-        cx /= length;
-        cy /= length;
-        cz /= length;
+/// @brief clear a tile and fill it with the triangles of its bin
+void rasterizeTile(int tile)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    int tileX0 = (tile % r.tilesX) * rasterTileSize, tileY0 = (tile / r.tilesX) * rasterTileSize;
+    int tileX1 = min(tileX0 + rasterTileSize, r.width) - 1, tileY1 = min(tileY0 + rasterTileSize, r.height) - 1;
+    for (int y = tileY0; y <= tileY1; y++)
+    {
+        fill(&r.colors[(size_t)y * r.stride + tileX0], &r.colors[(size_t)y * r.stride + tileX1] + 1, 0xFF000000u);
+        fill(&r.depths[(size_t)y * r.stride + tileX0], &r.depths[(size_t)y * r.stride + tileX1] + 1, FLT_MAX);
+    }
 
-        // Move the camera position away from the c vector by a single movementSpeed unit
-        eyex -= cx * movementSpeed;
-        eyey -= cy * movementSpeed;
-        eyez -= cz * movementSpeed;
+    long long pixels = 0;
+    for (int index : r.bins[tile])
+    {
+        const RasterTriangle &t = r.triangles[index];
+        int x0 = max(t.minX, tileX0) & ~3, x1 = min(t.maxX, tileX1);
+        int y0 = max(t.minY, tileY0), y1 = min(t.maxY, tileY1);
+        for (int y = y0; y <= y1; y++)
+        {
+            float py = y + 0.5f;
+            uint32_t *colorRow = &r.colors[(size_t)y * r.stride];
+            float *depthRow = &r.depths[(size_t)y * r.stride];
+#if defined(__SSE2__)
+            // four pixels at once: the planes are a * x + (b * y + c), with the part in y worked out once per row
+            const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            const __m128 zero = _mm_setzero_ps(), full = _mm_set1_ps(255.0f), end = _mm_set1_ps((float)(tileX1 + 1));
+            __m128 edgeA[3], edgeRow[3], colorA[3], colorRowStart[3];
+            for (int i = 0; i < 3; i++)
+            {
+                edgeA[i] = _mm_set1_ps(t.edges[i][0]);
+                edgeRow[i] = _mm_set1_ps(t.edges[i][1] * py + t.edges[i][2]);
+                colorA[i] = _mm_set1_ps(t.colors[i][0]);
+                colorRowStart[i] = _mm_set1_ps(t.colors[i][1] * py + t.colors[i][2]);
+            }
+            __m128 depthA = _mm_set1_ps(t.depth[0]), depthRowStart = _mm_set1_ps(t.depth[1] * py + t.depth[2]);
+            for (int x = x0; x <= x1; x += 4)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+                __m128 inside = _mm_cmplt_ps(px, end);
+                for (int i = 0; i < 3; i++)
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[i], px), edgeRow[i]), zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+                __m128 depth = _mm_add_ps(_mm_mul_ps(depthA, px), depthRowStart);
+                __m128 old = _mm_loadu_ps(depthRow + x);
+                __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(depth, old));
+                int bits = _mm_movemask_ps(pass);
+                if (bits == 0)
+                    continue;
+                _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, old)));
+
+                __m128i color = _mm_set1_epi32((int)0xFF000000);
+                for (int i = 0; i < 3; i++)
+                {
+                    __m128 channel = _mm_add_ps(_mm_mul_ps(colorA[i], px), colorRowStart[i]);
+                    channel = _mm_min_ps(_mm_max_ps(channel, zero), full);
+                    color = _mm_or_si128(color, _mm_slli_epi32(_mm_cvtps_epi32(channel), 8 * i));
+                }
+                __m128i mask = _mm_castps_si128(pass);
+                __m128i oldColor = _mm_loadu_si128((const __m128i *)(colorRow + x));
+                _mm_storeu_si128((__m128i *)(colorRow + x), _mm_or_si128(_mm_and_si128(mask, color), _mm_andnot_si128(mask, oldColor)));
+                pixels += __builtin_popcount(bits);
+            }
+#else
+            for (int x = x0; x <= x1; x++)
+            {
+                float px = x + 0.5f;
+                bool inside = true;
+                for (int i = 0; i < 3; i++)
+                    inside = inside && t.edges[i][0] * px + t.edges[i][1] * py + t.edges[i][2] >= 0.0f;
+                float depth = t.depth[0] * px + t.depth[1] * py + t.depth[2];
+                if (!inside || depth >= depthRow[x])
+                    continue;
+                depthRow[x] = depth;
+                uint32_t color = 0xFF000000u;
+                for (int i = 0; i < 3; i++)
+                {
+                    float channel = min(max(t.colors[i][0] * px + t.colors[i][1] * py + t.colors[i][2], 0.0f), 255.0f);
+                    color |= (uint32_t)lrintf(channel) << (8 * i);
+                }
+                colorRow[x] = color;
+                pixels++;
+            }
+#endif
+        }
+    }
+    r.tileTriangles[tile] += r.bins[tile].size();
+    r.tilePixels[tile] += pixels;
+}
 
-        // Move the look-at point away from the c vector by a single movementSpeed unit
-        centerx -= cx * movementSpeed;
-        centery -= cy * movementSpeed;
-        centerz -= cz * movementSpeed;
+/// @brief the parallel task of the tiles
+void rasterizeTiles(void *context, int begin, int end, int worker)
+{
+    for (int tile = begin; tile < end; tile++)
+    {
+        double start = nowSeconds();
+        rasterizeTile(tile);
+        softwareRenderer.tileSeconds[tile] += nowSeconds() - start;
+    }
+}
 
-        break;
+/// @brief draw a state into the software framebuffer
+void renderSoftwareFrame(const SceneState &state)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    double start = nowSeconds();
+    float view[16], projection[16];
+    lookAtMatrix(state.eye, state.center, state.up, view);
+    perspectiveMatrix(fieldOfView, (float)r.width / r.height, nearPlane, farPlane, projection);
+    multiplyMatrices(projection, view, r.viewProjection);
+    r.triangles.clear();
+    for (vector<int> &bin : r.bins)
+        bin.clear();
+
+    Frustum frustum = frustumFromMatrices(projection, view);
+    cullSpheres(state, frustum, visibleSpheres);
+    cullStats.frames++;
+    float roomLow[3] = {0.0f, 0.0f, 0.0f}, roomHigh[3] = {cubeSize, cubeSize, cubeSize};
+    float axesLow[3] = {0.0f, 0.0f, 0.0f}, axesHigh[3] = {1.0f, 1.0f, 1.0f};
+
+    // the room, with the floor tiles and colors of drawCheckeredFloor and drawCubeWithCheckeredFloor
+    if (!useFrustumCulling || boxInFrustum(frustum, roomLow, roomHigh))
+    {
+        float c = cubeSize;
+        int tiles = (int)cubeSize;
+        float tileSize = cubeSize / tiles;
+        const float white[3] = {255.0f, 255.0f, 255.0f}, black[3] = {0.0f, 0.0f, 0.0f};
+        for (int x = 0; x < tiles; x++)
+            for (int z = 0; z < tiles; z++)
+            {
+                float corners[4][3] = {{x * tileSize, 0, z * tileSize}, {(x + 1) * tileSize, 0, z * tileSize},
+                                       {(x + 1) * tileSize, 0, (z + 1) * tileSize}, {x * tileSize, 0, (z + 1) * tileSize}};
+                submitRasterQuad(corners, (x + z) % 2 == 0 ? white : black);
+            }
+        const float wallColor[3] = {127.5f, 255.0f, 127.5f}, ceilingColor[3] = {127.5f, 127.5f, 127.5f};
+        const float walls[5][4][3] = {{{0, 0, 0}, {c, 0, 0}, {c, c, 0}, {0, c, 0}},
+                                      {{0, 0, c}, {c, 0, c}, {c, c, c}, {0, c, c}},
+                                      {{0, 0, 0}, {0, 0, c}, {0, c, c}, {0, c, 0}},
+                                      {{c, 0, 0}, {c, 0, c}, {c, c, c}, {c, c, 0}},
+                                      {{0, c, 0}, {c, c, 0}, {c, c, c}, {0, c, c}}};
+        for (int wall = 0; wall < 5; wall++)
+            submitRasterQuad(walls[wall], wall < 4 ? wallColor : ceilingColor);
     }
-    case GLUT_KEY_PAGE_UP:
+    if (isAxes && (!useFrustumCulling || boxInFrustum(frustum, axesLow, axesHigh)))
     {
-        // here we know the up side is the side of the head vector, which in this case is the up vector
-        // Move the camera position along the head vector by a single unit
-        eyex += upx * movementSpeed;
-        eyey += upy * movementSpeed;
-        eyez += upz * movementSpeed;
-
-        // Move the reference point towards the up vector by a single unit of movement speed
-        centerx += upx * movementSpeed;
-        centery += upy * movementSpeed;
-        centerz += upz * movementSpeed;
-
-        break;
+        const float origin[3] = {0.0f, 0.0f, 0.0f};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float end[3] = {0.0f, 0.0f, 0.0f}, color[3] = {0.0f, 0.0f, 0.0f};
+            end[axis] = 1.0f;
+            color[axis] = 255.0f;
+            submitRasterLine(origin, end, color);
+        }
     }
 
-    case GLUT_KEY_PAGE_DOWN:
+    SphereLodView lodView = lodViewFromMatrices(projection, view, r.height);
+    for (int index : visibleSpheres)
     {
-        // here we know the down side is the other side of the head vector, which in this case is the up vector
-        // Move the camera position along the opposite direction of the head vector by a single unit
-        eyex -= upx * movementSpeed;
-        eyey -= upy * movementSpeed;
-        eyez -= upz * movementSpeed;
+        const Sphere &sphere = state.spheres[index];
+        sphereDrawStats.triangles += submitRasterSphere(sphere, chooseSphereLod(sphere, lodView), state.eye);
+    }
+    sphereDrawStats.frames++;
+    double binned = nowSeconds();
+    r.geometrySeconds += binned - start;
 
-        // Move the reference point towards the opposite direction of the up vector by a single unit of movement speed
-        centerx -= upx * movementSpeed;
-        centery -= upy * movementSpeed;
-        centerz -= upz * movementSpeed;
+    parallelFor(r.tilesX * r.tilesY, rasterizeTiles, NULL, 1);
+    r.rasterSeconds += nowSeconds() - binned;
+    r.frames++;
+}
 
-        break;
-    }
+/// @brief print the average time of every tile as a map of the screen
+void printTileTimes()
+{
+    SoftwareRenderer &r = softwareRenderer;
+    long long frames = max(1LL, r.frames);
+    printf("  ms per tile and frame, the top of the picture first:\n");
+    for (int ty = r.tilesY - 1; ty >= 0; ty--)
+    {
+        printf("   ");
+        for (int tx = 0; tx < r.tilesX; tx++)
+            printf(" %6.3f", r.tileSeconds[ty * r.tilesX + tx] * 1e3 / frames);
+        printf("\n");
     }
+}
 
-    glutPostRedisplay(); // Request a screen refresh
+/// @brief print where the time of the software frames went, with the average time of every tile as a map of the screen
+void printSoftwareRendererStats()
+{
+    SoftwareRenderer &r = softwareRenderer;
+    long long frames = max(1LL, r.frames);
+    int tiles = r.tilesX * r.tilesY;
+    double tileSum = 0.0, tileMax = 0.0;
+    long long triangles = 0, pixels = 0;
+    for (int tile = 0; tile < tiles; tile++)
+    {
+        tileSum += r.tileSeconds[tile];
+        tileMax = max(tileMax, r.tileSeconds[tile]);
+        triangles += r.tileTriangles[tile];
+        pixels += r.tilePixels[tile];
+    }
+    printf("software renderer: %.3f ms per frame setting up and binning, %.3f ms filling %d tiles on %d threads\n",
+           r.geometrySeconds * 1e3 / frames, r.rasterSeconds * 1e3 / frames, tiles,
+           min(physicsThreadCount, 1 + (int)physicsWorkers.threads.size()));
+    printf("  %.0f triangles sent, %.0f triangles in the bins, %.0f pixels written per frame\n",
+           (double)sphereDrawStats.triangles / max(1LL, sphereDrawStats.frames), (double)triangles / frames, (double)pixels / frames);
+    printf("  tiles: %.4f ms on average, %.4f ms the slowest, the slowest tile takes %.1fx the average\n",
+           tileSum * 1e3 / frames / tiles, tileMax * 1e3 / frames, tileMax / max(tileSum / tiles, 1e-12));
+    printTileTimes();
 }
 
-// Simulate physics
+// --- Ray Tracer ---
+// With --headless F --software --raytrace the CPU frames are ray traced instead of rasterized. The scene is
+// simple enough to intersect exactly: the balls are spheres and the room is a box. The balls go into a
+// bounding volume hierarchy that is built again for every state, since they all move. The rays are traced in
+// packets of four (2x2 pixels) with SSE2: a packet walks down the tree as long as one of its rays hits the
+// box of a node, and the spheres of a leaf are tested against all four rays at once. The room is hit with
+// the slab test, the floor gets its checker from the hit point. Every hit sends a shadow ray to a light under
+// the middle of the ceiling, and a ball in between halves the color. The tiles of the software renderer are
+// traced in parallel on the physics workers. Without SSE2 the same tree is walked one ray at a time.
+// The axes, the arrows and the sparks are not ray traced.
+
+/// @brief true to ray trace the CPU frames instead of rasterizing them (--raytrace)
+bool useRayTracer = false;
+/// @brief the most balls in a leaf of the tree
+const int bvhLeafSize = 4;
+/// @brief how far a shadow ray starts off the surface, so it does not hit the surface it starts from
+const float shadowOffset = 1e-3f;
+
+/// @brief a node of the tree: an inner node has its two children at first and first + 1, a leaf has count balls
+typedef struct
+{
+    float low[3], high[3];
+    int first;
+    int count; // 0 for an inner node
+    int axis;  // the axis the balls were split along, the child on the low side is first
+} BvhNode;
 
-/**
- * Draw coordinate axes
- * X axis: red, Y axis: green, Z axis: blue
- */
-void drawAxes()
+/// @brief the tree and the balls in the order of its leaves
+typedef struct
 {
-    glLineWidth(3); // Set line thickness
+    vector<BvhNode> nodes;
+    vector<int> order;                  // the balls, sorted so every leaf is a run of them
+    vector<float> centerX, centerY, centerZ, radius;
+    vector<float> rotations;            // 9 per ball, to find the stripe of a hit
+    float light[3];
+
+    long long frames;
+    double buildSeconds;                // building the tree
+    double traceSeconds;                // tracing all tiles, on all workers
+    vector<long long> tileRays;         // the rays of every tile, primary and shadow
+} RayTracer;
+
+RayTracer rayTracer;
+
+/// @brief build the node for the balls order[first] .. order[first + count - 1] and the nodes below it
+void buildBvhNode(const SceneState &state, int nodeIndex, int first, int count)
+{
+    RayTracer &rt = rayTracer;
+    float low[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, high[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    float centerLow[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, centerHigh[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (int i = first; i < first + count; i++)
+    {
+        const Sphere &sphere = state.spheres[rt.order[i]];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            low[axis] = min(low[axis], sphere.position[axis] - sphere.radius);
+            high[axis] = max(high[axis], sphere.position[axis] + sphere.radius);
+            centerLow[axis] = min(centerLow[axis], sphere.position[axis]);
+            centerHigh[axis] = max(centerHigh[axis], sphere.position[axis]);
+        }
+    }
+    BvhNode &node = rt.nodes[nodeIndex];
+    copy(low, low + 3, node.low);
+    copy(high, high + 3, node.high);
+    if (count <= bvhLeafSize)
+    {
+        node.first = first;
+        node.count = count;
+        node.axis = 0;
+        return;
+    }
 
-    glBegin(GL_LINES);
+    // split at the median center along the axis where the centers spread the most
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+        if (centerHigh[k] - centerLow[k] > centerHigh[axis] - centerLow[axis])
+            axis = k;
+    int half = count / 2;
+    nth_element(rt.order.begin() + first, rt.order.begin() + first + half, rt.order.begin() + first + count,
+                [&](int a, int b)
+                { return state.spheres[a].position[axis] < state.spheres[b].position[axis]; });
+    int children = (int)rt.nodes.size();
+    rt.nodes.resize(children + 2);
+    BvhNode &parent = rt.nodes[nodeIndex]; // the resize may have moved it
+    parent.first = children;
+    parent.count = 0;
+    parent.axis = axis;
+    buildBvhNode(state, children, first, half);
+    buildBvhNode(state, children + 1, first + half, count - half);
+}
 
-    // X axis (red)
-    glColor3f(1, 0, 0);
-    glVertex3f(0, 0, 0);
-    glVertex3f(1, 0, 0);
+/// @brief build the tree over all balls of a state, and copy the balls into the order of the leaves
+void buildBvh(const SceneState &state)
+{
+    RayTracer &rt = rayTracer;
+    int count = (int)state.spheres.size();
+    rt.order.resize(count);
+    for (int i = 0; i < count; i++)
+        rt.order[i] = i;
+    rt.nodes.clear();
+    rt.nodes.reserve(2 * count / bvhLeafSize + 2);
+    rt.nodes.resize(1);
+    buildBvhNode(state, 0, 0, count);
+
+    rt.centerX.resize(count);
+    rt.centerY.resize(count);
+    rt.centerZ.resize(count);
+    rt.radius.resize(count);
+    rt.rotations.resize(9 * count);
+    for (int i = 0; i < count; i++)
+    {
+        const Sphere &sphere = state.spheres[rt.order[i]];
+        rt.centerX[i] = sphere.position[0];
+        rt.centerY[i] = sphere.position[1];
+        rt.centerZ[i] = sphere.position[2];
+        rt.radius[i] = sphere.radius;
+        rotationMatrix(sphere.rotationAngle, &rt.rotations[9 * i]);
+    }
+}
 
-    // Y axis (green)
-    glColor3f(0, 1, 0);
-    glVertex3f(0, 0, 0);
-    glVertex3f(0, 1, 0);
+/// @brief what a ray found: how far, and which ball (-1 for the room)
+typedef struct
+{
+    float t;
+    int ball;
+} RayHit;
 
-    // Z axis (blue)
-    glColor3f(0, 0, 1);
-    glVertex3f(0, 0, 0);
-    glVertex3f(0, 0, 1);
+/// @brief the color of a hit, from 0 to 255, and the normal to start the shadow ray from
+void shadeRayHit(const float origin[3], const float direction[3], const RayHit &hit, float color[3], float normal[3])
+{
+    RayTracer &rt = rayTracer;
+    float point[3];
+    for (int k = 0; k < 3; k++)
+        point[k] = origin[k] + direction[k] * hit.t;
+    if (hit.ball >= 0)
+    {
+        float center[3] = {rt.centerX[hit.ball], rt.centerY[hit.ball], rt.centerZ[hit.ball]};
+        for (int k = 0; k < 3; k++)
+            normal[k] = (point[k] - center[k]) / rt.radius[hit.ball];
+        // the longitude in the ball's own frame, like stripeShaderSource
+        const float *rotation = &rt.rotations[9 * hit.ball];
+        float localX = rotation[0] * normal[0] + rotation[1] * normal[1] + rotation[2] * normal[2];
+        float localZ = rotation[6] * normal[0] + rotation[7] * normal[1] + rotation[8] * normal[2];
+        float angle = atan2(localZ, localX);
+        if (angle < 0.0f)
+            angle += 2.0f * pi;
+        int stripe = (int)(angle / (2.0f * pi / 18.0f)) % 2;
+        for (int k = 0; k < 3; k++)
+            color[k] = stripeColors[stripe][k] * 255.0f;
+        return;
+    }
 
-    glEnd();
+    // the room: the face is the one the hit point lies on, the normal points into the room
+    float c = cubeSize, closest = FLT_MAX;
+    int face = 0;
+    for (int axis = 0; axis < 3; axis++)
+        for (int side = 0; side < 2; side++)
+        {
+            float distance = fabs(point[axis] - side * c);
+            if (distance < closest)
+                closest = distance, face = axis * 2 + side;
+        }
+    normal[0] = normal[1] = normal[2] = 0.0f;
+    normal[face / 2] = face % 2 == 0 ? 1.0f : -1.0f;
+    if (face == 2) // the floor, tile (0, 0) is white like in drawCheckeredFloor
+    {
+        float tileSize = cubeSize / (int)cubeSize;
+        int white = ((int)floor(point[0] / tileSize) + (int)floor(point[2] / tileSize)) % 2 == 0;
+        color[0] = color[1] = color[2] = white ? 255.0f : 0.0f;
+    }
+    else if (face == 3) // the ceiling
+        color[0] = color[1] = color[2] = 127.5f;
+    else
+        color[0] = 127.5f, color[1] = 255.0f, color[2] = 127.5f;
 }
 
-
-/// @brief draws a checkered floor made of alternating black and white square tiles
-/// @param size what will be the size of the floor
-/// @param tiles how many tiles in each direction
-void drawCheckeredFloor(float size, int tiles)
+#if defined(__SSE2__)
+/// @brief four rays, one per lane
+typedef struct
 {
-    // Set up the colors
-    GLfloat white[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat black[] = {0.0f, 0.0f, 0.0f, 1.0f};
-
-    float tileSize = size / tiles;
+    __m128 origin[3], direction[3], inverse[3];
+    __m128 t;      // the closest hit so far, or how far a shadow ray may go
+    __m128 ball;   // the ball that was hit, as an int in every lane, -1 for none
+    __m128 active; // all bits set for the lanes that take part
+} RayPacket;
+
+/// @brief the lanes of a packet whose ray hits the box of a node closer than what they hit so far
+inline __m128 packetHitsBox(const RayPacket &packet, const BvhNode &node)
+{
+    __m128 enter = _mm_setzero_ps(), leave = packet.t;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.low[axis]), packet.origin[axis]), packet.inverse[axis]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.high[axis]), packet.origin[axis]), packet.inverse[axis]);
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        leave = _mm_min_ps(leave, _mm_max_ps(t0, t1));
+    }
+    return _mm_and_ps(packet.active, _mm_cmple_ps(enter, leave));
+}
 
-    // Draw the floor on XZ plane starting from (0,0,0)
-    glBegin(GL_QUADS);
-    for (int x = 0; x < tiles; x++)
+/// @brief walk the tree with a packet and keep the closest ball of every lane; with anyHit a lane stops at
+/// the first ball in its way, and a lane that hit something is taken out of the packet
+void tracePacket(RayPacket &packet, bool anyHit)
+{
+    RayTracer &rt = rayTracer;
+    if (rt.nodes.empty() || rt.order.empty())
+        return;
+    const __m128 epsilon = _mm_set1_ps(shadowOffset);
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    // the packet's rays point about the same way, so the first lane decides which child is nearer
+    float firstDirection[3];
+    for (int axis = 0; axis < 3; axis++)
+        _mm_store_ss(&firstDirection[axis], packet.direction[axis]);
+
+    while (top > 0)
     {
-        for (int z = 0; z < tiles; z++)
+        const BvhNode &node = rt.nodes[stack[--top]];
+        if (_mm_movemask_ps(packetHitsBox(packet, node)) == 0)
+            continue;
+        if (node.count == 0)
         {
-            if ((x + z) % 2 == 0)
+            bool lowFirst = firstDirection[node.axis] >= 0.0f;
+            stack[top++] = lowFirst ? node.first + 1 : node.first; // the far child waits on the stack
+            stack[top++] = lowFirst ? node.first : node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            // |o + t d - c|^2 = r^2 with |d| = 1: t = -b -+ sqrt(b^2 - (|o - c|^2 - r^2)), b = (o - c) . d
+            __m128 ox = _mm_sub_ps(packet.origin[0], _mm_set1_ps(rt.centerX[i]));
+            __m128 oy = _mm_sub_ps(packet.origin[1], _mm_set1_ps(rt.centerY[i]));
+            __m128 oz = _mm_sub_ps(packet.origin[2], _mm_set1_ps(rt.centerZ[i]));
+            __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, packet.direction[0]), _mm_mul_ps(oy, packet.direction[1])),
+                                  _mm_mul_ps(oz, packet.direction[2]));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)),
+                                  _mm_set1_ps(rt.radius[i] * rt.radius[i]));
+            __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+            __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+            __m128 nearT = _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), root);
+            __m128 farT = _mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), b), root);
+            __m128 useNear = _mm_cmpgt_ps(nearT, epsilon); // from inside a ball the far side is hit
+            __m128 t = _mm_or_ps(_mm_and_ps(useNear, nearT), _mm_andnot_ps(useNear, farT));
+            __m128 hit = _mm_and_ps(packet.active, _mm_and_ps(_mm_cmpge_ps(discriminant, _mm_setzero_ps()),
+                                                              _mm_and_ps(_mm_cmpgt_ps(t, epsilon), _mm_cmplt_ps(t, packet.t))));
+            if (_mm_movemask_ps(hit) == 0)
+                continue;
+            packet.t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, packet.t));
+            packet.ball = _mm_or_ps(_mm_and_ps(hit, _mm_castsi128_ps(_mm_set1_epi32(i))), _mm_andnot_ps(hit, packet.ball));
+            if (anyHit)
             {
-                glColor4fv(white); // checking the color of the tile
+                packet.active = _mm_andnot_ps(hit, packet.active);
+                if (_mm_movemask_ps(packet.active) == 0)
+                    return;
             }
-            else
+        }
+    }
+}
+
+/// @brief set the directions of a packet and their inverses; origins, t, ball and active are set by the caller
+void setPacketDirections(RayPacket &packet, const float directions[4][3])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        packet.direction[axis] = _mm_setr_ps(directions[0][axis], directions[1][axis], directions[2][axis], directions[3][axis]);
+        packet.inverse[axis] = _mm_div_ps(_mm_set1_ps(1.0f), packet.direction[axis]);
+    }
+}
+#else
+/// @brief walk the tree with one ray, the same as tracePacket does with four
+/// @return the hit, with ball -1 if no ball is closer than maxT
+RayHit traceRay(const float origin[3], const float direction[3], float maxT, bool anyHit)
+{
+    RayTracer &rt = rayTracer;
+    RayHit hit = {maxT, -1};
+    if (rt.nodes.empty() || rt.order.empty())
+        return hit;
+    float inverse[3] = {1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2]};
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BvhNode &node = rt.nodes[stack[--top]];
+        float enter = 0.0f, leave = hit.t;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float t0 = (node.low[axis] - origin[axis]) * inverse[axis], t1 = (node.high[axis] - origin[axis]) * inverse[axis];
+            enter = max(enter, min(t0, t1));
+            leave = min(leave, max(t0, t1));
+        }
+        if (enter > leave)
+            continue;
+        if (node.count == 0)
+        {
+            bool lowFirst = direction[node.axis] >= 0.0f;
+            stack[top++] = lowFirst ? node.first + 1 : node.first;
+            stack[top++] = lowFirst ? node.first : node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            float o[3] = {origin[0] - rt.centerX[i], origin[1] - rt.centerY[i], origin[2] - rt.centerZ[i]};
+            float b = o[0] * direction[0] + o[1] * direction[1] + o[2] * direction[2];
+            float discriminant = b * b - (o[0] * o[0] + o[1] * o[1] + o[2] * o[2] - rt.radius[i] * rt.radius[i]);
+            if (discriminant < 0.0f)
+                continue;
+            float t = -b - sqrt(discriminant);
+            if (t <= shadowOffset)
+                t = -b + sqrt(discriminant);
+            if (t > shadowOffset && t < hit.t)
             {
-                glColor4fv(black);
+                hit.t = t;
+                hit.ball = i;
+                if (anyHit)
+                    return hit;
             }
-
-            // draws a tile of the floor which will be tilesize length long, and xz plane
-            glVertex3f(x * tileSize, 0.0f, z * tileSize);
-            glVertex3f((x + 1) * tileSize, 0.0f, z * tileSize);
-            glVertex3f((x + 1) * tileSize, 0.0f, (z + 1) * tileSize);
-            glVertex3f(x * tileSize, 0.0f, (z + 1) * tileSize);
         }
     }
-    glEnd();
+    return hit;
 }
+#endif
 
-void drawCubeWithCheckeredFloor()
+/// @brief how far a ray goes before it leaves (or, from outside, enters) the room
+/// @return FLT_MAX if the ray misses the room, which can happen when the camera is outside of it
+float traceRoom(const float origin[3], const float direction[3])
 {
-    // Set up the cube's dimensions
+    float enter = -FLT_MAX, leave = FLT_MAX;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (0.0f - origin[axis]) / direction[axis], t1 = (cubeSize - origin[axis]) / direction[axis];
+        enter = max(enter, min(t0, t1));
+        leave = min(leave, max(t0, t1));
+    }
+    if (enter > leave || leave <= shadowOffset)
+        return FLT_MAX;
+    return enter > shadowOffset ? enter : leave;
+}
 
-    int tiles = cubeSize;
-    // Number of tiles in each direction
+/// @brief the context of the tile task: the camera of the frame
+typedef struct
+{
+    float eye[3];
+    float right[3], up[3], forward[3]; // forward is 1 long, right and up are as long as half the screen 1 unit away
+} RayCamera;
 
-    // Set up the colors
-    GLfloat wallColor[] = {0.5f, 1.0f, 0.5f, 1.0f}; // the color of the walls
-    GLfloat ceilingColor[] = {0.5f, 0.5f, 0.5f, 1.0f}; // the color of the ceiling
+/// @brief trace four pixels, the ones outside the screen have valid false
+/// @return how many rays were traced
+int traceFourPixels(const RayCamera &camera, const int pixels[4][2], const bool valid[4])
+{
+    SoftwareRenderer &r = softwareRenderer;
+    float directions[4][3];
+    for (int lane = 0; lane < 4; lane++)
+    {
+        float u = ((pixels[lane][0] + 0.5f) / r.width) * 2.0f - 1.0f, v = ((pixels[lane][1] + 0.5f) / r.height) * 2.0f - 1.0f;
+        float length = 0.0f;
+        for (int k = 0; k < 3; k++)
+        {
+            directions[lane][k] = camera.forward[k] + u * camera.right[k] + v * camera.up[k];
+            length += directions[lane][k] * directions[lane][k];
+        }
+        length = sqrt(length);
+        for (int k = 0; k < 3; k++)
+            directions[lane][k] /= length;
+    }
 
-    // Draw the checkered floor starting from origin
-    drawCheckeredFloor(cubeSize, tiles);
+    // the closest ball of every primary ray, and where the ray leaves the room
+    RayHit hits[4];
+    for (int lane = 0; lane < 4; lane++)
+        hits[lane].t = traceRoom(camera.eye, directions[lane]), hits[lane].ball = -1;
+#if defined(__SSE2__)
+    RayPacket packet;
+    for (int axis = 0; axis < 3; axis++)
+        packet.origin[axis] = _mm_set1_ps(camera.eye[axis]);
+    setPacketDirections(packet, directions);
+    packet.t = _mm_setr_ps(hits[0].t, hits[1].t, hits[2].t, hits[3].t);
+    packet.ball = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    packet.active = _mm_castsi128_ps(_mm_setr_epi32(valid[0] ? -1 : 0, valid[1] ? -1 : 0, valid[2] ? -1 : 0, valid[3] ? -1 : 0));
+    tracePacket(packet, false);
+    float ts[4];
+    int balls[4];
+    _mm_storeu_ps(ts, packet.t);
+    _mm_storeu_si128((__m128i *)balls, _mm_castps_si128(packet.ball));
+    for (int lane = 0; lane < 4; lane++)
+        hits[lane].t = ts[lane], hits[lane].ball = balls[lane];
+#else
+    for (int lane = 0; lane < 4; lane++)
+        if (valid[lane])
+            hits[lane] = traceRay(camera.eye, directions[lane], hits[lane].t, false);
+#endif
 
-    // Draw the walls
-    glBegin(GL_QUADS);
-    glColor4fv(wallColor);
-    // Front wall with the wall color
-    glVertex3f(0.0f, 0.0f, 0.0f);
-    glVertex3f(cubeSize, 0.0f, 0.0f);
-    glVertex3f(cubeSize, cubeSize, 0.0f);
-    glVertex3f(0.0f, cubeSize, 0.0f);
+    // color every hit and send a shadow ray from it to the light, a ray that hit nothing gets the clear color of GL
+    const float *light = rayTracer.light;
+    float colors[4][3], shadowOrigins[4][3], shadowDirections[4][3], shadowLengths[4];
+    bool missed[4];
+    for (int lane = 0; lane < 4; lane++)
+    {
+        missed[lane] = hits[lane].ball < 0 && hits[lane].t == FLT_MAX;
+        if (missed[lane])
+        {
+            // no shadow ray either, the lane only needs numbers the packet can hold
+            const float background[3] = {0.0f, 0.0f, 0.0f}, up[3] = {0.0f, 1.0f, 0.0f};
+            copy(background, background + 3, colors[lane]);
+            copy(camera.eye, camera.eye + 3, shadowOrigins[lane]);
+            copy(up, up + 3, shadowDirections[lane]);
+            shadowLengths[lane] = 0.0f;
+            continue;
+        }
+        float normal[3];
+        shadeRayHit(camera.eye, directions[lane], hits[lane], colors[lane], normal);
+        float length = 0.0f;
+        for (int k = 0; k < 3; k++)
+        {
+            shadowOrigins[lane][k] = camera.eye[k] + directions[lane][k] * hits[lane].t + normal[k] * shadowOffset;
+            shadowDirections[lane][k] = light[k] - shadowOrigins[lane][k];
+            length += shadowDirections[lane][k] * shadowDirections[lane][k];
+        }
+        shadowLengths[lane] = sqrt(length);
+        for (int k = 0; k < 3; k++)
+            shadowDirections[lane][k] /= max(shadowLengths[lane], 1e-6f);
+    }
+    bool shadowed[4];
+#if defined(__SSE2__)
+    RayPacket shadow;
+    for (int axis = 0; axis < 3; axis++)
+        shadow.origin[axis] = _mm_setr_ps(shadowOrigins[0][axis], shadowOrigins[1][axis], shadowOrigins[2][axis], shadowOrigins[3][axis]);
+    setPacketDirections(shadow, shadowDirections);
+    shadow.t = _mm_loadu_ps(shadowLengths);
+    shadow.ball = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    shadow.active = _mm_and_ps(packet.active, _mm_castsi128_ps(_mm_setr_epi32(missed[0] ? 0 : -1, missed[1] ? 0 : -1,
+                                                                              missed[2] ? 0 : -1, missed[3] ? 0 : -1)));
+    tracePacket(shadow, true);
+    _mm_storeu_si128((__m128i *)balls, _mm_castps_si128(shadow.ball));
+    for (int lane = 0; lane < 4; lane++)
+        shadowed[lane] = balls[lane] >= 0;
+#else
+    for (int lane = 0; lane < 4; lane++)
+        shadowed[lane] = valid[lane] && !missed[lane] && traceRay(shadowOrigins[lane], shadowDirections[lane], shadowLengths[lane], true).ball >= 0;
+#endif
 
-    // drawing the back wall with the wall color
-    glVertex3f(0.0f, 0.0f, cubeSize);
-    glVertex3f(cubeSize, 0.0f, cubeSize);
-    glVertex3f(cubeSize, cubeSize, cubeSize);
-    glVertex3f(0.0f, cubeSize, cubeSize);
+    int rays = 0;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        if (!valid[lane])
+            continue;
+        float shade = shadowed[lane] ? 0.5f : 1.0f;
+        uint32_t color = 0xFF000000u;
+        for (int k = 0; k < 3; k++)
+            color |= (uint32_t)lrintf(colors[lane][k] * shade) << (8 * k);
+        r.colors[(size_t)pixels[lane][1] * r.stride + pixels[lane][0]] = color;
+        rays += missed[lane] ? 1 : 2; // a ray that hit nothing sends no shadow ray
+    }
+    return rays;
+}
 
-    // drawing the left wall with the wall color
-    glVertex3f(0.0f, 0.0f, 0.0f);
-    glVertex3f(0.0f, 0.0f, cubeSize);
-    glVertex3f(0.0f, cubeSize, cubeSize);
-    glVertex3f(0.0f, cubeSize, 0.0f);
+/// @brief the parallel task of the ray traced tiles, every tile is traced in 2x2 pixel packets
+void traceTiles(void *context, int begin, int end, int worker)
+{
+    const RayCamera &camera = *(const RayCamera *)context;
+    SoftwareRenderer &r = softwareRenderer;
+    for (int tile = begin; tile < end; tile++)
+    {
+        double start = nowSeconds();
+        int tileX0 = (tile % r.tilesX) * rasterTileSize, tileY0 = (tile / r.tilesX) * rasterTileSize;
+        int tileX1 = min(tileX0 + rasterTileSize, r.width), tileY1 = min(tileY0 + rasterTileSize, r.height);
+        long long rays = 0;
+        for (int y = tileY0; y < tileY1; y += 2)
+            for (int x = tileX0; x < tileX1; x += 2)
+            {
+                int pixels[4][2] = {{x, y}, {x + 1, y}, {x, y + 1}, {x + 1, y + 1}};
+                bool valid[4];
+                for (int lane = 0; lane < 4; lane++)
+                    valid[lane] = pixels[lane][0] < tileX1 && pixels[lane][1] < tileY1;
+                rays += traceFourPixels(camera, pixels, valid);
+            }
+        rayTracer.tileRays[tile] += rays;
+        r.tileSeconds[tile] += nowSeconds() - start;
+    }
+}
 
-    // drawing the right wall with the wall color
-    glVertex3f(cubeSize, 0.0f, 0.0f);
-    glVertex3f(cubeSize, 0.0f, cubeSize);
-    glVertex3f(cubeSize, cubeSize, cubeSize);
-    glVertex3f(cubeSize, cubeSize, 0.0f);
-    glEnd();
+/// @brief ray trace a state into the software framebuffer
+void traceFrame(const SceneState &state)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    RayTracer &rt = rayTracer;
+    rt.tileRays.resize(r.tilesX * r.tilesY, 0);
+    rt.light[0] = cubeSize * 0.5f, rt.light[1] = cubeSize * 0.9f, rt.light[2] = cubeSize * 0.5f;
+
+    double start = nowSeconds();
+    buildBvh(state);
+    double built = nowSeconds();
+    rt.buildSeconds += built - start;
+
+    // the camera of gluLookAt and gluPerspective
+    RayCamera camera;
+    copy(state.eye, state.eye + 3, camera.eye);
+    float length = 0.0f;
+    for (int k = 0; k < 3; k++)
+    {
+        camera.forward[k] = state.center[k] - state.eye[k];
+        length += camera.forward[k] * camera.forward[k];
+    }
+    for (int k = 0; k < 3; k++)
+        camera.forward[k] /= sqrt(length);
+    const float *f = camera.forward, *u = state.up;
+    float side[3] = {f[1] * u[2] - f[2] * u[1], f[2] * u[0] - f[0] * u[2], f[0] * u[1] - f[1] * u[0]};
+    length = sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+    float halfHeight = tan(fieldOfView * pi / 360.0f), halfWidth = halfHeight * r.width / r.height;
+    for (int k = 0; k < 3; k++)
+        camera.right[k] = side[k] / length * halfWidth;
+    float trueUp[3] = {side[1] * f[2] - side[2] * f[1], side[2] * f[0] - side[0] * f[2], side[0] * f[1] - side[1] * f[0]};
+    for (int k = 0; k < 3; k++)
+        camera.up[k] = trueUp[k] / length * halfHeight;
+
+    parallelFor(r.tilesX * r.tilesY, traceTiles, &camera, 1);
+    rt.traceSeconds += nowSeconds() - built;
+    rt.frames++;
+    r.frames++;
+}
 
-    // Drawing the ceiling with the color of the ceiling
-    glBegin(GL_QUADS);
-    glColor4fv(ceilingColor); // cahnge the color as the color of the ceiling is different from the wall color
-    glVertex3f(0.0f, cubeSize, 0.0f);
-    glVertex3f(cubeSize, cubeSize, 0.0f);
-    glVertex3f(cubeSize, cubeSize, cubeSize);
-    glVertex3f(0.0f, cubeSize, cubeSize);
-    glEnd();
+/// @brief print how fast the rays went
+void printRayTracerStats()
+{
+    RayTracer &rt = rayTracer;
+    long long frames = max(1LL, rt.frames), rays = 0;
+    for (long long tileRays : rt.tileRays)
+        rays += tileRays;
+    printf("ray tracer: %.3f ms per frame building the tree of %d nodes, %.3f ms tracing %.0f rays (primary and shadow)\n",
+           rt.buildSeconds * 1e3 / frames, (int)rt.nodes.size(), rt.traceSeconds * 1e3 / frames, (double)rays / frames);
+    printf("  %.2f Mrays/s on %d threads, packets of %d rays\n", rays / max(rt.traceSeconds, 1e-9) / 1e6,
+           min(physicsThreadCount, 1 + (int)physicsWorkers.threads.size()),
+#if defined(__SSE2__)
+           4
+#else
+           1
+#endif
+    );
 }
 
-/**
- * Timer function for animation.
- * This demonstrates the use of a timer instead of idle function.
- * Timer functions provide better control over animation speed.
- *
- * @param value Value passed to the timer function (not used here)
- */
-void timerFunction(int value)
+/// @brief draw headlessFrames frames with the software renderer, without any GL, and print how long it took
+/// @return 0 if all frames were drawn and written
+int runSoftwareRenderer()
 {
-    // Update animation values
-    // cout << "Timer function called" << endl;
-    time_t currentTime = time(NULL);
-    struct tm *timeInfo = localtime(&currentTime);
-    if (paused == false)
+    initSpheres();
+    initParticlePool(particles, particleCapacity);
+    initSoftwareRenderer(windowWidth, windowHeight);
+    resetSceneStates();
+    paused = false;
+
+    vector<unsigned char> pixels(windowWidth * windowHeight * 3);
+    double renderSeconds = 0.0;
+    for (int frame = 0; frame < headlessFrames; frame++)
     {
-        // we wont apply physics if the scene is paused
-        updatePhysics((float)(animationSpeed));
+        updatePhysics(animationSpeed);
+        threadTimings.steps++;
+        publishSceneState(frame + 1);
+
+        double start = nowSeconds();
+        if (useRayTracer)
+            traceFrame(acquireSceneState());
+        else
+            renderSoftwareFrame(acquireSceneState());
+        renderSeconds += nowSeconds() - start;
+
+        if (!headlessFramePrefix.empty())
+        {
+            SoftwareRenderer &r = softwareRenderer;
+            for (int y = 0; y < r.height; y++)
+                for (int x = 0; x < r.width; x++)
+                {
+                    uint32_t color = r.colors[(size_t)y * r.stride + x];
+                    unsigned char *pixel = &pixels[((size_t)y * r.width + x) * 3];
+                    pixel[0] = color & 0xFF, pixel[1] = (color >> 8) & 0xFF, pixel[2] = (color >> 16) & 0xFF;
+                }
+            char number[16];
+            snprintf(number, sizeof(number), "%04d.ppm", frame);
+            if (!writePPM(headlessFramePrefix + number, pixels, windowWidth, windowHeight))
+            {
+                printf("could not write %s%s\n", headlessFramePrefix.c_str(), number);
+                return 1;
+            }
+        }
     }
-    // Request a redisplay
-    glutPostRedisplay();
 
-    // Register the timer again
-    glutTimerFunc(animationSpeed, timerFunction, 0);
+    int frames = max(1, headlessFrames);
+    printf("%d frames of %dx%d with %d balls on the CPU: %.3f ms per frame (%.1f fps)\n", headlessFrames, windowWidth,
+           windowHeight, ballCount, renderSeconds * 1e3 / frames, frames / max(renderSeconds, 1e-9));
+    if (useRayTracer)
+    {
+        printRayTracerStats();
+        printTileTimes();
+        return 0;
+    }
+    printSoftwareRendererStats();
+    printCullStats();
+    return 0;
+}
+
+// --- Software Renderer Check ---
+// --software-check F draws F frames of the same states twice, with GL into the headless framebuffer and with the
+// software rasterizer, and compares them pixel by pixel. For the check GL draws the stripes from the vertex
+// colors and the floor one quad per tile, like the software renderer, and the arrows and the sparks, which the
+// software renderer does not draw, are left out. The two are still not the same down to the last bit, GL has its
+// own rules for the edges and rounds the colors its own way, so a pixel counts as different only when one of its
+// channels is more than softwareCheckTolerance away. A ball drawn inside out, an edge function with the wrong
+// sign or a depth that goes the wrong way changes far more than a few edge pixels, so the run fails once more
+// than softwareCheckLimit of the pixels of a frame differ. With --frames both frames of every state are written.
+
+/// @brief how many frames --software-check compares, 0 to compare none
+int softwareCheckFrames = 0;
+/// @brief how far a channel of the software frame may be from GL before the pixel counts as different
+const int softwareCheckTolerance = 48;
+/// @brief the part of the pixels of a frame that may differ before the check fails
+const double softwareCheckLimit = 0.005;
+
+/// @brief count the pixels of the software framebuffer that are more than softwareCheckTolerance away from GL's
+/// @param glPixels the GL frame as glReadPixels gives it, 0xAABBGGRR with the bottom row first
+long long countDifferentPixels(const vector<uint32_t> &glPixels)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    long long different = 0;
+    for (int y = 0; y < r.height; y++)
+        for (int x = 0; x < r.width; x++)
+        {
+            uint32_t a = glPixels[(size_t)y * r.width + x], b = r.colors[(size_t)y * r.stride + x];
+            for (int shift = 0; shift < 24; shift += 8)
+                if (abs((int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF)) > softwareCheckTolerance)
+                {
+                    different++;
+                    break;
+                }
+        }
+    return different;
+}
+
+/// @brief write the GL frame and the software frame as PREFIXgl0000.ppm and PREFIXsoftware0000.ppm (--frames)
+/// @return false if one could not be written
+bool writeSoftwareCheckFrames(int frame, const vector<uint32_t> &glPixels)
+{
+    SoftwareRenderer &r = softwareRenderer;
+    vector<unsigned char> pixels[2];
+    for (int side = 0; side < 2; side++)
+    {
+        pixels[side].resize((size_t)r.width * r.height * 3);
+        for (int y = 0; y < r.height; y++)
+            for (int x = 0; x < r.width; x++)
+            {
+                uint32_t color = side == 0 ? glPixels[(size_t)y * r.width + x] : r.colors[(size_t)y * r.stride + x];
+                unsigned char *pixel = &pixels[side][((size_t)y * r.width + x) * 3];
+                pixel[0] = color & 0xFF, pixel[1] = (color >> 8) & 0xFF, pixel[2] = (color >> 16) & 0xFF;
+            }
+    }
+    char number[16];
+    snprintf(number, sizeof(number), "%04d.ppm", frame);
+    const char *names[2] = {"gl", "software"};
+    for (int side = 0; side < 2; side++)
+        if (!writePPM(headlessFramePrefix + names[side] + number, pixels[side], r.width, r.height))
+        {
+            printf("could not write %s%s%s\n", headlessFramePrefix.c_str(), names[side], number);
+            return false;
+        }
+    return true;
+}
+
+/// @brief draw softwareCheckFrames states with GL and with the software rasterizer and compare the frames
+/// @return 0 if no frame had more than softwareCheckLimit of its pixels different
+int runSoftwareCheck()
+{
+#ifdef __linux__
+    showArrow = useStripeShader = useFloorTexture = false;
+    maxParticlesPerImpact = 0; // no sparks, the software renderer does not draw them
+    if (!initHeadlessRenderer())
+        return 1;
+    printf("software check: %s against the software rasterizer, %d balls\n", glGetString(GL_RENDERER), ballCount);
+    initSoftwareRenderer(windowWidth, windowHeight);
+    initSpheres();
+    resetSceneStates();
+
+    vector<uint32_t> glPixels((size_t)windowWidth * windowHeight);
+    double glSeconds = 0.0, softwareSeconds = 0.0, worst = 0.0, sum = 0.0;
+    int failed = 0;
+    for (int frame = 0; frame < softwareCheckFrames; frame++)
+    {
+        updatePhysics(animationSpeed);
+        threadTimings.steps++;
+        publishSceneState(frame + 1);
+
+        double start = nowSeconds();
+        renderFrame();
+        glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, glPixels.data());
+        double drawn = nowSeconds();
+        glSeconds += drawn - start;
+        renderSoftwareFrame(acquireSceneState()); // the same state, renderFrame took the newest one
+        softwareSeconds += nowSeconds() - drawn;
+
+        if (!headlessFramePrefix.empty() && !writeSoftwareCheckFrames(frame, glPixels))
+            return 1;
+
+        double part = (double)countDifferentPixels(glPixels) / ((double)windowWidth * windowHeight);
+        worst = max(worst, part);
+        sum += part;
+        if (part > softwareCheckLimit)
+        {
+            printf("  frame %d: %.2f%% of the pixels differ\n", frame, part * 100.0);
+            failed++;
+        }
+    }
+    stopPassTimers();
+
+    int frames = max(1, softwareCheckFrames);
+    printf("%d frames: %.2f%% of the pixels differ on average, %.2f%% at most, %d frames over %.1f%%\n",
+           softwareCheckFrames, sum * 100.0 / frames, worst * 100.0, failed, softwareCheckLimit * 100.0);
+    printf("  GL %.3f ms per frame with the readback, software %.3f ms per frame\n", glSeconds * 1e3 / frames,
+           softwareSeconds * 1e3 / frames);
+    return failed == 0 ? 0 : 1;
+#else
+    printf("--software-check needs EGL, which this build does not have\n");
+    return 1;
+#endif
+}
+
+/// @brief reads the command line options described at the top of the file
+/// @return false if an option is not known
+bool parseArguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--balls") == 0 && hasValue)
+            ballCount = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--room") == 0 && hasValue)
+            cubeSize = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--domains") == 0 && hasValue)
+            domainCount = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--steps") == 0 && hasValue)
+            domainSteps = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue)
+            physicsThreadCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--particles") == 0 && hasValue)
+            particleCapacity = max(4, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--particle-bench") == 0 && hasValue)
+            particleBenchmarkFrames = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--core") == 0)
+            useCoreProfile = true;
+        else if (strcmp(argv[i], "--headless") == 0 && hasValue)
+            headlessFrames = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)
+            headlessFramePrefix = argv[++i];
+        else if (strcmp(argv[i], "--software") == 0)
+            useSoftwareRenderer = true;
+        else if (strcmp(argv[i], "--raytrace") == 0)
+            useSoftwareRenderer = useRayTracer = true;
+        else if (strcmp(argv[i], "--record") == 0 && hasValue)
+            trajectoryRecordPath = argv[++i];
+        else if (strcmp(argv[i], "--render-farm") == 0 && hasValue)
+            renderFarmPath = argv[++i];
+        else if (strcmp(argv[i], "--video") == 0 && hasValue)
+            renderFarmVideoPath = argv[++i];
+        else if (strcmp(argv[i], "--workers") == 0 && hasValue)
+            renderFarmWorkers = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bench") == 0 && hasValue)
+            benchmarkFrames = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bench-json") == 0 && hasValue)
+            benchmarkJsonPath = argv[++i];
+        else if (strcmp(argv[i], "--pass-log") == 0 && hasValue)
+            passLogPath = argv[++i];
+        else if (strcmp(argv[i], "--gpu-physics") == 0)
+            useGpuPhysics = true;
+        else if (strcmp(argv[i], "--gpu-physics-check") == 0 && hasValue)
+            gpuPhysicsCheckSteps = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--software-check") == 0 && hasValue)
+            softwareCheckFrames = max(1, atoi(argv[++i]));
+        else if (argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            printf("unknown option %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
@@ -1051,26 +8172,106 @@ void timerFunction(int value)
  */
 int main(int argc, char **argv)
 {
+    if (!parseArguments(argc, argv))
+        return 1;
+    if (useGpuPhysics && (useCoreProfile || useSoftwareRenderer || !trajectoryRecordPath.empty()))
+    {
+        printf("--gpu-physics keeps the spheres on the GPU and draws them with the fixed function pipeline, "
+               "it does not go with --core, --software, --raytrace or --record\n");
+        return 1;
+    }
+    if (softwareCheckFrames > 0 && (useCoreProfile || useGpuPhysics))
+    {
+        printf("--software-check compares the fixed function pipeline with the stripes of the vertices, "
+               "it does not go with --core or --gpu-physics\n");
+        return 1;
+    }
+    startPhysicsWorkers();
+    atexit(stopPhysicsWorkers);
+
+    // the domain run has no window, it prints its results and ends
+    if (domainCount > 0)
+    {
+        initSpheres();
+        return runDomainDecomposition();
+    }
+    if (particleBenchmarkFrames > 0)
+        return runParticleBenchmark(particleBenchmarkFrames);
+    if (!renderFarmPath.empty())
+        return runRenderFarm();
+    if (benchmarkFrames > 0)
+        return runBenchmark();
+    if (gpuPhysicsCheckSteps > 0)
+        return runGpuPhysicsCheck();
+    if (softwareCheckFrames > 0)
+        return runSoftwareCheck();
+    if (!trajectoryRecordPath.empty())
+    {
+        if (!startTrajectoryRecording(trajectoryRecordPath))
+        {
+            printf("could not write %s\n", trajectoryRecordPath.c_str());
+            return 1;
+        }
+        atexit(stopTrajectoryRecording); // registered before the simulation thread, so it runs after that stopped
+    }
+    if (headlessFrames > 0)
+        return useSoftwareRenderer ? runSoftwareRenderer() : runHeadless();
+
     // Initialize GLUT
     glutInit(&argc, argv);
 
     // Configure display mode and window
-    glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGB);
-    glutInitWindowSize(640, 640);
+    unsigned int displayMode = GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGB;
+    if (useCoreProfile)
+    {
+#if defined(__APPLE__)
+        displayMode |= GLUT_3_2_CORE_PROFILE;
+#elif defined(FREEGLUT)
+        glutInitContextVersion(3, 3);
+        glutInitContextProfile(GLUT_CORE_PROFILE);
+#endif
+    }
+    glutInitDisplayMode(displayMode);
+    glutInitWindowSize(windowWidth, windowHeight);
     glutInitWindowPosition(50, 50);
     glutCreateWindow("OpenGL 3D Drawing");
+    glewExperimental = GL_TRUE; // without it GLEW misses functions in a core profile context
+    glewInit();                 // the buffer functions below come from GLEW
 
     glEnable(GL_DEPTH_TEST);
-    glShadeModel(GL_SMOOTH);
-    
+    if (useCoreProfile && !initCoreRenderer())
+    {
+        printf("the core profile backend could not be set up\n");
+        return 1;
+    }
+    if (!useCoreProfile)
+        glShadeModel(GL_SMOOTH);
+    if (useGpuPhysics && !initGpuPhysics())
+        useGpuPhysics = false; // the physics stays on the CPU
+
     glutDisplayFunc(display);
     glutReshapeFunc(reshapeListener);
     glutKeyboardFunc(keyboardListener);
     glutSpecialFunc(specialKeyListener);
+    glutMouseFunc(mouseListener);
     glutTimerFunc(animationSpeed, timerFunction, 0);
-    initSphere(); // initialize the sphere object
+    initSpheres(); // initialize the sphere objects
     // Initialize OpenGL settings
     initGL();
+    initParticlePool(particles, particleCapacity);
+    if (!useCoreProfile)
+        initParticleGraphics(particles);
+    initPassTimers();
+    if (!headlessFramePrefix.empty())
+    {
+        startFrameCapture(headlessFramePrefix, false);
+        atexit([]
+               { stopFrameCapture(false); printCaptureStats(); });
+    }
+
+    // the physics runs on its own thread from now on
+    startSimulationThread();
+    atexit(stopSimulationThread);
 
     // Enter the GLUT event loop
     glutMainLoop();